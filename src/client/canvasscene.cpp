@@ -62,17 +62,12 @@ void CanvasScene::initCanvas(net::Client *client)
 	
 	connect(_statetracker, SIGNAL(myAnnotationCreated(AnnotationItem*)), this, SIGNAL(myAnnotationCreated(AnnotationItem*)));
 	connect(_statetracker, SIGNAL(myLayerCreated(int)), this, SIGNAL(myLayerCreated(int)));
+	connect(_statetracker, SIGNAL(catchupProgress(int)), this, SIGNAL(catchupProgress(int)));
 	connect(_image->image(), SIGNAL(resized(int,int)), this, SLOT(handleCanvasResize(int,int)));
 
 	addItem(_image);
 	clearAnnotations();
 
-	foreach(QGraphicsLineItem *p, _previewstrokes)
-		delete p;
-	_previewstrokes.clear();
-	foreach(QGraphicsLineItem *p, _previewstrokecache)
-		delete p;
-	_previewstrokecache.clear();
 	foreach(UserMarkerItem *i, _usermarkers)
 		delete i;
 	_usermarkers.clear();
@@ -267,6 +262,35 @@ void CanvasScene::setAnnotations(const QVector<AnnotationState> &annotations)
 	}
 }
 
+void CanvasScene::updateAnnotations(const QVector<AnnotationState> &annotations, const QSet<int> &changed)
+{
+	QSet<int> remaining = changed;
+	foreach(const AnnotationState &a, annotations) {
+		if(!remaining.remove(a.id))
+			continue;
+
+		AnnotationItem *item = getAnnotationById(a.id);
+		if(!item) {
+			item = new AnnotationItem(a);
+			item->setShowBorder(showAnnotationBorders());
+			addItem(item);
+			continue;
+		}
+
+		const AnnotationState &old = item->state();
+		if(old.rect != a.rect)
+			item->setGeometry(a.rect);
+		if(old.bgcolor != a.bgcolor)
+			item->setBackgroundColor(a.bgcolor);
+		if(old.text != a.text)
+			item->setText(a.text);
+	}
+
+	// The rest were deleted
+	foreach(int id, remaining)
+		deleteAnnotation(id);
+}
+
 /**
  * The file format is determined from the name of the file
  * @param file file path
@@ -350,60 +374,49 @@ void CanvasScene::setSelectionItem(SelectionItem *selection)
 		addItem(selection);
 }
 
-void CanvasScene::startPreview(const paintcore::Brush &brush, const paintcore::Point &point)
-{
-	_previewpen = penForBrush(brush);
-	_lastpreview = point;
-	addPreview(point);
-}
-
 /**
  * Preview strokes are used to give immediate feedback to the user,
  * before the stroke info messages have completed their roundtrip
- * through the server.
+ * through the server. They are drawn with the real brush on top of
+ * the layer the stroke is for.
+ * @param layer the layer being drawn on
+ * @param brush the brush being drawn with
  * @param point stroke point
  */
-void CanvasScene::addPreview(const paintcore::Point& point)
+void CanvasScene::startPreview(int layer, const paintcore::Brush &brush, const paintcore::Point &point)
 {
-	QGraphicsLineItem *s;
-	if(_previewstrokecache.isEmpty()) {
-		s = new QGraphicsLineItem();
-		addItem(s);
-	} else {
-		s = _previewstrokecache.takeLast();
-		s->show();
+	if(_image) {
+		_image->image()->startPrediction(layer, brush, point);
+		_previewClearTimer->start(2000);
 	}
-	s->setPen(_previewpen);
-	s->setLine(_lastpreview.x(), _lastpreview.y(), point.x(), point.y());
-	_previewstrokes.append(s);
-	_lastpreview = point;
+}
 
-	// Clear out previews automatically.
-	// If the user is locked, some strokes may have been dropped by
-	// the server, causing an annoying tail of preview strokes.
-	_previewClearTimer->start(2000);
+void CanvasScene::addPreview(const paintcore::Point& point)
+{
+	if(_image) {
+		_image->image()->addPrediction(point);
+
+		// Clear out previews automatically.
+		// If the user is locked, some strokes may have been dropped by
+		// the server, causing an annoying tail of preview strokes.
+		_previewClearTimer->start(2000);
+	}
 }
 
+/**
+ * This is called once the real stroke is on the canvas.
+ * @param count number of stroke points received
+ */
 void CanvasScene::takePreview(int count)
 {
-	while(count-->0 && !_previewstrokes.isEmpty()) {
-		QGraphicsLineItem *s = _previewstrokes.takeFirst();
-		s->hide();
-		_previewstrokecache.append(s);
-	}
+	if(_image)
+		_image->image()->takePrediction(count);
 }
 
 void CanvasScene::clearPreviews()
 {
-	while(!_previewstrokes.isEmpty()) {
-		QGraphicsLineItem *s = _previewstrokes.takeFirst();
-		s->hide();
-		_previewstrokecache.append(s);
-	}
-	// Limit the size of the cache
-	while(_previewstrokecache.size() > 100) {
-		delete _previewstrokecache.takeLast();
-	}
+	if(_image)
+		_image->image()->clearPrediction();
 }
 
 void CanvasScene::handleDrawingCommand(protocol::MessagePtr cmd)
@@ -21,6 +21,7 @@
 #define CANVAS_SCENE_H
 
 #include <QGraphicsScene>
+#include <QSet>
 
 #include "core/point.h"
 #include "../shared/net/message.h"
@@ -112,6 +113,17 @@ public:
 	//! Reset annotations
 	void setAnnotations(const QVector<AnnotationState> &annotations);
 
+	/**
+	 * @brief Update the changed annotations to match the given states
+	 *
+	 * Unlike setAnnotations, other items are left alone, so annotations
+	 * being edited locally are not disturbed.
+	 *
+	 * @param annotations the current states of all annotations
+	 * @param changed IDs of the annotations that were created, changed or deleted
+	 */
+	void updateAnnotations(const QVector<AnnotationState> &annotations, const QSet<int> &changed);
+
 	//! Are annotation borders shown?
 	bool showAnnotationBorders() const { return _showAnnotationBorders; }
 
@@ -136,12 +148,12 @@ public:
 	SelectionItem *selectionItem() { return _selection; }
 
 	//! Start a new preview stroke
-	void startPreview(const paintcore::Brush &brush, const paintcore::Point &point);
+	void startPreview(int layer, const paintcore::Brush &brush, const paintcore::Point &point);
 
-	//! Add a preview stroke
+	//! Continue the preview stroke
 	void addPreview(const paintcore::Point& point);
 
-	//! Remove the oldest preview stroke(s)
+	//! Remove the oldest preview point(s)
 	void takePreview(int count);
 
 	/**
@@ -222,6 +234,9 @@ signals:
 	//! Emitted when a new snapshot point was generated
 	void newSnapshot(QList<protocol::MessagePtr>);
 
+	//! Progress of executing the session history when joining (100 when done)
+	void catchupProgress(int percent);
+
 private slots:
 	void handleCanvasResize(int xoffset, int yoffset);
 
@@ -234,18 +249,6 @@ private:
 	//! Drawing context state tracker
 	StateTracker *_statetracker;
 
-	//! Preview strokes currently on screen
-	QList<QGraphicsLineItem*> _previewstrokes;
-
-	//! Cache of reusable preview strokes
-	QList<QGraphicsLineItem*> _previewstrokecache;
-
-	//! Coordinate of the last preview stroke
-	paintcore::Point _lastpreview;
-
-	//! The pen to use for preview strokes
-	QPen _previewpen;
-
 	//! Graphics item for previewing a special tool shape
 	QGraphicsItem *_toolpreview;
 
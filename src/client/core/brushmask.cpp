@@ -18,6 +18,8 @@
    Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
 */
 
+#include <QThreadStorage>
+
 #include <cmath>
 
 #include "brush.h"
@@ -36,7 +38,10 @@ inline qreal interpolate(qreal a, qreal b, qreal alpha)
 }
 
 typedef quint64 BrushCacheKey;
-static QCache<BrushCacheKey, BrushMaskGenerator> BMG_CACHE(10);
+typedef QCache<BrushCacheKey, BrushMaskGenerator> BrushCache;
+
+// Brushes are drawn by several threads at once, so each has its own cache
+static QThreadStorage<BrushCache*> BMG_CACHE;
 
 BrushCacheKey brushCacheKey(const Brush &brush) {
 	// the cache key includes only the parameters that affect mask generation
@@ -61,11 +66,15 @@ inline int pressure2int(float pressure) {
 
 const BrushMaskGenerator &BrushMaskGenerator::cached(const Brush &brush)
 {
+	if(!BMG_CACHE.hasLocalData())
+		BMG_CACHE.setLocalData(new BrushCache(10));
+	BrushCache *cache = BMG_CACHE.localData();
+
 	BrushCacheKey key = brushCacheKey(brush);
-	BrushMaskGenerator *bmg = BMG_CACHE[key];
+	BrushMaskGenerator *bmg = (*cache)[key];
 	if(!bmg) {
 		bmg = new BrushMaskGenerator(brush);
-		BMG_CACHE.insert(key, bmg);
+		cache->insert(key, bmg);
 	}
 	return *bmg;
 }
@@ -119,14 +119,19 @@ Layer::Layer(LayerStack *owner, int id, const QSize &size)
 }
 
 Layer::Layer(const Layer &layer)
-	: owner_(layer.owner_), id_(layer.id()), _title(layer._title),
+	: Layer(layer, layer.owner_)
+{
+}
+
+Layer::Layer(const Layer &layer, LayerStack *owner)
+	: owner_(owner), id_(layer.id()), _title(layer._title),
 	  _width(layer._width), _height(layer._height),
 	  _xtiles(layer._xtiles), _ytiles(layer._ytiles),
 	  _tiles(layer._tiles),
 	  _opacity(layer._opacity), _blend(layer._blend), _hidden(layer._hidden)
 {
 	foreach(const Layer *sl, layer._sublayers)
-		_sublayers.append(new Layer(*sl));
+		_sublayers.append(new Layer(*sl, owner));
 }
 
 Layer::~Layer() {
@@ -43,6 +43,8 @@ class LayerStack;
  * always a multiple of Tile::SIZE.
  */
 class Layer {
+	friend class Savepoint;
+	friend class LayerStack;
 	public:
 		//! Construct a layer filled with solid color
 		Layer(LayerStack *owner, int id, const QString& title, const QColor& color, const QSize& size);
@@ -50,6 +52,9 @@ class Layer {
 		//! Construct a copy of this layer
 		Layer(const Layer &layer);
 
+		//! Construct a copy of a layer that belongs to another stack
+		Layer(const Layer &layer, LayerStack *owner);
+
 		~Layer();
 
 		//! Get the layer width in pixels
@@ -19,9 +19,9 @@
 */
 
 #include <QDebug>
-#include <QPixmap>
 #include <QPainter>
 #include <QMimeData>
+#include <QDataStream>
 
 #include "layer.h"
 #include "layerstack.h"
@@ -31,7 +31,8 @@
 namespace paintcore {
 
 LayerStack::LayerStack(QObject *parent)
-	: QObject(parent), _width(0), _height(0)
+	: QObject(parent), _width(0), _height(0), _prediction(0), _predictionlayer(0), _predictionstroke(0),
+	  _predictiondistance(0)
 {
 }
 
@@ -39,6 +40,7 @@ LayerStack::~LayerStack()
 {
 	foreach(Layer *l, _layers)
 		delete l;
+	delete _prediction;
 }
 
 void LayerStack::resize(int top, int right, int bottom, int left)
@@ -56,7 +58,7 @@ void LayerStack::resize(int top, int right, int bottom, int left)
 
 	_xtiles = Tile::roundTiles(_width);
 	_ytiles = Tile::roundTiles(_height);
-	_cache = QPixmap(_width, _height);
+	_cache = QImage();
 	_dirtytiles = QBitArray(_xtiles*_ytiles, true);
 
 	foreach(Layer *l, _layers)
@@ -192,6 +194,11 @@ void LayerStack::setLayerHidden(int layerid, bool hide)
  */
 void LayerStack::paint(const QRectF& rect, QPainter *painter)
 {
+	if(_cache.isNull()) {
+		_cache = QImage(_width, _height, QImage::Format_RGB32);
+		_dirtytiles.fill(true);
+	}
+
 	// Refresh cache
 	const int tx0 = qBound(0, int(rect.left()) / Tile::SIZE, _xtiles-1);
 	const int tx1 = qBound(tx0, int(rect.right()) / Tile::SIZE, _xtiles-1);
@@ -209,8 +216,8 @@ void LayerStack::paint(const QRectF& rect, QPainter *painter)
 		}
 	}
 
-	// Paint the cached pixmap
-	painter->drawPixmap(rect, _cache, rect);
+	// Paint the cached image
+	painter->drawImage(rect, _cache, rect);
 }
 
 QColor LayerStack::colorAt(int x, int y) const
@@ -235,6 +242,21 @@ QImage LayerStack::toFlatImage() const
 	return flat.toImage();
 }
 
+namespace {
+	void compositeSublayers(quint32 *data, const Layer *layer, int xindex, int yindex)
+	{
+		foreach(const Layer *sl, layer->sublayers()) {
+			if(sl->visible()) {
+				const Tile &subtile = sl->tile(xindex, yindex);
+				if(!subtile.isNull()) {
+					compositePixels(sl->blendmode(), data, subtile.data(),
+							Tile::SIZE*Tile::SIZE, sl->opacity());
+				}
+			}
+		}
+	}
+}
+
 // Flatten a single tile
 void LayerStack::flattenTile(quint32 *data, int xindex, int yindex) const
 {
@@ -245,20 +267,17 @@ void LayerStack::flattenTile(quint32 *data, int xindex, int yindex) const
 	foreach(const Layer *l, _layers) {
 		if(l->visible()) {
 			const Tile &tile = l->tile(xindex, yindex);
-			if(l->sublayers().count()) {
+			const bool predicted = _prediction && l->id() == _predictionlayer;
+			if(l->sublayers().count() || predicted) {
 				// Sublayers present, composite them first
 				quint32 ldata[Tile::SIZE*Tile::SIZE];
 				tile.copyTo(ldata);
 
-				foreach(const Layer *sl, l->sublayers()) {
-					if(sl->visible()) {
-						const Tile &subtile = sl->tile(xindex, yindex);
-						if(!subtile.isNull()) {
-							compositePixels(sl->blendmode(), ldata, subtile.data(),
-									Tile::SIZE*Tile::SIZE, sl->opacity());
-						}
-					}
-				}
+				compositeSublayers(ldata, l, xindex, yindex);
+
+				// The local user's predicted strokes go on top
+				if(predicted)
+					compositeSublayers(ldata, _prediction, xindex, yindex);
 
 				// Composite merged tile
 				compositePixels(l->blendmode(), data, ldata,
@@ -302,11 +321,13 @@ void LayerStack::markDirty(const QRect &area)
 	int ty0 = qBound(0, area.top() / Tile::SIZE, _ytiles-1);
 	int ty1 = qBound(ty0, area.bottom() / Tile::SIZE, _ytiles-1);
 	
+	_dirtymutex.lock();
 	for(;ty0<=ty1;++ty0) {
 		for(int tx=tx0;tx<=tx1;++tx) {
 			_dirtytiles.setBit(ty0*_xtiles + tx);
 		}
 	}
+	_dirtymutex.unlock();
 	emit areaChanged(area);
 }
 
@@ -314,7 +335,9 @@ void LayerStack::markDirty()
 {
 	if(_layers.isEmpty())
 		return;
+	_dirtymutex.lock();
 	_dirtytiles.fill(true);
+	_dirtymutex.unlock();
 	emit areaChanged(QRect(0, 0, _width, _height));
 }
 
@@ -323,7 +346,9 @@ void LayerStack::markDirty(int x, int y)
 	Q_ASSERT(x>=0 && x < _xtiles);
 	Q_ASSERT(y>=0 && y < _ytiles);
 
+	_dirtymutex.lock();
 	_dirtytiles.setBit(y*_xtiles + x);
+	_dirtymutex.unlock();
 	emit areaChanged(QRect(x*Tile::SIZE, y*Tile::SIZE, Tile::SIZE, Tile::SIZE));
 }
 
@@ -333,6 +358,142 @@ Savepoint::~Savepoint()
 		delete layers.takeLast();
 }
 
+uint Savepoint::sizeExcluding(const Savepoint *other) const
+{
+	uint size = 0;
+	foreach(const Layer *l, layers) {
+		const Layer *ol = 0;
+		if(other) {
+			foreach(const Layer *candidate, other->layers) {
+				if(candidate->id() == l->id() && candidate->width() == l->width() && candidate->height() == l->height()) {
+					ol = candidate;
+					break;
+				}
+			}
+		}
+
+		const int tiles = Tile::roundTiles(l->width()) * Tile::roundTiles(l->height());
+		for(int i=0;i<tiles;++i) {
+			const Tile &t = l->tile(i);
+			if(t.isNull())
+				continue;
+			if(!ol || ol->tile(i).isNull() || ol->tile(i).data() != t.data())
+				size += Tile::BYTES;
+		}
+	}
+	return size;
+}
+
+namespace {
+	const quint32 SAVEPOINT_MAGIC = 0x44505350; // "DPSP"
+
+	enum SpilledTile {
+		TILE_SHARED, // same as in the newer savepoint
+		TILE_NULL,
+		TILE_DATA
+	};
+
+	const Layer *findLayer(const QList<Layer*> &layers, int id, int width, int height)
+	{
+		foreach(const Layer *l, layers)
+			if(l->id() == id && l->width() == width && l->height() == height)
+				return l;
+		return 0;
+	}
+}
+
+Savepoint *Savepoint::clone() const
+{
+	Savepoint *sp = new Savepoint;
+	foreach(const Layer *l, layers)
+		sp->layers.append(new Layer(*l));
+	sp->width = width;
+	sp->height = height;
+	return sp;
+}
+
+QByteArray Savepoint::toDelta(const Savepoint *newer) const
+{
+	QByteArray buffer;
+	QDataStream out(&buffer, QIODevice::WriteOnly);
+
+	out << SAVEPOINT_MAGIC << qint32(width) << qint32(height) << qint32(layers.count());
+
+	foreach(const Layer *l, layers) {
+		out << qint32(l->id()) << l->title() << quint8(l->opacity()) << qint32(l->blendmode()) << l->hidden()
+			<< qint32(l->width()) << qint32(l->height());
+
+		const Layer *nl = newer ? findLayer(newer->layers, l->id(), l->width(), l->height()) : 0;
+		const int tiles = l->_tiles.count();
+		for(int i=0;i<tiles;++i) {
+			const Tile &t = l->_tiles.at(i);
+			if(t.isNull()) {
+				out << quint8(TILE_NULL);
+			} else if(nl && !nl->_tiles.at(i).isNull() && nl->_tiles.at(i).data() == t.data()) {
+				out << quint8(TILE_SHARED);
+			} else {
+				out << quint8(TILE_DATA);
+				out.writeRawData(reinterpret_cast<const char*>(t.data()), Tile::BYTES);
+			}
+		}
+	}
+
+	return qCompress(buffer);
+}
+
+Savepoint *Savepoint::fromDelta(const QByteArray &data, const Savepoint *newer, LayerStack *owner)
+{
+	const QByteArray buffer = qUncompress(data);
+	QDataStream in(buffer);
+
+	quint32 magic;
+	qint32 width, height, layercount;
+	in >> magic >> width >> height >> layercount;
+	if(magic != SAVEPOINT_MAGIC || in.status() != QDataStream::Ok)
+		return 0;
+
+	Savepoint *sp = new Savepoint;
+	sp->width = width;
+	sp->height = height;
+
+	QVector<quint32> tiledata(Tile::LENGTH);
+	for(int li=0;li<layercount;++li) {
+		qint32 id, blend, lw, lh;
+		QString title;
+		quint8 opacity;
+		bool hidden;
+		in >> id >> title >> opacity >> blend >> hidden >> lw >> lh;
+
+		Layer *l = new Layer(owner, id, QSize(lw, lh));
+		l->_title = title;
+		l->_opacity = opacity;
+		l->_blend = blend;
+		l->_hidden = hidden;
+		sp->layers.append(l);
+
+		const Layer *nl = newer ? findLayer(newer->layers, id, lw, lh) : 0;
+		for(int i=0;i<l->_tiles.count();++i) {
+			quint8 type;
+			in >> type;
+			if(type == TILE_DATA) {
+				in.readRawData(reinterpret_cast<char*>(tiledata.data()), Tile::BYTES);
+				l->_tiles[i] = Tile(tiledata.constData());
+			} else if(type == TILE_SHARED && nl) {
+				l->_tiles[i] = nl->_tiles.at(i);
+			} else {
+				l->_tiles[i] = Tile();
+			}
+		}
+
+		if(in.status() != QDataStream::Ok) {
+			delete sp;
+			return 0;
+		}
+	}
+
+	return sp;
+}
+
 Savepoint *LayerStack::makeSavepoint()
 {
 	Savepoint *sp = new Savepoint;
@@ -347,12 +508,24 @@ Savepoint *LayerStack::makeSavepoint()
 	return sp;
 }
 
+Savepoint *LayerStack::makeSnapshot() const
+{
+	Savepoint *sp = new Savepoint;
+	foreach(const Layer *l, _layers)
+		sp->layers.append(new Layer(*l));
+
+	sp->width = _width;
+	sp->height = _height;
+
+	return sp;
+}
+
 void LayerStack::restoreSavepoint(const Savepoint *savepoint)
 {
 	while(!_layers.isEmpty())
 		delete _layers.takeLast();
 	foreach(const Layer *l, savepoint->layers)
-		_layers.append(new Layer(*l));
+		_layers.append(new Layer(*l, this));
 
 
 	if(_width != savepoint->width || _height != savepoint->height) {
@@ -360,7 +533,7 @@ void LayerStack::restoreSavepoint(const Savepoint *savepoint)
 		_height = savepoint->height;
 		_xtiles = Tile::roundTiles(_width);
 		_ytiles = Tile::roundTiles(_height);
-		_cache = QPixmap(_width, _height);
+		_cache = QImage();
 		_dirtytiles = QBitArray(_xtiles*_ytiles, true);
 		emit resized(0, 0);
 	} else {
@@ -369,4 +542,253 @@ void LayerStack::restoreSavepoint(const Savepoint *savepoint)
 	}
 }
 
+bool LayerStack::restoreLayers(const Savepoint *savepoint, const QSet<int> &layers)
+{
+	if(_width != savepoint->width || _height != savepoint->height)
+		return false;
+
+	// Check that every layer can be restored before changing anything
+	QList<QPair<int, const Layer*>> restore;
+	foreach(int id, layers) {
+		const int index = indexOf(id);
+		const Layer *saved = 0;
+		foreach(const Layer *l, savepoint->layers) {
+			if(l->id() == id) {
+				saved = l;
+				break;
+			}
+		}
+		if(index<0 || !saved)
+			return false;
+		restore.append(qMakePair(index, saved));
+	}
+
+	for(int i=0;i<restore.count();++i) {
+		Layer *old = _layers.at(restore[i].first);
+		Layer *l = new Layer(*restore[i].second, this);
+		l->setHidden(old->hidden());
+		_layers[restore[i].first] = l;
+		delete old;
+	}
+
+	if(!layers.isEmpty())
+		markDirty();
+	return true;
+}
+
+namespace {
+	bool sameTile(const Tile &a, const Tile &b)
+	{
+		if(a.isNull() || b.isNull())
+			return a.isNull() && b.isNull();
+		return a.data() == b.data();
+	}
+
+	bool sameAttributes(const Layer *a, const Layer *b)
+	{
+		return a->id() == b->id() && a->opacity() == b->opacity() && a->blendmode() == b->blendmode()
+			&& a->hidden() == b->hidden();
+	}
+
+	const Layer *findSublayer(const QList<Layer*> &sublayers, int id)
+	{
+		foreach(const Layer *l, sublayers)
+			if(l->id() == id)
+				return l;
+		return 0;
+	}
+
+	/**
+	 * Set the bits of the tiles that differ between two versions of
+	 * a (sub)layer. If the other version doesn't exist, all its
+	 * non-blank tiles are changed.
+	 */
+	void findChangedTiles(const Layer *layer, const Layer *other, QBitArray &changed)
+	{
+		for(int i=0;i<changed.size();++i) {
+			if(other && sameAttributes(layer, other)) {
+				if(!sameTile(layer->tile(i), other->tile(i)))
+					changed.setBit(i);
+			} else if(!layer->tile(i).isNull() || (other && !other->tile(i).isNull())) {
+				changed.setBit(i);
+			}
+		}
+	}
+}
+
+/**
+ * Unchanged tiles are shared with the snapshot, so comparing the tile
+ * data pointers is enough to find the ones that need repainting.
+ */
+void LayerStack::updateFrom(const Savepoint *snapshot, int xoffset, int yoffset)
+{
+	const bool resized = _width != snapshot->width || _height != snapshot->height || xoffset || yoffset;
+	bool restructured = _layers.count() != snapshot->layers.count();
+
+	QList<Layer*> layers;
+	layers.reserve(snapshot->layers.count());
+	for(int i=0;i<snapshot->layers.count();++i) {
+		Layer *l = new Layer(*snapshot->layers.at(i), this);
+		const Layer *old = getLayer(l->id());
+		l->_hidden = old && old->hidden();
+		layers.append(l);
+
+		if(!restructured && !sameAttributes(l, _layers.at(i)))
+			restructured = true;
+	}
+
+	if(resized || restructured) {
+		while(!_layers.isEmpty())
+			delete _layers.takeLast();
+		_layers = layers;
+
+		if(resized) {
+			clearPrediction();
+			_width = snapshot->width;
+			_height = snapshot->height;
+			_xtiles = Tile::roundTiles(_width);
+			_ytiles = Tile::roundTiles(_height);
+			_cache = QImage();
+			_dirtytiles = QBitArray(_xtiles*_ytiles, true);
+			emit resized(xoffset, yoffset);
+		} else {
+			markDirty();
+		}
+		return;
+	}
+
+	QBitArray changed(_xtiles*_ytiles);
+	for(int i=0;i<layers.count();++i) {
+		const Layer *nl = layers.at(i);
+		const Layer *ol = _layers.at(i);
+		findChangedTiles(nl, ol, changed);
+
+		// Indirect strokes in progress
+		foreach(const Layer *sl, nl->sublayers())
+			findChangedTiles(sl, findSublayer(ol->sublayers(), sl->id()), changed);
+		foreach(const Layer *sl, ol->sublayers()) {
+			if(!findSublayer(nl->sublayers(), sl->id()))
+				findChangedTiles(sl, 0, changed);
+		}
+
+		delete ol;
+	}
+	_layers = layers;
+
+	for(int y=0;y<_ytiles;++y) {
+		for(int x=0;x<_xtiles;++x) {
+			if(changed.testBit(y*_xtiles+x))
+				markDirty(x, y);
+		}
+	}
+}
+
+namespace {
+	QRect strokeArea(const Brush &brush, const Point &from, const Point &to)
+	{
+		const int r = qMax(brush.radius1(), brush.radius2()) + 1;
+		return QRectF(
+			QPointF(qMin(from.x(), to.x()) - r, qMin(from.y(), to.y()) - r),
+			QPointF(qMax(from.x(), to.x()) + r, qMax(from.y(), to.y()) + r)
+		).toAlignedRect();
+	}
+}
+
+/**
+ * Predicted strokes are always drawn indirectly, so the prediction layer
+ * can be composited on top of the target layer with the brush's blending
+ * mode. For incremental brushes, this is a close approximation.
+ */
+void LayerStack::startPrediction(int layerid, const Brush &brush, const Point &point)
+{
+	if(_width<=0 || _height<=0)
+		return;
+
+	if(_prediction && _predictionlayer != layerid)
+		clearPrediction();
+
+	if(!_prediction)
+		_prediction = new Layer(this, 0, QSize(_width, _height));
+
+	_predictionlayer = layerid;
+	++_predictionstroke;
+	_predictionbrush = brush;
+	_predictionbrush.setIncremental(false);
+	_predictionpoint = point;
+	_predictiondistance = 0;
+
+	_prediction->dab(_predictionstroke, _predictionbrush, point);
+	_predictionareas.append(strokeArea(_predictionbrush, point, point));
+}
+
+void LayerStack::addPrediction(const Point &point)
+{
+	if(!_prediction)
+		return;
+
+	_prediction->drawLine(_predictionstroke, _predictionbrush, _predictionpoint, point, _predictiondistance);
+	_predictionareas.append(strokeArea(_predictionbrush, _predictionpoint, point));
+	_predictionpoint = point;
+}
+
+void LayerStack::takePrediction(int count)
+{
+	if(!_prediction || count<=0)
+		return;
+
+	if(count >= _predictionareas.count()) {
+		clearPrediction();
+		return;
+	}
+
+	QList<QRect> taken;
+	while(count-->0)
+		taken.append(_predictionareas.takeFirst());
+
+	// Tiles still needed by the remaining points are kept
+	QBitArray keep(_xtiles*_ytiles);
+	foreach(const QRect &area, _predictionareas) {
+		const QRect a = area.intersected(QRect(0, 0, _width, _height));
+		if(a.isEmpty())
+			continue;
+		for(int ty=a.top()/Tile::SIZE;ty<=a.bottom()/Tile::SIZE;++ty)
+			for(int tx=a.left()/Tile::SIZE;tx<=a.right()/Tile::SIZE;++tx)
+				keep.setBit(ty*_xtiles+tx);
+	}
+
+	foreach(const QRect &area, taken) {
+		const QRect a = area.intersected(QRect(0, 0, _width, _height));
+		if(a.isEmpty())
+			continue;
+		for(int ty=a.top()/Tile::SIZE;ty<=a.bottom()/Tile::SIZE;++ty) {
+			for(int tx=a.left()/Tile::SIZE;tx<=a.right()/Tile::SIZE;++tx) {
+				const int i = ty*_xtiles+tx;
+				if(keep.testBit(i))
+					continue;
+				keep.setBit(i);
+
+				foreach(Layer *sl, _prediction->_sublayers)
+					sl->_tiles[i] = Tile();
+				markDirty(tx, ty);
+			}
+		}
+	}
+}
+
+void LayerStack::clearPrediction()
+{
+	if(!_prediction)
+		return;
+
+	foreach(const QRect &area, _predictionareas) {
+		const QRect a = area.intersected(QRect(0, 0, _width, _height));
+		if(!a.isEmpty())
+			markDirty(a);
+	}
+
+	delete _prediction;
+	_prediction = 0;
+	_predictionareas.clear();
+}
+
 }
@@ -25,8 +25,12 @@
 #include <QObject>
 #include <QList>
 #include <QImage>
-#include <QPixmap>
 #include <QBitArray>
+#include <QSet>
+#include <QMutex>
+
+#include "brush.h"
+#include "point.h"
 
 namespace paintcore {
 
@@ -35,6 +39,9 @@ class Savepoint;
 
 /**
  * \brief A stack of layers.
+ *
+ * Different layers may be drawn on by different threads at the same time.
+ * Marking tiles dirty is thread safe.
  */
 class LayerStack : public QObject {
 	Q_OBJECT
@@ -102,9 +109,71 @@ class LayerStack : public QObject {
 		//! Create a new savepoint
 		Savepoint *makeSavepoint();
 
-		//! Restore layer stack to a previous savepoint
+		/**
+		 * @brief Make a snapshot of the current state
+		 *
+		 * Like a savepoint, but the layers are not optimized first,
+		 * so this is cheap to call often. The tiles are shared.
+		 */
+		Savepoint *makeSnapshot() const;
+
+		//! Restore layer stack to a savepoint (which may have been made from another stack)
 		void restoreSavepoint(const Savepoint *savepoint);
 
+		/**
+		 * @brief Restore only the given layers to a previous savepoint
+		 *
+		 * The stack structure must be the same as in the savepoint.
+		 * The local hidden flags are kept.
+		 *
+		 * @param savepoint the savepoint to restore from
+		 * @param layers IDs of the layers to restore
+		 * @return false if the layers couldn't be restored (nothing is changed)
+		 */
+		bool restoreLayers(const Savepoint *savepoint, const QSet<int> &layers);
+
+		/**
+		 * @brief Show the content of a snapshot made from another stack
+		 *
+		 * The local hidden flags are kept. Only the tiles that have changed
+		 * are marked dirty.
+		 *
+		 * @param snapshot the snapshot to show
+		 * @param xoffset horizontal offset of the content if the canvas was resized
+		 * @param yoffset vertical offset of the content if the canvas was resized
+		 */
+		void updateFrom(const Savepoint *snapshot, int xoffset, int yoffset);
+
+		/**
+		 * @brief Start predicting a stroke of the local user
+		 *
+		 * The stroke is drawn with the real brush on a private layer,
+		 * which is shown on top of the target layer until the real
+		 * stroke arrives. Strokes still waiting for their real
+		 * counterparts are kept, unless the target layer changes.
+		 *
+		 * @param layerid the layer the stroke is drawn on
+		 * @param brush brush to draw with
+		 * @param point the first point of the stroke
+		 */
+		void startPrediction(int layerid, const Brush &brush, const Point &point);
+
+		//! Continue the predicted stroke
+		void addPrediction(const Point &point);
+
+		/**
+		 * @brief Discard the oldest predicted points
+		 *
+		 * This is called once the real strokes are on the canvas. Tiles
+		 * not touched by the remaining predicted points are cleared.
+		 *
+		 * @param count number of points to discard
+		 */
+		void takePrediction(int count);
+
+		//! Discard the whole prediction
+		void clearPrediction();
+
 	public slots:
 		//! Set or clear the "hidden" flag of a layer
 		void setLayerHidden(int layerid, bool hide);
@@ -124,8 +193,21 @@ class LayerStack : public QObject {
 		int _xtiles, _ytiles;
 		QList<Layer*> _layers;
 
-		QPixmap _cache;
+		// Flattened image for painting. This is allocated only when painted,
+		// so the layer stack can also be used without a GUI.
+		QImage _cache;
 		QBitArray _dirtytiles;
+		QMutex _dirtymutex;
+
+		// Local stroke prediction. Each predicted stroke is a sublayer
+		// of the prediction layer.
+		Layer *_prediction;
+		int _predictionlayer;
+		int _predictionstroke;
+		Brush _predictionbrush;
+		Point _predictionpoint;
+		qreal _predictiondistance;
+		QList<QRect> _predictionareas; // area touched by each predicted point
 };
 
 /// Layer stack savepoint for undo use
@@ -133,6 +215,49 @@ class Savepoint {
 	friend class LayerStack;
 public:
 	~Savepoint();
+
+	/**
+	 * @brief Estimate the memory used by the pixel data of this savepoint
+	 *
+	 * Unchanged tiles are shared between savepoints, so tiles that
+	 * are also in the other savepoint are not counted.
+	 *
+	 * @param other the previous savepoint (may be null)
+	 * @return size in bytes
+	 */
+	uint sizeExcluding(const Savepoint *other) const;
+
+	/**
+	 * @brief Make a copy of this savepoint
+	 *
+	 * The copy shares the tiles with the original.
+	 */
+	Savepoint *clone() const;
+
+	/**
+	 * @brief Serialize this savepoint for storing on disk
+	 *
+	 * Only the tiles that differ from the given newer savepoint are
+	 * included. The result is compressed.
+	 *
+	 * Neither savepoint is modified, so this may be called from
+	 * another thread, as long as the savepoints are not deleted meanwhile.
+	 *
+	 * @param newer the savepoint to store the difference to (may be null)
+	 * @return compressed savepoint data
+	 */
+	QByteArray toDelta(const Savepoint *newer) const;
+
+	/**
+	 * @brief Reconstruct a savepoint serialized with toDelta()
+	 *
+	 * @param data the serialized savepoint
+	 * @param newer the same savepoint that was given to toDelta()
+	 * @param owner the layer stack the savepoint belongs to
+	 * @return the savepoint or null if the data was invalid
+	 */
+	static Savepoint *fromDelta(const QByteArray &data, const Savepoint *newer, LayerStack *owner);
+
 private:
 	Savepoint() {}
 	QList<Layer*> layers;
@@ -41,6 +41,12 @@ Tile::Tile(const QColor& color)
 		*(ptr++) = col;
 }
 
+Tile::Tile(const quint32 *data)
+	: _data(new TileData)
+{
+	memcpy(_data->data, data, BYTES);
+}
+
 /**
  * -Copy all pixel data from (x*SIZE-xoff, y*SIZE-yoff, (x+1)*SIZE-xoff, (y+1)*SIZE-yoff).
  * -Pixels outside the source image are set to zero
@@ -86,6 +86,9 @@ class Tile {
 		//! Construct a tile from an image
 		Tile(const QImage& image, int xoff=0, int yoff=0);
 
+		//! Construct a tile from raw pixel data (LENGTH words)
+		explicit Tile(const quint32 *data);
+
 		//! Get a pixel value from this tile
 		quint32 pixel(int x, int y) const {
 			Q_ASSERT(x>=0 && x<SIZE);
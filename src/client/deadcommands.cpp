@@ -0,0 +1,172 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2013 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include "deadcommands.h"
+#include "statetracker.h"
+
+#include "../shared/net/pen.h"
+#include "../shared/net/layer.h"
+#include "../shared/net/image.h"
+
+namespace drawingboard {
+
+DeadCommandFinder::DeadCommandFinder(const QHash<int, DrawingContext> &contexts)
+{
+	QHashIterator<int, DrawingContext> i(contexts);
+	while(i.hasNext()) {
+		i.next();
+		Tool &t = _tools[i.key()];
+		t.layer = i.value().tool.layer_id;
+		t.radius = qMax(i.value().tool.brush.radius1(), i.value().tool.brush.radius2());
+		t.pendown = i.value().pendown;
+	}
+}
+
+void DeadCommandFinder::add(int index, const protocol::MessagePtr &msg, bool permanent)
+{
+	switch(msg->type()) {
+	using namespace protocol;
+	case MSG_TOOLCHANGE: {
+		const ToolChange &cmd = msg.cast<ToolChange>();
+		Tool &t = _tools[cmd.contextId()];
+		t.layer = cmd.layer();
+		t.radius = qMax(cmd.size_h(), cmd.size_l());
+		if(t.stroke>=0)
+			_strokes[t.stroke].valid = false;
+		break;
+	}
+	case MSG_PEN_MOVE: {
+		const PenMove &cmd = msg.cast<PenMove>();
+		Tool &t = _tools[cmd.contextId()];
+
+		// A stroke that was in progress at the start of the range is
+		// never tracked, since its beginning was executed already.
+		if(!t.pendown) {
+			Stroke s;
+			s.layer = t.layer;
+			s.end = -1;
+			s.valid = true;
+			t.pendown = true;
+			t.stroke = _strokes.count();
+			_strokes.append(s);
+		}
+
+		if(t.stroke>=0) {
+			Stroke &s = _strokes[t.stroke];
+			s.commands.append(index);
+
+			// Leave a margin for subpixel positioning and antialiasing
+			const int r = t.radius + 2;
+			const PenPointVector &points = cmd.points();
+			for(int i=0;i<points.size();++i)
+				s.bounds |= QRect(points.at(i).x / 4 - r, points.at(i).y / 4 - r, 2*r + 1, 2*r + 1);
+		}
+		break;
+	}
+	case MSG_PEN_UP: {
+		Tool &t = _tools[msg->contextId()];
+		if(t.stroke>=0) {
+			Stroke &s = _strokes[t.stroke];
+			s.commands.append(index);
+			s.end = index;
+		}
+		t.pendown = false;
+		t.stroke = -1;
+		break;
+	}
+	case MSG_PUTIMAGE: {
+		const PutImage &cmd = msg.cast<PutImage>();
+		const QRect rect(cmd.x(), cmd.y(), cmd.width(), cmd.height());
+
+		Stroke s;
+		s.commands.append(index);
+		s.layer = cmd.layer();
+		s.bounds = rect;
+		s.end = index;
+		s.valid = true;
+		_strokes.append(s);
+
+		if(!(cmd.flags() & PutImage::MODE_BLEND)) {
+			const Overwrite o = { index, rect, permanent };
+			_overwrites[cmd.layer()].append(o);
+		}
+		break;
+	}
+	case MSG_LAYER_DELETE: {
+		const LayerDelete &cmd = msg.cast<LayerDelete>();
+		const Deletion d = { index, cmd.merge(), permanent };
+		_deletions[cmd.id()].append(d);
+		break;
+	}
+	case MSG_CANVAS_RESIZE:
+		_resizes.append(index);
+		break;
+	default: break;
+	}
+}
+
+QSet<int> DeadCommandFinder::find() const
+{
+	QSet<int> dead;
+	foreach(const Stroke &s, _strokes) {
+		if(s.valid && s.end>=0 && isDead(s.layer, s.bounds, s.end)) {
+			foreach(int i, s.commands)
+				dead.insert(i);
+		}
+	}
+	return dead;
+}
+
+bool DeadCommandFinder::isDead(int layer, const QRect &bounds, int end) const
+{
+	// The first deletion after the drawing is the one that removes its layer.
+	// (A layer with the same ID may be created again after it.)
+	int deleted = -1;
+	foreach(const Deletion &d, _deletions.value(layer)) {
+		if(d.index > end) {
+			if(!d.merge && d.permanent)
+				return true;
+			deleted = d.index;
+			break;
+		}
+	}
+
+	// Coordinates change when the canvas is resized
+	int resized = -1;
+	foreach(int r, _resizes) {
+		if(r > end) {
+			resized = r;
+			break;
+		}
+	}
+
+	foreach(const Overwrite &o, _overwrites.value(layer)) {
+		if(o.index <= end)
+			continue;
+		if((deleted>=0 && o.index > deleted) || (resized>=0 && o.index > resized))
+			break;
+		if(o.permanent && o.rect.contains(bounds))
+			return true;
+	}
+
+	return false;
+}
+
+}
@@ -0,0 +1,114 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2013 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+#ifndef DP_DEADCOMMANDS_H
+#define DP_DEADCOMMANDS_H
+
+#include <QHash>
+#include <QList>
+#include <QRect>
+#include <QSet>
+
+#include "../shared/net/message.h"
+
+namespace drawingboard {
+
+struct DrawingContext;
+
+/**
+ * @brief Find commands whose effects are not visible at the end of a range
+ *
+ * When a long range of history is executed at once (when joining a session
+ * or replaying after an undo,) only the final result is shown. Drawing
+ * commands whose results are later thrown away don't need to be executed:
+ *
+ * - strokes and images on a layer that is later deleted without merging
+ * - strokes and images on an area that is later replaced by a non-blending
+ *   PutImage on the same layer
+ *
+ * A stroke (from the first pen move to the pen up) is treated as a unit.
+ * Strokes already in progress at the start of the range or still in progress
+ * at its end are never skipped, nor are strokes during which the tool changed.
+ *
+ * The deleting or replacing command must be permanent, i.e. impossible to
+ * undo. Otherwise undoing it would bring back the skipped commands' area.
+ * The skipped commands should still update the drawing context state.
+ */
+class DeadCommandFinder {
+public:
+	//! Start a range with the given drawing context states
+	explicit DeadCommandFinder(const QHash<int, DrawingContext> &contexts);
+
+	/**
+	 * @brief Add the next command in the range
+	 *
+	 * Commands that will not be executed (e.g. undone ones) should not be added.
+	 *
+	 * @param index position of the command. These must be in ascending order
+	 * @param msg the command
+	 * @param permanent can the command no longer be undone?
+	 */
+	void add(int index, const protocol::MessagePtr &msg, bool permanent);
+
+	//! Get the positions of the commands that can be skipped
+	QSet<int> find() const;
+
+private:
+	struct Tool {
+		Tool() : layer(0), radius(0), stroke(-1), pendown(false) { }
+
+		int layer;
+		int radius;
+		int stroke; // stroke in progress (index in _strokes) or -1
+		bool pendown;
+	};
+
+	//! A whole stroke or a single PutImage
+	struct Stroke {
+		QList<int> commands;
+		int layer;
+		QRect bounds;
+		int end; // -1 while in progress
+		bool valid;
+	};
+
+	struct Overwrite {
+		int index;
+		QRect rect;
+		bool permanent;
+	};
+
+	struct Deletion {
+		int index;
+		bool merge;
+		bool permanent;
+	};
+
+	bool isDead(int layer, const QRect &bounds, int end) const;
+
+	QHash<int, Tool> _tools;
+	QList<Stroke> _strokes;
+	QHash<int, QList<Overwrite>> _overwrites;
+	QHash<int, QList<Deletion>> _deletions;
+	QList<int> _resizes;
+};
+
+}
+
+#endif
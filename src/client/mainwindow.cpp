@@ -175,16 +175,20 @@ MainWindow::MainWindow(bool restoreWindowPosition)
 	// Network status changes
 	connect(_client, SIGNAL(serverConnected(QString, int)), this, SLOT(connecting()));
 	connect(_client, SIGNAL(serverLoggedin(bool)), this, SLOT(loggedin(bool)));
+	connect(_client, SIGNAL(sessionResynced()), this, SLOT(resynced()));
 	connect(_client, SIGNAL(serverDisconnected(QString)), this, SLOT(disconnected(QString)));
 
 	connect(_client, SIGNAL(serverConnected(QString, int)), netstatus, SLOT(connectingToHost(QString, int)));
 	connect(_client, SIGNAL(serverLoggedin(bool)), netstatus, SLOT(loggedIn()));
+	connect(_client, SIGNAL(sessionResumed()), netstatus, SLOT(loggedIn()));
 	connect(_client, SIGNAL(serverDisconnecting()), netstatus, SLOT(hostDisconnecting()));
 	connect(_client, SIGNAL(serverDisconnected(QString)), netstatus, SLOT(hostDisconnected()));
 	connect(_client, SIGNAL(expectingBytes(int)),netstatus, SLOT(expectBytes(int)));
 	connect(_client, SIGNAL(sendingBytes(int)), netstatus, SLOT(sendingBytes(int)));
 	connect(_client, SIGNAL(bytesReceived(int)), netstatus, SLOT(bytesReceived(int)));
 	connect(_client, SIGNAL(bytesSent(int)), netstatus, SLOT(bytesSent(int)));
+	connect(_client, SIGNAL(compressionRatioChanged(qreal)), netstatus, SLOT(compressionRatio(qreal)));
+	connect(_canvas, SIGNAL(catchupProgress(int)), netstatus, SLOT(catchupProgress(int)));
 
 	connect(_client, SIGNAL(userJoined(int, QString)), netstatus, SLOT(join(int, QString)));
 	connect(_client, SIGNAL(userLeft(QString)), netstatus, SLOT(leave(QString)));
@@ -398,6 +402,12 @@ void MainWindow::readSettings(bool windowpos)
 
 	cfg.endGroup();
 
+	// Network settings
+	cfg.beginGroup("settings/network");
+	if(cfg.contains("strokebatch"))
+		_client->setStrokeBatchInterval(cfg.value("strokebatch").toInt());
+	cfg.endGroup();
+
 	// Customize shortcuts
 	loadShortcuts();
 
@@ -943,6 +953,15 @@ void MainWindow::loggedin(bool join)
 	}
 }
 
+/**
+ * The server dropped the commands we had not yet received and is
+ * resending the session from its latest snapshot point.
+ */
+void MainWindow::resynced()
+{
+	_canvas->initCanvas(_client);
+}
+
 void MainWindow::sessionConfChanged(bool locked, bool layerctrllocked, bool closed)
 {
 	getAction("locksession")->setChecked(locked);
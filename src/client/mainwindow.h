@@ -109,6 +109,7 @@ class MainWindow : public QMainWindow {
 
 		void connecting();
 		void loggedin(bool join);
+		void resynced();
 		void disconnected(const QString &message);
 		void sessionConfChanged(bool locked, bool layerctrllocked, bool closed);
 
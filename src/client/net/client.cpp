@@ -20,6 +20,7 @@
 */
 #include <QDebug>
 #include <QImage>
+#include <QTimer>
 
 #include "net/client.h"
 #include "net/loopbackserver.h"
@@ -46,7 +47,7 @@ using protocol::MessagePtr;
 namespace net {
 
 Client::Client(QObject *parent)
-	: QObject(parent), _my_id(1)
+	: QObject(parent), _my_id(1), _strokeBatchInterval(8), _expectedbytes(0), _receivedcommands(0), _resumeAttempts(0)
 {
 	_loopback = new LoopbackServer(this);
 	_server = _loopback;
@@ -58,6 +59,10 @@ Client::Client(QObject *parent)
 	_userlist = new UserListModel(this);
 	_layerlist = new LayerListModel(this);
 
+	_strokeFlushTimer = new QTimer(this);
+	_strokeFlushTimer->setSingleShot(true);
+	connect(_strokeFlushTimer, SIGNAL(timeout()), this, SLOT(flushStroke()));
+
 	connect(
 		_loopback,
 		SIGNAL(messageReceived(protocol::MessagePtr)),
@@ -81,28 +86,45 @@ void Client::connectToServer(LoginHandler *loginhandler)
 {
 	Q_ASSERT(_isloopback);
 
+	if(loginhandler->mode() == LoginHandler::HOST)
+		loginhandler->setUserId(_my_id);
+
+	_resumeurl = loginhandler->url();
+	_resumetoken = QString();
+
+	emit serverConnected(loginhandler->url().host(), loginhandler->url().port());
+	startLogin(loginhandler);
+}
+
+void Client::startLogin(LoginHandler *loginhandler, int delay)
+{
 	TcpServer *server = new TcpServer(this);
 	_server = server;
 	_isloopback = false;
 
 	connect(server, SIGNAL(loggingOut()), this, SIGNAL(serverDisconnecting()));
-	connect(server, SIGNAL(serverDisconnected(QString)), this, SLOT(handleDisconnect(QString)));
+	connect(server, SIGNAL(serverDisconnected(QString, bool)), this, SLOT(handleDisconnect(QString, bool)));
 	connect(server, SIGNAL(loggedIn(int, bool)), this, SLOT(handleConnect(int, bool)));
+	connect(server, SIGNAL(sessionResumed(int)), this, SLOT(handleResume(int)));
+	connect(server, SIGNAL(resumeTokenReceived(QString)), this, SLOT(setResumeToken(QString)));
 	connect(server, SIGNAL(messageReceived(protocol::MessagePtr)), this, SLOT(handleMessage(protocol::MessagePtr)));
 
+	// Download progress is tracked before it is passed on, so the count is
+	// up to date when the canvas is initialized in the middle of a batch
+	connect(server, SIGNAL(expectingBytes(int)), this, SLOT(setExpectedBytes(int)));
+	connect(server, SIGNAL(bytesReceived(int)), this, SLOT(countReceivedBytes(int)));
 	connect(server, SIGNAL(expectingBytes(int)), this, SIGNAL(expectingBytes(int)));
 	connect(server, SIGNAL(bytesReceived(int)), this, SIGNAL(bytesReceived(int)));
 	connect(server, SIGNAL(bytesSent(int)), this, SIGNAL(bytesSent(int)));
+	connect(server, SIGNAL(compressionRatioChanged(qreal)), this, SIGNAL(compressionRatioChanged(qreal)));
 
-	if(loginhandler->mode() == LoginHandler::HOST)
-		loginhandler->setUserId(_my_id);
-
-	emit serverConnected(loginhandler->url().host(), loginhandler->url().port());
-	server->login(loginhandler);
+	server->login(loginhandler, delay);
 }
 
 void Client::disconnectFromServer()
 {
+	// Logging out on purpose, so don't try to resume
+	_resumetoken = QString();
 	_server->logout();
 }
 
@@ -114,11 +136,68 @@ bool Client::isLoggedIn() const
 void Client::handleConnect(int userid, bool join)
 {
 	_my_id = userid;
+	_receivedcommands = 0;
 	emit serverLoggedin(join);
 }
 
-void Client::handleDisconnect(const QString &message)
+/**
+ * The server continues sending the session from where we were when the
+ * connection dropped (or resends it from a snapshot point, in which
+ * case it sends a RESET first.)
+ *
+ * Commands made while the connection was down are sent now.
+ */
+void Client::handleResume(int userid)
 {
+	_my_id = userid;
+	_resumeTimer.invalidate();
+
+	foreach(const MessagePtr &msg, _resumequeue)
+		_server->sendMessage(msg);
+	_resumequeue.clear();
+
+	emit sessionResumed();
+}
+
+/**
+ * If the connection dropped unexpectedly, resuming the session is retried
+ * with an increasing delay until the server's grace period has passed or
+ * the server refuses to let us resume.
+ */
+void Client::handleDisconnect(const QString &message, bool loginFailed)
+{
+	_strokeFlushTimer->stop();
+	_expectedbytes = 0;
+
+	if(!_resumetoken.isEmpty() && !loginFailed) {
+		if(!_resumeTimer.isValid()) {
+			qWarning() << "Connection lost:" << message << "- trying to resume the session";
+			_resumeTimer.start();
+			_resumeAttempts = 0;
+
+			// Hold on to the unsent stroke points
+			flushStroke();
+		}
+
+		if(!_resumeTimer.hasExpired(RESUME_TIMEOUT * 1000)) {
+			const int delay = _resumeAttempts==0 ? 0 : qMin(RESUME_MAX_DELAY, RESUME_MIN_DELAY << qMin(_resumeAttempts-1, 8));
+			++_resumeAttempts;
+
+			LoginHandler *login = new LoginHandler(LoginHandler::JOIN, _resumeurl);
+			login->setResume(_resumetoken, _receivedcommands);
+			startLogin(login, delay);
+			return;
+		}
+	}
+
+	if(_resumeTimer.isValid())
+		qWarning() << "Could not resume the session:" << message;
+
+	_resumetoken = QString();
+	_resumeTimer.invalidate();
+	_resumequeue.clear();
+	_strokebuffer.clear();
+
 	emit serverDisconnected(message);
 	_userlist->clearUsers();
 	_layerlist->unlockAll();
@@ -155,7 +234,7 @@ int Client::uploadQueueBytes() const
 
 void Client::sendCanvasResize(int top, int right, int bottom, int left)
 {
-	_server->sendMessage(MessagePtr(new protocol::CanvasResize(
+	sendMessage(MessagePtr(new protocol::CanvasResize(
 		_my_id,
 		top, right, bottom, left
 	)));
@@ -164,19 +243,19 @@ void Client::sendCanvasResize(int top, int right, int bottom, int left)
 void Client::sendNewLayer(int id, const QColor &fill, const QString &title)
 {
 	Q_ASSERT(id>=0 && id<256);
-	_server->sendMessage(MessagePtr(new protocol::LayerCreate(_my_id, id, fill.rgba(), title)));
+	sendMessage(MessagePtr(new protocol::LayerCreate(_my_id, id, fill.rgba(), title)));
 }
 
 void Client::sendLayerAttribs(int id, float opacity, int blend)
 {
 	Q_ASSERT(id>=0 && id<256);
-	_server->sendMessage(MessagePtr(new protocol::LayerAttributes(_my_id, id, opacity*255, blend)));
+	sendMessage(MessagePtr(new protocol::LayerAttributes(_my_id, id, opacity*255, blend)));
 }
 
 void Client::sendLayerTitle(int id, const QString &title)
 {
 	Q_ASSERT(id>=0 && id<256);
-	_server->sendMessage(MessagePtr(new protocol::LayerRetitle(_my_id, id, title)));
+	sendMessage(MessagePtr(new protocol::LayerRetitle(_my_id, id, title)));
 }
 
 void Client::sendLayerVisibility(int id, bool hide)
@@ -189,36 +268,85 @@ void Client::sendLayerVisibility(int id, bool hide)
 void Client::sendDeleteLayer(int id, bool merge)
 {
 	Q_ASSERT(id>=0 && id<256);
-	_server->sendMessage(MessagePtr(new protocol::LayerDelete(_my_id, id, merge)));
+	sendMessage(MessagePtr(new protocol::LayerDelete(_my_id, id, merge)));
 }
 
 void Client::sendLayerReorder(const QList<uint8_t> &ids)
 {
 	Q_ASSERT(ids.size()>0);
-	_server->sendMessage(MessagePtr(new protocol::LayerOrder(_my_id, ids)));
+	sendMessage(MessagePtr(new protocol::LayerOrder(_my_id, ids)));
 }
 
 void Client::sendToolChange(const drawingboard::ToolContext &ctx)
 {
 	// TODO check if needs resending
-	_server->sendMessage(brushToToolChange(_my_id, ctx.layer_id, ctx.brush));
+	sendMessage(brushToToolChange(_my_id, ctx.layer_id, ctx.brush));
 }
 
+/**
+ * Motion points are not sent one by one. Instead, they are gathered
+ * for a short while and sent together in one PenMove message.
+ *
+ * The first point after a pause is sent right away if the upload
+ * queue is empty, so starting a stroke doesn't add latency.
+ */
 void Client::sendStroke(const paintcore::Point &point)
 {
-	protocol::PenPointVector v(1);
-	v[0] = pointToProtocol(point);
-	_server->sendMessage(MessagePtr(new protocol::PenMove(_my_id, v)));
+	_strokebuffer.append(pointToProtocol(point));
+
+	if(_isloopback || _strokeBatchInterval<=0 || _strokebuffer.size() >= MAX_STROKE_BATCH) {
+		flushStroke();
+
+	} else if(!_strokeFlushTimer->isActive()) {
+		if(_strokebuffer.size()==1 && uploadQueueBytes()==0 &&
+			(!_lastStrokeFlush.isValid() || _lastStrokeFlush.hasExpired(_strokeBatchInterval)))
+			flushStroke();
+		else
+			_strokeFlushTimer->start(_strokeBatchInterval);
+	}
 }
 
 void Client::sendStroke(const paintcore::PointVector &points)
 {
-	_server->sendMessage(MessagePtr(new protocol::PenMove(_my_id, pointsToProtocol(points))));
+	sendMessage(MessagePtr(new protocol::PenMove(_my_id, pointsToProtocol(points))));
+}
+
+void Client::flushStroke()
+{
+	_strokeFlushTimer->stop();
+	if(_strokebuffer.isEmpty())
+		return;
+
+	// The buffer keeps its capacity for the next batch
+	const MessagePtr msg(new protocol::PenMove(_my_id, _strokebuffer));
+	_strokebuffer.clear();
+	transmit(msg);
+	_lastStrokeFlush.start();
+}
+
+/**
+ * All outgoing messages go through here, so that any buffered stroke
+ * points are sent first and the command order is preserved.
+ */
+void Client::sendMessage(MessagePtr msg)
+{
+	flushStroke();
+	transmit(msg);
+}
+
+void Client::transmit(MessagePtr msg)
+{
+	// While the session is being resumed, messages are held back
+	// until the connection is back
+	if(_resumeTimer.isValid())
+		_resumequeue.append(msg);
+	else
+		_server->sendMessage(msg);
 }
 
 void Client::sendPenup()
 {
-	_server->sendMessage(MessagePtr(new protocol::PenUp(_my_id)));
+	sendMessage(MessagePtr(new protocol::PenUp(_my_id)));
 }
 
 /**
@@ -233,21 +361,21 @@ void Client::sendPenup()
 void Client::sendImage(int layer, int x, int y, const QImage &image, bool blend)
 {
 	foreach(MessagePtr msg, putQImage(_my_id, layer, x, y, image, blend))
-		_server->sendMessage(msg);
+		sendMessage(msg);
 
 	emit sendingBytes(_server->uploadQueueBytes());
 }
 
 void Client::sendUndopoint()
 {
-	_server->sendMessage(MessagePtr(new protocol::UndoPoint(_my_id)));
+	sendMessage(MessagePtr(new protocol::UndoPoint(_my_id)));
 }
 
 void Client::sendUndo(int actions, int override)
 {
 	Q_ASSERT(actions != 0);
 	Q_ASSERT(actions >= -128 && actions <= 127);
-	_server->sendMessage(MessagePtr(new protocol::Undo(_my_id, override, actions)));
+	sendMessage(MessagePtr(new protocol::Undo(_my_id, override, actions)));
 }
 
 void Client::sendRedo(int actions, int override)
@@ -258,7 +386,7 @@ void Client::sendRedo(int actions, int override)
 void Client::sendAnnotationCreate(int id, const QRect &rect)
 {
 	Q_ASSERT(id>=0 && id < 256);
-	_server->sendMessage(MessagePtr(new protocol::AnnotationCreate(
+	sendMessage(MessagePtr(new protocol::AnnotationCreate(
 		_my_id,
 		id,
 		rect.x(),
@@ -271,7 +399,7 @@ void Client::sendAnnotationCreate(int id, const QRect &rect)
 void Client::sendAnnotationReshape(int id, const QRect &rect)
 {
 	Q_ASSERT(id>0 && id < 256);
-	_server->sendMessage(MessagePtr(new protocol::AnnotationReshape(
+	sendMessage(MessagePtr(new protocol::AnnotationReshape(
 		_my_id,
 		id,
 		rect.x(),
@@ -284,7 +412,7 @@ void Client::sendAnnotationReshape(int id, const QRect &rect)
 void Client::sendAnnotationEdit(int id, const QColor &bg, const QString &text)
 {
 	Q_ASSERT(id>0 && id < 256);
-	_server->sendMessage(MessagePtr(new protocol::AnnotationEdit(
+	sendMessage(MessagePtr(new protocol::AnnotationEdit(
 		_my_id,
 		id,
 		bg.rgba(),
@@ -295,7 +423,7 @@ void Client::sendAnnotationEdit(int id, const QColor &bg, const QString &text)
 void Client::sendAnnotationDelete(int id)
 {
 	Q_ASSERT(id>0 && id < 256);
-	_server->sendMessage(MessagePtr(new protocol::AnnotationDelete(_my_id, id)));
+	sendMessage(MessagePtr(new protocol::AnnotationDelete(_my_id, id)));
 }
 
 /**
@@ -305,7 +433,7 @@ void Client::sendAnnotationDelete(int id)
 void Client::sendSnapshot(const QList<protocol::MessagePtr> commands)
 {
 	// Send ACK to indicate the rest of the data is on its way
-	_server->sendMessage(MessagePtr(new protocol::SnapshotMode(protocol::SnapshotMode::ACK)));
+	sendMessage(MessagePtr(new protocol::SnapshotMode(protocol::SnapshotMode::ACK)));
 
 	// The actual snapshot data will be sent in parallel with normal session traffic
 	_server->sendSnapshotMessages(commands);
@@ -315,7 +443,7 @@ void Client::sendSnapshot(const QList<protocol::MessagePtr> commands)
 
 void Client::sendChat(const QString &message)
 {
-	_server->sendMessage(MessagePtr(new protocol::Chat(0, message)));
+	sendMessage(MessagePtr(new protocol::Chat(0, message)));
 }
 
 /**
@@ -339,7 +467,7 @@ void Client::sendLockUser(int userid, bool lock)
 		cmd = "/unlock ";
 	cmd += QString::number(userid);
 
-	_server->sendMessage((MessagePtr(new protocol::Chat(0, cmd))));
+	sendMessage((MessagePtr(new protocol::Chat(0, cmd))));
 }
 
 void Client::sendOpUser(int userid, bool op)
@@ -352,19 +480,19 @@ void Client::sendOpUser(int userid, bool op)
 		cmd = "/deop ";
 	cmd += QString::number(userid);
 
-	_server->sendMessage((MessagePtr(new protocol::Chat(0, cmd))));
+	sendMessage((MessagePtr(new protocol::Chat(0, cmd))));
 }
 
 void Client::sendKickUser(int userid)
 {
 	Q_ASSERT(userid>0 && userid<256);
 	QString cmd = QString("/kick %1").arg(userid);
-	_server->sendMessage((MessagePtr(new protocol::Chat(0, cmd))));
+	sendMessage((MessagePtr(new protocol::Chat(0, cmd))));
 }
 
 void Client::sendSetSessionTitle(const QString &title)
 {
-	_server->sendMessage(MessagePtr(new protocol::SessionTitle(_my_id, title)));
+	sendMessage(MessagePtr(new protocol::SessionTitle(_my_id, title)));
 }
 
 void Client::sendLockSession(bool lock)
@@ -375,7 +503,7 @@ void Client::sendLockSession(bool lock)
 	else
 		cmd = "/unlock";
 
-	_server->sendMessage(MessagePtr(new protocol::Chat(0, cmd)));
+	sendMessage(MessagePtr(new protocol::Chat(0, cmd)));
 }
 
 void Client::sendLockLayerControls(bool lock)
@@ -386,7 +514,7 @@ void Client::sendLockLayerControls(bool lock)
 	else
 		cmd = "/unlocklayerctrl";
 
-	_server->sendMessage(MessagePtr(new protocol::Chat(0, cmd)));
+	sendMessage(MessagePtr(new protocol::Chat(0, cmd)));
 }
 
 void Client::sendCloseSession(bool close)
@@ -397,7 +525,7 @@ void Client::sendCloseSession(bool close)
 	else
 		cmd = "/open";
 
-	_server->sendMessage(MessagePtr(new protocol::Chat(0, cmd)));
+	sendMessage(MessagePtr(new protocol::Chat(0, cmd)));
 }
 
 void Client::sendLayerAcl(int layerid, bool locked, QList<uint8_t> exclusive)
@@ -405,13 +533,15 @@ void Client::sendLayerAcl(int layerid, bool locked, QList<uint8_t> exclusive)
 	if(_isloopback)
 		qWarning() << "tried to send layer ACL in loopback mode!";
 	else
-		_server->sendMessage(MessagePtr(new protocol::LayerACL(_my_id, layerid, locked, exclusive)));
+		sendMessage(MessagePtr(new protocol::LayerACL(_my_id, layerid, locked, exclusive)));
 }
 
 void Client::handleMessage(protocol::MessagePtr msg)
 {
 	// TODO should meta commands go here too for session recording purposes?
 	if(msg->isCommand()) {
+		// The server needs this number to resume the session
+		++_receivedcommands;
 		emit drawingCommandReceived(msg);
 		return;
 	}
@@ -449,7 +579,16 @@ void Client::handleMessage(protocol::MessagePtr msg)
 
 void Client::handleSnapshotRequest(const protocol::SnapshotMode &msg)
 {
-	// The server should ever only send a REQUEST mode snapshot messages
+	if(msg.mode() == protocol::SnapshotMode::RESET) {
+		// We fell too far behind. The server will resend the whole session.
+		_receivedcommands = 0;
+		_userlist->clearUsers();
+		_layerlist->clear();
+		emit sessionResynced();
+		return;
+	}
+
+	// Apart from resets, the server should ever only send a REQUEST mode snapshot messages
 	if(msg.mode() != protocol::SnapshotMode::REQUEST && msg.mode() != protocol::SnapshotMode::REQUEST_NEW) {
 		qWarning() << "received unhandled snapshot mode" << msg.mode() << "message.";
 		return;
@@ -22,9 +22,15 @@
 #define DP_NET_CLIENT_H
 
 #include <QObject>
+#include <QElapsedTimer>
+#include <QList>
+#include <QUrl>
 
 #include "core/point.h"
 #include "../shared/net/message.h"
+#include "../shared/net/pen.h"
+
+class QTimer;
 
 namespace paintcore {
 	class Point;
@@ -120,6 +126,15 @@ public:
 	 */
 	bool isOperator() const { return _isloopback || _isOp; }
 
+	/**
+	 * @brief Get the number of session history bytes still being downloaded
+	 *
+	 * This is nonzero while a joining client is receiving the session
+	 * (see expectingBytes)
+	 * @return remaining byte count
+	 */
+	int expectedBytes() const { return _expectedbytes; }
+
 	/**
 	 * @brief Get the number of bytes waiting to be sent
 	 * @return upload queue length
@@ -141,6 +156,17 @@ public:
 	//! Reinitialize after clearing out the old board
 	void init();
 
+	/**
+	 * @brief Set the stroke point batching interval
+	 *
+	 * Motion points are gathered for this long before being sent
+	 * together in one message. Pen up and all other messages cause the
+	 * buffered points to be sent immediately.
+	 *
+	 * @param ms batching interval in milliseconds. Zero disables batching.
+	 */
+	void setStrokeBatchInterval(int ms) { _strokeBatchInterval = ms; }
+
 public slots:
 	// Layer changing
 	void sendCanvasResize(int top, int right, int bottom, int left);
@@ -190,6 +216,8 @@ signals:
 	void drawingCommandReceived(protocol::MessagePtr msg);
 	void chatMessageReceived(const QString &user, const QString &message, bool me);
 	void needSnapshot(bool forcenew);
+	void sessionResynced(); // fell behind: the session is resent from a snapshot point
+	void sessionResumed(); // the connection was restored after it dropped
 
 	void serverConnected(const QString &address, int port);
 	void serverLoggedin(bool join);
@@ -211,13 +239,35 @@ signals:
 	void sendingBytes(int);
 	void bytesReceived(int);
 	void bytesSent(int);
+	void compressionRatioChanged(qreal);
 
 private slots:
 	void handleMessage(protocol::MessagePtr msg);
+	void flushStroke();
 	void handleConnect(int userid, bool join);
-	void handleDisconnect(const QString &message);
+	void handleDisconnect(const QString &message, bool loginFailed);
+	void handleResume(int userid);
+	void setResumeToken(const QString &token) { _resumetoken = token; }
+	void setExpectedBytes(int count) { _expectedbytes = count; }
+	void countReceivedBytes(int count) { _expectedbytes = qMax(0, _expectedbytes - count); }
 
 private:
+	//! Maximum number of points to gather before sending a PenMove
+	static const int MAX_STROKE_BATCH = 64;
+
+	//! How long to keep trying to resume the session (seconds). This matches the server's default grace period
+	static const int RESUME_TIMEOUT = 30;
+
+	//! Delay before the second resume attempt (ms). The delay doubles after each attempt
+	static const int RESUME_MIN_DELAY = 250;
+
+	//! Maximum delay between resume attempts (ms)
+	static const int RESUME_MAX_DELAY = 4000;
+
+	void sendMessage(protocol::MessagePtr msg);
+	void transmit(protocol::MessagePtr msg);
+	void startLogin(LoginHandler *loginhandler, int delay=0);
+
 	void handleSnapshotRequest(const protocol::SnapshotMode &msg);
 	void handleChatMessage(const protocol::Chat &msg);
 	void handleUserJoin(const protocol::UserJoin &msg);
@@ -235,6 +285,20 @@ private:
 	bool _isSessionLocked, _isUserLocked;
 	UserListModel *_userlist;
 	LayerListModel *_layerlist;
+
+	protocol::PenPointVector _strokebuffer;
+	QTimer *_strokeFlushTimer;
+	QElapsedTimer _lastStrokeFlush;
+	int _strokeBatchInterval;
+	int _expectedbytes;
+
+	// For resuming the session if the connection drops
+	QUrl _resumeurl;
+	QString _resumetoken;
+	qint64 _receivedcommands;
+	QElapsedTimer _resumeTimer;
+	int _resumeAttempts;
+	QList<protocol::MessagePtr> _resumequeue;
 };
 
 }
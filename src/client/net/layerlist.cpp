@@ -146,6 +146,7 @@ void LayerListModel::clear()
 	beginRemoveRows(QModelIndex(), 0, _items.size());
 	_items.clear();
 	endRemoveRows();
+	_pendingacl.clear();
 }
 
 void LayerListModel::changeLayer(int id, float opacity, int blend)
@@ -182,7 +183,14 @@ void LayerListModel::setLayerHidden(int id, bool hidden)
 void LayerListModel::updateLayerAcl(int id, bool locked, QList<uint8_t> exclusive)
 {
 	int row = indexOf(id);
-	Q_ASSERT(row>=0);
+	if(row<0) {
+		// While catching up with a session, the layer list is only
+		// updated once the canvas is ready
+		LayerListItem &pending = _pendingacl[id];
+		pending.locked = locked;
+		pending.exclusive = exclusive;
+		return;
+	}
 	LayerListItem &item = _items[row];
 	item.locked = locked;
 	item.exclusive = exclusive;
@@ -196,6 +204,7 @@ void LayerListModel::unlockAll()
 		_items[i].locked = false;
 		_items[i].exclusive.clear();
 	}
+	_pendingacl.clear();
 	emit dataChanged(index(0), index(_items.count()));
 }
 
@@ -223,9 +232,56 @@ QStringList LayerMimeData::formats() const
 
 void LayerListModel::setLayers(const QVector<LayerListItem> &items)
 {
+	const bool wasempty = _items.isEmpty();
+
+	QVector<LayerListItem> newitems = items;
+	bool changed = newitems.count() != _items.count();
+	for(int i=0;i<newitems.count();++i) {
+		LayerListItem &item = newitems[i];
+		const int old = indexOf(item.id);
+		if(old>=0) {
+			const LayerListItem &o = _items.at(old);
+			item.hidden = o.hidden;
+			item.locked = o.locked;
+			item.exclusive = o.exclusive;
+			if(old != i || o.title != item.title || o.opacity != item.opacity || o.blend != item.blend)
+				changed = true;
+		} else {
+			changed = true;
+		}
+
+		if(_pendingacl.contains(item.id)) {
+			const LayerListItem acl = _pendingacl.take(item.id);
+			item.locked = acl.locked;
+			item.exclusive = acl.exclusive;
+			changed = true;
+		}
+	}
+
+	if(!changed)
+		return;
+
+	QList<QPair<int,int>> deleted;
+	for(int i=0;i<_items.count();++i) {
+		bool found = false;
+		foreach(const LayerListItem &item, newitems) {
+			if(item.id == _items.at(i).id) {
+				found = true;
+				break;
+			}
+		}
+		if(!found)
+			deleted.append(qMakePair(_items.at(i).id, i));
+	}
+
 	beginResetModel();
-	_items = items;
+	_items = newitems;
 	endResetModel();
+
+	if(wasempty && !_items.isEmpty())
+		emit layerCreated(true);
+	for(int i=0;i<deleted.count();++i)
+		emit layerDeleted(deleted.at(i).first, deleted.at(i).second);
 }
 
 }
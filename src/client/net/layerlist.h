@@ -23,6 +23,7 @@
 #include <QAbstractListModel>
 #include <QMimeData>
 #include <QVector>
+#include <QHash>
 
 namespace net {
 
@@ -82,6 +83,15 @@ public:
 	void unlockAll();
 	
 	QVector<LayerListItem> getLayers() const { return _items; }
+
+	/**
+	 * @brief Replace the whole layer list
+	 *
+	 * The local hidden flags and the access controls of existing layers
+	 * are kept. Access controls received for layers that were not yet in
+	 * the list are applied to the new items. Nothing is done if the list
+	 * didn't change.
+	 */
 	void setLayers(const QVector<LayerListItem> &items);
 
 signals:
@@ -98,6 +108,9 @@ private:
 	int indexOf(int id) const;
 	
 	QVector<LayerListItem> _items;
+
+	//! Access controls for layers not (yet) in the list
+	QHash<int, LayerListItem> _pendingacl;
 };
 
 /**
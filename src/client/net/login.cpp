@@ -48,8 +48,26 @@ void LoginHandler::receiveMessage(protocol::MessagePtr message)
 	}
 }
 
+void LoginHandler::serverConnected()
+{
+	// Select a session on a multisession server. This is sent only when
+	// a session is explicitly requested, since single session servers
+	// don't understand it.
+	QString session = _address.path();
+	if(session.startsWith('/'))
+		session = session.mid(1);
+
+	if(!session.isEmpty())
+		_server->sendMessage(protocol::MessagePtr(new protocol::Login(QString("SESSION %1").arg(session))));
+}
+
 void LoginHandler::expectHello(const QString &msg)
 {
+	if(msg == "BADSESSION") {
+		_server->loginFailure(QApplication::tr("Invalid session name"));
+		return;
+	}
+
 	// Hello response should be in format "DRAWPILE <major.minor> [PASS]"
 	QStringList tokens = msg.split(' ', QString::SkipEmptyParts);
 
@@ -137,7 +155,10 @@ void LoginHandler::sendLogin()
 		msg = QString("HOST %1 %2 %3").arg(DRAWPILE_PROTO_MINOR_VERSION).arg(_userid).arg(_address.userName());
 		break;
 	case JOIN:
-		msg = QString("JOIN %1").arg(_address.userName());
+		if(_token.isEmpty())
+			msg = QString("JOIN %1").arg(_address.userName());
+		else
+			msg = QString("RESUME %1 %2").arg(_token).arg(_received);
 		break;
 	}
 
@@ -156,11 +177,14 @@ void LoginHandler::expectLoginOk(const QString &msg)
 	} else if(msg == "CLOSED") {
 		_server->loginFailure(QApplication::tr("Session is closed!"));
 		return;
+	} else if(msg == "NORESUME") {
+		_server->loginFailure(QApplication::tr("Connection lost and the session could not be resumed"));
+		return;
 	}
 
-	// OK response should be in format "OK <userid>"
+	// OK response should be in format "OK <userid>" (or "RESUMED <userid>")
 	QStringList tokens = msg.split(' ', QString::SkipEmptyParts);
-	if(tokens.length() != 2 || tokens[0] != "OK") {
+	if(tokens.length() != 2 || tokens[0] != (_token.isEmpty() ? "OK" : "RESUMED")) {
 		qWarning() << "Login error. Expected OK, got:" << msg;
 		_server->loginFailure(QApplication::tr("Incompatible server"));
 		return;
@@ -175,10 +199,15 @@ void LoginHandler::expectLoginOk(const QString &msg)
 	}
 
 	_userid = userid;
+	_resumed = !_token.isEmpty();
 
 	// Login complete!
 	_server->loginSuccess();
 
+	// Announce optional protocol features. The server will reply with
+	// the ones it supports. (Old servers just ignore this.)
+	_server->sendMessage(protocol::MessagePtr(new protocol::Login(protocol::capabilityMessage(protocol::SUPPORTED_CAPABILITIES))));
+
 	// If in host mode, send initial session settings
 	if(_mode==HOST) {
 		if(!_password.isEmpty())
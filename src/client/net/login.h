@@ -40,7 +40,7 @@ public:
 	enum Mode {HOST, JOIN};
 
 	LoginHandler(Mode mode, const QUrl &url)
-		: QObject(0), _mode(mode), _address(url), _maxusers(0), _allowdrawing(true), _layerctrllock(true), _state(0) { }
+		: QObject(0), _mode(mode), _address(url), _maxusers(0), _allowdrawing(true), _layerctrllock(true), _received(0), _resumed(false), _state(0) { }
 
 	/**
 	 * @brief Set the desired user ID. Only for host mode.
@@ -78,6 +78,13 @@ public:
 	 */
 	void setLayerControlLock(bool layerlock) { Q_ASSERT(_mode==HOST); _layerctrllock = layerlock; }
 
+	/**
+	 * @brief Resume a session instead of joining it. Only for join mode.
+	 * @param token the resume token the server gave us
+	 * @param received number of command messages received before the connection dropped
+	 */
+	void setResume(const QString &token, qint64 received) { Q_ASSERT(_mode==JOIN); _token=token; _received=received; }
+
 	/**
 	 * @brief Set the server we're communicating with
 	 * @param server
@@ -90,6 +97,14 @@ public:
 	 */
 	void receiveMessage(protocol::MessagePtr message);
 
+	/**
+	 * @brief Connection to the server has been established
+	 *
+	 * If the URL includes a session name, it is sent to the server
+	 * before the login proper begins.
+	 */
+	void serverConnected();
+
 	Mode mode() const { return _mode; }
 
 	const QUrl &url() const { return _address; }
@@ -100,6 +115,12 @@ public:
 	 */
 	int userId() const { return _userid; }
 
+	/**
+	 * @brief Was an earlier session resumed?
+	 * @return true if the server accepted the resume request
+	 */
+	bool isResumed() const { return _resumed; }
+
 private:
 	void expectHello(const QString &msg);
 	void expectPasswordResponse(const QString &msg);
@@ -117,6 +138,11 @@ private:
 	bool _allowdrawing;
 	bool _layerctrllock;
 
+	// resuming a dropped connection
+	QString _token;
+	qint64 _received;
+	bool _resumed;
+
 	Server *_server;
 	int _state;
 	bool _requirepass;
@@ -57,6 +57,9 @@ void ServerThread::run() {
 	server::Server server;
 	server.setErrorStream(new QTextStream(stderr));
 
+	// Compression is a waste of CPU time for local connections
+	server.setCompressionEnabled(false);
+
 	connect(&server, SIGNAL(lastClientLeft()), this, SLOT(quit()));
 
 	qDebug() << "starting server";
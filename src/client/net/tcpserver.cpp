@@ -21,21 +21,24 @@
 
 #include <QDebug>
 #include <QTcpSocket>
+#include <QTimer>
 
 #include "config.h"
 #include "tcpserver.h"
 #include "login.h"
 
 #include "../shared/net/messagequeue.h"
+#include "../shared/net/login.h"
 
 namespace net {
 
 TcpServer::TcpServer(QObject *parent) :
-	QObject(parent), Server(false), _loginstate(0)
+	QObject(parent), Server(false), _loginstate(0), _loginfailed(false)
 {
 	_socket = new QTcpSocket(this);
 	_msgqueue = new protocol::MessageQueue(_socket, this);
 
+	connect(_socket, SIGNAL(connected()), this, SLOT(handleConnect()));
 	connect(_socket, SIGNAL(disconnected()), this, SLOT(handleDisconnect()));
 	connect(_socket, SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(handleSocketError()));
 	connect(_socket, &QTcpSocket::stateChanged, [this](QAbstractSocket::SocketState state) {
@@ -47,19 +50,37 @@ TcpServer::TcpServer(QObject *parent) :
 	connect(_msgqueue, SIGNAL(bytesSent(int)), this, SIGNAL(bytesSent(int)));
 	connect(_msgqueue, SIGNAL(badData(int,int)), this, SLOT(handleBadData(int,int)));
 	connect(_msgqueue, SIGNAL(expectingBytes(int)), this, SIGNAL(expectingBytes(int)));
+	connect(_msgqueue, SIGNAL(compressionRatioChanged(qreal)), this, SIGNAL(compressionRatioChanged(qreal)));
 }
 
-void TcpServer::login(LoginHandler *login)
+void TcpServer::login(LoginHandler *login, int delay)
 {
 	_loginstate = login;
 	_loginstate->setParent(this);
 	_loginstate->setServer(this);
-	_socket->connectToHost(login->url().host(), login->url().port(DRAWPILE_PROTO_DEFAULT_PORT));
+
+	if(delay>0)
+		QTimer::singleShot(delay, this, SLOT(connectToHost()));
+	else
+		connectToHost();
+}
+
+void TcpServer::connectToHost()
+{
+	// The login may have been cancelled while waiting
+	if(_loginstate)
+		_socket->connectToHost(_loginstate->url().host(), _loginstate->url().port(DRAWPILE_PROTO_DEFAULT_PORT));
 }
 
 void TcpServer::logout()
 {
-	_socket->disconnectFromHost();
+	if(_socket->state() == QAbstractSocket::UnconnectedState) {
+		// A delayed login hasn't started connecting yet
+		_loginstate = 0;
+		handleDisconnect();
+	} else {
+		_socket->disconnectFromHost();
+	}
 }
 
 int TcpServer::uploadQueueBytes() const
@@ -84,11 +105,31 @@ void TcpServer::handleMessage()
 		protocol::MessagePtr msg = _msgqueue->getPending();
 		if(_loginstate)
 			_loginstate->receiveMessage(msg);
+		else if(msg->type() == protocol::MSG_LOGIN)
+			handleLoginMessage(msg.cast<protocol::Login>());
 		else
 			emit messageReceived(msg);
 	}
 }
 
+void TcpServer::handleLoginMessage(const protocol::Login &msg)
+{
+	// The server gives us a token for resuming the session if the connection drops
+	if(msg.message().startsWith("TOKEN ")) {
+		emit resumeTokenReceived(msg.message().mid(6));
+		return;
+	}
+
+	int caps = protocol::parseCapabilityMessage(msg.message());
+	if(caps<0) {
+		qWarning() << "Unexpected login message:" << msg.message();
+		return;
+	}
+
+	qDebug() << "server capabilities:" << msg.message();
+	_msgqueue->setPeerCapabilities(caps & protocol::SUPPORTED_CAPABILITIES);
+}
+
 void TcpServer::handleBadData(int len, int type)
 {
 	qWarning() << "Received" << len << "bytes of unknown message type" << type;
@@ -96,9 +137,15 @@ void TcpServer::handleBadData(int len, int type)
 	_socket->abort();
 }
 
+void TcpServer::handleConnect()
+{
+	if(_loginstate)
+		_loginstate->serverConnected();
+}
+
 void TcpServer::handleDisconnect()
 {
-	emit serverDisconnected(_error);
+	emit serverDisconnected(_error, _loginfailed);
 	deleteLater();
 }
 
@@ -116,13 +163,17 @@ void TcpServer::loginFailure(const QString &message)
 {
 	qWarning() << "Login failed:" << message;
 	_error = message;
+	_loginfailed = true;
 	_socket->close();
 }
 
 void TcpServer::loginSuccess()
 {
 	qDebug() << "logged in! Got user id" << _loginstate->userId();
-	emit loggedIn(_loginstate->userId(), _loginstate->mode() == LoginHandler::JOIN);
+	if(_loginstate->isResumed())
+		emit sessionResumed(_loginstate->userId());
+	else
+		emit loggedIn(_loginstate->userId(), _loginstate->mode() == LoginHandler::JOIN);
 
 	_loginstate->deleteLater();
 	_loginstate = 0;
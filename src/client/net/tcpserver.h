@@ -29,6 +29,7 @@ class QTcpSocket;
 
 namespace protocol {
     class MessageQueue;
+    class Login;
 }
 
 namespace net {
@@ -41,7 +42,12 @@ class TcpServer : public QObject, public Server
 public:
 	explicit TcpServer(QObject *parent = 0);
 
-	void login(LoginHandler *login);
+	/**
+	 * @brief Connect to the server and log in
+	 * @param login the login handler
+	 * @param delay milliseconds to wait before connecting
+	 */
+	void login(LoginHandler *login, int delay=0);
 	void logout();
 
 	void sendMessage(protocol::MessagePtr msg);
@@ -53,12 +59,15 @@ public:
 
 signals:
 	void loggedIn(int userid, bool join);
+	void sessionResumed(int userid);
+	void resumeTokenReceived(const QString &token);
 	void loggingOut();
-	void serverDisconnected(const QString &message);
+	void serverDisconnected(const QString &message, bool loginFailed);
 
 	void expectingBytes(int);
 	void bytesReceived(int);
 	void bytesSent(int);
+	void compressionRatioChanged(qreal);
 	void messageReceived(protocol::MessagePtr message);
 
 protected:
@@ -68,14 +77,19 @@ protected:
 private slots:
 	void handleMessage();
 	void handleBadData(int len, int type);
+	void connectToHost();
+	void handleConnect();
 	void handleDisconnect();
 	void handleSocketError();
 
 private:
+	void handleLoginMessage(const protocol::Login &msg);
+
 	QTcpSocket *_socket;
 	protocol::MessageQueue *_msgqueue;
 	LoginHandler *_loginstate;
 	QString _error;
+	bool _loginfailed;
 };
 
 }
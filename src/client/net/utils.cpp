@@ -136,6 +136,7 @@ protocol::PenPoint pointToProtocol(const paintcore::Point &p)
 protocol::PenPointVector pointsToProtocol(const paintcore::PointVector &points)
 {
 	protocol::PenPointVector ppvec;
+	ppvec.reserve(points.size());
 	foreach(const paintcore::Point &p, points)
 		ppvec.append(pointToProtocol(p));
 
@@ -0,0 +1,209 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2013 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <QDebug>
+#include <QDir>
+#include <QRunnable>
+#include <QMutexLocker>
+#include <QStandardPaths>
+
+#include "savepointstore.h"
+#include "core/layerstack.h"
+
+namespace drawingboard {
+
+namespace {
+
+class SpillJob : public QRunnable {
+public:
+	SpillJob(SavepointStore *store, int id, paintcore::Savepoint *savepoint, paintcore::Savepoint *newer)
+		: _store(store), _id(id), _savepoint(savepoint), _newer(newer)
+	{ }
+
+	~SpillJob()
+	{
+		delete _savepoint;
+		delete _newer;
+	}
+
+	void run()
+	{
+		_store->write(_id, _savepoint->toDelta(_newer));
+	}
+
+private:
+	SavepointStore *_store;
+	int _id;
+	paintcore::Savepoint *_savepoint;
+	paintcore::Savepoint *_newer;
+};
+
+}
+
+SavepointStore::SavepointStore()
+	: _available(false), _lastid(0)
+{
+	// A single thread keeps the file writes in order
+	_pool.setMaxThreadCount(1);
+
+	const QString cachedir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+	if(QDir().mkpath(cachedir)) {
+		_file.setFileTemplate(QDir(cachedir).filePath("savepoints-XXXXXX"));
+		_available = _file.open();
+	}
+
+	if(!_available)
+		qWarning() << "Couldn't create savepoint spill file. Savepoints will be kept in memory.";
+}
+
+SavepointStore::~SavepointStore()
+{
+	_pool.waitForDone();
+}
+
+int SavepointStore::spill(paintcore::Savepoint *savepoint, const paintcore::Savepoint *newer)
+{
+	const int id = ++_lastid;
+	_pool.start(new SpillJob(this, id, savepoint, newer ? newer->clone() : 0));
+	return id;
+}
+
+void SavepointStore::write(int id, const QByteArray &data)
+{
+	QMutexLocker lock(&_mutex);
+	if(_discarded.remove(id))
+		return;
+
+	Location loc;
+	loc.length = data.length();
+	loc.offset = allocate(loc.length);
+
+	if(!_file.seek(loc.offset) || _file.write(data) != data.length()) {
+		qWarning() << "Couldn't write savepoint to spill file:" << _file.errorString();
+		release(loc);
+		loc.length = -1;
+	}
+
+	_index[id] = loc;
+}
+
+/**
+ * The first free range that is big enough is used. If there is none,
+ * the data goes to the end of the file.
+ */
+qint64 SavepointStore::allocate(qint64 length)
+{
+	for(int i=0;i<_free.size();++i) {
+		Location &range = _free[i];
+		if(range.length >= length) {
+			const qint64 offset = range.offset;
+			range.offset += length;
+			range.length -= length;
+			if(range.length==0)
+				_free.removeAt(i);
+			return offset;
+		}
+	}
+	return _file.size();
+}
+
+/**
+ * The freed range is merged with its free neighbours. A free range at the
+ * end of the file is given back by truncating the file.
+ */
+void SavepointStore::release(const Location &loc)
+{
+	if(loc.length<=0)
+		return;
+
+	Location range = loc;
+
+	int i=0;
+	while(i<_free.size() && _free.at(i).offset < range.offset)
+		++i;
+
+	if(i>0 && _free.at(i-1).offset + _free.at(i-1).length == range.offset) {
+		--i;
+		range.offset = _free.at(i).offset;
+		range.length += _free.at(i).length;
+		_free.removeAt(i);
+	}
+
+	if(i<_free.size() && range.offset + range.length == _free.at(i).offset) {
+		range.length += _free.at(i).length;
+		_free.removeAt(i);
+	}
+
+	if(range.offset + range.length >= _file.size())
+		_file.resize(range.offset);
+	else
+		_free.insert(i, range);
+}
+
+paintcore::Savepoint *SavepointStore::load(int id, const paintcore::Savepoint *newer, paintcore::LayerStack *owner)
+{
+	_mutex.lock();
+	if(!_index.contains(id)) {
+		// Still being written
+		_mutex.unlock();
+		_pool.waitForDone();
+		_mutex.lock();
+	}
+
+	const Location loc = _index.value(id, Location { 0, -1 });
+	QByteArray data;
+	if(loc.length>=0 && _file.seek(loc.offset))
+		data = _file.read(loc.length);
+	_mutex.unlock();
+
+	discard(id);
+
+	if(data.length() != loc.length || loc.length<0) {
+		qWarning() << "Couldn't read savepoint" << id << "from spill file";
+		return 0;
+	}
+
+	return paintcore::Savepoint::fromDelta(data, newer, owner);
+}
+
+void SavepointStore::discard(int id)
+{
+	QMutexLocker lock(&_mutex);
+	QHash<int, Location>::iterator i = _index.find(id);
+	if(i == _index.end()) {
+		if(id > 0 && id <= _lastid)
+			_discarded.insert(id);
+		return;
+	}
+
+	const Location loc = i.value();
+	_index.erase(i);
+
+	// Reclaim the disk space right away once nothing is stored. Pending
+	// writes will simply start from the beginning of the file.
+	if(_index.isEmpty()) {
+		_free.clear();
+		_file.resize(0);
+	} else {
+		release(loc);
+	}
+}
+
+}
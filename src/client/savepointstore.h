@@ -0,0 +1,110 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2013 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+#ifndef DP_SAVEPOINTSTORE_H
+#define DP_SAVEPOINTSTORE_H
+
+#include <QHash>
+#include <QList>
+#include <QSet>
+#include <QMutex>
+#include <QThreadPool>
+#include <QTemporaryFile>
+
+namespace paintcore {
+	class LayerStack;
+	class Savepoint;
+}
+
+namespace drawingboard {
+
+/**
+ * @brief On-disk storage for old savepoints
+ *
+ * Savepoints are compressed and written to a temporary file in the cache
+ * directory by a background thread. Only the tiles that differ from
+ * the next newer savepoint are stored, so that savepoint is needed to
+ * load the spilled one back.
+ *
+ * The space of discarded savepoints is reused for new ones, and the file
+ * is truncated whenever its end is free, so it doesn't keep growing
+ * during a long session.
+ */
+class SavepointStore {
+public:
+	SavepointStore();
+	~SavepointStore();
+
+	SavepointStore(const SavepointStore&) = delete;
+	SavepointStore &operator=(const SavepointStore&) = delete;
+
+	//! Can savepoints be spilled? (false if the spill file couldn't be created)
+	bool isAvailable() const { return _available; }
+
+	/**
+	 * @brief Write a savepoint to disk in the background
+	 *
+	 * @param savepoint the savepoint to store. The store takes ownership of it
+	 * @param newer the next newer savepoint (may be null). A copy is made, so this may be deleted afterwards
+	 * @return spill ID
+	 */
+	int spill(paintcore::Savepoint *savepoint, const paintcore::Savepoint *newer);
+
+	/**
+	 * @brief Load a spilled savepoint
+	 *
+	 * If the savepoint is still being written, this waits until it is done.
+	 * The spilled copy is discarded.
+	 *
+	 * @param id spill ID
+	 * @param newer the same newer savepoint that was given to spill()
+	 * @param owner the layer stack the savepoint belongs to
+	 * @return the savepoint or null in case of error
+	 */
+	paintcore::Savepoint *load(int id, const paintcore::Savepoint *newer, paintcore::LayerStack *owner);
+
+	//! Discard a spilled savepoint that is no longer needed
+	void discard(int id);
+
+	//! Called by the background job when the savepoint has been serialized
+	void write(int id, const QByteArray &data);
+
+private:
+	struct Location {
+		qint64 offset;
+		qint64 length;
+	};
+
+	qint64 allocate(qint64 length);
+	void release(const Location &loc);
+
+	QThreadPool _pool;
+	QTemporaryFile _file;
+	bool _available;
+
+	QMutex _mutex;
+	QHash<int, Location> _index;
+	QList<Location> _free; // unused ranges of the file, sorted by offset
+	QSet<int> _discarded;
+	int _lastid;
+};
+
+}
+
+#endif
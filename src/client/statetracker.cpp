@@ -19,9 +19,15 @@
 
 */
 #include <QDebug>
-#include <QDateTime>
+#include <QHash>
+#include <QSet>
+#include <QRunnable>
+#include <QMutexLocker>
+
+#include <cmath>
 
 #include "statetracker.h"
+#include "deadcommands.h"
 #include "canvasscene.h" // needed for annotations
 #include "annotationitem.h"
 #include "loader.h"
@@ -40,15 +46,158 @@
 
 namespace drawingboard {
 
+namespace {
+	// Replay cost is estimated in composited pixels. Each command also
+	// has a fixed overhead, about the same as filling a tile.
+	const qint64 COMMAND_COST = 64 * 64;
+
+	// A savepoint is made at the next undo point once replaying the commands
+	// since the previous one would cost more than this. At a typical speed
+	// of around 100 megapixels per second, undoing the latest action
+	// should then never take much more than a tenth of a second.
+	const qint64 SAVEPOINT_COST = 10 * 1000 * 1000;
+
+	// Memory budget for savepoint pixel data
+	const uint SAVEPOINT_MEMORY_LIMIT = 1024 * 1024 * 128;
+
+	// Number of newest savepoints that are never spilled to disk
+	const int RESIDENT_SAVEPOINTS = 3;
+
+	// Shorter runs of layer commands are not worth splitting between threads
+	const int PARALLEL_MIN_COMMANDS = 8;
+
+	bool isLayerCommand(int type)
+	{
+		return type == protocol::MSG_TOOLCHANGE || type == protocol::MSG_PEN_MOVE
+			|| type == protocol::MSG_PEN_UP || type == protocol::MSG_PUTIMAGE;
+	}
+
+	// Finds the groups of layers and drawing contexts connected by commands
+	class GroupFinder {
+	public:
+		static int contextNode(int id) { return id * 2; }
+		static int layerNode(int id) { return id * 2 + 1; }
+
+		int find(int node) const
+		{
+			while(_parent.value(node, node) != node)
+				node = _parent.value(node);
+			return node;
+		}
+
+		void join(int a, int b)
+		{
+			a = find(a);
+			b = find(b);
+			if(a != b)
+				_parent[a] = b;
+		}
+
+	private:
+		QHash<int,int> _parent;
+	};
+}
+
+/**
+ * @brief Commands that can be executed independently of the other groups
+ */
+struct CommandGroup {
+	QList<protocol::MessagePtr> commands;
+	QVector<int> positions;
+	QVector<bool> dead;
+};
+
+namespace {
+
+class EngineJob : public QRunnable {
+public:
+	EngineJob(StateTracker *tracker) : _tracker(tracker) { }
+
+	void run() { _tracker->runCommands(); }
+
+private:
+	StateTracker *_tracker;
+};
+
+class LayerGroupJob : public QRunnable {
+public:
+	LayerGroupJob(StateTracker *tracker, const CommandGroup *group) : _tracker(tracker), _group(group) { }
+
+	void run() { _tracker->executeGroup(*_group); }
+
+private:
+	StateTracker *_tracker;
+	const CommandGroup *_group;
+};
+
+struct MarkerUpdate {
+	MarkerUpdate() : visible(false) {}
+
+	bool visible;
+	QColor color;
+	paintcore::Point point;
+};
+
+}
+
+/**
+ * @brief Changes made by the paint engine that are not yet visible
+ */
+struct PublishedState {
+	PublishedState() : canvas(0), xoffset(0), yoffset(0), previews(0) {}
+	PublishedState(const PublishedState &) = delete;
+	PublishedState &operator=(const PublishedState&) = delete;
+	~PublishedState() { delete canvas; }
+
+	//! Add the changes of a newer batch to these
+	void append(PublishedState *newer);
+
+	paintcore::Savepoint *canvas;
+	int xoffset, yoffset; // accumulated canvas resize offset
+	QVector<net::LayerListItem> layers;
+	QVector<AnnotationState> annotations;
+	QSet<int> changedannotations;
+	int previews; // number of local preview strokes to remove
+	QHash<int, MarkerUpdate> markers;
+	QList<int> mylayers;
+	QList<int> myannotations;
+};
+
+void PublishedState::append(PublishedState *newer)
+{
+	delete canvas;
+	canvas = newer->canvas;
+	newer->canvas = 0;
+
+	xoffset += newer->xoffset;
+	yoffset += newer->yoffset;
+	layers = newer->layers;
+	annotations = newer->annotations;
+	changedannotations.unite(newer->changedannotations);
+	previews += newer->previews;
+
+	QHashIterator<int, MarkerUpdate> i(newer->markers);
+	while(i.hasNext()) {
+		i.next();
+		markers[i.key()] = i.value();
+	}
+
+	mylayers.append(newer->mylayers);
+	myannotations.append(newer->myannotations);
+}
+
 struct StateSavepoint {
-	StateSavepoint() : timestamp(0), streampointer(-1), canvas(0) {}
+	StateSavepoint() : replaycost(0), bytes(0), streampointer(-1), canvas(0), spillid(0), spilldelta(false) {}
 	StateSavepoint(const StateSavepoint &) = delete;
 	StateSavepoint &operator=(const StateSavepoint&) = delete;
 	~StateSavepoint() { delete canvas; }
 
-	qint64 timestamp;
+	qint64 replaycost;
+	uint bytes;
 	int streampointer;
-	paintcore::Savepoint *canvas;
+	paintcore::Savepoint *canvas; // null when spilled to disk
+	int spillid;
+	bool spilldelta; // spilled relative to the next savepoint
 	QHash<int, DrawingContext> ctxstate;
 	QVector<net::LayerListItem> layermodel;
 	QVector<drawingboard::AnnotationState> annotations;
@@ -57,22 +206,97 @@ struct StateSavepoint {
 StateTracker::StateTracker(CanvasScene *scene, net::Client *client, QObject *parent)
 	: QObject(parent),
 	  _scene(scene),
-	  _image(scene->layers()),
-	  _layerlist(client->layerlist()),
+	  _image(new paintcore::LayerStack),
+	  _layerlist(new net::LayerListModel),
+	  _visibleimage(scene->layers()),
+	  _visiblelayers(client->layerlist()),
 	  _myid(client->myId()),
 	  _hassnapshot(true),
-	  _msgstream_sizelimit(1024 * 1024 * 10)
+	  _msgstream_sizelimit(1024 * 1024 * 10),
+	  _replaycost(0),
+	  _savepointbytes(0),
+	  _catchingup(false),
+	  _hascommands(false),
+	  _catchupremaining(0),
+	  _catchuptotal(0),
+	  _catchupdone(0),
+	  _catchuppercent(0),
+	  _enginejob(false),
+	  _parallel(true),
+	  _batch(new PublishedState),
+	  _published(0)
 {
-	connect(client, SIGNAL(layerVisibilityChange(int,bool)), _image, SLOT(setLayerHidden(int,bool)));
+	// A single thread keeps the commands in order
+	_enginepool.setMaxThreadCount(1);
+
+	connect(client, SIGNAL(layerVisibilityChange(int,bool)), _visibleimage, SLOT(setLayerHidden(int,bool)));
+	connect(client, SIGNAL(expectingBytes(int)), this, SLOT(expectBytes(int)));
+	connect(client, SIGNAL(bytesReceived(int)), this, SLOT(bytesReceived(int)));
+
+	// The download may have started already in the same batch as the login
+	startCatchup(client->expectedBytes());
 }
 
 StateTracker::~StateTracker()
 {
+	// Stop the paint engine thread
+	_enginecancel.store(1);
+	_enginepool.waitForDone();
+
 	while(!_savepoints.isEmpty())
 		delete _savepoints.takeLast();
+
+	delete _image;
+	delete _layerlist;
+	delete _batch;
+	delete _published;
 }
 
+/**
+ * The command is queued for the paint engine thread. Its result
+ * becomes visible once the batch it is part of has been executed.
+ */
 void StateTracker::receiveCommand(protocol::MessagePtr msg)
+{
+	_hascommands = true;
+
+	QMutexLocker lock(&_queuemutex);
+	_queue.append(msg);
+	if(!_enginejob) {
+		_enginejob = true;
+		_enginepool.start(new EngineJob(this));
+	}
+}
+
+void StateTracker::receiveCommands(const QList<protocol::MessagePtr> &msgs)
+{
+	if(msgs.isEmpty())
+		return;
+
+	_hascommands = true;
+
+	QMutexLocker lock(&_queuemutex);
+	_queue.append(msgs);
+	if(!_enginejob) {
+		_enginejob = true;
+		_enginepool.start(new EngineJob(this));
+	}
+}
+
+void StateTracker::executeCommand(protocol::MessagePtr msg, bool dead)
+{
+	const int pos = appendCommand(msg);
+	if(dead)
+		skipCommand(msg);
+	else
+		handleCommand(msg, false, pos);
+}
+
+/**
+ * @brief Add a command to the history
+ * @return position of the command in the message stream
+ */
+int StateTracker::appendCommand(protocol::MessagePtr msg)
 {
 	// Cleanup
 	if(_msgstream_sizelimit>0 && _msgstream.lengthInBytes() > _msgstream_sizelimit) {
@@ -111,19 +335,89 @@ void StateTracker::receiveCommand(protocol::MessagePtr msg)
 			} else {
 				qDebug() << "removing" << savepoint << "redundant save points out of" << _savepoints.count();
 				while(savepoint--)
-					delete _savepoints.takeFirst();
+					removeSavepoint(0);
 			}
 		}
 	}
 
-	// Add command to history and execute it
 	_msgstream.append(msg);
-	int pos = _msgstream.end() - 1;
-	handleCommand(msg, false, pos);
+	return _msgstream.end() - 1;
+}
+
+/**
+ * Execute a run of layer commands. Each layer and each drawing context
+ * belongs to exactly one group, so the groups can be executed in parallel
+ * and the commands of each layer are still executed in the same order.
+ *
+ * @param commands the batch of commands
+ * @param begin index of the first command to execute
+ * @param end index after the last command to execute
+ * @param dead indexes of the commands that can be skipped
+ */
+void StateTracker::executeParallel(const QList<protocol::MessagePtr> &commands, int begin, int end, const QSet<int> &dead)
+{
+	GroupFinder finder;
+	QHash<int,int> ctxlayer;
+	QVector<int> nodes;
+	nodes.reserve(end - begin);
+
+	for(int i=begin;i<end;++i) {
+		const protocol::MessagePtr &msg = commands.at(i);
+		const int ctxid = msg->contextId();
+
+		if(msg->type() == protocol::MSG_PUTIMAGE) {
+			nodes.append(GroupFinder::layerNode(msg.cast<protocol::PutImage>().layer()));
+			continue;
+		}
+
+		// The context hash must not change while the groups are executed
+		if(!ctxlayer.contains(ctxid))
+			ctxlayer[ctxid] = _contexts[ctxid].tool.layer_id;
+
+		if(msg->type() == protocol::MSG_TOOLCHANGE)
+			ctxlayer[ctxid] = msg.cast<protocol::ToolChange>().layer();
+		else
+			finder.join(GroupFinder::contextNode(ctxid), GroupFinder::layerNode(ctxlayer[ctxid]));
+
+		nodes.append(GroupFinder::contextNode(ctxid));
+	}
+
+	QVector<CommandGroup> groups;
+	QHash<int,int> groupindex;
+	for(int i=begin;i<end;++i) {
+		const int root = finder.find(nodes.at(i-begin));
+		if(!groupindex.contains(root)) {
+			groupindex[root] = groups.count();
+			groups.append(CommandGroup());
+		}
+
+		CommandGroup &group = groups[groupindex[root]];
+		group.commands.append(commands.at(i));
+		group.positions.append(appendCommand(commands.at(i)));
+		group.dead.append(dead.contains(i));
+	}
+
+	for(int i=1;i<groups.count();++i)
+		_layerpool.start(new LayerGroupJob(this, &groups.at(i)));
+
+	executeGroup(groups.at(0));
+	_layerpool.waitForDone();
+}
+
+void StateTracker::executeGroup(const CommandGroup &group)
+{
+	for(int i=0;i<group.commands.count() && !_enginecancel.load();++i) {
+		if(group.dead.at(i))
+			skipCommand(group.commands.at(i));
+		else
+			handleCommand(group.commands.at(i), false, group.positions.at(i));
+	}
 }
 
 void StateTracker::handleCommand(protocol::MessagePtr msg, bool replay, int pos)
 {
+	_replaycost += COMMAND_COST;
+
 	switch(msg->type()) {
 		using namespace protocol;
 		case MSG_CANVAS_RESIZE:
@@ -157,10 +451,10 @@ void StateTracker::handleCommand(protocol::MessagePtr msg, bool replay, int pos)
 			handlePutImage(msg.cast<PutImage>());
 			break;
 		case MSG_UNDOPOINT:
-			handleUndoPoint(msg.cast<UndoPoint>(), replay, pos);
+			handleUndoPoint(pos);
 			break;
 		case MSG_UNDO:
-			handleUndo(msg.cast<Undo>());
+			handleUndo(msg.cast<Undo>(), pos);
 			break;
 		case MSG_ANNOTATION_CREATE:
 			handleAnnotationCreate(msg.cast<AnnotationCreate>());
@@ -180,11 +474,266 @@ void StateTracker::handleCommand(protocol::MessagePtr msg, bool replay, int pos)
 	}
 }
 
+/**
+ * Catching up is possible only if the session history is still to be
+ * downloaded and nothing has been received yet.
+ *
+ * @param bytes length of the history
+ */
+void StateTracker::startCatchup(int bytes)
+{
+	if(_catchingup || bytes<=0 || _hascommands)
+		return;
+
+	_catchingup = true;
+	_catchupremaining = bytes;
+	_catchuptotal = bytes;
+	_catchupdone = 0;
+	_catchuppercent = 0;
+
+	emit catchupProgress(0);
+}
+
+void StateTracker::expectBytes(int count)
+{
+	if(_catchingup)
+		_catchupremaining = count;
+	else
+		startCatchup(count);
+}
+
+void StateTracker::bytesReceived(int count)
+{
+	if(_catchingup) {
+		_catchupremaining -= count;
+
+		// The commands of this batch are received right after this, so
+		// check only once they have been queued.
+		if(_catchupremaining <= 0)
+			QMetaObject::invokeMethod(this, "checkCatchup", Qt::QueuedConnection);
+	}
+}
+
+/**
+ * The commands queued so far are executed as one batch, so commands whose
+ * results are not visible at the end of the batch can be skipped. The
+ * result of each batch is published, unless still catching up.
+ */
+void StateTracker::runCommands()
+{
+	while(true) {
+		QList<protocol::MessagePtr> batch;
+		{
+			QMutexLocker lock(&_queuemutex);
+			if(_queue.isEmpty() || _enginecancel.load()) {
+				_enginejob = false;
+				break;
+			}
+			batch.swap(_queue);
+		}
+
+		const QSet<int> dead = findDeadCommands(batch);
+
+		int i = 0;
+		while(i<batch.count() && !_enginecancel.load()) {
+			int end = i;
+			while(end<batch.count() && isLayerCommand(batch.at(end)->type()))
+				++end;
+
+			if(_parallel && end - i >= PARALLEL_MIN_COMMANDS) {
+				executeParallel(batch, i, end, dead);
+			} else {
+				end = qMax(end, i+1);
+				for(int j=i;j<end;++j)
+					executeCommand(batch.at(j), dead.contains(j));
+			}
+
+			if(_catchingup) {
+				// Meta messages are part of the total too, so this stays slightly short
+				for(int j=i;j<end;++j)
+					_catchupdone += batch.at(j)->length();
+				const int percent = qMin(99, int(qint64(_catchupdone) * 100 / _catchuptotal));
+				if(percent != _catchuppercent) {
+					_catchuppercent = percent;
+					emit catchupProgress(percent);
+				}
+			}
+
+			i = end;
+		}
+
+		if(!_catchingup)
+			publish();
+	}
+
+	if(_catchingup)
+		QMetaObject::invokeMethod(this, "checkCatchup", Qt::QueuedConnection);
+}
+
+/**
+ * @brief Hand the changes made so far over to the GUI thread
+ *
+ * This is called by the paint engine thread, or by the GUI thread
+ * while the engine is idle.
+ */
+void StateTracker::publish()
+{
+	_batch->canvas = _image->makeSnapshot();
+	_batch->layers = _layerlist->getLayers();
+	_batch->annotations = _annotations;
+
+	PublishedState *batch = _batch;
+	_batch = new PublishedState;
+
+	QMutexLocker lock(&_publishmutex);
+	if(_published) {
+		// The GUI hasn't caught up with the previous batch yet
+		_published->append(batch);
+		delete batch;
+	} else {
+		_published = batch;
+		QMetaObject::invokeMethod(this, "applyPublished", Qt::QueuedConnection);
+	}
+}
+
+/**
+ * Update the visible canvas, layer list and annotations. Preview strokes
+ * and user markers are updated afterwards, so the real strokes are on
+ * the canvas before the previews are removed.
+ */
+void StateTracker::applyPublished()
+{
+	PublishedState *state;
+	{
+		QMutexLocker lock(&_publishmutex);
+		state = _published;
+		_published = 0;
+	}
+	if(!state)
+		return;
+
+	_visibleimage->updateFrom(state->canvas, state->xoffset, state->yoffset);
+	_visiblelayers->setLayers(state->layers);
+	if(!state->changedannotations.isEmpty())
+		_scene->updateAnnotations(state->annotations, state->changedannotations);
+
+	_scene->takePreview(state->previews);
+
+	QHashIterator<int, MarkerUpdate> markers(state->markers);
+	while(markers.hasNext()) {
+		markers.next();
+		if(markers.value().visible)
+			_scene->moveUserMarker(markers.key(), markers.value().color, markers.value().point);
+		else
+			_scene->hideUserMarker(markers.key());
+	}
+
+	foreach(int id, state->mylayers)
+		emit myLayerCreated(id);
+
+	foreach(int id, state->myannotations) {
+		AnnotationItem *item = _scene->getAnnotationById(id);
+		if(item)
+			emit myAnnotationCreated(item);
+	}
+
+	delete state;
+}
+
+/**
+ * @brief Wait for the paint engine thread to execute all queued commands
+ *
+ * The result is made visible right away. The GUI thread can access the
+ * engine's state until the next command is received.
+ */
+void StateTracker::waitForEngine()
+{
+	finishCatchup();
+	_enginepool.waitForDone();
+	applyPublished();
+}
+
+/**
+ * Catch-up is finished once the whole history has been received
+ * and the background job has executed all of it.
+ */
+void StateTracker::checkCatchup()
+{
+	if(!_catchingup || _catchupremaining > 0)
+		return;
+
+	{
+		QMutexLocker lock(&_queuemutex);
+		if(_enginejob)
+			return;
+	}
+
+	finishCatchup();
+}
+
+/**
+ * Wait for the paint engine thread to execute the queued commands
+ * and publish the whole result at once.
+ */
+void StateTracker::finishCatchup()
+{
+	if(!_catchingup)
+		return;
+
+	_enginepool.waitForDone();
+	Q_ASSERT(_queue.isEmpty());
+
+	_catchingup = false;
+	publish();
+	applyPublished();
+
+	emit catchupProgress(100);
+}
+
+int StateTracker::annotationIndex(int id) const
+{
+	for(int i=0;i<_annotations.count();++i) {
+		if(_annotations.at(i).id == id)
+			return i;
+	}
+	return -1;
+}
+
+/**
+ * @brief Update the drawing context for a command whose result won't be seen
+ *
+ * See DeadCommandFinder. Only pen commands affect the context.
+ */
+void StateTracker::skipCommand(const protocol::MessagePtr &msg)
+{
+	_replaycost += COMMAND_COST;
+
+	if(msg->type() == protocol::MSG_PEN_MOVE) {
+		const protocol::PenPointVector &points = msg.cast<protocol::PenMove>().points();
+		if(points.isEmpty())
+			return;
+
+		DrawingContext &ctx = _contexts[msg->contextId()];
+		if(!ctx.pendown) {
+			ctx.pendown = true;
+			ctx.distance_accumulator = 0;
+		}
+		const protocol::PenPoint &pp = points.last();
+		ctx.lastpoint = paintcore::Point(pp.x / 4.0, pp.y / 4.0, pp.p/255.0);
+
+	} else if(msg->type() == protocol::MSG_PEN_UP) {
+		_contexts[msg->contextId()].pendown = false;
+	}
+}
+
 /**
  * @brief Network disconnected, so end remote drawing processes
  */
 void StateTracker::endRemoteContexts()
 {
+	// The rest of the history is not coming
+	waitForEngine();
+
 	QHashIterator<int, DrawingContext> iter(_contexts);
 	while(iter.hasNext()) {
 		iter.next();
@@ -198,6 +747,9 @@ void StateTracker::endRemoteContexts()
 
 QList<protocol::MessagePtr> StateTracker::generateSnapshot(bool forcenew)
 {
+	// The snapshot is made from the visible state
+	waitForEngine();
+
 	if(!_hassnapshot || forcenew) {
 		// Generate snapshot
 		QList<protocol::MessagePtr> snapshot = SnapshotLoader(_scene).loadInitCommands();
@@ -223,6 +775,17 @@ QList<protocol::MessagePtr> StateTracker::generateSnapshot(bool forcenew)
 void StateTracker::handleCanvasResize(const protocol::CanvasResize &cmd, int pos)
 {
 	_image->resize(cmd.top(), cmd.right(), cmd.bottom(), cmd.left());
+	_replaycost += qint64(_image->width()) * _image->height() * _image->layers();
+
+	// Annotations stay in place relative to the content
+	if(cmd.left() || cmd.top()) {
+		_batch->xoffset += cmd.left();
+		_batch->yoffset += cmd.top();
+		for(int i=0;i<_annotations.count();++i) {
+			_annotations[i].rect.translate(cmd.left(), cmd.top());
+			_batch->changedannotations.insert(_annotations.at(i).id);
+		}
+	}
 
 	// Generate the initial savepoint, just in case
 	makeSavepoint(pos);
@@ -231,9 +794,10 @@ void StateTracker::handleCanvasResize(const protocol::CanvasResize &cmd, int pos
 void StateTracker::handleLayerCreate(const protocol::LayerCreate &cmd)
 {
 	_image->addLayer(cmd.id(), cmd.title(), QColor::fromRgba(cmd.fill()));
+	_replaycost += qint64(_image->width()) * _image->height();
 	_layerlist->createLayer(cmd.id(), cmd.title());
-	if(cmd.contextId() == _myid)
-		emit myLayerCreated(cmd.id());
+	if(cmd.contextId() == _myid && !_catchingup)
+		_batch->mylayers.append(cmd.id());
 }
 
 void StateTracker::handleLayerAttributes(const protocol::LayerAttributes &cmd)
@@ -269,8 +833,10 @@ void StateTracker::handleLayerOrder(const protocol::LayerOrder &cmd)
 
 void StateTracker::handleLayerDelete(const protocol::LayerDelete &cmd)
 {
-	if(cmd.merge())
+	if(cmd.merge()) {
 		_image->mergeLayerDown(cmd.id());
+		_replaycost += qint64(_image->width()) * _image->height();
+	}
 	_image->deleteLayer(cmd.id());
 	_layerlist->deleteLayer(cmd.id());
 }
@@ -303,23 +869,42 @@ void StateTracker::handlePenMove(const protocol::PenMove &cmd)
 		return;
 	}
 	
+	// Estimate the number of dabs for the replay cost
+	const int radius = qMax(ctx.tool.brush.radius1(), ctx.tool.brush.radius2());
+	const qreal spacing = qMax(qreal(1.0), ctx.tool.brush.spacing() * radius / 100.0);
+	qint64 dabs = 0;
+
 	paintcore::Point p;
-	foreach(const protocol::PenPoint pp, cmd.points()) {
+	const protocol::PenPointVector &points = cmd.points();
+	for(int i=0;i<points.size();++i) {
+		const protocol::PenPoint &pp = points.at(i);
 		p = paintcore::Point(pp.x / 4.0, pp.y / 4.0, pp.p/255.0);
 
 		if(ctx.pendown) {
 			layer->drawLine(cmd.contextId(), ctx.tool.brush, ctx.lastpoint, p, ctx.distance_accumulator);
+			dabs += 1 + qint64(hypot(p.x() - ctx.lastpoint.x(), p.y() - ctx.lastpoint.y()) / spacing);
 		} else {
 			ctx.pendown = true;
 			ctx.distance_accumulator = 0;
 			layer->dab(cmd.contextId(), ctx.tool.brush, p);
+			++dabs;
 		}
 		ctx.lastpoint = p;
 	}
-	if(cmd.contextId() == _myid)
-		_scene->takePreview(cmd.points().size());
-	else
-		_scene->moveUserMarker(cmd.contextId(), ctx.tool.brush.color1(), ctx.lastpoint);
+	_replaycost += dabs * (2*radius+1) * (2*radius+1);
+
+	if(_catchingup)
+		return;
+
+	QMutexLocker lock(&_batchmutex);
+	if(cmd.contextId() == _myid) {
+		_batch->previews += cmd.points().size();
+	} else {
+		MarkerUpdate &marker = _batch->markers[cmd.contextId()];
+		marker.visible = true;
+		marker.color = ctx.tool.brush.color1();
+		marker.point = ctx.lastpoint;
+	}
 }
 
 void StateTracker::handlePenUp(const protocol::PenUp &cmd)
@@ -335,7 +920,10 @@ void StateTracker::handlePenUp(const protocol::PenUp &cmd)
 	layer->mergeSublayer(cmd.contextId());
 
 	ctx.pendown = false;
-	_scene->hideUserMarker(cmd.contextId());
+	if(!_catchingup) {
+		QMutexLocker lock(&_batchmutex);
+		_batch->markers[cmd.contextId()].visible = false;
+	}
 }
 
 void StateTracker::handlePutImage(const protocol::PutImage &cmd)
@@ -348,37 +936,23 @@ void StateTracker::handlePutImage(const protocol::PutImage &cmd)
 	QByteArray data = qUncompress(cmd.image());
 	QImage img(reinterpret_cast<const uchar*>(data.constData()), cmd.width(), cmd.height(), QImage::Format_ARGB32);
 	layer->putImage(cmd.x(), cmd.y(), img, (cmd.flags() & protocol::PutImage::MODE_BLEND));
+	_replaycost += qint64(cmd.width()) * cmd.height() + cmd.image().length();
 }
 
-void StateTracker::handleUndoPoint(const protocol::UndoPoint &cmd, bool replay, int pos)
+void StateTracker::handleUndoPoint(int pos)
 {
-	// New undo point. This branches the undo history. Since we store the
-	// commands in a linear sequence, this branching is represented by marking
-	// the unreachable commands as GONE.
-	if(!replay) {
-		int i = pos - 1; // skip the one just added
-		while(_msgstream.isValidIndex(i)) {
-			protocol::MessagePtr msg = _msgstream.at(i);
-			if(msg->contextId() == cmd.contextId()) {
-				// optimization: we can stop searching after finding the first GONE command
-				if(msg->type() != protocol::MSG_UNDO && msg->undoState() == protocol::GONE)
-					break;
-				else if(msg->undoState() == protocol::UNDONE)
-					msg->setUndoState(protocol::GONE);
-			}
-			--i;
-		}
-	}
+	// The message stream takes care of branching the undo history
+	// when a new undo point is added.
 
 	// Make a new savepoint (if possible)
 	makeSavepoint(pos);
 }
 
-void StateTracker::handleUndo(protocol::Undo &cmd)
+void StateTracker::handleUndo(protocol::Undo &cmd, int pos)
 {
 	// Undo/redo commands are never replayed, so start
 	// by marking it as unavailable.
-	cmd.setUndoState(protocol::GONE);
+	_msgstream.setUndoState(pos, protocol::GONE);
 
 	if(cmd.points()==0) {
 		qWarning() << "zero undo from user" << cmd.contextId();
@@ -386,53 +960,30 @@ void StateTracker::handleUndo(protocol::Undo &cmd)
 	}
 
 	const uint8_t ctxid = cmd.contextId();
-	const bool undo = cmd.points()>0;
-	int actions = qAbs(cmd.points());
-
-	// Step 1. Find undo or redo point
-	int pos = _msgstream.end();
-	if(undo) {
-		// Search for undoable actions from the end of the
-		// command stream towards the beginning
-		while(actions>0 && _msgstream.isValidIndex(--pos)) {
-			protocol::MessagePtr msg = _msgstream.at(pos);
-			if(msg->type() == protocol::MSG_UNDOPOINT && msg->contextId() == ctxid) {
-				if(msg->undoState() == protocol::DONE)
-					--actions;
-			}
-		}
-	} else {
-		// Find the start of the undo sequence
-		int redostart = pos;
-		while(_msgstream.isValidIndex(--pos)) {
-			protocol::MessagePtr msg = _msgstream.at(pos);
-			if(msg->type() == protocol::MSG_UNDOPOINT && msg->contextId() == ctxid) {
-				if(msg->undoState() != protocol::DONE)
-					redostart = pos;
-				else
-					break;
-			}
-		}
 
-		if(redostart == _msgstream.end()) {
-			qWarning() << "nothing to redo for user" << cmd.contextId();
-			return;
-		}
-		pos = redostart;
-	}
+	// Step 1. (Un)mark undo points. Only the user's undo points are marked:
+	// the commands following them share their state.
+	QList<int> marked;
+	if(cmd.points()>0)
+		marked = _msgstream.markUndone(ctxid, cmd.points(), protocol::UNDO_HISTORY_LIMIT, _msgstream.offset());
+	else
+		marked = _msgstream.markRedone(ctxid, -cmd.points(), protocol::UNDO_HISTORY_LIMIT);
 
-	if(!_msgstream.isValidIndex(pos)) {
+	if(marked.isEmpty()) {
 		// Normally the server should enforce undo limits to prevent
 		// this from happening
-		qWarning() << "Cannot undo action by user" << ctxid << ": not enough messages in buffer!";
+		qWarning() << "Cannot undo/redo action by user" << ctxid << ": nothing in buffer!";
 		return;
 	}
 
+	const int target = marked.first();
+
 	// Step 2. Find nearest save point
 	const StateSavepoint *savepoint = 0;
 	for(int i=_savepoints.count()-1;i>=0;--i) {
-		if(_savepoints.at(i)->streampointer <= pos) {
-			savepoint = _savepoints.at(i);
+		if(_savepoints.at(i)->streampointer <= target) {
+			if(loadSavepoint(i))
+				savepoint = _savepoints.at(i);
 			break;
 		}
 	}
@@ -442,42 +993,248 @@ void StateTracker::handleUndo(protocol::Undo &cmd)
 		return;
 	}
 
-	// Step 3. (Un)mark all actions by the user as undone
-	if(undo) {
-		for(int i=pos;i<_msgstream.end();++i) {
-			protocol::MessagePtr msg = _msgstream.at(i);
-			if(msg->contextId() == ctxid)
-				msg->setUndoState(protocol::MessageUndoState(protocol::UNDONE | msg->undoState()));
+	// Step 3. Revert to the savepoint and replay commands, excluding undone
+	// actions. If possible, only the layers the undo affects are replayed.
+	QSet<int> layers;
+	if(!findAffectedLayers(savepoint, ctxid, marked, layers) || !replayLayers(savepoint, ctxid, layers))
+		replayAll(savepoint);
+}
+
+void StateTracker::replayAll(const StateSavepoint *savepoint)
+{
+	const QSet<int> dead = findDeadCommands(savepoint);
+
+	revertSavepoint(savepoint);
+
+	protocol::ReplayUndoState undostate(_msgstream.undoIndex(), savepoint->streampointer);
+	for(int i=savepoint->streampointer+1;i<_msgstream.end();++i) {
+		const protocol::MessagePtr msg = _msgstream.at(i);
+		if(undostate.next(msg, i) != protocol::DONE)
+			continue;
+
+		if(dead.contains(i))
+			skipCommand(msg);
+		else
+			handleCommand(msg, true, i);
+	}
+}
+
+/**
+ * @brief Find the commands after a savepoint that can be skipped when replaying
+ *
+ * The client enforces the same undo history limit as the server, so
+ * commands older than it are permanent.
+ */
+QSet<int> StateTracker::findDeadCommands(const StateSavepoint *savepoint) const
+{
+	DeadCommandFinder finder(savepoint->ctxstate);
+
+	protocol::ReplayUndoState undostate(_msgstream.undoIndex(), savepoint->streampointer);
+	for(int i=savepoint->streampointer+1;i<_msgstream.end();++i) {
+		const protocol::MessagePtr msg = _msgstream.at(i);
+		if(undostate.next(msg, i) == protocol::DONE)
+			finder.add(i, msg, _msgstream.isUndoFinal(msg->contextId(), i, protocol::UNDO_HISTORY_LIMIT));
+	}
+
+	return finder.find();
+}
+
+/**
+ * @brief Find the commands in the catch-up queue that can be skipped
+ *
+ * The queued commands are not in the message stream yet, so the queue
+ * itself is used to tell which ones are permanent: a command can no longer
+ * be undone once UNDO_HISTORY_LIMIT undo points have followed it without
+ * any undo in between. Neither can commands whose user's latest undo point
+ * in the stream is permanent already.
+ *
+ * @param commands the queued commands. The returned set contains indices to this list
+ */
+QSet<int> StateTracker::findDeadCommands(const QList<protocol::MessagePtr> &commands) const
+{
+	const int count = commands.count();
+	QVector<bool> permanent(count, false);
+
+	QSet<int> undopoints;
+	for(int i=0;i<count;++i) {
+		const protocol::MessagePtr &msg = commands.at(i);
+		if(msg->type() == protocol::MSG_UNDOPOINT)
+			undopoints.insert(msg->contextId());
+		else if(!undopoints.contains(msg->contextId()))
+			permanent[i] = _msgstream.isUndoFinal(msg->contextId(), _msgstream.end()-1, protocol::UNDO_HISTORY_LIMIT);
+	}
+
+	QVector<int> following; // undo points after the current command, nearest last
+	int undo = count;
+	for(int i=count-1;i>=0;--i) {
+		if(following.size() >= protocol::UNDO_HISTORY_LIMIT && following.at(following.size() - protocol::UNDO_HISTORY_LIMIT) < undo)
+			permanent[i] = true;
+
+		const int type = commands.at(i)->type();
+		if(type == protocol::MSG_UNDOPOINT)
+			following.append(i);
+		else if(type == protocol::MSG_UNDO)
+			undo = i;
+	}
+
+	DeadCommandFinder finder(_contexts);
+	for(int i=0;i<count;++i)
+		finder.add(i, commands.at(i), permanent.at(i));
+
+	return finder.find();
+}
+
+/**
+ * @brief Find the layers affected by an undo or redo
+ *
+ * These are the layers touched by the user's commands after the first
+ * (un)marked undo point, both before and after the undo. Commands that
+ * change the layer stack structure or annotations can't be replayed
+ * selectively.
+ *
+ * @param savepoint the savepoint to replay from
+ * @param ctxid the user whose actions were undone
+ * @param marked the undo points whose state was changed
+ * @param layers the affected layers are added here
+ * @return false if the whole canvas must be replayed
+ */
+bool StateTracker::findAffectedLayers(const StateSavepoint *savepoint, int ctxid, const QList<int> &marked, QSet<int> &layers)
+{
+	const QSet<int> changed = marked.toSet();
+	const int target = marked.first();
+
+	// The layers the user was drawing on before and after the undo
+	int prelayer = savepoint->ctxstate.value(ctxid).tool.layer_id;
+	int postlayer = prelayer;
+	bool flipped = false;
+
+	protocol::ReplayUndoState undostate(_msgstream.undoIndex(), savepoint->streampointer);
+	for(int i=savepoint->streampointer+1;i<_msgstream.end();++i) {
+		using namespace protocol;
+		const MessagePtr msg = _msgstream.at(i);
+		const bool post = undostate.next(msg, i) == DONE;
+
+		switch(msg->type()) {
+		case MSG_CANVAS_RESIZE:
+		case MSG_LAYER_CREATE:
+		case MSG_LAYER_ORDER:
+		case MSG_LAYER_DELETE:
+			return false;
+		default: break;
 		}
-	} else {
-		int i=pos;
-		++actions;
-		while(i<_msgstream.end()) {
-			protocol::MessagePtr msg = _msgstream.at(i);
-			if(msg->contextId() == ctxid) {
-				if(msg->type() == protocol::MSG_UNDOPOINT && msg->undoState() != protocol::GONE)
-					if(--actions==0)
-						break;
-
-				// GONE messages cannot be redone
-				if(msg->undoState() == protocol::UNDONE)
-					msg->setUndoState(protocol::DONE);
-			}
-			++i;
+
+		if(msg->contextId() != ctxid)
+			continue;
+
+		if(msg->type() == MSG_UNDOPOINT)
+			flipped = changed.contains(i);
+
+		// Commands following a changed undo point were in the opposite state before
+		const bool pre = flipped ? !post : post;
+		const bool touched = i >= target && (pre || post);
+
+		switch(msg->type()) {
+		case MSG_TOOLCHANGE:
+			if(pre)
+				prelayer = msg.cast<ToolChange>().layer();
+			if(post)
+				postlayer = msg.cast<ToolChange>().layer();
+			break;
+		case MSG_PEN_MOVE:
+		case MSG_PEN_UP:
+			if(i >= target && pre)
+				layers.insert(prelayer);
+			if(i >= target && post)
+				layers.insert(postlayer);
+			break;
+		case MSG_PUTIMAGE:
+			if(touched)
+				layers.insert(msg.cast<PutImage>().layer());
+			break;
+		case MSG_LAYER_ATTR:
+			if(touched)
+				layers.insert(msg.cast<LayerAttributes>().id());
+			break;
+		case MSG_LAYER_RETITLE:
+			if(touched)
+				layers.insert(msg.cast<LayerRetitle>().id());
+			break;
+		case MSG_ANNOTATION_CREATE:
+		case MSG_ANNOTATION_RESHAPE:
+		case MSG_ANNOTATION_EDIT:
+		case MSG_ANNOTATION_DELETE:
+			if(touched)
+				return false;
+			break;
+		default: break;
 		}
 	}
+	return true;
+}
 
-	// Step 4. Revert to savepoint
-	revertSavepoint(savepoint);
+/**
+ * @brief Restore and replay only the given layers
+ *
+ * Other layers are left as they are. Drawing contexts are tracked for
+ * everyone, but strokes are replayed only if they are on the affected
+ * layers. No new savepoints are made, since the canvas is not in a
+ * consistent state until the replay is done.
+ *
+ * @return false if the layers couldn't be restored
+ */
+bool StateTracker::replayLayers(const StateSavepoint *savepoint, int ctxid, const QSet<int> &layers)
+{
+	if(!_image->restoreLayers(savepoint->canvas, layers))
+		return false;
+
+	discardSavepointsAfter(savepoint);
+
+	foreach(int id, layers) {
+		const paintcore::Layer *l = _image->getLayer(id);
+		_layerlist->changeLayer(id, l->opacity() / 255.0, l->blendmode());
+		_layerlist->retitleLayer(id, l->title());
+	}
+
+	const QSet<int> dead = findDeadCommands(savepoint);
+	const QHash<int, DrawingContext> contexts = _contexts;
+	const qint64 replaycost = _replaycost;
+	_contexts = savepoint->ctxstate;
 
-	// Step 5. Replay commands, excluding undone actions
-	pos = savepoint->streampointer + 1;
-	while(pos < _msgstream.end()) {
-		if(_msgstream.at(pos)->undoState() == protocol::DONE) {
-			handleCommand(_msgstream.at(pos), true, pos);
+	protocol::ReplayUndoState undostate(_msgstream.undoIndex(), savepoint->streampointer);
+	for(int i=savepoint->streampointer+1;i<_msgstream.end();++i) {
+		using namespace protocol;
+		const MessagePtr msg = _msgstream.at(i);
+		if(undostate.next(msg, i) != DONE)
+			continue;
+
+		bool replay = false;
+		switch(msg->type()) {
+		case MSG_TOOLCHANGE: replay = true; break;
+		case MSG_PEN_MOVE:
+		case MSG_PEN_UP: replay = layers.contains(_contexts.value(msg->contextId()).tool.layer_id); break;
+		case MSG_PUTIMAGE: replay = layers.contains(msg.cast<PutImage>().layer()); break;
+		case MSG_LAYER_ATTR: replay = layers.contains(msg.cast<LayerAttributes>().id()); break;
+		case MSG_LAYER_RETITLE: replay = layers.contains(msg.cast<LayerRetitle>().id()); break;
+		default: break;
 		}
-		++pos;
+
+		if(!replay)
+			continue;
+
+		if(dead.contains(i))
+			skipCommand(msg);
+		else
+			handleCommand(msg, true, i);
 	}
+
+	// Only the undoing user's drawing context is changed by the undo
+	QHash<int, DrawingContext> newcontexts = contexts;
+	if(_contexts.contains(ctxid))
+		newcontexts[ctxid] = _contexts.value(ctxid);
+	_contexts = newcontexts;
+	_replaycost = replaycost;
+
+	return true;
 }
 
 /**
@@ -486,7 +1243,8 @@ void StateTracker::handleUndo(protocol::Undo &cmd)
  * The following criteria are used:
  *
  * - All users must be in PEN_UP state
- * - Sufficient time must have elapsed since last savepoint
+ * - Replaying the commands since the last savepoint must be expensive
+ *   enough to be worth a new savepoint
  * @return
  */
 bool StateTracker::canMakeSavepoint(int pos) const
@@ -495,13 +1253,9 @@ bool StateTracker::canMakeSavepoint(int pos) const
 	if(_msgstream.end() <= _msgstream.offset())
 		return false;
 
-	// Check if sufficient time and actions has elapsed from previous savepoint
-	if(!_savepoints.isEmpty()) {
-		const StateSavepoint *sp = _savepoints.last();
-		quint64 now = QDateTime::currentMSecsSinceEpoch();
-		if(now - sp->timestamp < 1000 && _msgstream.end() - sp->streampointer < 100)
-			return false;
-	}
+	// Check if the commands since the previous savepoint would take too long to replay
+	if(!_savepoints.isEmpty() && _replaycost - _savepoints.last()->replaycost < SAVEPOINT_COST)
+		return false;
 
 	// Check if all users are in PEN_UP state
 	// (this is not strictly necessary, but it makes for neater savepoints)
@@ -517,73 +1271,204 @@ void StateTracker::makeSavepoint(int pos)
 {
 	if(canMakeSavepoint(pos)) {
 		StateSavepoint *savepoint = new StateSavepoint;
-		savepoint->timestamp = QDateTime::currentMSecsSinceEpoch();
+		savepoint->replaycost = _replaycost;
 		savepoint->streampointer = pos;
 		savepoint->canvas = _image->makeSavepoint();
 		savepoint->ctxstate = _contexts;
 		savepoint->layermodel = _layerlist->getLayers();
-
-		QList<drawingboard::AnnotationItem*> annotations = _scene->getAnnotations();
-		savepoint->annotations.reserve(annotations.size());
-		foreach(const drawingboard::AnnotationItem *a, annotations)
-			savepoint->annotations.append(a->state());
+		savepoint->annotations = _annotations;
 
 		_savepoints.append(savepoint);
+		updateSavepointSize(_savepoints.count()-1);
+
+		// Move older savepoints to disk
+		for(int i=0;i<_savepoints.count()-RESIDENT_SAVEPOINTS;++i)
+			spillSavepoint(i);
+
+		if(_savepointbytes > SAVEPOINT_MEMORY_LIMIT)
+			thinSavepoints();
+	}
+}
+
+/**
+ * Only the tiles that differ from the next savepoint are stored, if that
+ * one is in memory. Otherwise the whole savepoint is stored.
+ */
+void StateTracker::spillSavepoint(int index)
+{
+	StateSavepoint *sp = _savepoints.at(index);
+	if(!sp->canvas || !_spillstore.isAvailable())
+		return;
+
+	const paintcore::Savepoint *newer = _savepoints.at(index+1)->canvas;
+	sp->spillid = _spillstore.spill(sp->canvas, newer);
+	sp->spilldelta = newer != 0;
+	sp->canvas = 0;
+
+	updateSavepointSize(index);
+	updateSavepointSize(index+1);
+}
+
+/**
+ * A savepoint spilled relative to the next one can only be loaded after
+ * that one, so the whole chain up to the first savepoint in memory is
+ * loaded.
+ */
+bool StateTracker::loadSavepoint(int index)
+{
+	int last = index;
+	while(!_savepoints.at(last)->canvas && _savepoints.at(last)->spilldelta && last+1 < _savepoints.count())
+		++last;
+
+	for(int i=last;i>=index;--i) {
+		StateSavepoint *sp = _savepoints.at(i);
+		if(sp->canvas)
+			continue;
+
+		const paintcore::Savepoint *newer = sp->spilldelta ? _savepoints.at(i+1)->canvas : 0;
+		sp->canvas = _spillstore.load(sp->spillid, newer, _image);
+		sp->spillid = 0;
+		sp->spilldelta = false;
+		if(!sp->canvas) {
+			qWarning() << "Couldn't load savepoint" << sp->streampointer << "from disk!";
+			return false;
+		}
+
+		updateSavepointSize(i);
+		if(i+1 < _savepoints.count())
+			updateSavepointSize(i+1);
+	}
+	return true;
+}
+
+void StateTracker::updateSavepointSize(int index)
+{
+	StateSavepoint *sp = _savepoints.at(index);
+	_savepointbytes -= sp->bytes;
+	sp->bytes = sp->canvas ? sp->canvas->sizeExcluding(index>0 ? _savepoints.at(index-1)->canvas : 0) : 0;
+	_savepointbytes += sp->bytes;
+}
+
+void StateTracker::removeSavepoint(int index, bool keepolder)
+{
+	// The previous savepoint may have been spilled relative to this one
+	if(keepolder && index>0 && _savepoints.at(index-1)->spilldelta)
+		loadSavepoint(index-1);
+
+	StateSavepoint *sp = _savepoints.takeAt(index);
+	_savepointbytes -= sp->bytes;
+	if(!sp->canvas && sp->spillid)
+		_spillstore.discard(sp->spillid);
+	delete sp;
+
+	// The next savepoint now owns the tiles it shared only with the removed one
+	if(index < _savepoints.count())
+		updateSavepointSize(index);
+}
+
+/**
+ * Savepoints are thinned out logarithmically. The newest ones are kept
+ * dense, since undo is mostly used to undo the latest actions. Going back
+ * in history, the replay cost allowed between two savepoints doubles
+ * for each savepoint kept. The oldest savepoint is always kept, as it
+ * is the base for undoing everything else.
+ */
+void StateTracker::thinSavepoints()
+{
+	qint64 mingap = SAVEPOINT_COST;
+	while(_savepointbytes > SAVEPOINT_MEMORY_LIMIT && _savepoints.count() > 2) {
+		qint64 gap = mingap;
+		int newer = _savepoints.count() - 1;
+		for(int i=newer-1;i>0 && _savepointbytes > SAVEPOINT_MEMORY_LIMIT;--i) {
+			// Spilled savepoints don't take up memory
+			if(!_savepoints.at(i)->canvas)
+				continue;
+
+			if(_savepoints.at(newer)->replaycost - _savepoints.at(i)->replaycost < gap) {
+				removeSavepoint(i);
+				--newer;
+			} else {
+				newer = i;
+				gap *= 2;
+			}
+		}
+		mingap *= 2;
 	}
 }
 
 void StateTracker::revertSavepoint(const StateSavepoint *savepoint)
 {
 	Q_ASSERT(_savepoints.contains(const_cast<StateSavepoint*>(savepoint)));
+	Q_ASSERT(savepoint->canvas);
 
 	_image->restoreSavepoint(savepoint->canvas);
 	_contexts = savepoint->ctxstate;
 	_layerlist->setLayers(savepoint->layermodel);
-	_scene->setAnnotations(savepoint->annotations);
 
+	foreach(const AnnotationState &a, _annotations)
+		_batch->changedannotations.insert(a.id);
+	_annotations = savepoint->annotations;
+	foreach(const AnnotationState &a, _annotations)
+		_batch->changedannotations.insert(a.id);
+
+	_replaycost = savepoint->replaycost;
+
+	discardSavepointsAfter(savepoint);
+}
+
+void StateTracker::discardSavepointsAfter(const StateSavepoint *savepoint)
+{
 	// Reverting a savepoint destroys all newer savepoints
 	while(_savepoints.last() != savepoint)
-		delete _savepoints.takeLast();
+		removeSavepoint(_savepoints.count()-1, false);
 }
 
 void StateTracker::handleAnnotationCreate(const protocol::AnnotationCreate &cmd)
 {
-	AnnotationItem *item = new AnnotationItem(cmd.id());
-	item->setShowBorder(_scene->showAnnotationBorders());
-	item->setGeometry(QRect(cmd.x(), cmd.y(), cmd.w(), cmd.h()));
+	AnnotationState a(cmd.id());
+	a.rect = QRect(cmd.x(), cmd.y(), cmd.w(), cmd.h());
+	_annotations.append(a);
 
-	_scene->addItem(item);
-	if(cmd.contextId() == _myid)
-		emit myAnnotationCreated(item);
+	_batch->changedannotations.insert(cmd.id());
+	if(cmd.contextId() == _myid && !_catchingup)
+		_batch->myannotations.append(cmd.id());
 }
 
 void StateTracker::handleAnnotationReshape(const protocol::AnnotationReshape &cmd)
 {
-	AnnotationItem *item = _scene->getAnnotationById(cmd.id());
-	if(!item) {
+	const int i = annotationIndex(cmd.id());
+	if(i<0) {
 		qWarning() << "Got annotation reshape for non-existent annotation" << cmd.id();
 		return;
 	}
 
-	item->setGeometry(QRect(cmd.x(), cmd.y(), cmd.w(), cmd.h()));
+	_annotations[i].rect = QRect(cmd.x(), cmd.y(), cmd.w(), cmd.h());
+	_batch->changedannotations.insert(cmd.id());
 }
 
 void StateTracker::handleAnnotationEdit(const protocol::AnnotationEdit &cmd)
 {
-	AnnotationItem *item = _scene->getAnnotationById(cmd.id());
-	if(!item) {
+	const int i = annotationIndex(cmd.id());
+	if(i<0) {
 		qWarning() << "Got annotation edit for non-existent annotation" << cmd.id();
 		return;
 	}
 
-	item->setBackgroundColor(QColor::fromRgba(cmd.bg()));
-	item->setText(cmd.text());
+	_annotations[i].bgcolor = QColor::fromRgba(cmd.bg());
+	_annotations[i].text = cmd.text();
+	_batch->changedannotations.insert(cmd.id());
 }
 
 void StateTracker::handleAnnotationDelete(const protocol::AnnotationDelete &cmd)
 {
-	if(!_scene->deleteAnnotation(cmd.id()))
+	const int i = annotationIndex(cmd.id());
+	if(i<0) {
 		qWarning() << "Got annotation delete for non-existent annotation" << cmd.id();
+		return;
+	}
+
+	_annotations.remove(i);
+	_batch->changedannotations.insert(cmd.id());
 }
 
 }
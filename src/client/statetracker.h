@@ -23,11 +23,16 @@
 
 #include <QObject>
 #include <QHash>
+#include <QSet>
+#include <QMutex>
+#include <QThreadPool>
+#include <QAtomicInt>
 
 #include "core/brush.h"
 #include "core/point.h"
 #include "../shared/net/message.h"
 #include "../shared/net/messagestream.h"
+#include "savepointstore.h"
 
 namespace protocol {
 	class CanvasResize;
@@ -62,8 +67,11 @@ namespace drawingboard {
 
 class CanvasScene;
 class AnnotationItem;
+struct AnnotationState;
 
 struct ToolContext {
+	ToolContext() : layer_id(0) {}
+
 	int layer_id;
 	paintcore::Brush brush;
 };
@@ -90,12 +98,30 @@ struct DrawingContext {
 };
 
 class StateSavepoint;
+struct PublishedState;
+struct CommandGroup;
 
 /**
  * \brief Drawing context state tracker
  * 
  * The state tracker object keeps track of each drawing context and performs
  * the drawing using the paint engine.
+ *
+ * The commands are executed by a paint engine thread, which owns a private
+ * layer stack, layer list and annotation state. After each batch of commands,
+ * a snapshot of the result is published to the GUI thread, which updates
+ * the visible canvas, layer list and annotations from it. Since unchanged
+ * tiles are shared, publishing is cheap and the GUI never waits for
+ * the engine.
+ *
+ * Runs of drawing commands that each affect a single layer are split into
+ * groups that share no layers or drawing contexts. The groups are executed
+ * in parallel. Commands with effects across layers (such as merging,
+ * reordering, resizing and undo) are executed alone, in order. The result
+ * is the same as when executing everything sequentially.
+ *
+ * When joining a session, the history is downloaded first. Nothing is
+ * published until the whole history has been received and executed.
  */
 class StateTracker : public QObject {
 	Q_OBJECT
@@ -106,6 +132,23 @@ public:
 
 	void receiveCommand(protocol::MessagePtr msg);
 
+	/**
+	 * @brief Queue a list of commands to be executed as a single batch
+	 * @param msgs the commands
+	 */
+	void receiveCommands(const QList<protocol::MessagePtr> &msgs);
+
+	//! Wait until the paint engine has executed and published all received commands
+	void waitForEngine();
+
+	/**
+	 * @brief Enable or disable executing layer commands in parallel
+	 *
+	 * The result is the same either way. This must be set before
+	 * any commands are received.
+	 */
+	void setParallelExecution(bool parallel) { _parallel = parallel; }
+
 	void endRemoteContexts();
 
 	QList<protocol::MessagePtr> generateSnapshot(bool forcenew);
@@ -118,14 +161,39 @@ public:
 	 */
 	void setMaxHistorySize(uint limit) { _msgstream_sizelimit = limit; }
 
+	//! Called by the paint engine thread to execute the queued commands
+	void runCommands();
+
+	//! Called by the layer threads to execute a group of commands
+	void executeGroup(const CommandGroup &group);
+
 	StateTracker &operator=(const StateTracker&) = delete;
 
 signals:
 	void myAnnotationCreated(AnnotationItem *item);
 	void myLayerCreated(int);
 
+	//! Progress of executing the session history when joining
+	void catchupProgress(int percent);
+
+private slots:
+	void expectBytes(int count);
+	void bytesReceived(int count);
+	void checkCatchup();
+	void applyPublished();
+
 private:
+	void executeCommand(protocol::MessagePtr msg, bool dead=false);
+	int appendCommand(protocol::MessagePtr msg);
+	void executeParallel(const QList<protocol::MessagePtr> &commands, int begin, int end, const QSet<int> &dead);
 	void handleCommand(protocol::MessagePtr msg, bool replay, int pos);
+	void skipCommand(const protocol::MessagePtr &msg);
+
+	// Paint engine thread
+	void publish();
+	void startCatchup(int bytes);
+	void finishCatchup();
+	int annotationIndex(int id) const;
 
 	// Layer related commands
 	void handleCanvasResize(const protocol::CanvasResize &cmd, int pos);
@@ -142,11 +210,22 @@ private:
 	void handlePutImage(const protocol::PutImage &cmd);
 
 	// Undo/redo
-	void handleUndoPoint(const protocol::UndoPoint &cmd, bool replay, int pos);
-	void handleUndo(protocol::Undo &cmd);
+	void handleUndoPoint(int pos);
+	void handleUndo(protocol::Undo &cmd, int pos);
 	bool canMakeSavepoint(int pos) const;
 	void makeSavepoint(int pos);
 	void revertSavepoint(const StateSavepoint *savepoint);
+	void discardSavepointsAfter(const StateSavepoint *savepoint);
+	void replayAll(const StateSavepoint *savepoint);
+	bool findAffectedLayers(const StateSavepoint *savepoint, int ctxid, const QList<int> &marked, QSet<int> &layers);
+	bool replayLayers(const StateSavepoint *savepoint, int ctxid, const QSet<int> &layers);
+	QSet<int> findDeadCommands(const StateSavepoint *savepoint) const;
+	QSet<int> findDeadCommands(const QList<protocol::MessagePtr> &commands) const;
+	void updateSavepointSize(int index);
+	void removeSavepoint(int index, bool keepolder=true);
+	void thinSavepoints();
+	void spillSavepoint(int index);
+	bool loadSavepoint(int index);
 
 	// Annotation related commands
 	void handleAnnotationCreate(const protocol::AnnotationCreate &cmd);
@@ -157,15 +236,57 @@ private:
 	QHash<int, DrawingContext> _contexts;
 	
 	CanvasScene *_scene;
+
+	// The paint engine thread's private state
 	paintcore::LayerStack *_image;
 	net::LayerListModel *_layerlist;
+	QVector<AnnotationState> _annotations;
+
+	// The visible state, updated from the published snapshots
+	paintcore::LayerStack *_visibleimage;
+	net::LayerListModel *_visiblelayers;
 
 	int _myid;
 
 	protocol::MessageStream _msgstream;
 	QList<StateSavepoint*> _savepoints;
+	SavepointStore _spillstore;
 	bool _hassnapshot;
 	uint _msgstream_sizelimit;
+
+	//! Estimated cost of replaying all commands so far (see canMakeSavepoint)
+	QAtomicInteger<qint64> _replaycost;
+
+	//! Estimated memory used by the savepoints
+	uint _savepointbytes;
+
+	// Catching up with the session history. This is changed only while
+	// the paint engine thread is idle.
+	bool _catchingup;
+	bool _hascommands;
+	int _catchupremaining;
+	int _catchuptotal;
+	int _catchupdone;
+	int _catchuppercent;
+
+	// Commands waiting for the paint engine thread
+	QMutex _queuemutex;
+	QList<protocol::MessagePtr> _queue;
+	bool _enginejob;
+	QAtomicInt _enginecancel;
+	QThreadPool _enginepool;
+
+	// Threads for executing layers in parallel
+	QThreadPool _layerpool;
+	bool _parallel;
+
+	// Changes made by the current batch (owned by the paint engine thread)
+	PublishedState *_batch;
+	QMutex _batchmutex;
+
+	// Changes waiting for the GUI thread
+	QMutex _publishmutex;
+	PublishedState *_published;
 };
 
 }
@@ -0,0 +1,74 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2013 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+#include <QtTest>
+
+#include "canvasscene.h"
+#include "statetracker.h"
+#include "textloader.h"
+#include "core/layerstack.h"
+#include "net/client.h"
+
+class TestParallelLayers : public QObject
+{
+	Q_OBJECT
+private slots:
+	void parallelMatchesSequential();
+
+private:
+	QImage render(const QList<protocol::MessagePtr> &commands, bool parallel);
+};
+
+/**
+ * Execute the commands in a single batch and return the flattened result
+ */
+QImage TestParallelLayers::render(const QList<protocol::MessagePtr> &commands, bool parallel)
+{
+	net::Client client;
+	drawingboard::CanvasScene scene(0);
+	scene.initCanvas(&client);
+
+	drawingboard::StateTracker *tracker = scene.statetracker();
+	tracker->setParallelExecution(parallel);
+	tracker->receiveCommands(commands);
+	tracker->waitForEngine();
+
+	return scene.layers()->toFlatImage();
+}
+
+void TestParallelLayers::parallelMatchesSequential()
+{
+	TextCommandLoader loader(TESTDATA_DIR "/test_parallel_layers.dptxt");
+	QVERIFY2(loader.load(), qPrintable(loader.errorMessage()));
+
+	const QList<protocol::MessagePtr> commands = loader.loadInitCommands();
+	QVERIFY(!commands.isEmpty());
+
+	const QImage sequential = render(commands, false);
+	const QImage parallel = render(commands, true);
+
+	QCOMPARE(sequential.size(), QSize(400, 300));
+	QCOMPARE(parallel.size(), sequential.size());
+	QVERIFY(parallel == sequential);
+}
+
+QTEST_MAIN(TestParallelLayers)
+#include "test_parallel_layers.moc"
@@ -107,7 +107,7 @@ void BrushBase::begin(const paintcore::Point& point, bool right)
 	};
 
 	if(!client().isLocalServer())
-		scene().startPreview(brush, point);
+		scene().startPreview(layer(), brush, point);
 
 	client().sendUndopoint();
 	client().sendToolChange(tctx);
@@ -83,6 +83,22 @@ NetStatus::NetStatus(QWidget *parent)
 	}
 	progresslayout->addWidget(_download);
 
+	// Session history execution progress bar
+	_catchup = new QProgressBar(this);
+	_catchup->setMaximumWidth(120);
+	_catchup->setSizePolicy(QSizePolicy());
+	_catchup->setTextVisible(false);
+	_catchup->setRange(0, 100);
+	_catchup->setToolTip(tr("Catching up with the session"));
+	_catchup->hide();
+	{
+		// Green progress bar for catching up
+		QPalette pal = _catchup->palette();
+		pal.setColor(QPalette::Highlight, QColor(48, 198, 90));
+		_catchup->setPalette(pal);
+	}
+	progresslayout->addWidget(_catchup);
+
 	layout->addLayout(progresslayout);
 
 	// Host address label
@@ -94,6 +110,12 @@ NetStatus::NetStatus(QWidget *parent)
 	_label->setContextMenuPolicy(Qt::ActionsContextMenu);
 	layout->addWidget(_label);
 
+	// Compression ratio label (shown only when compression is in use)
+	_ratio = new QLabel(this);
+	_ratio->setToolTip(tr("Compression ratio"));
+	_ratio->hide();
+	layout->addWidget(_ratio);
+
 	// Action to copy address to clipboard
 	_copyaction = new QAction(tr("Copy address to clipboard"), this);
 	_copyaction->setEnabled(false);
@@ -143,6 +165,7 @@ void NetStatus::connectingToHost(const QString& address, int port)
 	// reset statistics
 	_recvbytes = 0;
 	_sentbytes = 0;
+	_ratio->hide();
 	_online = true;
 	updateIcon();
 }
@@ -172,6 +195,7 @@ void NetStatus::hostDisconnected()
 	_discoverIp->setVisible(false);
 
 	message(tr("Disconnected"));
+	_ratio->hide();
 	_online = false;
 	updateIcon();
 }
@@ -227,6 +251,22 @@ void NetStatus::bytesSent(int count)
 	_timer->start(500);
 }
 
+void NetStatus::compressionRatio(qreal ratio)
+{
+	_ratio->setText(QString("%1:1").arg(ratio, 0, 'f', 1));
+	_ratio->show();
+}
+
+void NetStatus::catchupProgress(int percent)
+{
+	if(percent>=100) {
+		_catchup->hide();
+	} else {
+		_catchup->setValue(percent);
+		_catchup->show();
+	}
+}
+
 void NetStatus::updateStats()
 {
 	_activity = 0;
@@ -51,6 +51,8 @@ public slots:
 	void sendingBytes(int count);
 	void bytesReceived(int count);
 	void bytesSent(int count);
+	void compressionRatio(qreal ratio);
+	void catchupProgress(int percent);
 
 
 	void join(int id, const QString& user);
@@ -77,8 +79,9 @@ private:
 
 	QProgressBar *_download;
 	QProgressBar *_upload;
+	QProgressBar *_catchup;
 
-	QLabel *_label, *_icon;
+	QLabel *_label, *_icon, *_ratio;
 	PopupMessage *_popup;
 	QString _address;
 	int _port;
@@ -1,13 +1,21 @@
 #include <QCoreApplication>
 #include <QStringList>
+#include <QUrl>
 #include <iostream>
 
 #include "config.h"
 
 #include "../shared/server/server.h"
+#include "../shared/server/multiserver.h"
+#include "../shared/server/iothreadpool.h"
+#include "../shared/server/adminserver.h"
 
 using std::cerr;
 using server::Server;
+using server::MultiServer;
+using server::IoThreadPool;
+using server::AdminServer;
+using server::SlowClientLimits;
 
 void printHelp() {
 	std::cout << "DrawPile standalone server. Usage:\n\n"
@@ -16,7 +24,21 @@ void printHelp() {
 		"\t--port, -p <port>           Listening port (default: "
 		<< DRAWPILE_PROTO_DEFAULT_PORT << ")\n"
 		"\t--listen, -l <address>      Listening address (default: all)\n"
-		"\t--verbose, -v               Verbose mode\n";
+		"\t--verbose, -v               Verbose mode\n"
+		"\t--no-compression            Do not compress client connections\n"
+		"\t--history-limit <MB>        Session history size limit (default: unlimited)\n"
+		"\t--multisession              Host multiple named sessions, each in its own thread\n"
+		"\t--io-threads <count>        Handle client connections in a pool of threads (default: 0)\n"
+		"\t--admin-port <port>         Serve metrics at http://127.0.0.1:<port>/metrics (and /metrics.json)\n"
+		"\t--slow-clients <policy>     What to do with lagging clients: pause, coalesce or resync (default: nothing)\n"
+		"\t--max-queue <KB>            Client upload queue limit for --slow-clients (default: 1024)\n"
+		"\t--max-lag <seconds>         Client upload queue age limit for --slow-clients (default: unlimited)\n"
+		"\t--resume-grace <seconds>    How long a dropped connection can be resumed (default: 30, 0 disables)\n"
+		"\t--relay <address>           Relay a session from another server (host[:port][/session])\n"
+#ifdef DP_SERVER_CANVAS
+		"\t--canvas                    Maintain a server side canvas for generating snapshots\n"
+#endif
+		;
 }
 
 int main(int argc, char *argv[]) {
@@ -25,6 +47,16 @@ int main(int argc, char *argv[]) {
 	int port = DRAWPILE_PROTO_DEFAULT_PORT;
 	QHostAddress address = QHostAddress::Any;
 	bool verbose = false;
+	bool compression = true;
+	uint historylimit = 0;
+	bool multisession = false;
+	int iothreads = 0;
+	int adminport = 0;
+	bool canvas = false;
+	int resumegrace = Server::DEFAULT_RESUME_GRACE;
+	QUrl upstream;
+	SlowClientLimits slowclients;
+	slowclients.bytes = 1024 * 1024;
 
 	// Parse command line arguments
 	// TODO
@@ -55,12 +87,154 @@ int main(int argc, char *argv[]) {
 			}
 		} else if(args[i]=="--verbose" || args[i]=="-v") {
 			verbose = true;
+		} else if(args[i]=="--no-compression") {
+			compression = false;
+		} else if(args[i]=="--history-limit") {
+			if(i+1>=args.size()) {
+				cerr << "History size limit not specified\n";
+				return 1;
+			}
+			bool ok;
+			historylimit = args[++i].toUInt(&ok);
+			if(!ok || historylimit > 4095) {
+				cerr << args[i].toUtf8().constData() << " is not a valid size.";
+				return 1;
+			}
+			historylimit *= 1024 * 1024;
+		} else if(args[i]=="--multisession") {
+			multisession = true;
+#ifdef DP_SERVER_CANVAS
+		} else if(args[i]=="--canvas") {
+			canvas = true;
+#endif
+		} else if(args[i]=="--admin-port") {
+			if(i+1>=args.size()) {
+				cerr << "Admin port number not specified\n";
+				return 1;
+			}
+			bool ok;
+			adminport = args[++i].toInt(&ok);
+			if(!ok || adminport<1 || adminport>0xffff) {
+				cerr << args[i].toUtf8().constData() << " is not a valid port.";
+				return 1;
+			}
+		} else if(args[i]=="--slow-clients") {
+			if(i+1>=args.size()) {
+				cerr << "Slow client policy not specified\n";
+				return 1;
+			}
+			const QString policy = args[++i];
+			if(policy=="pause")
+				slowclients.policy = server::SLOW_CLIENT_PAUSE;
+			else if(policy=="coalesce")
+				slowclients.policy = server::SLOW_CLIENT_COALESCE;
+			else if(policy=="resync")
+				slowclients.policy = server::SLOW_CLIENT_RESYNC;
+			else {
+				cerr << "Unknown slow client policy: " << policy.toUtf8().constData() << "\n";
+				return 1;
+			}
+		} else if(args[i]=="--max-queue") {
+			if(i+1>=args.size()) {
+				cerr << "Queue limit not specified\n";
+				return 1;
+			}
+			bool ok;
+			slowclients.bytes = args[++i].toInt(&ok);
+			if(!ok || slowclients.bytes<0 || slowclients.bytes > 1024*1024) {
+				cerr << args[i].toUtf8().constData() << " is not a valid size.";
+				return 1;
+			}
+			slowclients.bytes *= 1024;
+		} else if(args[i]=="--max-lag") {
+			if(i+1>=args.size()) {
+				cerr << "Lag limit not specified\n";
+				return 1;
+			}
+			bool ok;
+			slowclients.seconds = args[++i].toInt(&ok);
+			if(!ok || slowclients.seconds<0) {
+				cerr << args[i].toUtf8().constData() << " is not a valid time.";
+				return 1;
+			}
+		} else if(args[i]=="--resume-grace") {
+			if(i+1>=args.size()) {
+				cerr << "Resume grace period not specified\n";
+				return 1;
+			}
+			bool ok;
+			resumegrace = args[++i].toInt(&ok);
+			if(!ok || resumegrace<0) {
+				cerr << args[i].toUtf8().constData() << " is not a valid time.";
+				return 1;
+			}
+		} else if(args[i]=="--relay") {
+			if(i+1>=args.size()) {
+				cerr << "Upstream server not specified\n";
+				return 1;
+			}
+			QString url = args[++i];
+			if(!url.contains("://"))
+				url = "drawpile://" + url;
+			upstream = QUrl(url);
+			if(!upstream.isValid() || upstream.host().isEmpty()) {
+				cerr << "Not a valid address: " << args[i].toUtf8().constData() << "\n";
+				return 1;
+			}
+		} else if(args[i]=="--io-threads") {
+			if(i+1>=args.size()) {
+				cerr << "Thread count not specified\n";
+				return 1;
+			}
+			bool ok;
+			iothreads = args[++i].toInt(&ok);
+			if(!ok || iothreads<0 || iothreads>256) {
+				cerr << args[i].toUtf8().constData() << " is not a valid thread count.";
+				return 1;
+			}
 		} else {
 			cerr << "Unrecognized argument: " << args[i].toUtf8().constData() << "\n";
 			return 1;
 		}
 	}
 
+	IoThreadPool *iopool = 0;
+	if(iothreads>0)
+		iopool = new IoThreadPool(iothreads);
+
+	if(multisession && !upstream.isEmpty()) {
+		cerr << "A relay can serve only a single session\n";
+		return 1;
+	}
+
+	if(multisession) {
+		MultiServer *server = new MultiServer();
+
+		server->setErrorStream(new QTextStream(stderr));
+		if(verbose)
+			server->setDebugStream(new QTextStream(stdout));
+
+		server->setCompressionEnabled(compression);
+		server->setHistoryLimit(historylimit);
+		server->setIoThreadPool(iopool);
+		server->setSlowClientLimits(slowclients);
+		server->setCanvasEnabled(canvas);
+		server->setResumeGracePeriod(resumegrace);
+
+		if(!server->start(port, address))
+			return 1;
+
+		if(adminport>0) {
+			AdminServer *admin = new AdminServer(server);
+			if(!admin->start(adminport)) {
+				cerr << "Couldn't start admin server: " << admin->errorString().toUtf8().constData() << "\n";
+				return 1;
+			}
+		}
+
+		return app.exec();
+	}
+
 	// Start the server
 	Server *server = new Server();
 
@@ -70,9 +244,26 @@ int main(int argc, char *argv[]) {
 	if(verbose)
 		server->setDebugStream(new QTextStream(stdout));
 
+	server->setCompressionEnabled(compression);
+	server->setHistoryLimit(historylimit);
+	server->setIoThreadPool(iopool);
+	server->setSlowClientLimits(slowclients);
+	server->setCanvasEnabled(canvas);
+	server->setResumeGracePeriod(resumegrace);
+	if(!upstream.isEmpty())
+		server->setUpstream(upstream);
+
 	if(!server->start(port, false, address))
 		return 1;
 
+	if(adminport>0) {
+		AdminServer *admin = new AdminServer(server);
+		if(!admin->start(adminport)) {
+			cerr << "Couldn't start admin server: " << admin->errorString().toUtf8().constData() << "\n";
+			return 1;
+		}
+	}
+
 	return app.exec();
 }
 
@@ -19,10 +19,53 @@
 */
 
 #include <cstring>
+#include <QStringList>
+
 #include "login.h"
 
 namespace protocol {
 
+namespace {
+	struct CapabilityName {
+		Capability cap;
+		const char *name;
+	};
+
+	const CapabilityName CAPABILITY_NAMES[] = {
+		{CAP_COMPACT_PENMOVE, "compactpen"},
+		{CAP_DEFLATE, "deflate"},
+		{CAP_FRAGMENT, "fragment"},
+		{CAP_RESYNC, "resync"},
+		{CAP_RESUME, "resume"}
+	};
+}
+
+QString capabilityMessage(int caps)
+{
+	QString msg = "CAPS";
+	for(const CapabilityName &c : CAPABILITY_NAMES) {
+		if((caps & c.cap))
+			msg = msg + " " + c.name;
+	}
+	return msg;
+}
+
+int parseCapabilityMessage(const QString &msg)
+{
+	QStringList tokens = msg.split(' ', QString::SkipEmptyParts);
+	if(tokens.isEmpty() || tokens[0] != "CAPS")
+		return -1;
+
+	int caps = 0;
+	for(int i=1;i<tokens.length();++i) {
+		for(const CapabilityName &c : CAPABILITY_NAMES) {
+			if(tokens[i] == c.name)
+				caps |= c.cap;
+		}
+	}
+	return caps;
+}
+
 Login *Login::deserialize(const uchar *data, uint len)
 {
 	return new Login(QByteArray((const char*)data, len));
@@ -27,6 +27,51 @@
 
 namespace protocol {
 
+/**
+ * @brief Optional protocol features
+ *
+ * After a successful login, the client may announce the features it supports
+ * with a "CAPS <feature> <feature>..." login message. The server replies
+ * with the list of features it will use. Old servers simply ignore the
+ * announcement and old clients never send it, so the features are only used
+ * when both ends support them.
+ */
+enum Capability {
+	//! Compact pen move encoding (MSG_PEN_MOVE_COMPACT)
+	CAP_COMPACT_PENMOVE = 0x01,
+
+	//! Streaming deflate compression (MSG_COMPRESSED)
+	CAP_DEFLATE = 0x02,
+
+	//! Large messages may be sent in interleaved fragments (MSG_FRAGMENT)
+	CAP_FRAGMENT = 0x04,
+
+	//! The server may reset a lagging client and resend the session (SnapshotMode::RESET)
+	CAP_RESYNC = 0x08,
+
+	//! A dropped connection can be resumed with a token ("TOKEN" and "RESUME" login messages)
+	CAP_RESUME = 0x10
+};
+
+//! The capabilities supported by this version
+static const int SUPPORTED_CAPABILITIES = CAP_COMPACT_PENMOVE | CAP_DEFLATE | CAP_FRAGMENT | CAP_RESYNC | CAP_RESUME;
+
+/**
+ * @brief Format a capability announcement
+ * @param caps capability flags
+ * @return login message text
+ */
+QString capabilityMessage(int caps);
+
+/**
+ * @brief Parse a capability announcement
+ *
+ * Unknown capabilities are ignored.
+ * @param msg login message text
+ * @return capability flags or -1 if this was not a capability announcement
+ */
+int parseCapabilityMessage(const QString &msg);
+
 class Login : public Message {
 public:
 	Login(const QByteArray &msg) : Message(MSG_LOGIN, 0), _msg(msg) {}
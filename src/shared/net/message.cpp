@@ -71,6 +71,8 @@ Message *Message::deserialize(const uchar *data)
 	case MSG_ANNOTATION_DELETE: return AnnotationDelete::deserialize(data, len);
 	case MSG_UNDOPOINT: return UndoPoint::deserialize(data, len);
 	case MSG_UNDO: return Undo::deserialize(data, len);
+
+	case MSG_PEN_MOVE_COMPACT: return PenMove::deserializeCompact(data, len);
 	}
 	// Unknown message type!
 	return 0;
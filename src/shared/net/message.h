@@ -22,6 +22,7 @@
 #define DP_NET_MESSAGE_H
 
 #include <Qt>
+#include <QAtomicInt>
 
 namespace protocol {
 
@@ -59,7 +60,19 @@ enum MessageType {
 	MSG_ANNOTATION_EDIT,
 	MSG_ANNOTATION_DELETE,
 	MSG_UNDOPOINT,
-	MSG_UNDO
+	MSG_UNDO,
+
+	// Alternative wire encodings (these are deserialized as their normal counterparts)
+	MSG_PEN_MOVE_COMPACT,
+
+	// Transport framing: a deflate compressed batch of messages (handled by MessageQueue)
+	MSG_COMPRESSED,
+
+	// Transport framing: a piece of a large message (handled by MessageQueue)
+	MSG_FRAGMENT,
+
+	// Local only: a block of already serialized messages (written as is by MessageQueue)
+	MSG_SERIALIZED_CHUNK
 };
 
 enum MessageUndoState {
@@ -120,8 +133,8 @@ public:
 	 * @brief Has this command been marked as undone?
 	 *
 	 * Note. This is a purely local flag that is not part of the
-	 * protocol. It is here to avoid the need to maintain an
-	 * external undone action list.
+	 * protocol. For messages in a MessageStream, the stream keeps
+	 * the authoritative copy of the flag.
 	 *
 	 * @return true if this message has been marked as undone
 	 */
@@ -137,6 +150,12 @@ public:
 	 */
 	void setUndoState(MessageUndoState undo) { if(isUndoable()) _undone = undo; }
 
+	/**
+	 * @brief Is this message type undoable?
+	 * @return true if this action can be undone
+	 */
+	virtual bool isUndoable() const { return false; }
+
 	/**
 	 * @brief Serialize this message
 	 *
@@ -183,18 +202,12 @@ protected:
 	 */
 	virtual int serializePayload(uchar *data) const = 0;
 
-	/**
-	 * @brief Is this message type undoable?
-	 * @return true if this action can be undone
-	 */
-	virtual bool isUndoable() const { return false; }
-
 private:
 	const MessageType _type;
 	uint8_t _contextid; // this is part of the payload for those message types that have it
 
 	MessageUndoState _undone;
-	int _refcount;
+	QAtomicInt _refcount;
 };
 
 /**
@@ -203,7 +216,8 @@ private:
 * This object is the length of a normal pointer so it can be used
 * efficiently with QList.
 *
-* @todo use QAtomicInt if thread safety is needed
+* The reference count is atomic, so the same message can be shared
+* by connections running in different threads.
 */
 class MessagePtr {
 public:
@@ -218,27 +232,27 @@ public:
 		: _ptr(msg)
 	{
 		Q_ASSERT(_ptr);
-		Q_ASSERT(_ptr->_refcount==0);
-		++_ptr->_refcount;
+		Q_ASSERT(_ptr->_refcount.load()==0);
+		_ptr->_refcount.ref();
 	}
 
-	MessagePtr(const MessagePtr &ptr) : _ptr(ptr._ptr) { ++_ptr->_refcount; }
+	MessagePtr(const MessagePtr &ptr) : _ptr(ptr._ptr) { _ptr->_refcount.ref(); }
 
 	~MessagePtr()
 	{
-		Q_ASSERT(_ptr->_refcount>0);
-		if(--_ptr->_refcount == 0)
+		Q_ASSERT(_ptr->_refcount.load()>0);
+		if(!_ptr->_refcount.deref())
 			delete _ptr;
 	}
 
 	MessagePtr &operator=(const MessagePtr &msg)
 	{
 		if(msg._ptr != _ptr) {
-			Q_ASSERT(_ptr->_refcount>0);
-			if(--_ptr->_refcount == 0)
+			msg._ptr->_refcount.ref();
+			Q_ASSERT(_ptr->_refcount.load()>0);
+			if(!_ptr->_refcount.deref())
 				delete _ptr;
 			_ptr = msg._ptr;
-			++_ptr->_refcount;
 		}
 		return *this;
 	}
@@ -0,0 +1,126 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2013 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+#include <QMutexLocker>
+#include <new>
+
+#include "messagepool.h"
+
+namespace protocol {
+
+namespace {
+	// Head of the list of all pools. This is zero initialized before any
+	// pool is created.
+	MessagePool *firstPool = 0;
+
+	// Intentionally leaked, like the pools themselves
+	QMutex &registryMutex()
+	{
+		static QMutex *mutex = new QMutex;
+		return *mutex;
+	}
+}
+
+MessagePool &MessagePool::create(const char *name, size_t blocksize, int reserve)
+{
+	return *new MessagePool(name, blocksize, reserve);
+}
+
+MessagePool::MessagePool(const char *name, size_t blocksize, int reserve)
+	: _name(name), _blocksize(blocksize), _reserve(reserve),
+	  _freelist(0), _pooled(0), _live(0), _allocations(0), _reused(0)
+{
+	Q_ASSERT(blocksize >= sizeof(FreeBlock));
+
+	QMutexLocker lock(&registryMutex());
+	_nextpool = firstPool;
+	firstPool = this;
+}
+
+void *MessagePool::allocate(size_t size)
+{
+	if(size != _blocksize)
+		return ::operator new(size);
+
+	QMutexLocker lock(&_mutex);
+	++_allocations;
+	++_live;
+
+	if(_freelist) {
+		FreeBlock *b = _freelist;
+		_freelist = b->next;
+		--_pooled;
+		++_reused;
+		return b;
+	}
+
+	lock.unlock();
+	return ::operator new(size);
+}
+
+void MessagePool::release(void *ptr, size_t size)
+{
+	if(!ptr)
+		return;
+
+	if(size != _blocksize) {
+		::operator delete(ptr);
+		return;
+	}
+
+	QMutexLocker lock(&_mutex);
+	--_live;
+
+	if(_pooled < _reserve) {
+		FreeBlock *b = static_cast<FreeBlock*>(ptr);
+		b->next = _freelist;
+		_freelist = b;
+		++_pooled;
+	} else {
+		lock.unlock();
+		::operator delete(ptr);
+	}
+}
+
+MessagePoolStats MessagePool::stats() const
+{
+	QMutexLocker lock(&_mutex);
+	MessagePoolStats s;
+	s.name = _name;
+	s.blockSize = _blocksize;
+	s.allocations = _allocations;
+	s.reused = _reused;
+	s.live = _live;
+	s.pooled = _pooled;
+	return s;
+}
+
+QList<MessagePoolStats> MessagePool::allStats()
+{
+	QList<MessagePoolStats> list;
+	QMutexLocker lock(&registryMutex());
+	for(const MessagePool *p=firstPool;p;p=p->_nextpool)
+		list.append(p->stats());
+	return list;
+}
+
+}
+
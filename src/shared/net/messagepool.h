@@ -0,0 +1,134 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2013 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+#ifndef DP_NET_MESSAGEPOOL_H
+#define DP_NET_MESSAGEPOOL_H
+
+#include <QList>
+#include <QMutex>
+
+#include <cstddef>
+
+namespace protocol {
+
+/**
+ * @brief Allocation statistics of a single message pool
+ */
+struct MessagePoolStats {
+	//! Name of the message type this pool serves
+	const char *name;
+
+	//! Size of a pooled block
+	size_t blockSize;
+
+	//! Total number of allocations served
+	quint64 allocations;
+
+	//! Number of allocations served from the free list
+	quint64 reused;
+
+	//! Number of blocks currently in use
+	int live;
+
+	//! Number of free blocks held in reserve
+	int pooled;
+};
+
+/**
+ * @brief A free list allocator for frequently created message types
+ *
+ * High frequency messages (pen moves, tool changes, undo points) are
+ * created and destroyed constantly both when relaying on the server
+ * and when replaying on the client. Message classes that use a pool
+ * override their operator new and delete to allocate from it.
+ *
+ * Freed blocks are kept on a free list (up to a limit) and handed out
+ * again on the next allocation. Allocation requests of the wrong size
+ * (i.e. from a subclass) fall through to the global allocator.
+ *
+ * Pools are thread safe, since the built-in server runs in its own thread.
+ *
+ * Pools are never destroyed: messages may still be released by other
+ * static objects or lingering threads during program exit, so a pool
+ * must outlive every message allocated from it.
+ */
+class MessagePool {
+public:
+	/**
+	 * @brief Create a new pool
+	 *
+	 * The pool is registered in a global list so allocation statistics
+	 * can be queried. It lives until the end of the process.
+	 *
+	 * @param name message type name (for statistics)
+	 * @param blocksize size of the pooled type
+	 * @param reserve maximum number of free blocks to keep around
+	 * @return the new pool
+	 */
+	static MessagePool &create(const char *name, size_t blocksize, int reserve=4096);
+
+	MessagePool(const MessagePool&) = delete;
+	MessagePool &operator=(const MessagePool&) = delete;
+
+	/**
+	 * @brief Allocate a block of memory
+	 * @param size requested size
+	 * @return pointer to at least size bytes of memory
+	 */
+	void *allocate(size_t size);
+
+	/**
+	 * @brief Return a block of memory to the pool
+	 * @param ptr pointer previously returned by allocate()
+	 * @param size the size passed to allocate()
+	 */
+	void release(void *ptr, size_t size);
+
+	//! Get allocation statistics for this pool
+	MessagePoolStats stats() const;
+
+	//! Get allocation statistics for all pools
+	static QList<MessagePoolStats> allStats();
+
+private:
+	MessagePool(const char *name, size_t blocksize, int reserve);
+
+	struct FreeBlock {
+		FreeBlock *next;
+	};
+
+	const char *_name;
+	const size_t _blocksize;
+	const int _reserve;
+
+	mutable QMutex _mutex;
+	FreeBlock *_freelist;
+	int _pooled;
+	int _live;
+	quint64 _allocations;
+	quint64 _reused;
+
+	MessagePool *_nextpool;
+};
+
+}
+
+#endif
+
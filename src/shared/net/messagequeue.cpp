@@ -19,10 +19,17 @@
 
 */
 #include <QIODevice>
+#include <QAbstractSocket>
+#include <QThread>
+#include <QMutexLocker>
+#include <QtEndian>
 #include <cstring>
+#include <zlib.h>
 
 #include "messagequeue.h"
 #include "snapshot.h"
+#include "login.h"
+#include "pen.h"
 #include "meta.h" /* for STREAMPOS */
 
 namespace protocol {
@@ -30,77 +37,264 @@ namespace protocol {
 // Reserve enough buffer space for one complete message + snapshot mode marker
 static const int MAX_BUF_LEN = 1024*64 + 4 + 5;
 
+// Maximum amount of uncompressed data in a compressed batch. The deflated
+// batch must fit in the payload of a single message.
+static const int MAX_BATCH_LEN = 1024*32;
+
+// Maximum amount of inflated data buffered at once. A well behaved peer never
+// sends more than a batch, plus the tail of one message left over from before.
+static const int MAX_INFLATED_LEN = MAX_BATCH_LEN + MAX_BUF_LEN;
+
+// Messages longer than this are sent in fragments, if the peer supports it
+static const int FRAGMENT_LEN = 1024*4;
+
+/**
+ * Meta stream messages that do not affect the canvas may overtake other messages.
+ * Layer ACLs, snapshot markers and stream positions must stay in order with
+ * the command stream.
+ *
+ * A user leave must not overtake the user's last commands. Context IDs are
+ * reused, so user joins and attribute changes stay in order with the leaves
+ * too. Operator commands sent as chat (/lock, /kick...) act on the session,
+ * so they stay in order as well.
+ */
+static bool isPriorityMessage(const MessagePtr &msg)
+{
+	switch(msg->type()) {
+	case MSG_LOGIN:
+	case MSG_SESSION_TITLE:
+	case MSG_SESSION_CONFIG:
+		return true;
+	case MSG_CHAT:
+		return !msg.cast<Chat>().isOperatorCommand();
+	default:
+		return false;
+	}
+}
+
 MessageQueue::MessageQueue(QIODevice *socket, QObject *parent)
-	: QObject(parent), _socket(socket), _closeWhenReady(false), _expectingSnapshot(false)
+	: QObject(parent), _socket(socket), _closeWhenReady(false), _expectingSnapshot(false), _peercaps(0),
+	  _queuedbytes(0), _writebytes(0), _readPaused(false),
+	  _writeScheduled(false), _deflater(0), _deflateFailed(false), _inflater(0), _inflateEnabled(false), _wirebytes(0), _logicalbytes(0)
 {
 	connect(socket, SIGNAL(readyRead()), this, SLOT(readData()));
 	connect(socket, SIGNAL(bytesWritten(qint64)), this, SLOT(dataWritten(qint64)));
 
+	QAbstractSocket *netsocket = qobject_cast<QAbstractSocket*>(socket);
+	if(netsocket)
+		connect(netsocket, SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(deviceError()));
+
 	_recvbuffer = new char[MAX_BUF_LEN];
 	_sendbuffer = new char[MAX_BUF_LEN];
+	_batchbuffer = new char[MAX_BATCH_LEN];
 	_recvcount = 0;
 	_sentcount = 0;
 	_sendbuflen = 0;
+	_sendbuflogical = 0;
+	_fragsent = 0;
+	_fragtype = 0;
+	_clock.start();
 }
 
 MessageQueue::~MessageQueue()
 {
 	delete [] _recvbuffer;
 	delete [] _sendbuffer;
+	delete [] _batchbuffer;
+
+	if(_deflater) {
+		deflateEnd(_deflater);
+		delete _deflater;
+	}
+	if(_inflater) {
+		inflateEnd(_inflater);
+		delete _inflater;
+	}
+}
+
+bool MessageQueue::isOwnThread() const
+{
+	return QThread::currentThread() == thread();
 }
 
 bool MessageQueue::isPending() const
 {
+	QMutexLocker lock(&_mutex);
 	return !_recvqueue.isEmpty();
 }
 
 MessagePtr MessageQueue::getPending()
 {
+	QMutexLocker lock(&_mutex);
 	return _recvqueue.dequeue();
 }
 
 bool MessageQueue::isPendingSnapshot() const
 {
+	QMutexLocker lock(&_mutex);
 	return !_snapshot_recv.isEmpty();
 }
 
 MessagePtr MessageQueue::getPendingSnapshot()
 {
+	QMutexLocker lock(&_mutex);
 	return _snapshot_recv.dequeue();
 }
 
 void MessageQueue::send(MessagePtr packet)
 {
-	if(!_closeWhenReady) {
+	QMutexLocker lock(&_mutex);
+	if(_closeWhenReady)
+		return;
+
+	if(isPriorityMessage(packet)) {
+		_priorityqueue.enqueue(packet);
+	} else {
 		_sendqueue.enqueue(packet);
-		if(_sendbuflen==0)
-			writeData();
+		_sendtimes.enqueue(_clock.elapsed());
 	}
+	_queuedbytes += packet->length();
+
+	scheduleWrite(lock);
 }
 
 void MessageQueue::sendSnapshot(const QList<MessagePtr> &snapshot)
 {
-	if(!_closeWhenReady) {
-		_snapshot_send = snapshot;
-		_snapshot_send.append(MessagePtr(new SnapshotMode(SnapshotMode::END)));
+	QMutexLocker lock(&_mutex);
+	if(_closeWhenReady)
+		return;
 
-		if(_sendbuflen==0)
-			writeData();
+	_snapshot_send = snapshot;
+	_snapshot_send.append(MessagePtr(new SnapshotMode(SnapshotMode::END)));
+
+	scheduleWrite(lock);
+}
+
+/**
+ * Start writing if not already in progress. When called from some other
+ * thread, the write is done later in the queue's own thread.
+ *
+ * @param lock the held queue lock. This is released before writing.
+ */
+void MessageQueue::scheduleWrite(QMutexLocker &lock)
+{
+	if(!isOwnThread()) {
+		if(!_writeScheduled) {
+			_writeScheduled = true;
+			QMetaObject::invokeMethod(this, "writeData", Qt::QueuedConnection);
+		}
+	} else if(_sendbuflen==0) {
+		lock.unlock();
+		writeData();
 	}
 }
 
+/**
+ * Note. When called from another thread, the count is approximate.
+ */
+bool MessageQueue::isSendingSnapshot() const
+{
+	QMutexLocker lock(&_mutex);
+	return !_snapshot_send.isEmpty();
+}
+
 int MessageQueue::uploadQueueBytes() const
 {
-	int total = _socket->bytesToWrite() + _sendbuflen - _sentcount;
-	foreach(const MessagePtr msg, _sendqueue)
-		total += msg->length();
+	QMutexLocker lock(&_mutex);
+	int total = _writebytes.load();
+	total += _fragsend.length() - _fragsent;
+	total += _queuedbytes;
 	foreach(const MessagePtr msg, _snapshot_send)
 		total += msg->length() + 4; /* include snapshot mode packets */
 	return total;
 }
 
+qint64 MessageQueue::uploadQueueAge() const
+{
+	QMutexLocker lock(&_mutex);
+	if(_sendtimes.isEmpty())
+		return 0;
+	return _clock.elapsed() - _sendtimes.head();
+}
+
+int MessageQueue::dropBacklog()
+{
+	QMutexLocker lock(&_mutex);
+	int dropped = 0;
+	foreach(const MessagePtr msg, _sendqueue)
+		dropped += msg->length();
+
+	_sendqueue.clear();
+	_sendtimes.clear();
+	_queuedbytes -= dropped;
+	return dropped;
+}
+
+int MessageQueue::coalesceBacklog()
+{
+	QMutexLocker lock(&_mutex);
+	QQueue<MessagePtr> queue;
+	QQueue<qint64> times;
+	int saved = 0;
+
+	int i=0;
+	while(i<_sendqueue.size()) {
+		const MessagePtr msg = _sendqueue.at(i);
+		times.enqueue(_sendtimes.at(i));
+		++i;
+
+		if(msg->type() != MSG_PEN_MOVE) {
+			queue.enqueue(msg);
+			continue;
+		}
+
+		// Merge the run of pen moves by this user
+		PenPointVector points = msg.cast<PenMove>().points();
+		int oldlen = msg->length();
+		int merged = 1;
+		while(i<_sendqueue.size()) {
+			const MessagePtr &next = _sendqueue.at(i);
+			if(next->type() != MSG_PEN_MOVE || next->contextId() != msg->contextId())
+				break;
+			const PenPointVector &more = next.cast<PenMove>().points();
+			if(points.size() + more.size() > MAX_PENMOVE_POINTS)
+				break;
+			points.append(more.constData(), more.size());
+			oldlen += next->length();
+			++merged;
+			++i;
+		}
+
+		if(merged>1) {
+			MessagePtr pm(new PenMove(msg->contextId(), points));
+			saved += oldlen - pm->length();
+			queue.enqueue(pm);
+		} else {
+			queue.enqueue(msg);
+		}
+	}
+
+	_sendqueue = queue;
+	_sendtimes = times;
+	_queuedbytes -= saved;
+	return saved;
+}
+
+qreal MessageQueue::compressionRatio() const
+{
+	if(_wirebytes==0)
+		return 1.0;
+	return qreal(_logicalbytes) / qreal(_wirebytes);
+}
+
 void MessageQueue::readData() {
-	bool gotmessage = false, gotsnapshot = false;
+	if(_readPaused)
+		return;
+
+	_gotmessage = false;
+	_gotsnapshot = false;
+	_recvlogical = 0;
+
 	int read, totalread=0;
 	do {
 		// Read available data
@@ -111,79 +305,243 @@ void MessageQueue::readData() {
 			return;
 		}
 		_recvcount += read;
+		totalread += read;
 
 		// Extract all complete messages
-		int len;
-		while(2 < _recvcount && (len=Message::sniffLength(_recvbuffer)) <= _recvcount) {
-			// Whole message received!
-			Message *msg = Message::deserialize((const uchar*)_recvbuffer);
-			if(!msg) {
-				emit badData(len, _recvbuffer[2]);
-			} else {
-				if(msg->type() == MSG_STREAMPOS) {
-					// Special handling for Stream Position message
-					emit expectingBytes(static_cast<StreamPos*>(msg)->bytes() + totalread);
-					delete msg;
-				} else if(_expectingSnapshot) {
-					// A message preceded by SnapshotMode::SNAPSHOT goes into the snapshot queue
-					_snapshot_recv.enqueue(MessagePtr(msg));
-					_expectingSnapshot = false;
-					gotsnapshot = true;
-				} else {
-					if(msg->type() == MSG_SNAPSHOT && static_cast<SnapshotMode*>(msg)->mode() == SnapshotMode::SNAPSHOT) {
-						delete msg;
-						_expectingSnapshot = true;
-					} else {
-						_recvqueue.enqueue(MessagePtr(msg));
-						gotmessage = true;
-					}
-				}
-			}
-			if(len < _recvcount) {
-				memmove(_recvbuffer, _recvbuffer+len, _recvcount-len);
-			}
-			_recvcount -= len;
+		int consumed = extractMessages(_recvbuffer, _recvcount);
+		if(consumed < _recvcount) {
+			memmove(_recvbuffer, _recvbuffer+consumed, _recvcount-consumed);
 		}
-		totalread += read;
+		_recvcount -= consumed;
 	} while(read>0);
 
-	if(totalread)
-		emit bytesReceived(totalread);
-	if(gotmessage)
+	_wirebytes += totalread;
+	_logicalbytes += _recvlogical;
+
+	if(_recvlogical)
+		emit bytesReceived(_recvlogical);
+	if(_inflater)
+		emit compressionRatioChanged(compressionRatio());
+	if(_gotmessage)
 		emit messageAvailable();
-	if(gotsnapshot)
+	if(_gotsnapshot)
 		emit snapshotAvailable();
 }
 
+/**
+ * Deserialize all complete messages in the buffer. Compressed batches
+ * are inflated and the messages inside them are extracted as well.
+ *
+ * @return number of bytes consumed
+ */
+int MessageQueue::extractMessages(const char *buffer, int count)
+{
+	int consumed = 0;
+	int len;
+	while(consumed+2 < count && (len=Message::sniffLength(buffer+consumed)) <= count-consumed) {
+		// Whole message received!
+		const uchar *data = (const uchar*)buffer + consumed;
+
+		if(data[2] == MSG_COMPRESSED && buffer == _recvbuffer) {
+			// Compressed batches are accepted only if deflate was negotiated
+			if(!(_inflateEnabled || (_peercaps.load() & CAP_DEFLATE)) || !inflateBatch(data+3, len-3))
+				emit badData(len, data[2]);
+		} else if(data[2] == MSG_FRAGMENT) {
+			if(!reassembleFragment(data+3, len-3))
+				emit badData(len, data[2]);
+		} else {
+			Message *msg = Message::deserialize(data);
+			if(!msg)
+				emit badData(len, data[2]);
+			else
+				handleMessage(msg);
+		}
+		consumed += len;
+	}
+	return consumed;
+}
+
+/**
+ * A fragment contains the next piece of a serialized message.
+ * The message is complete when all the bytes promised by its
+ * header have been received.
+ */
+bool MessageQueue::reassembleFragment(const uchar *data, int len)
+{
+	_fragrecv.append((const char*)data, len);
+
+	if(_fragrecv.length() < 3)
+		return true;
+
+	const int msglen = Message::sniffLength(_fragrecv.constData());
+	if(_fragrecv.length() < msglen)
+		return true;
+
+	bool ok = false;
+	if(_fragrecv.length() == msglen) {
+		Message *msg = Message::deserialize((const uchar*)_fragrecv.constData());
+		if(msg) {
+			handleMessage(msg);
+			ok = true;
+		}
+	}
+	_fragrecv.clear();
+	return ok;
+}
+
+void MessageQueue::handleMessage(Message *msg)
+{
+	// Received data is counted in uncompressed message lengths, so it can
+	// be compared with StreamPos and upload queue lengths.
+	_recvlogical += msg->length();
+
+	// The peer may start compressing right after its capability message, possibly
+	// in the same read, so inflate must be enabled before the owner sees the message.
+	if(msg->type() == MSG_LOGIN && !_inflateEnabled) {
+		const int caps = parseCapabilityMessage(static_cast<Login*>(msg)->message());
+		if(caps>=0 && (caps & CAP_DEFLATE))
+			_inflateEnabled = true;
+	}
+
+	if(msg->type() == MSG_STREAMPOS) {
+		// Special handling for Stream Position message
+		emit expectingBytes(static_cast<StreamPos*>(msg)->bytes() + _recvlogical);
+		delete msg;
+	} else if(_expectingSnapshot) {
+		// A message preceded by SnapshotMode::SNAPSHOT goes into the snapshot queue
+		QMutexLocker lock(&_mutex);
+		_snapshot_recv.enqueue(MessagePtr(msg));
+		_expectingSnapshot = false;
+		_gotsnapshot = true;
+	} else {
+		if(msg->type() == MSG_SNAPSHOT && static_cast<SnapshotMode*>(msg)->mode() == SnapshotMode::SNAPSHOT) {
+			delete msg;
+			_expectingSnapshot = true;
+		} else {
+			QMutexLocker lock(&_mutex);
+			_recvqueue.enqueue(MessagePtr(msg));
+			_gotmessage = true;
+		}
+	}
+}
+
+/**
+ * The compressed batches form a single continuous deflate stream.
+ * Each batch ends in a sync flush, so it always inflates to complete messages.
+ *
+ * If the batch is invalid or inflates to more than a batch worth of data,
+ * the inflater is reset. The rest of the stream cannot be decoded after that.
+ */
+bool MessageQueue::inflateBatch(const uchar *data, int len)
+{
+	if(!inflateStream(data, len)) {
+		if(_inflater) {
+			inflateEnd(_inflater);
+			delete _inflater;
+			_inflater = 0;
+		}
+		_inflated.clear();
+		return false;
+	}
+
+	int consumed = extractMessages(_inflated.constData(), _inflated.length());
+	_inflated.remove(0, consumed);
+
+	return true;
+}
+
+bool MessageQueue::inflateStream(const uchar *data, int len)
+{
+	if(!_inflater) {
+		_inflater = new z_stream;
+		memset(_inflater, 0, sizeof(z_stream));
+		if(inflateInit(_inflater) != Z_OK) {
+			delete _inflater;
+			_inflater = 0;
+			return false;
+		}
+	}
+
+	_inflater->next_in = const_cast<Bytef*>(data);
+	_inflater->avail_in = len;
+
+	char out[16*1024];
+	do {
+		_inflater->next_out = (Bytef*)out;
+		_inflater->avail_out = sizeof(out);
+
+		int ret = inflate(_inflater, Z_SYNC_FLUSH);
+		if(ret != Z_OK && ret != Z_BUF_ERROR)
+			return false;
+
+		_inflated.append(out, sizeof(out) - _inflater->avail_out);
+
+		// Guard against decompression bombs
+		if(_inflated.length() > MAX_INFLATED_LEN)
+			return false;
+	} while(_inflater->avail_out == 0);
+
+	return _inflater->avail_in == 0;
+}
+
 void MessageQueue::dataWritten(qint64 bytes)
 {
-	emit bytesSent(bytes);
+	Q_UNUSED(bytes);
+	updateWriteBytes();
 
 	// Write more once the buffer is empty
 	if(_socket->bytesToWrite()==0) {
-		if(_sendbuflen==0 && _sendqueue.isEmpty() && _snapshot_send.isEmpty())
+		bool empty;
+		{
+			QMutexLocker lock(&_mutex);
+			empty = _sendbuflen==0 && _priorityqueue.isEmpty() && _sendqueue.isEmpty() && _fragsend.isEmpty() && _snapshot_send.isEmpty();
+		}
+		if(empty)
 			emit allSent();
 		else
 			writeData();
 	}
 }
 
+void MessageQueue::deviceError()
+{
+	emit socketError(_socket->errorString());
+}
+
+/**
+ * Update the number of bytes taken from the queues but not yet sent.
+ * This is called in the queue's own thread whenever the send buffer
+ * or the device's write buffer changes.
+ */
+void MessageQueue::updateWriteBytes()
+{
+	_writebytes.store(_socket->bytesToWrite() + _sendbuflen - _sentcount);
+}
+
 void MessageQueue::writeData() {
-	if(_sendbuflen==0) {
-		// If send buffer is empty, serialize the next message in the queue.
-		// The snapshot upload queue has lower priority than the normal queue.
-		if(!_sendqueue.isEmpty()) {
-			// There are messages in the higher priority queue, send one
-			_sendbuflen = _sendqueue.dequeue()->serialize(_sendbuffer);
-		} else if(!_snapshot_send.isEmpty()) {
-			// If there is nothing in the normal send queue, check if
-			// there is something in the lower priority snapshot queue
-			SnapshotMode mode(SnapshotMode::SNAPSHOT);
-			_sendbuflen = mode.serialize(_sendbuffer);
-			_sendbuflen += _snapshot_send.takeFirst()->serialize(_sendbuffer + _sendbuflen);
+	int batchlen = 0;
+	{
+		QMutexLocker lock(&_mutex);
+		_writeScheduled = false;
+
+		if(_sendbuflen==0) {
+			// If send buffer is empty, fill it with the next batch of messages
+			_sendbuflogical = 0;
+			if((_peercaps.load() & CAP_DEFLATE) && !_deflateFailed)
+				batchlen = serializeBatch();
+
+			if(batchlen==0)
+				_sendbuflen = serializeNext(_sendbuffer);
+
+			_writebytes.store(_socket->bytesToWrite() + batchlen + _sendbuflen);
 		}
 	}
 
+	// Compress without holding the lock, so other threads are not
+	// blocked when they enqueue messages
+	if(batchlen>0)
+		_sendbuflen = compressBatch(batchlen);
+
 	if(_sentcount < _sendbuflen) {
 		int sent = _socket->write(_sendbuffer+_sentcount, _sendbuflen-_sentcount);
 		if(sent<0) {
@@ -192,9 +550,21 @@ void MessageQueue::writeData() {
 			return;
 		}
 		_sentcount += sent;
+		updateWriteBytes();
 		if(_sentcount == _sendbuflen) {
+			if(_sentcounter && !_sendtypes.isEmpty())
+				_sentcounter->messagesSent((const uchar*)_sendtypes.constData(), _sendtypes.length());
+			_sendtypes.clear();
+
+			_wirebytes += _sendbuflen;
+			_logicalbytes += _sendbuflogical;
+			emit bytesSent(_sendbuflogical);
+			if(_deflater)
+				emit compressionRatioChanged(compressionRatio());
+
 			_sendbuflen=0;
 			_sentcount=0;
+			updateWriteBytes();
 			if(_closeWhenReady)
 				close();
 			else
@@ -203,8 +573,229 @@ void MessageQueue::writeData() {
 	}
 }
 
+/**
+ * Serialize the next message in the queue.
+ *
+ * Priority messages are sent first, then the next fragment of a
+ * partially sent message or the next message in the normal queue.
+ * The snapshot upload queue has lower priority than the normal queue.
+ *
+ * @return number of bytes written or 0 if there is nothing to send
+ */
+int MessageQueue::serializeNext(char *data)
+{
+	if(!_priorityqueue.isEmpty()) {
+		MessagePtr msg = _priorityqueue.dequeue();
+		_queuedbytes -= msg->length();
+		_sendbuflogical += msg->length();
+		_sendtypes.append(char(msg->type()));
+		return serializeMessage(msg, data);
+
+	} else if(!_fragsend.isEmpty()) {
+		// Continue sending a fragmented message
+		return serializeFragment(data);
+
+	} else if(!_sendqueue.isEmpty()) {
+		MessagePtr msg = _sendqueue.dequeue();
+		_sendtimes.dequeue();
+		_queuedbytes -= msg->length();
+		if(isFragmented(msg)) {
+			_fragsend.resize(msg->length());
+			msg->serialize(_fragsend.data());
+			_fragsent = 0;
+			_fragtype = msg->type();
+			return serializeFragment(data);
+		}
+
+		_sendbuflogical += msg->length();
+		_sendtypes.append(char(msg->type()));
+		return serializeMessage(msg, data);
+
+	} else if(!_snapshot_send.isEmpty()) {
+		// If there is nothing in the normal send queue, check if
+		// there is something in the lower priority snapshot queue
+		SnapshotMode mode(SnapshotMode::SNAPSHOT);
+		int len = mode.serialize(data);
+
+		MessagePtr msg = _snapshot_send.takeFirst();
+		len += serializeMessage(msg, data + len);
+		_sendbuflogical += mode.length() + msg->length();
+		_sendtypes.append(char(msg->type()));
+		return len;
+	}
+
+	return 0;
+}
+
+/**
+ * Get the maximum serialized length of the next message in the queue.
+ *
+ * @param compressible set to false if compressing the message would be pointless
+ * @return length or 0 if there is nothing to send
+ */
+int MessageQueue::nextMessageLength(bool *compressible) const
+{
+	if(!_priorityqueue.isEmpty()) {
+		// Login messages are never compressed: the peer enables inflate only
+		// after reading our capability message
+		*compressible = _priorityqueue.head()->type() != MSG_LOGIN;
+		return _priorityqueue.head()->length();
+
+	} else if(!_fragsend.isEmpty()) {
+		*compressible = false;
+		return 3 + qMin(FRAGMENT_LEN, _fragsend.length() - _fragsent);
+
+	} else if(!_sendqueue.isEmpty()) {
+		const MessagePtr &msg = _sendqueue.head();
+		if(isFragmented(msg)) {
+			*compressible = false;
+			return 3 + FRAGMENT_LEN;
+		}
+		if(msg->type() == MSG_SERIALIZED_CHUNK)
+			*compressible = msg.cast<SerializedChunk>().isCompressible();
+		else
+			*compressible = msg->type() != MSG_PUTIMAGE;
+		return msg->length();
+
+	} else if(!_snapshot_send.isEmpty()) {
+		const MessagePtr &msg = _snapshot_send.first();
+		*compressible = msg->type() != MSG_PUTIMAGE;
+		return msg->length() + 4;
+	}
+
+	return 0;
+}
+
+/**
+ * Serialize as many messages as will fit in a batch into the batch buffer.
+ * Image data is already compressed, so PutImage messages are sent as is.
+ *
+ * @return length of the batch or 0 if the next message should be sent uncompressed
+ */
+int MessageQueue::serializeBatch()
+{
+	if(!_deflater) {
+		_deflater = new z_stream;
+		memset(_deflater, 0, sizeof(z_stream));
+		if(deflateInit(_deflater, Z_DEFAULT_COMPRESSION) != Z_OK) {
+			delete _deflater;
+			_deflater = 0;
+			_deflateFailed = true;
+			return 0;
+		}
+	}
+
+	int batchlen = 0;
+	int len;
+	bool compressible;
+	while((len=nextMessageLength(&compressible)) > 0 && compressible && batchlen+len <= MAX_BATCH_LEN)
+		batchlen += serializeNext(_batchbuffer + batchlen);
+
+	return batchlen;
+}
+
+/**
+ * Deflate the serialized batch into the send buffer.
+ *
+ * This touches only the batch buffer, the send buffer and the deflater,
+ * so the queue lock need not be held.
+ *
+ * @return number of bytes written
+ */
+int MessageQueue::compressBatch(int batchlen)
+{
+	_deflater->next_in = (Bytef*)_batchbuffer;
+	_deflater->avail_in = batchlen;
+	_deflater->next_out = (Bytef*)_sendbuffer + 3;
+	_deflater->avail_out = 0xffff;
+
+	// The output buffer is always big enough for a sync flush of a whole batch
+	int ret = deflate(_deflater, Z_SYNC_FLUSH);
+	if(ret != Z_OK || _deflater->avail_in != 0 || _deflater->avail_out == 0) {
+		// Nothing from this batch has been sent, so the peer's inflater
+		// is still intact. Stop compressing and send the batch as is.
+		qWarning("Deflate error %d, disabling compression", ret);
+		deflateEnd(_deflater);
+		delete _deflater;
+		_deflater = 0;
+		_deflateFailed = true;
+
+		memcpy(_sendbuffer, _batchbuffer, batchlen);
+		return batchlen;
+	}
+
+	const int payload = 0xffff - _deflater->avail_out;
+	qToBigEndian(quint16(payload), (uchar*)_sendbuffer);
+	_sendbuffer[2] = MSG_COMPRESSED;
+
+	return 3 + payload;
+}
+
+/**
+ * Check if a message should be sent in fragments.
+ *
+ * Only messages from the normal queue are fragmented. Snapshot upload
+ * messages are preceded by a marker that must be immediately followed by
+ * the message itself. Pre-serialized chunks may contain more than one message,
+ * so they cannot be fragmented either.
+ */
+bool MessageQueue::isFragmented(const MessagePtr &msg) const
+{
+	return (_peercaps.load() & CAP_FRAGMENT) && msg->length() > FRAGMENT_LEN && msg->type() != MSG_SERIALIZED_CHUNK;
+}
+
+/**
+ * Write the next fragment of the message being sent in pieces
+ */
+int MessageQueue::serializeFragment(char *data)
+{
+	const int len = qMin(FRAGMENT_LEN, _fragsend.length() - _fragsent);
+
+	qToBigEndian(quint16(len), (uchar*)data);
+	data[2] = MSG_FRAGMENT;
+	memcpy(data+3, _fragsend.constData() + _fragsent, len);
+
+	_fragsent += len;
+	_sendbuflogical += len;
+	if(_fragsent == _fragsend.length()) {
+		// The message is counted as sent with its last fragment
+		_sendtypes.append(char(_fragtype));
+		_fragsend.clear();
+		_fragsent = 0;
+	}
+
+	return 3 + len;
+}
+
+/**
+ * Serialize a message using the most efficient encoding the peer supports
+ */
+int MessageQueue::serializeMessage(const MessagePtr &msg, char *data) const
+{
+	if(msg->type() == MSG_SERIALIZED_CHUNK) {
+		const QByteArray &chunk = msg.cast<SerializedChunk>().data();
+		memcpy(data, chunk.constData(), chunk.length());
+		return chunk.length();
+	}
+
+	if((_peercaps.load() & CAP_COMPACT_PENMOVE) && msg->type() == MSG_PEN_MOVE) {
+		const PenMove &pm = msg.cast<PenMove>();
+		if(pm.compactLength() < pm.length())
+			return pm.serializeCompact(data);
+	}
+
+	return msg->serialize(data);
+}
+
 void MessageQueue::close() {
+	if(!isOwnThread()) {
+		QMetaObject::invokeMethod(this, "close", Qt::QueuedConnection);
+		return;
+	}
+
 	_socket->close();
+
+	QMutexLocker lock(&_mutex);
 	_closeWhenReady = false;
 }
 
@@ -214,10 +805,51 @@ void MessageQueue::close() {
  * has been called.
  */
 void MessageQueue::closeWhenReady() {
-	if(_sendbuflen==0)
+	if(!isOwnThread()) {
+		QMetaObject::invokeMethod(this, "closeWhenReady", Qt::QueuedConnection);
+		return;
+	}
+
+	if(_sendbuflen==0) {
 		close();
-	else
+	} else {
+		QMutexLocker lock(&_mutex);
 		_closeWhenReady = true;
+	}
+}
+
+void MessageQueue::setReadingPaused(bool pause)
+{
+	if(!isOwnThread()) {
+		QMetaObject::invokeMethod(this, "setReadingPaused", Qt::QueuedConnection, Q_ARG(bool, pause));
+		return;
+	}
+
+	if(pause == _readPaused)
+		return;
+	_readPaused = pause;
+
+	QAbstractSocket *netsocket = qobject_cast<QAbstractSocket*>(_socket);
+	if(netsocket)
+		netsocket->setReadBufferSize(pause ? MAX_BUF_LEN : 0);
+
+	// Process whatever was received while paused
+	if(!pause)
+		readData();
+}
+
+void MessageQueue::abort()
+{
+	if(!isOwnThread()) {
+		QMetaObject::invokeMethod(this, "abort", Qt::QueuedConnection);
+		return;
+	}
+
+	QAbstractSocket *netsocket = qobject_cast<QAbstractSocket*>(_socket);
+	if(netsocket)
+		netsocket->abort();
+	else
+		_socket->close();
 }
 
 #if 0
@@ -23,16 +23,53 @@
 #define DP_NET_MSGQUEUE_H
 
 #include <QQueue>
+#include <QByteArray>
 #include <QObject>
+#include <QMutex>
+#include <QAtomicInt>
+#include <QElapsedTimer>
+#include <QSharedPointer>
 
 #include "message.h"
 
 class QIODevice;
+struct z_stream_s;
 
 namespace protocol {
 
+/**
+ * @brief Receiver of sent message statistics
+ */
+class SentMessageCounter {
+public:
+	virtual ~SentMessageCounter() { }
+
+	/**
+	 * @brief Messages were written to the device
+	 *
+	 * This is called in the message queue's own thread.
+	 * @param types the types of the written messages
+	 * @param count number of messages
+	 */
+	virtual void messagesSent(const uchar *types, int count) = 0;
+};
+
 /**
  * A wrapper for an IO device for sending and receiving messages.
+ *
+ * Outgoing messages are sent in three priority classes:
+ * 1. meta stream messages that do not affect the canvas (chat, user joins, session info)
+ * 2. everything else, in the order they were enqueued
+ * 3. snapshot upload
+ *
+ * If the peer supports it, large messages are split into fragments so
+ * higher priority messages can be sent between them. The relative order of
+ * the messages in the normal priority class is always preserved.
+ *
+ * A message queue can be moved to another thread together with its device.
+ * All the public methods may then be called from any thread; the actual
+ * reading, writing, (de)serialization and compression happen in the
+ * queue's own thread.
  */
 class MessageQueue : public QObject {
 Q_OBJECT
@@ -75,6 +112,9 @@ public:
 
 	/**
 	 * Enqueue a message for sending.
+	 *
+	 * Meta stream messages that do not affect the canvas may overtake
+	 * other messages.
 	 */
 	void send(MessagePtr message);
 
@@ -83,7 +123,7 @@ public:
 	 *
 	 * This method is used to enqueue a snapshot point for asynchronous upload.
 	 * Messages from the snapshot queue are sent when there is a lull in the main queue.
-	 * This command is used only on the client side.
+	 * This command is used on the client side and when sending snapshot points to relays.
 	 *
 	 * Note. Calling this function will overwrite the old snapshot queue, so make
 	 * sure it has been fully sent first!
@@ -91,6 +131,82 @@ public:
 	 */
 	void sendSnapshot(const QList<MessagePtr> &snapshot);
 
+	/**
+	 * @brief Is there still something in the snapshot queue?
+	 * @return true if the snapshot has not been fully sent
+	 */
+	bool isSendingSnapshot() const;
+
+	/**
+	 * @brief Get the number of bytes in the upload queue
+	 * @return
+	 */
+	int uploadQueueBytes() const;
+
+	/**
+	 * @brief Get how long the oldest message in the upload queue has been waiting
+	 *
+	 * Only the normal priority class is considered.
+	 *
+	 * @return age in milliseconds (0 if the queue is empty)
+	 */
+	qint64 uploadQueueAge() const;
+
+	/**
+	 * @brief Discard all unsent messages of the normal priority class
+	 *
+	 * A message that has already been partially sent is finished first,
+	 * so the peer never receives a truncated message. Priority messages
+	 * are kept.
+	 *
+	 * @return number of bytes discarded
+	 */
+	int dropBacklog();
+
+	/**
+	 * @brief Merge queued messages to make the upload queue shorter
+	 *
+	 * Consecutive pen moves by the same user are merged into a single message.
+	 *
+	 * @return number of bytes saved
+	 */
+	int coalesceBacklog();
+
+	/**
+	 * @brief Set the optional protocol features the peer supports
+	 *
+	 * This affects how outgoing messages are encoded. Incoming messages
+	 * are accepted in all supported encodings, except compressed batches,
+	 * which are rejected unless CAP_DEFLATE is set or the peer has
+	 * announced it in a capability message received through this queue.
+	 * Login messages are always sent uncompressed.
+	 *
+	 * @param caps capability flags (see protocol::Capability)
+	 */
+	void setPeerCapabilities(int caps) { _peercaps.store(caps); }
+
+	//! Get the optional features the peer supports
+	int peerCapabilities() const { return _peercaps.load(); }
+
+	/**
+	 * @brief Set the receiver of sent message statistics
+	 *
+	 * Messages are counted when they are actually written to the device,
+	 * so messages dropped from the backlog are not included.
+	 * This must be set before the queue is moved to another thread.
+	 */
+	void setSentCounter(const QSharedPointer<SentMessageCounter> &counter) { _sentcounter = counter; }
+
+	/**
+	 * @brief Get the compression ratio of this connection
+	 *
+	 * This is the ratio of message bytes to bytes actually transferred,
+	 * in both directions.
+	 * @return compression ratio (1.0 when compression is not used)
+	 */
+	qreal compressionRatio() const;
+
+public slots:
 	/**
 	 * Close the IO device
 	 */
@@ -103,10 +219,18 @@ public:
 	void closeWhenReady();
 
 	/**
-	 * @brief Get the number of bytes in the upload queue
-	 * @return
+	 * Abort the connection immediately, discarding any unsent data
 	 */
-	int uploadQueueBytes() const;
+	void abort();
+
+	/**
+	 * @brief Stop or resume reading from the IO device
+	 *
+	 * While paused, the socket's read buffer is limited, so a peer that
+	 * keeps sending is eventually slowed down by TCP flow control.
+	 * @param pause
+	 */
+	void setReadingPaused(bool pause);
 
 signals:
 	/**
@@ -117,16 +241,28 @@ signals:
 
 	/**
 	 * @brief data reception statistics
+	 *
+	 * The count is in uncompressed message bytes.
 	 * @param number of bytes received since last signal
 	 */
 	void bytesReceived(int count);
 
 	/**
 	 * @brief data transmission statistics
+	 *
+	 * The count is in uncompressed message bytes.
 	 * @param count number of bytes sent since last signal
 	 */
 	void bytesSent(int count);
 
+	/**
+	 * @brief Compression ratio of this connection has changed
+	 *
+	 * This is emitted only when compression is in use.
+	 * @param ratio new compression ratio
+	 */
+	void compressionRatioChanged(qreal ratio);
+
 	/**
 	 * New message(s) are available. Get them with getPending().
 	 */
@@ -154,25 +290,72 @@ signals:
 private slots:
 	void readData();
 	void dataWritten(qint64);
+	void writeData();
+	void deviceError();
 
 private:
-	void writeData();
+	bool isOwnThread() const;
+	void scheduleWrite(QMutexLocker &lock);
+	int serializeNext(char *data);
+	int serializeMessage(const MessagePtr &msg, char *data) const;
+	int serializeFragment(char *data);
+	bool isFragmented(const MessagePtr &msg) const;
+	int nextMessageLength(bool *compressible) const;
+	int serializeBatch();
+	int compressBatch(int batchlen);
+	void updateWriteBytes();
+
+	int extractMessages(const char *buffer, int count);
+	void handleMessage(Message *msg);
+	bool reassembleFragment(const uchar *data, int len);
+	bool inflateBatch(const uchar *data, int len);
+	bool inflateStream(const uchar *data, int len);
 
 	QIODevice *_socket;
 
 	char *_recvbuffer;
 	char *_sendbuffer;
+	char *_batchbuffer;
 	int _recvcount;
 	int _sentcount, _sendbuflen;
+	int _sendbuflogical, _recvlogical;
+	bool _gotmessage, _gotsnapshot;
 
 	QQueue<MessagePtr> _recvqueue;
+	QQueue<MessagePtr> _priorityqueue;
 	QQueue<MessagePtr> _sendqueue;
+	QQueue<qint64> _sendtimes; // enqueue times of the messages in _sendqueue
+	QElapsedTimer _clock;
+
+	QByteArray _fragsend;
+	int _fragsent;
+	uchar _fragtype;
+	QByteArray _fragrecv;
 
 	QQueue<MessagePtr> _snapshot_recv;
 	QList<MessagePtr> _snapshot_send;
 
 	bool _closeWhenReady;
 	bool _expectingSnapshot;
+	QAtomicInt _peercaps;
+	int _queuedbytes; // total length of the messages in the priority and send queues
+	QAtomicInt _writebytes; // bytes taken from the queues, but not yet sent
+	bool _readPaused;
+
+	// Guards the message queues when used from other threads
+	mutable QMutex _mutex;
+	bool _writeScheduled;
+
+	z_stream_s *_deflater;
+	bool _deflateFailed; // compression disabled after an error
+	z_stream_s *_inflater;
+	bool _inflateEnabled; // peer announced deflate support
+	QByteArray _inflated;
+
+	qint64 _wirebytes, _logicalbytes;
+
+	QSharedPointer<SentMessageCounter> _sentcounter;
+	QByteArray _sendtypes; // types of the messages in the send buffer
 };
 
 }
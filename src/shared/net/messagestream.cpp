@@ -21,21 +21,128 @@
 
 #include <QDebug>
 
+#include <algorithm>
+
 #include "messagestream.h"
 #include "snapshot.h"
 #include "undo.h"
 
 namespace protocol {
 
+const int MessageStream::CHUNK_LEN;
+const int MessageStream::CACHE_SIZE;
+
 MessageStream::MessageStream()
-	: _offset(0), _snapshotpointer(-1), _bytes(0)
+	: _head(0), _firstchunk(0), _cache(CACHE_SIZE),
+	  _offset(0), _snapshotpointer(-1), _bytes(0), _snapshotbytes(0), _presnapshotbytes(0)
 {
 }
 
 void MessageStream::append(MessagePtr msg)
 {
-	_messages.append(msg);
-	_bytes += msg->length();
+	const int pos = end();
+
+	Entry e;
+	e.type = msg->type();
+	e.ctxid = msg->contextId();
+	e.undostate = msg->undoState();
+	e.undoable = msg->isUndoable();
+
+	if(msg->type() == MSG_SNAPSHOT) {
+		// Snapshot points are not counted in the stream length,
+		// their contents are tracked separately.
+		e.chunk = -1;
+		e.offset = 0;
+		_pinned.insert(pos, msg);
+
+	} else {
+		const int len = msg->length();
+		if(_chunks.isEmpty() || _chunks.last().length() + len > CHUNK_LEN) {
+			if(!_chunks.isEmpty())
+				_chunks.last().squeeze();
+			_chunks.append(QByteArray());
+			_chunks.last().reserve(qMax(CHUNK_LEN, len));
+		}
+
+		QByteArray &chunk = _chunks.last();
+		e.chunk = _firstchunk + _chunks.size() - 1;
+		e.offset = chunk.length();
+		chunk.resize(e.offset + len);
+		msg->serialize(chunk.data() + e.offset);
+
+		_bytes += len;
+
+		// The latest messages are likely to be needed again soon
+		_cache.insert(pos, new MessagePtr(msg));
+	}
+
+	_entries.append(e);
+
+	if(msg->type() == MSG_UNDOPOINT)
+		addUndoPoint(msg->contextId(), pos);
+}
+
+const uchar *MessageStream::data(const Entry &e) const
+{
+	Q_ASSERT(e.chunk >= _firstchunk);
+	return reinterpret_cast<const uchar*>(_chunks.at(e.chunk - _firstchunk).constData()) + e.offset;
+}
+
+MessagePtr MessageStream::deserialize(int pos) const
+{
+	const Entry &e = entry(pos);
+	if(e.chunk<0)
+		return _pinned.constFind(pos).value();
+
+	Message *msg = Message::deserialize(data(e));
+	Q_ASSERT(msg);
+
+	// The context ID is not part of the payload of every message type
+	msg->setContextId(e.ctxid);
+	return MessagePtr(msg);
+}
+
+MessagePtr MessageStream::message(int pos, bool cache) const
+{
+	QMutexLocker lock(&_cachemutex);
+
+	const MessagePtr *cached = _cache.object(pos);
+	if(cached)
+		return *cached;
+
+	MessagePtr msg = deserialize(pos);
+	if(cache && entry(pos).chunk>=0)
+		_cache.insert(pos, new MessagePtr(msg));
+	return msg;
+}
+
+void MessageStream::setUndoState(int pos, MessageUndoState state)
+{
+	Entry &e = entry(pos);
+	if(e.undoable)
+		e.undostate = state;
+}
+
+void MessageStream::addUndoPoint(int ctxid, int pos)
+{
+	foreach(int gone, _undoindex.addUndoPoint(ctxid, pos))
+		setUndoState(gone, GONE);
+}
+
+QList<int> MessageStream::markUndone(int ctxid, int points, int limit, int minpos)
+{
+	const QList<int> marked = _undoindex.markUndone(ctxid, points, limit, qMax(minpos, offset()));
+	foreach(int pos, marked)
+		setUndoState(pos, UNDONE);
+	return marked;
+}
+
+QList<int> MessageStream::markRedone(int ctxid, int points, int limit)
+{
+	const QList<int> marked = _undoindex.markRedone(ctxid, points, limit);
+	foreach(int pos, marked)
+		setUndoState(pos, DONE);
+	return marked;
 }
 
 void MessageStream::addSnapshotPoint()
@@ -49,29 +156,34 @@ void MessageStream::addSnapshotPoint()
 		}
 	}
 
-	// Create the new point
+	// Create the new point.
 	append(MessagePtr(new SnapshotPoint()));
 	_snapshotpointer = end()-1;
+	_presnapshotbytes = _bytes;
 }
 
-int MessageStream::cleanup()
+bool MessageStream::appendToSnapshot(MessagePtr msg)
+{
+	SnapshotPoint &sp = snapshotPoint().cast<SnapshotPoint>();
+	const uint oldlen = sp.storedLength();
+	sp.append(msg);
+	_snapshotbytes += sp.storedLength() - oldlen;
+	return sp.isComplete();
+}
+
+int MessageStream::cleanup(int readpos)
 {
 	if(hasSnapshot()) {
 		const SnapshotPoint &sp = snapshotPoint().cast<protocol::SnapshotPoint>();
 		if(sp.isComplete()) {
-			int i = _snapshotpointer - _offset;
-			Q_ASSERT(i>=0);
-			if(i>0) {
-				_messages = _messages.mid(i);
-				_offset += i;
-				_snapshotpointer = _offset;
+			int last = _snapshotpointer;
+			if(readpos>=0 && readpos < last)
+				last = readpos;
 
-				uint newlen=0;
-				for(int j=1;j<_messages.count();++j)
-					newlen += _messages.at(j)->length();
-				_bytes = newlen;
-
-			}
+			int i = last - _offset;
+			Q_ASSERT(i>=0);
+			for(int j=0;j<i;++j)
+				removeFirst();
 			return i;
 		}
 	}
@@ -82,18 +194,76 @@ void MessageStream::hardCleanup(uint sizelimit)
 {
 	// First, find the index of the last protected undo point
 	int undo_point = _offset;
-	int undo_points = 0;
-	for(int i=end()-1;i>=offset() && undo_points<UNDO_HISTORY_LIMIT;--i) {
-		if(at(i)->type() == MSG_UNDOPOINT) {
-			undo_point = i;
-			++undo_points;
+	const QList<int> &undopoints = _undoindex.undoPoints();
+	if(!undopoints.isEmpty())
+		undo_point = undopoints.at(qMax(0, undopoints.size() - UNDO_HISTORY_LIMIT));
+
+	// Remove messages until size limit or protected undo point is reached
+	while(_bytes > sizelimit && _offset < undo_point)
+		removeFirst();
+}
+
+uint MessageStream::lengthAfter(int index) const
+{
+	if(index == _snapshotpointer && hasSnapshot())
+		return _bytes - _presnapshotbytes;
+
+	uint len = 0;
+	for(int i=qMax(index+1, offset());i<end();++i) {
+		const Entry &e = entry(i);
+		if(e.chunk>=0)
+			len += Message::sniffLength(reinterpret_cast<const char*>(data(e)));
+	}
+	return len;
+}
+
+void MessageStream::removeFirst()
+{
+	const Entry e = entry(_offset);
+
+	if(e.chunk<0) {
+		QHash<int, MessagePtr>::iterator pinned = _pinned.find(_offset);
+		if(e.type == MSG_SNAPSHOT)
+			_snapshotbytes -= pinned.value().cast<SnapshotPoint>().storedLength();
+		_pinned.erase(pinned);
+
+	} else {
+		const uint len = Message::sniffLength(reinterpret_cast<const char*>(data(e)));
+		_bytes -= len;
+		if(_offset < _snapshotpointer)
+			_presnapshotbytes -= len;
+
+		// Messages are removed in order, so the undo point is
+		// always the first one in the index
+		if(e.type == MSG_UNDOPOINT)
+			_undoindex.removeFirst(e.ctxid, _offset);
+	}
+
+	_cache.remove(_offset);
+	++_head;
+	++_offset;
+
+	// Release the chunk once its last message is gone
+	if(e.chunk>=0) {
+		int next = -1;
+		for(int i=_head;i<_entries.size();++i) {
+			if(_entries.at(i).chunk>=0) {
+				next = _entries.at(i).chunk;
+				break;
+			}
+		}
+		if(next != e.chunk) {
+			while(_firstchunk <= e.chunk) {
+				_chunks.removeFirst();
+				++_firstchunk;
+			}
 		}
 	}
 
-	// Remove messages until size limit or protected undo point is reached
-	while(_bytes > sizelimit && _offset < undo_point) {
-		_bytes -= _messages.takeFirst()->length();
-		++_offset;
+	// Compact the entry array every now and then
+	if(_head > 1024 && _head*2 > _entries.size()) {
+		_entries.remove(0, _head);
+		_head = 0;
 	}
 }
 
@@ -101,18 +271,36 @@ void MessageStream::clear()
 {
 	_offset = end();
 	_snapshotpointer = -1;
-	_messages.clear();
+	_entries.clear();
+	_head = 0;
+	_chunks.clear();
+	_firstchunk = 0;
+	_pinned.clear();
+	_cache.clear();
 	_bytes = 0;
+	_snapshotbytes = 0;
+	_presnapshotbytes = 0;
+	_undoindex.clear();
 }
 
-QList<MessagePtr> MessageStream::toCommandList() const
+QList<MessagePtr> MessageStream::toList() const
 {
+	// Bulk reads bypass the cache so they don't evict the latest messages
 	QList<MessagePtr> lst;
-	foreach(MessagePtr m, _messages)
-		if(m->isCommand())
-			lst.append(m);
+	for(int i=offset();i<end();++i)
+		lst.append(message(i, false));
 	return lst;
 }
 
+QList<MessagePtr> MessageStream::toCommandList() const
+{
+	QList<MessagePtr> lst;
+	for(int i=offset();i<end();++i) {
+		const MessagePtr msg = message(i, false);
+		if(msg->isCommand())
+			lst.append(msg);
+	}
+	return lst;
 }
 
+}
@@ -23,17 +23,43 @@
 #define DP_SHARED_NET_MSGSTREAM_H
 
 #include <QList>
+#include <QVector>
+#include <QHash>
+#include <QCache>
+#include <QMutex>
+#include <QByteArray>
 
 #include "message.h"
+#include "undoindex.h"
 
 namespace protocol {
 
 /**
  * @brief The ordered stream of command messages
  *
+ * To save memory, messages are stored in serialized form in large
+ * contiguous chunks and deserialized on demand. A small cache keeps the
+ * most recently used messages around, since they are typically needed
+ * again soon (e.g. when sending the latest commands to every client.)
+ * Snapshot points are containers that are modified in place, so they are
+ * kept as objects.
+ *
+ * The local undo state flags are kept only in a side array. The message
+ * objects returned by at() may be shared with other readers through the
+ * cache, so they are never modified: their own undo state is not meaningful.
+ * Use undoState() and setUndoState() instead.
+ *
+ * The const accessors may be called from several threads at once, but
+ * not while the stream is being modified.
  */
 class MessageStream {
 public:
+	//! Preferred length of a storage chunk. Bigger messages get a chunk of their own.
+	static const int CHUNK_LEN = 1024 * 256;
+
+	//! Number of deserialized messages to cache
+	static const int CACHE_SIZE = 256;
+
 	MessageStream();
 
 	/**
@@ -50,7 +76,7 @@ public:
 	 * @brief Get the end index of the stream
 	 * @return
 	 */
-	int end() const { return _offset + _messages.size(); }
+	int end() const { return _offset + _entries.size() - _head; }
 
 	/**
 	 * @brief Check if a message at the given index exists in this stream
@@ -59,9 +85,33 @@ public:
 	 */
 	bool isValidIndex(int i) const { return i >= offset() && i < end(); }
 
-	MessagePtr at(int pos) { return _messages.at(pos-_offset); }
+	/**
+	 * @brief Get the message at the given index
+	 *
+	 * The message is deserialized, unless it is in the cache.
+	 *
+	 * @param pos stream index
+	 * @pre isValidIndex(pos)
+	 */
+	MessagePtr at(int pos) const { return message(pos, true); }
 
-	const MessagePtr at(int pos) const { return _messages.at(pos-_offset); }
+	/**
+	 * @brief Get the undo state of a message without deserializing it
+	 * @param pos stream index
+	 * @pre isValidIndex(pos)
+	 */
+	MessageUndoState undoState(int pos) const { return MessageUndoState(entry(pos).undostate); }
+
+	/**
+	 * @brief Set the undo state of a message
+	 *
+	 * This does nothing if the message type isn't undoable.
+	 *
+	 * @param pos stream index
+	 * @param state new undo state
+	 * @pre isValidIndex(pos)
+	 */
+	void setUndoState(int pos, MessageUndoState state);
 
 	/**
 	 * @brief Add a new command to the stream
@@ -75,6 +125,14 @@ public:
 	 */
 	void addSnapshotPoint();
 
+	/**
+	 * @brief Add a message to the latest snapshot point
+	 * @param msg snapshot command to add
+	 * @pre hasSnapshot() == true
+	 * @return true if this message completed the snapshot
+	 */
+	bool appendToSnapshot(MessagePtr msg);
+
 	/**
 	 * @brief Does this stream contain a snapshot
 	 *
@@ -98,9 +156,14 @@ public:
 
 	/**
 	 * @brief remove all messages before the last complete snapshot point
+	 *
+	 * Messages at or after the given read position are not removed, even
+	 * if they precede the snapshot point.
+	 *
+	 * @param readpos lowest stream index still needed by a reader (-1 if none)
 	 * @return the number of messages removed
 	 */
-	int cleanup();
+	int cleanup(int readpos=-1);
 
 	/**
 	 * @brief Clean up old messages
@@ -121,16 +184,37 @@ public:
 	/**
 	 * @brief Get the length of the stored message stream in bytes.
 	 *
-	 * Note. Snapshot point is not included.
+	 * Note. Snapshot points are not included.
 	 * @return length in bytes
 	 */
 	uint lengthInBytes() const { return _bytes; }
 
+	/**
+	 * @brief Get the total length of the stored messages in bytes
+	 *
+	 * This includes the contents of all the snapshot points in the stream.
+	 * Snapshot contents are stored twice (see SnapshotPoint::storedLength())
+	 * and both copies are counted.
+	 * @return length in bytes
+	 */
+	uint totalLengthInBytes() const { return _bytes + _snapshotbytes; }
+
+	/**
+	 * @brief Get the length of the messages after the given index
+	 *
+	 * Snapshot points are not included. This is a constant time operation
+	 * when the index is that of the latest snapshot point.
+	 *
+	 * @param index stream index
+	 * @return length in bytes
+	 */
+	uint lengthAfter(int index) const;
+
 	/**
 	 * @brief return the whole stream as a list
 	 * @return list of messages
 	 */
-	QList<MessagePtr> toList() const { return _messages; }
+	QList<MessagePtr> toList() const;
 
 	/**
 	 * @brief return a filtered copy of the stream as a list, containing only the command stream messages.
@@ -138,11 +222,93 @@ public:
 	 */
 	QList<MessagePtr> toCommandList() const;
 
+	/**
+	 * @brief Mark the latest undoable actions of a user as undone
+	 *
+	 * The undo points of each user are indexed as they are added, so
+	 * this does not need to scan through the stream.
+	 *
+	 * @param ctxid user ID
+	 * @param points maximum number of undo points to mark
+	 * @param limit only the latest N undo points (of all users) can be undone. Zero means no limit
+	 * @param minpos undo points before this index cannot be undone
+	 * @return stream indexes of the undo points marked, earliest first
+	 */
+	QList<int> markUndone(int ctxid, int points, int limit=0, int minpos=0);
+
+	/**
+	 * @brief Mark the earliest undone actions of a user as done again
+	 *
+	 * @param ctxid user ID
+	 * @param points maximum number of undo points to mark
+	 * @param limit only the latest N undo points (of all users) can be redone. Zero means no limit
+	 * @return stream indexes of the undo points marked, earliest first
+	 */
+	QList<int> markRedone(int ctxid, int points, int limit=0);
+
+	/**
+	 * @brief Find the latest undo point of a user at or before the given index
+	 *
+	 * Commands share the undo state of the user's preceding undo point.
+	 *
+	 * @param ctxid user ID
+	 * @param pos stream index
+	 * @return undo point index or -1 if there is none in the stream
+	 */
+	int undoPointBefore(int ctxid, int pos) const { return _undoindex.undoPointBefore(ctxid, pos); }
+
+	/**
+	 * @brief Check if the undo state of a user's commands can no longer change
+	 *
+	 * This is the case when the undo point preceding the position is older
+	 * than the undo history limit, or if there is no such undo point.
+	 *
+	 * @param ctxid user ID
+	 * @param pos stream index
+	 * @param limit undo history limit (number of undo points)
+	 * @return true if the commands can no longer be undone or redone
+	 */
+	bool isUndoFinal(int ctxid, int pos, int limit) const { return _undoindex.isUndoFinal(ctxid, pos, limit); }
+
+	//! Get the index of the undo points in this stream
+	const UndoIndex &undoIndex() const { return _undoindex; }
+
 private:
-	QList<MessagePtr> _messages;
+	//! Stored message. Chunk is -1 for messages kept as objects
+	struct Entry {
+		int chunk;
+		quint32 offset;
+		quint8 type;
+		quint8 ctxid;
+		quint8 undostate;
+		bool undoable;
+	};
+
+	const Entry &entry(int pos) const { return _entries.at(_head + pos - _offset); }
+	Entry &entry(int pos) { return _entries[_head + pos - _offset]; }
+
+	const uchar *data(const Entry &e) const;
+	MessagePtr deserialize(int pos) const;
+	MessagePtr message(int pos, bool cache) const;
+
+	void removeFirst();
+	void addUndoPoint(int ctxid, int pos);
+
+	QVector<Entry> _entries;
+	int _head; // number of removed entries at the start of _entries
+	QList<QByteArray> _chunks;
+	int _firstchunk; // number of the first chunk in _chunks
+	QHash<int, MessagePtr> _pinned;
+	mutable QCache<int, MessagePtr> _cache;
+	mutable QMutex _cachemutex;
+
 	int _offset;
 	int _snapshotpointer;
 	uint _bytes;
+	uint _snapshotbytes;
+	uint _presnapshotbytes;
+
+	UndoIndex _undoindex;
 };
 
 }
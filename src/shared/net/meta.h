@@ -134,6 +134,13 @@ public:
 
 	QString message() const { return QString::fromUtf8(_msg); }
 
+	/**
+	 * @brief Is this an operator command rather than an ordinary chat message?
+	 *
+	 * Operator commands start with a slash
+	 */
+	bool isOperatorCommand() const { return _msg.startsWith('/'); }
+
 protected:
     int payloadLength() const;
 	int serializePayload(uchar *data) const;
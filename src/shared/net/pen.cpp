@@ -21,9 +21,83 @@
 
 #include <QtEndian>
 #include "pen.h"
+#include "messagepool.h"
 
 namespace protocol {
 
+namespace {
+	MessagePool &toolChangePool()
+	{
+		static MessagePool &pool = MessagePool::create("ToolChange", sizeof(ToolChange));
+		return pool;
+	}
+
+	MessagePool &penMovePool()
+	{
+		static MessagePool &pool = MessagePool::create("PenMove", sizeof(PenMove));
+		return pool;
+	}
+
+	MessagePool &penUpPool()
+	{
+		static MessagePool &pool = MessagePool::create("PenUp", sizeof(PenUp));
+		return pool;
+	}
+}
+
+void *ToolChange::operator new(size_t size) { return toolChangePool().allocate(size); }
+void ToolChange::operator delete(void *ptr, size_t size) { toolChangePool().release(ptr, size); }
+
+void *PenMove::operator new(size_t size) { return penMovePool().allocate(size); }
+void PenMove::operator delete(void *ptr, size_t size) { penMovePool().release(ptr, size); }
+
+namespace {
+	inline uint32_t zigzag(int32_t v) { return (uint32_t(v) << 1) ^ uint32_t(v >> 31); }
+	inline int32_t unzigzag(uint32_t v) { return int32_t(v >> 1) ^ -int32_t(v & 1); }
+
+	int varintLength(uint32_t v)
+	{
+		int len = 1;
+		while(v >= 0x80) {
+			v >>= 7;
+			++len;
+		}
+		return len;
+	}
+
+	uchar *writeVarint(uchar *ptr, uint32_t v)
+	{
+		while(v >= 0x80) {
+			*(ptr++) = (v & 0x7f) | 0x80;
+			v >>= 7;
+		}
+		*(ptr++) = v;
+		return ptr;
+	}
+
+	// Returns null if the varint is truncated or too long
+	const uchar *readVarint(const uchar *ptr, const uchar *end, uint32_t &v)
+	{
+		v = 0;
+		for(int shift=0;shift<35;shift+=7) {
+			if(ptr == end)
+				return 0;
+			const uchar b = *(ptr++);
+			v |= uint32_t(b & 0x7f) << shift;
+			if(!(b & 0x80))
+				return ptr;
+		}
+		return 0;
+	}
+
+	// Deltas are calculated with wrapping unsigned arithmetic, so even
+	// extreme coordinate jumps survive the round trip.
+	inline int32_t delta(int32_t v, int32_t prev) { return int32_t(uint32_t(v) - uint32_t(prev)); }
+}
+
+void *PenUp::operator new(size_t size) { return penUpPool().allocate(size); }
+void PenUp::operator delete(void *ptr, size_t size) { penUpPool().release(ptr, size); }
+
 ToolChange *ToolChange::deserialize(const uchar *data, uint len)
 {
 	if(len != 19)
@@ -100,7 +174,8 @@ int PenMove::serializePayload(uchar *data) const
 {
 	uchar *ptr = data;
 	*(ptr++) = contextId();
-	foreach(const PenPoint &p, _points) {
+	for(int i=0;i<_points.size();++i) {
+		const PenPoint &p = _points.at(i);
 		qToBigEndian(p.x, ptr); ptr += 4;
 		qToBigEndian(p.y, ptr); ptr += 4;
 		*(ptr++) = p.p;
@@ -108,6 +183,80 @@ int PenMove::serializePayload(uchar *data) const
 	return ptr - data;
 }
 
+PenMove *PenMove::deserializeCompact(const uchar *data, uint len)
+{
+	if(len<4)
+		return 0;
+
+	const uchar *end = data + len;
+	uint8_t ctx = *(data++);
+
+	PenPointVector pp;
+	int32_t x=0, y=0;
+	uint8_t p=0;
+	while(data < end) {
+		uint32_t dx, dy, dp;
+		if(!(data = readVarint(data, end, dx)))
+			return 0;
+		if(!(data = readVarint(data, end, dy)))
+			return 0;
+		if(!(data = readVarint(data, end, dp)))
+			return 0;
+
+		if(pp.size() >= MAX_PENMOVE_POINTS)
+			return 0;
+
+		x = int32_t(uint32_t(x) + uint32_t(unzigzag(dx)));
+		y = int32_t(uint32_t(y) + uint32_t(unzigzag(dy)));
+		p = uint8_t(p + unzigzag(dp));
+		pp.append(PenPoint(x, y, p));
+	}
+
+	return new PenMove(ctx, pp);
+}
+
+int PenMove::compactLength() const
+{
+	int len = 3 + 1;
+	int32_t x=0, y=0;
+	uint8_t p=0;
+	for(int i=0;i<_points.size();++i) {
+		const PenPoint &pt = _points.at(i);
+		len += varintLength(zigzag(delta(pt.x, x)));
+		len += varintLength(zigzag(delta(pt.y, y)));
+		len += varintLength(zigzag(int8_t(pt.p - p)));
+		x = pt.x;
+		y = pt.y;
+		p = pt.p;
+	}
+	return len;
+}
+
+int PenMove::serializeCompact(char *data) const
+{
+	uchar *ptr = (uchar*)data + 3;
+	*(ptr++) = contextId();
+
+	int32_t x=0, y=0;
+	uint8_t p=0;
+	for(int i=0;i<_points.size();++i) {
+		const PenPoint &pt = _points.at(i);
+		ptr = writeVarint(ptr, zigzag(delta(pt.x, x)));
+		ptr = writeVarint(ptr, zigzag(delta(pt.y, y)));
+		ptr = writeVarint(ptr, zigzag(int8_t(pt.p - p)));
+		x = pt.x;
+		y = pt.y;
+		p = pt.p;
+	}
+
+	const int len = ptr - (uchar*)data;
+	Q_ASSERT(len <= 0xffff + 3);
+	qToBigEndian(quint16(len - 3), (uchar*)data);
+	data[2] = MSG_PEN_MOVE_COMPACT;
+
+	return len;
+}
+
 PenUp *PenUp::deserialize(const uchar *data, uint len)
 {
 	if(len != 1)
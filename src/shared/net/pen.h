@@ -22,7 +22,7 @@
 #define DP_NET_PEN_H
 
 #include <cstdint>
-#include <QVector>
+#include <QVarLengthArray>
 
 #include "message.h"
 
@@ -31,6 +31,9 @@ namespace protocol {
 static const uint8_t TOOL_MODE_SUBPIXEL = (1<<0);
 static const uint8_t TOOL_MODE_INCREMENTAL = (1<<1);
 
+//! Maximum number of points that fit in a single (normally encoded) pen move message
+static const int MAX_PENMOVE_POINTS = (0xffff - 1) / 9;
+
 /**
  * \brief Tool setting change command
  */
@@ -52,6 +55,9 @@ public:
 		{}
 
 		static ToolChange *deserialize(const uchar *data, uint len);
+
+		static void *operator new(size_t size);
+		static void operator delete(void *ptr, size_t size);
 		
 		uint8_t layer() const { return _layer; }
 		uint8_t blend() const { return _blend; }
@@ -92,11 +98,23 @@ struct PenPoint {
 	uint8_t p;
 };
 
-typedef QVector<PenPoint> PenPointVector;
+/**
+ * Pen points of a single pen move. The client sends the points of a stroke
+ * in small batches every few milliseconds, so a few points are stored
+ * inline in the (pooled) message and only longer runs need a heap buffer.
+ * The inline space is kept small so a PenMove stays compact.
+ */
+typedef QVarLengthArray<PenPoint, 4> PenPointVector;
 
 /**
  * \brief Pen move command
  * 
+ * Pen moves have two wire encodings. The normal one stores absolute
+ * coordinates, 9 bytes per point. The compact encoding (MSG_PEN_MOVE_COMPACT)
+ * stores the difference from the previous point as zigzag encoded varints.
+ * Since consecutive points are usually close together, a point typically
+ * takes just 3 bytes. The compact encoding is only used when the peer has
+ * announced support for it.
  */
 class PenMove : public Message {
 public:
@@ -107,6 +125,33 @@ public:
 	
 	static PenMove *deserialize(const uchar *data, uint len);
 
+	/**
+	 * @brief Deserialize a compact encoded pen move
+	 *
+	 * The returned message is a normal MSG_PEN_MOVE message. Messages
+	 * with more than MAX_PENMOVE_POINTS points are rejected, since they
+	 * could not be re-encoded for peers without compact pen move support.
+	 */
+	static PenMove *deserializeCompact(const uchar *data, uint len);
+
+	/**
+	 * @brief Get the length of this message in the compact encoding
+	 * @return message length, header included
+	 */
+	int compactLength() const;
+
+	/**
+	 * @brief Serialize this message using the compact encoding
+	 *
+	 * The data buffer must be long enough to hold compactLength() bytes.
+	 * @param data buffer where to write the message
+	 * @return number of bytes written
+	 */
+	int serializeCompact(char *data) const;
+
+	static void *operator new(size_t size);
+	static void operator delete(void *ptr, size_t size);
+
 	const PenPointVector &points() const { return _points; }
 	
 protected:
@@ -127,6 +172,9 @@ public:
 	
 	static PenUp *deserialize(const uchar *data, uint len);
 
+	static void *operator new(size_t size);
+	static void operator delete(void *ptr, size_t size);
+
 protected:
 	int payloadLength() const;
 	int serializePayload(uchar *data) const;
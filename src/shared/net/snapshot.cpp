@@ -43,6 +43,24 @@ int SnapshotMode::serializePayload(uchar *data) const
 	return 1;
 }
 
+void SerializedChunk::append(const MessagePtr &msg)
+{
+	const int oldlen = _data.length();
+	_data.resize(oldlen + msg->length());
+	msg->serialize(_data.data() + oldlen);
+
+	++_count;
+	if(msg->isCommand())
+		++_commands;
+	if(msg->type() == MSG_PUTIMAGE)
+		_compressible = false;
+}
+
+SnapshotPoint::~SnapshotPoint()
+{
+	delete _chunk;
+}
+
 void SnapshotPoint::append(MessagePtr msg)
 {
 	if(_complete) {
@@ -50,10 +68,30 @@ void SnapshotPoint::append(MessagePtr msg)
 		return;
 	}
 
-	if(msg->type() == MSG_SNAPSHOT && msg.cast<SnapshotMode>().mode() == SnapshotMode::END)
+	if(msg->type() == MSG_SNAPSHOT && msg.cast<SnapshotMode>().mode() == SnapshotMode::END) {
 		_complete = true;
-	else
+		finishChunk();
+	} else {
 		_substream.append(msg);
+		_bytes += msg->length();
+
+		// Messages longer than the chunk length get a chunk of their own
+		if(_chunk && _chunk->length() + msg->length() > CHUNK_LEN)
+			finishChunk();
+		if(!_chunk)
+			_chunk = new SerializedChunk;
+		const int oldlen = _chunk->data().length();
+		_chunk->append(msg);
+		_serializedbytes += _chunk->data().length() - oldlen;
+	}
+}
+
+void SnapshotPoint::finishChunk()
+{
+	if(_chunk) {
+		_chunks.append(MessagePtr(_chunk));
+		_chunk = 0;
+	}
 }
 
 }
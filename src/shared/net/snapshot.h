@@ -22,6 +22,7 @@
 #define DP_NET_SNAPSHOT_H
 
 #include <QList>
+#include <QByteArray>
 #include "message.h"
 
 namespace protocol {
@@ -34,7 +35,18 @@ namespace protocol {
  */
 class SnapshotMode : public Message {
 public:
-	enum Mode {REQUEST, REQUEST_NEW, ACK, SNAPSHOT, END};
+	/**
+	 * Snapshot modes:
+	 * - REQUEST/REQUEST_NEW: server asks the client to upload a snapshot
+	 * - ACK: client has started generating the snapshot
+	 * - SNAPSHOT: the next message is part of the snapshot stream
+	 * - END: end of the snapshot stream
+	 * - RESET: server tells the client to discard its session state. The session
+	 *          is then resent from the latest snapshot point. (Requires CAP_RESYNC)
+	 * - POINT: server tells a relay there is a snapshot point here. The contents
+	 *          follow later in the snapshot stream.
+	 */
+	enum Mode {REQUEST, REQUEST_NEW, ACK, SNAPSHOT, END, RESET, POINT};
 
 	SnapshotMode(Mode mode) : Message(MSG_SNAPSHOT, 0), _mode(mode) {}
 
@@ -50,16 +62,70 @@ private:
     Mode _mode;
 };
 
+/**
+ * @brief A block of pre-serialized messages
+ *
+ * This is a local container that stands in for the messages it contains.
+ * The message queue writes the content as is, so the same chunk can be
+ * sent to any number of clients without serializing its messages again.
+ *
+ * The length of a chunk is the length of its content. Note that
+ * Message::serialize() must not be used on a chunk.
+ */
+class SerializedChunk : public Message {
+public:
+	SerializedChunk() : Message(MSG_SERIALIZED_CHUNK, 0), _count(0), _commands(0), _compressible(true) {}
+
+	/**
+	 * @brief Serialize a message and add it to the end of this chunk
+	 * @param msg message to add
+	 */
+	void append(const MessagePtr &msg);
+
+	//! Get the serialized messages
+	const QByteArray &data() const { return _data; }
+
+	//! Get the number of messages in this chunk
+	int messageCount() const { return _count; }
+
+	//! Get the number of command stream messages in this chunk
+	int commandCount() const { return _commands; }
+
+	//! Is it worthwhile to compress this chunk? (false if it contains image data)
+	bool isCompressible() const { return _compressible; }
+
+protected:
+	int payloadLength() const { return _data.length() - 3; }
+	int serializePayload(uchar*) const { Q_ASSERT(false); return 0; }
+
+private:
+	QByteArray _data;
+	int _count;
+	int _commands;
+	bool _compressible;
+};
+
 /**
  * @brief A snapshot point container
  *
  * This message is never actually transmitted over the network. It
  * serves as a container for the snapshot point stream in the actual
  * command stream.
+ *
+ * Besides the messages themselves, the substream is kept pre-serialized
+ * in chunks of up to CHUNK_LEN bytes. Joining clients are sent these chunks
+ * instead of the individual messages.
  */
 class SnapshotPoint : public Message {
 public:
-	SnapshotPoint() : Message(MSG_SNAPSHOT, 0), _complete(false) {}
+	//! Preferred maximum length of a substream chunk
+	static const int CHUNK_LEN = 1024 * 32;
+
+	SnapshotPoint() : Message(MSG_SNAPSHOT, 0), _complete(false), _bytes(0), _serializedbytes(0), _chunk(0) {}
+	~SnapshotPoint();
+
+	SnapshotPoint(const SnapshotPoint&) = delete;
+	SnapshotPoint &operator=(const SnapshotPoint&) = delete;
 
 	/**
 	 * @brief Get the snapshot point substream
@@ -86,13 +152,45 @@ public:
 	 */
 	bool isComplete() const { return _complete; }
 
+	/**
+	 * @brief Get the length of the substream in bytes
+	 * @return sum of substream message lengths
+	 */
+	uint substreamLength() const { return _bytes; }
+
+	/**
+	 * @brief Get the amount of memory used to store the substream
+	 *
+	 * The substream is kept both as messages and serialized in chunks,
+	 * so both copies are counted.
+	 * @return stored length in bytes
+	 */
+	uint storedLength() const { return _bytes + _serializedbytes; }
+
+	/**
+	 * @brief Get the finished chunks of the serialized substream
+	 *
+	 * The last chunk is being filled until it is full or the snapshot
+	 * is complete, so it is not included until then.
+	 *
+	 * @return list of SerializedChunks
+	 */
+	const QList<MessagePtr> &chunks() const { return _chunks; }
+
 protected:
 	int payloadLength() const { return 0; }
 	int serializePayload(uchar*) const { return 0; }
 
 private:
+	void finishChunk();
+
 	QList<MessagePtr> _substream;
 	bool _complete;
+	uint _bytes;
+	uint _serializedbytes;
+
+	QList<MessagePtr> _chunks;
+	SerializedChunk *_chunk;
 
 };
 }
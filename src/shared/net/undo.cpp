@@ -1,7 +1,19 @@
 #include "undo.h"
+#include "messagepool.h"
 
 namespace protocol {
 
+namespace {
+	MessagePool &undoPointPool()
+	{
+		static MessagePool &pool = MessagePool::create("UndoPoint", sizeof(UndoPoint));
+		return pool;
+	}
+}
+
+void *UndoPoint::operator new(size_t size) { return undoPointPool().allocate(size); }
+void UndoPoint::operator delete(void *ptr, size_t size) { undoPointPool().release(ptr, size); }
+
 UndoPoint *UndoPoint::deserialize(const uchar *data, uint len)
 {
 	if(len!=1)
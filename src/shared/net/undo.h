@@ -48,6 +48,9 @@ public:
 
 	static UndoPoint *deserialize(const uchar *data, uint len);
 
+	static void *operator new(size_t size);
+	static void operator delete(void *ptr, size_t size);
+
 protected:
 	int payloadLength() const;
 	int serializePayload(uchar *data) const;
@@ -0,0 +1,192 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2013 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+#include <QSet>
+
+#include <algorithm>
+
+#include "undoindex.h"
+
+namespace protocol {
+
+/**
+ * Since the commands are stored in a linear sequence, the branching of
+ * the undo history is represented by marking the unreachable undo points as GONE.
+ */
+QList<int> UndoIndex::addUndoPoint(int ctxid, int pos)
+{
+	UndoContext &ctx = _contexts[ctxid];
+
+	const QList<int> gone = ctx.live.mid(ctx.done);
+	ctx.live.erase(ctx.live.begin() + ctx.done, ctx.live.end());
+
+	ctx.all.append(pos);
+	ctx.live.append(pos);
+	ctx.done = ctx.live.size();
+	_undopoints.append(pos);
+
+	return gone;
+}
+
+int UndoIndex::limitIndex(int limit) const
+{
+	if(limit<=0 || _undopoints.size() <= limit)
+		return 0;
+	return _undopoints.at(_undopoints.size() - limit);
+}
+
+QList<int> UndoIndex::markUndone(int ctxid, int points, int limit, int minpos)
+{
+	QList<int> marked;
+	QHash<int, UndoContext>::iterator ctx = _contexts.find(ctxid);
+	if(ctx == _contexts.end())
+		return marked;
+
+	const int first = qMax(minpos, limitIndex(limit));
+	while(points>0 && ctx->done>0 && ctx->live.at(ctx->done-1) >= first) {
+		marked.prepend(ctx->live.at(--ctx->done));
+		--points;
+	}
+	return marked;
+}
+
+QList<int> UndoIndex::markRedone(int ctxid, int points, int limit)
+{
+	QList<int> marked;
+	QHash<int, UndoContext>::iterator ctx = _contexts.find(ctxid);
+	if(ctx == _contexts.end())
+		return marked;
+
+	// Redo must start from the beginning of the undo sequence
+	const int first = limitIndex(limit);
+	if(ctx->done < ctx->live.size() && ctx->live.at(ctx->done) < first)
+		return marked;
+
+	while(points>0 && ctx->done < ctx->live.size()) {
+		marked.append(ctx->live.at(ctx->done++));
+		--points;
+	}
+	return marked;
+}
+
+int UndoIndex::undoPointBefore(int ctxid, int pos) const
+{
+	QHash<int, UndoContext>::const_iterator ctx = _contexts.constFind(ctxid);
+	if(ctx == _contexts.constEnd())
+		return -1;
+
+	QList<int>::const_iterator i = std::upper_bound(ctx->all.constBegin(), ctx->all.constEnd(), pos);
+	if(i == ctx->all.constBegin())
+		return -1;
+	return *(--i);
+}
+
+MessageUndoState UndoIndex::state(int ctxid, int pos) const
+{
+	QHash<int, UndoContext>::const_iterator ctx = _contexts.constFind(ctxid);
+	if(ctx == _contexts.constEnd())
+		return DONE;
+
+	QList<int>::const_iterator i = std::lower_bound(ctx->live.constBegin(), ctx->live.constEnd(), pos);
+	if(i != ctx->live.constEnd() && *i == pos)
+		return (i - ctx->live.constBegin()) < ctx->done ? DONE : UNDONE;
+
+	if(std::binary_search(ctx->all.constBegin(), ctx->all.constEnd(), pos))
+		return GONE;
+
+	return DONE;
+}
+
+bool UndoIndex::isUndoFinal(int ctxid, int pos, int limit) const
+{
+	const int up = undoPointBefore(ctxid, pos);
+	return up<0 || up < limitIndex(limit);
+}
+
+void UndoIndex::removeFirst(int ctxid, int pos)
+{
+	Q_ASSERT(!_undopoints.isEmpty() && _undopoints.first() == pos);
+
+	UndoContext &ctx = _contexts[ctxid];
+	ctx.all.removeFirst();
+	if(!ctx.live.isEmpty() && ctx.live.first() == pos) {
+		ctx.live.removeFirst();
+		if(ctx.done>0)
+			--ctx.done;
+	}
+	if(ctx.all.isEmpty())
+		_contexts.remove(ctxid);
+	_undopoints.removeFirst();
+}
+
+void UndoIndex::discardBefore(int pos)
+{
+	QSet<int> removed;
+
+	QMutableHashIterator<int, UndoContext> i(_contexts);
+	while(i.hasNext()) {
+		UndoContext &ctx = i.next().value();
+		while(ctx.all.size() > 1 && ctx.all.at(1) < pos) {
+			const int first = ctx.all.takeFirst();
+			if(!ctx.live.isEmpty() && ctx.live.first() == first) {
+				ctx.live.removeFirst();
+				if(ctx.done>0)
+					--ctx.done;
+			}
+			removed.insert(first);
+		}
+	}
+
+	if(!removed.isEmpty()) {
+		QList<int> remaining;
+		foreach(int p, _undopoints)
+			if(!removed.contains(p))
+				remaining.append(p);
+		_undopoints = remaining;
+	}
+}
+
+void UndoIndex::clear()
+{
+	_contexts.clear();
+	_undopoints.clear();
+}
+
+MessageUndoState ReplayUndoState::next(const MessagePtr &msg, int pos)
+{
+	if(msg->type() == MSG_UNDO)
+		return GONE;
+
+	if(!msg->isUndoable())
+		return DONE;
+
+	const int ctx = msg->contextId();
+	if(msg->type() == MSG_UNDOPOINT) {
+		_state[ctx] = _index.state(ctx, pos);
+
+	} else if(!_state.contains(ctx)) {
+		const int up = _index.undoPointBefore(ctx, _savepoint);
+		_state[ctx] = up<0 ? DONE : _index.state(ctx, up);
+	}
+	return _state.value(ctx);
+}
+
+}
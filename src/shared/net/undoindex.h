@@ -0,0 +1,185 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2013 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+#ifndef DP_NET_UNDOINDEX_H
+#define DP_NET_UNDOINDEX_H
+
+#include <QHash>
+#include <QList>
+
+#include "message.h"
+
+namespace protocol {
+
+/**
+ * @brief Index of the undo points of each user
+ *
+ * The undo points of each user are indexed as they are added, so undo
+ * and redo don't need to scan through the command stream. The index
+ * positions are stream indexes.
+ *
+ * The index only tracks the undo state of the undo points themselves.
+ * Other commands share the state of the preceding undo point of the same user.
+ */
+class UndoIndex {
+public:
+	/**
+	 * @brief Add a new undo point
+	 *
+	 * A new undo point branches the undo history: the user's undone
+	 * undo points become unreachable.
+	 *
+	 * @param ctxid user ID
+	 * @param pos stream index of the undo point. Must be greater than any previously added
+	 * @return indexes of the undo points that became unreachable (GONE)
+	 */
+	QList<int> addUndoPoint(int ctxid, int pos);
+
+	/**
+	 * @brief Mark the latest undoable actions of a user as undone
+	 *
+	 * @param ctxid user ID
+	 * @param points maximum number of undo points to mark
+	 * @param limit only the latest N undo points (of all users) can be undone. Zero means no limit
+	 * @param minpos undo points before this index cannot be undone
+	 * @return stream indexes of the undo points marked, earliest first
+	 */
+	QList<int> markUndone(int ctxid, int points, int limit=0, int minpos=0);
+
+	/**
+	 * @brief Mark the earliest undone actions of a user as done again
+	 *
+	 * @param ctxid user ID
+	 * @param points maximum number of undo points to mark
+	 * @param limit only the latest N undo points (of all users) can be redone. Zero means no limit
+	 * @return stream indexes of the undo points marked, earliest first
+	 */
+	QList<int> markRedone(int ctxid, int points, int limit=0);
+
+	/**
+	 * @brief Find the latest undo point of a user at or before the given index
+	 * @param ctxid user ID
+	 * @param pos stream index
+	 * @return undo point index or -1 if there is none in the index
+	 */
+	int undoPointBefore(int ctxid, int pos) const;
+
+	/**
+	 * @brief Get the undo state of an undo point
+	 * @param ctxid user ID
+	 * @param pos stream index of the undo point
+	 * @return undo state (DONE if the undo point is not in the index)
+	 */
+	MessageUndoState state(int ctxid, int pos) const;
+
+	/**
+	 * @brief Check if the undo state of a user's commands can no longer change
+	 *
+	 * This is the case when the undo point preceding the position is older
+	 * than the undo history limit, or if there is no such undo point.
+	 *
+	 * @param ctxid user ID
+	 * @param pos stream index
+	 * @param limit undo history limit (number of undo points)
+	 * @return true if the commands can no longer be undone or redone
+	 */
+	bool isUndoFinal(int ctxid, int pos, int limit) const;
+
+	/**
+	 * @brief Get the index of the oldest undo point within the history limit
+	 * @param limit undo history limit (number of undo points). Zero means no limit
+	 * @return stream index (0 if all undo points are within the limit)
+	 */
+	int limitIndex(int limit) const;
+
+	//! Get the undo points of all users, in stream order
+	const QList<int> &undoPoints() const { return _undopoints; }
+
+	/**
+	 * @brief Remove the oldest undo point
+	 *
+	 * This is called when the start of the stream is discarded.
+	 * @param ctxid user ID
+	 * @param pos stream index of the undo point. This must be the oldest one in the index
+	 */
+	void removeFirst(int ctxid, int pos);
+
+	/**
+	 * @brief Remove undo points that are no longer needed before the given index
+	 *
+	 * The latest undo point of each user before the index is kept,
+	 * since the commands after the index still share its undo state.
+	 *
+	 * @param pos stream index
+	 */
+	void discardBefore(int pos);
+
+	//! Remove all undo points
+	void clear();
+
+private:
+	/**
+	 * @brief Undo points of a single user
+	 *
+	 * The reachable (not GONE) undo points always form a sequence of DONE
+	 * points followed by UNDONE points: undo marks the last done points,
+	 * redo the first undone ones and a new undo point makes the undone
+	 * ones unreachable.
+	 */
+	struct UndoContext {
+		UndoContext() : done(0) { }
+
+		QList<int> all;  // all undo points in the stream
+		QList<int> live; // reachable undo points
+		int done;        // number of DONE points at the start of live
+	};
+
+	QHash<int, UndoContext> _contexts;
+	QList<int> _undopoints;
+};
+
+/**
+ * @brief Resolve the undo state of commands when replaying from a savepoint
+ *
+ * A command's undo state is that of the latest undo point of the same
+ * user preceding it. Undo commands themselves are never replayed.
+ */
+class ReplayUndoState {
+public:
+	/**
+	 * @param index the undo index of the stream being replayed
+	 * @param savepoint stream index of the savepoint the replay starts from
+	 */
+	ReplayUndoState(const UndoIndex &index, int savepoint)
+		: _index(index), _savepoint(savepoint)
+	{ }
+
+	//! Get the undo state of the message at the given position. Messages must be passed in order
+	MessageUndoState next(const MessagePtr &msg, int pos);
+
+private:
+	const UndoIndex &_index;
+	const int _savepoint;
+	QHash<int, MessageUndoState> _state;
+};
+
+}
+
+#endif
@@ -0,0 +1,352 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2013 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QStringList>
+#include <QTextStream>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+
+#include "adminserver.h"
+#include "server.h"
+#include "multiserver.h"
+#include "metrics.h"
+
+#include "../net/messagepool.h"
+
+namespace server {
+
+namespace {
+	// Maximum size of a request header we are willing to buffer
+	const int MAX_REQUEST_LEN = 8 * 1024;
+
+	QString escapeLabel(const QString &value)
+	{
+		QString v = value;
+		v.replace('\\', "\\\\");
+		v.replace('"', "\\\"");
+		v.replace('\n', "\\n");
+		return v;
+	}
+
+	void writeHeader(QTextStream &out, const char *name, const char *type, const char *help)
+	{
+		out << "# HELP " << name << ' ' << help << '\n';
+		out << "# TYPE " << name << ' ' << type << '\n';
+	}
+
+	void writeHistogram(QTextStream &out, const QString &name, const QString &labels, const Histogram &h)
+	{
+		quint64 cumulative = 0;
+		for(int i=0;i<h.bounds().size();++i) {
+			cumulative += h.counts().at(i);
+			out << name << "_bucket{" << labels << ",le=\"" << h.bounds().at(i) << "\"} " << cumulative << '\n';
+		}
+		out << name << "_bucket{" << labels << ",le=\"+Inf\"} " << h.count() << '\n';
+		out << name << "_sum{" << labels << "} " << h.sum() << '\n';
+		out << name << "_count{" << labels << "} " << h.count() << '\n';
+	}
+
+	QJsonObject histogramToJson(const Histogram &h)
+	{
+		QJsonArray buckets;
+		for(int i=0;i<h.bounds().size();++i) {
+			QJsonObject b;
+			b["le"] = h.bounds().at(i);
+			b["count"] = double(h.counts().at(i));
+			buckets.append(b);
+		}
+		QJsonObject o;
+		o["buckets"] = buckets;
+		o["overflow"] = double(h.counts().last());
+		o["sum"] = h.sum();
+		o["count"] = double(h.count());
+		return o;
+	}
+
+	QJsonObject messageCountsToJson(const QVector<quint64> &counts)
+	{
+		QJsonObject o;
+		for(int i=0;i<counts.size();++i)
+			if(counts.at(i))
+				o[ServerMetrics::messageTypeName(i)] = double(counts.at(i));
+		return o;
+	}
+}
+
+AdminServer::AdminServer(Server *server, QObject *parent)
+	: QObject(parent), _listener(0), _server(server), _multiserver(0)
+{
+}
+
+AdminServer::AdminServer(MultiServer *server, QObject *parent)
+	: QObject(parent), _listener(0), _server(0), _multiserver(server)
+{
+}
+
+bool AdminServer::start(quint16 port)
+{
+	Q_ASSERT(_listener==0);
+	_listener = new QTcpServer(this);
+	connect(_listener, SIGNAL(newConnection()), this, SLOT(newConnection()));
+
+	return _listener->listen(QHostAddress::LocalHost, port);
+}
+
+QString AdminServer::errorString() const
+{
+	return _listener ? _listener->errorString() : QString();
+}
+
+QHash<QString, QSharedPointer<ServerMetrics> > AdminServer::sessions() const
+{
+	if(_multiserver)
+		return _multiserver->sessionMetrics();
+
+	QHash<QString, QSharedPointer<ServerMetrics> > s;
+	s[QString()] = _server->sharedMetrics();
+	return s;
+}
+
+void AdminServer::newConnection()
+{
+	QTcpSocket *socket = _listener->nextPendingConnection();
+	connect(socket, SIGNAL(readyRead()), this, SLOT(readRequest()));
+	connect(socket, SIGNAL(disconnected()), socket, SLOT(deleteLater()));
+}
+
+/**
+ * Only the request line is looked at. The rest of the request
+ * is ignored and the connection is closed after the response.
+ */
+void AdminServer::readRequest()
+{
+	QTcpSocket *socket = qobject_cast<QTcpSocket*>(sender());
+	Q_ASSERT(socket);
+
+	if(!socket->canReadLine()) {
+		if(socket->bytesAvailable() > MAX_REQUEST_LEN)
+			socket->abort();
+		return;
+	}
+
+	disconnect(socket, SIGNAL(readyRead()), this, SLOT(readRequest()));
+
+	const QStringList request = QString::fromLatin1(socket->readLine()).trimmed().split(' ');
+
+	QByteArray status = "200 OK";
+	QByteArray type;
+	QByteArray body;
+
+	if(request.size() != 3 || request[0] != "GET") {
+		status = "405 Method Not Allowed";
+	} else if(request[1] == "/metrics") {
+		type = "text/plain; version=0.0.4";
+		body = prometheusReport();
+	} else if(request[1] == "/metrics.json") {
+		type = "application/json";
+		body = jsonReport();
+	} else {
+		status = "404 Not Found";
+	}
+
+	if(type.isEmpty()) {
+		type = "text/plain";
+		body = status + "\n";
+	}
+
+	socket->write("HTTP/1.0 " + status + "\r\n"
+		"Content-Type: " + type + "\r\n"
+		"Content-Length: " + QByteArray::number(body.length()) + "\r\n"
+		"Connection: close\r\n"
+		"\r\n");
+	socket->write(body);
+	socket->disconnectFromHost();
+}
+
+QByteArray AdminServer::prometheusReport() const
+{
+	QByteArray report;
+	QTextStream out(&report);
+
+	const QHash<QString, QSharedPointer<ServerMetrics> > sessionlist = sessions();
+
+	QHash<QString, MetricsSnapshot> data;
+	QHashIterator<QString, QSharedPointer<ServerMetrics> > i(sessionlist);
+	while(i.hasNext()) {
+		i.next();
+		data[i.key()] = i.value()->snapshot();
+	}
+
+	writeHeader(out, "drawpile_sessions", "gauge", "Number of sessions");
+	out << "drawpile_sessions " << data.count() << '\n';
+
+	writeHeader(out, "drawpile_messages_received_total", "counter", "Messages received from clients");
+	foreach(const QString &s, data.keys()) {
+		const QVector<quint64> &counts = data[s].messagesReceived;
+		for(int t=0;t<counts.size();++t)
+			if(counts.at(t))
+				out << "drawpile_messages_received_total{session=\"" << escapeLabel(s) << "\",type=\"" << ServerMetrics::messageTypeName(t) << "\"} " << counts.at(t) << '\n';
+	}
+
+	writeHeader(out, "drawpile_messages_sent_total", "counter", "Messages sent to clients");
+	foreach(const QString &s, data.keys()) {
+		const QVector<quint64> &counts = data[s].messagesSent;
+		for(int t=0;t<counts.size();++t)
+			if(counts.at(t))
+				out << "drawpile_messages_sent_total{session=\"" << escapeLabel(s) << "\",type=\"" << ServerMetrics::messageTypeName(t) << "\"} " << counts.at(t) << '\n';
+	}
+
+	writeHeader(out, "drawpile_history_bytes", "gauge", "Size of the session history in bytes");
+	foreach(const QString &s, data.keys())
+		out << "drawpile_history_bytes{session=\"" << escapeLabel(s) << "\"} " << data[s].historyBytes << '\n';
+
+	writeHeader(out, "drawpile_history_messages", "gauge", "Number of messages in the session history");
+	foreach(const QString &s, data.keys())
+		out << "drawpile_history_messages{session=\"" << escapeLabel(s) << "\"} " << data[s].historyMessages << '\n';
+
+	writeHeader(out, "drawpile_clients", "gauge", "Number of connected clients");
+	foreach(const QString &s, data.keys())
+		out << "drawpile_clients{session=\"" << escapeLabel(s) << "\"} " << data[s].clients.count() << '\n';
+
+	// Client statistics are aggregated per session, to keep the number
+	// of series bounded and personal information out of the report
+	QHash<QString, ClientMetrics> totals;
+	QHash<QString, int> throttled;
+	foreach(const QString &s, data.keys()) {
+		ClientMetrics t = ClientMetrics();
+		int th = 0;
+		foreach(const ClientMetrics &c, data[s].clients) {
+			t.bytesReceived += c.bytesReceived;
+			t.bytesSent += c.bytesSent;
+			t.uploadQueueBytes += c.uploadQueueBytes;
+			t.uploadQueueAge = qMax(t.uploadQueueAge, c.uploadQueueAge);
+			t.resyncs += c.resyncs;
+			if(c.throttled)
+				++th;
+		}
+		totals[s] = t;
+		throttled[s] = th;
+	}
+
+	writeHeader(out, "drawpile_clients_received_bytes", "gauge", "Bytes received from currently connected clients");
+	foreach(const QString &s, data.keys())
+		out << "drawpile_clients_received_bytes{session=\"" << escapeLabel(s) << "\"} " << totals[s].bytesReceived << '\n';
+
+	writeHeader(out, "drawpile_clients_sent_bytes", "gauge", "Bytes sent to currently connected clients");
+	foreach(const QString &s, data.keys())
+		out << "drawpile_clients_sent_bytes{session=\"" << escapeLabel(s) << "\"} " << totals[s].bytesSent << '\n';
+
+	writeHeader(out, "drawpile_clients_upload_queue_bytes", "gauge", "Bytes waiting to be sent to clients");
+	foreach(const QString &s, data.keys())
+		out << "drawpile_clients_upload_queue_bytes{session=\"" << escapeLabel(s) << "\"} " << totals[s].uploadQueueBytes << '\n';
+
+	writeHeader(out, "drawpile_clients_upload_queue_age_seconds", "gauge", "How long the oldest message queued for any client has waited");
+	foreach(const QString &s, data.keys())
+		out << "drawpile_clients_upload_queue_age_seconds{session=\"" << escapeLabel(s) << "\"} " << totals[s].uploadQueueAge << '\n';
+
+	writeHeader(out, "drawpile_clients_throttled", "gauge", "Number of clients being held back for falling behind");
+	foreach(const QString &s, data.keys())
+		out << "drawpile_clients_throttled{session=\"" << escapeLabel(s) << "\"} " << throttled[s] << '\n';
+
+	writeHeader(out, "drawpile_clients_resyncs", "gauge", "Times a currently connected client was resynced from a snapshot");
+	foreach(const QString &s, data.keys())
+		out << "drawpile_clients_resyncs{session=\"" << escapeLabel(s) << "\"} " << totals[s].resyncs << '\n';
+
+	writeHeader(out, "drawpile_message_handling_seconds", "histogram", "Time spent processing a received message");
+	foreach(const QString &s, data.keys())
+		writeHistogram(out, "drawpile_message_handling_seconds", QString("session=\"%1\"").arg(escapeLabel(s)), data[s].messageHandling);
+
+	writeHeader(out, "drawpile_snapshot_sync_seconds", "histogram", "Time from snapshot request to complete snapshot");
+	foreach(const QString &s, data.keys())
+		writeHistogram(out, "drawpile_snapshot_sync_seconds", QString("session=\"%1\"").arg(escapeLabel(s)), data[s].snapshotSync);
+
+	const QList<protocol::MessagePoolStats> pools = protocol::MessagePool::allStats();
+	writeHeader(out, "drawpile_message_pool_live", "gauge", "Pooled message blocks in use");
+	foreach(const protocol::MessagePoolStats &p, pools)
+		out << "drawpile_message_pool_live{pool=\"" << p.name << "\"} " << p.live << '\n';
+	writeHeader(out, "drawpile_message_pool_free", "gauge", "Free message blocks held in reserve");
+	foreach(const protocol::MessagePoolStats &p, pools)
+		out << "drawpile_message_pool_free{pool=\"" << p.name << "\"} " << p.pooled << '\n';
+	writeHeader(out, "drawpile_message_pool_allocations_total", "counter", "Message allocations served by the pool");
+	foreach(const protocol::MessagePoolStats &p, pools)
+		out << "drawpile_message_pool_allocations_total{pool=\"" << p.name << "\"} " << p.allocations << '\n';
+
+	out.flush();
+	return report;
+}
+
+QByteArray AdminServer::jsonReport() const
+{
+	QJsonArray sessionarray;
+
+	const QHash<QString, QSharedPointer<ServerMetrics> > sessionlist = sessions();
+	QHashIterator<QString, QSharedPointer<ServerMetrics> > i(sessionlist);
+	while(i.hasNext()) {
+		i.next();
+		const MetricsSnapshot m = i.value()->snapshot();
+
+		QJsonArray clients;
+		foreach(const ClientMetrics &c, m.clients) {
+			QJsonObject co;
+			co["id"] = c.id;
+			co["bytesReceived"] = double(c.bytesReceived);
+			co["bytesSent"] = double(c.bytesSent);
+			co["uploadQueueBytes"] = c.uploadQueueBytes;
+			co["uploadQueueAge"] = c.uploadQueueAge;
+			co["throttled"] = c.throttled;
+			co["resyncs"] = c.resyncs;
+			clients.append(co);
+		}
+
+		QJsonObject so;
+		so["name"] = i.key();
+		so["historyBytes"] = double(m.historyBytes);
+		so["historyMessages"] = m.historyMessages;
+		so["messagesReceived"] = messageCountsToJson(m.messagesReceived);
+		so["messagesSent"] = messageCountsToJson(m.messagesSent);
+		so["clients"] = clients;
+		so["messageHandlingSeconds"] = histogramToJson(m.messageHandling);
+		so["snapshotSyncSeconds"] = histogramToJson(m.snapshotSync);
+		sessionarray.append(so);
+	}
+
+	QJsonArray pools;
+	foreach(const protocol::MessagePoolStats &p, protocol::MessagePool::allStats()) {
+		QJsonObject po;
+		po["name"] = QString(p.name);
+		po["blockSize"] = int(p.blockSize);
+		po["allocations"] = double(p.allocations);
+		po["reused"] = double(p.reused);
+		po["live"] = p.live;
+		po["free"] = p.pooled;
+		pools.append(po);
+	}
+
+	QJsonObject root;
+	root["sessions"] = sessionarray;
+	root["messagePools"] = pools;
+
+	return QJsonDocument(root).toJson();
+}
+
+}
@@ -0,0 +1,86 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2013 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+#ifndef DP_SERVER_ADMINSERVER_H
+#define DP_SERVER_ADMINSERVER_H
+
+#include <QObject>
+#include <QHash>
+#include <QSharedPointer>
+
+class QTcpServer;
+class QTcpSocket;
+
+namespace server {
+
+class Server;
+class MultiServer;
+class ServerMetrics;
+
+/**
+ * @brief A minimal HTTP server for monitoring
+ *
+ * The admin server listens on the loopback interface only and serves the
+ * following read only pages:
+ *
+ * - /metrics      all metrics in Prometheus text format
+ * - /metrics.json all metrics as JSON
+ *
+ * The admin server must live in the same thread as the server it monitors.
+ */
+class AdminServer : public QObject {
+Q_OBJECT
+public:
+	//! Monitor a single session server
+	AdminServer(Server *server, QObject *parent=0);
+
+	//! Monitor all sessions of a multisession server
+	AdminServer(MultiServer *server, QObject *parent=0);
+
+	/**
+	 * @brief Start listening on the loopback interface
+	 * @param port port to listen on
+	 * @return false on error
+	 */
+	bool start(quint16 port);
+
+	//! Get the latest error message
+	QString errorString() const;
+
+	//! Generate a report in Prometheus text exposition format
+	QByteArray prometheusReport() const;
+
+	//! Generate a report in JSON format
+	QByteArray jsonReport() const;
+
+private slots:
+	void newConnection();
+	void readRequest();
+
+private:
+	QHash<QString, QSharedPointer<ServerMetrics> > sessions() const;
+
+	QTcpServer *_listener;
+	Server *_server;
+	MultiServer *_multiserver;
+};
+
+}
+
+#endif
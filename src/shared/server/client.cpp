@@ -20,14 +20,18 @@
 
 #include <QTcpSocket>
 #include <QStringList>
+#include <QElapsedTimer>
+#include <QUuid>
 
 #include "config.h"
 
 #include "server.h"
 #include "client.h"
+#include "upstream.h"
 #include "exceptions.h"
 
 #include "../net/messagequeue.h"
+#include "../net/messagepool.h"
 #include "../net/annotation.h"
 #include "../net/image.h"
 #include "../net/layer.h"
@@ -41,10 +45,11 @@ namespace server {
 
 using protocol::MessagePtr;
 
-Client::Client(Server *server, QTcpSocket *socket)
+Client::Client(Server *server, QTcpSocket *socket, QThread *iothread)
 	: QObject(server),
 	  _server(server),
 	  _socket(socket),
+	  _peerAddress(socket->peerAddress()),
 	  _state(LOGIN), _substate(0),
 	  _awaiting_snapshot(false),
 	  _uploading_snapshot(false),
@@ -52,15 +57,37 @@ Client::Client(Server *server, QTcpSocket *socket)
 	  _id(0),
 	  _isOperator(false),
 	  _userLock(false),
-	  _barrierlock(BARRIER_NOTLOCKED)
+	  _bytesReceived(0),
+	  _bytesSent(0),
+	  _throttled(false),
+	  _resyncs(0),
+	  _relay(false),
+	  _writeonly(false),
+	  _relaysnapshot(-1),
+	  _upstream(0)
 {
-	_msgqueue = new protocol::MessageQueue(socket, this);
+	// The message queue owns the socket, so they can be moved to the I/O thread together
+	_msgqueue = new protocol::MessageQueue(socket);
+	_msgqueue->setSentCounter(server->sharedMetrics());
+	_socket->setParent(_msgqueue);
+	if(iothread)
+		_msgqueue->moveToThread(iothread);
 
 	connect(_socket, SIGNAL(disconnected()), this, SLOT(socketDisconnect()));
-	connect(_socket, SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(socketError()));
+	connect(_msgqueue, SIGNAL(socketError(QString)), this, SLOT(socketError(QString)));
 	connect(_msgqueue, SIGNAL(messageAvailable()), this, SLOT(receiveMessages()));
 	connect(_msgqueue, SIGNAL(snapshotAvailable()), this, SLOT(receiveSnapshot()));
 	connect(_msgqueue, SIGNAL(badData(int,int)), this, SLOT(gotBadData(int,int)));
+	connect(_msgqueue, SIGNAL(bytesReceived(int)), this, SLOT(countReceivedBytes(int)));
+	connect(_msgqueue, SIGNAL(bytesSent(int)), this, SLOT(countSentBytes(int)));
+
+	if(server->isRelay()) {
+		// The login is passed through to the upstream server, starting with its hello
+		_upstream = new UpstreamLink(UpstreamLink::USER, server->upstreamUrl(), this);
+		connect(_upstream, SIGNAL(messageReceived(protocol::MessagePtr)), this, SLOT(receiveUpstreamMessage(protocol::MessagePtr)));
+		connect(_upstream, SIGNAL(disconnected(QString)), this, SLOT(upstreamDisconnected(QString)));
+		return;
+	}
 
 	// Client just connected, start by saying hello
 	QString hello = QString("DRAWPILE %1.%2").arg(DRAWPILE_PROTO_MAJOR_VERSION).arg(_server->session().minorVersion);
@@ -74,43 +101,174 @@ Client::Client(Server *server, QTcpSocket *socket)
 		_substate = 1;
 	}
 
-	_msgqueue->send(MessagePtr(new protocol::Login(hello)));
+	sendMessage(MessagePtr(new protocol::Login(hello)));
 }
 
 Client::~Client()
 {
-	delete _socket;
+	// The queue may live in another thread
+	_msgqueue->deleteLater();
 }
 
 QHostAddress Client::peerAddress() const
 {
-	return _socket->peerAddress();
+	return _peerAddress;
+}
+
+ClientMetrics Client::metrics() const
+{
+	ClientMetrics m;
+	m.id = _id;
+	m.bytesReceived = _bytesReceived;
+	m.bytesSent = _bytesSent;
+	m.uploadQueueBytes = _msgqueue->uploadQueueBytes();
+	m.uploadQueueAge = _msgqueue->uploadQueueAge() / 1000.0;
+	m.throttled = _throttled;
+	m.resyncs = _resyncs;
+	return m;
+}
+
+void Client::sendMessage(MessagePtr msg)
+{
+	_msgqueue->send(msg);
+}
+
+void Client::countSentBytes(int bytes)
+{
+	_bytesSent += bytes;
+
+	// Resume sending once the queue has drained. (Relays may be waiting
+	// for the previous snapshot to be sent.)
+	if(_throttled || _relay)
+		sendAvailableCommands();
+}
+
+/**
+ * Check if the client has fallen too far behind and apply the
+ * slow client policy if so.
+ *
+ * @return true if more commands may be enqueued
+ */
+bool Client::checkBacklog()
+{
+	const SlowClientLimits &limits = _server->slowClientLimits();
+	if(limits.policy == SLOW_CLIENT_IGNORE)
+		return true;
+
+	int bytes = _msgqueue->uploadQueueBytes();
+
+	if(_throttled) {
+		if(limits.bytes>0 ? bytes > limits.bytes/2 : bytes > 0)
+			return false;
+
+		_throttled = false;
+		if(limits.policy == SLOW_CLIENT_PAUSE)
+			_msgqueue->setReadingPaused(false);
+		_server->printDebug(QString("Client %1 has caught up").arg(_id));
+	}
+
+	const bool lagging =
+		(limits.bytes>0 && bytes > limits.bytes) ||
+		(limits.seconds>0 && _msgqueue->uploadQueueAge() > limits.seconds * 1000);
+
+	if(!lagging)
+		return true;
+
+	switch(limits.policy) {
+	case SLOW_CLIENT_PAUSE:
+		_msgqueue->setReadingPaused(true);
+		break;
+	case SLOW_CLIENT_COALESCE:
+		bytes -= _msgqueue->coalesceBacklog();
+		// The client's message count no longer matches what we think we sent
+		_resumelog.invalidate();
+		if(limits.bytes>0 && bytes <= limits.bytes && (limits.seconds<=0 || _msgqueue->uploadQueueAge() <= limits.seconds * 1000))
+			return true;
+		break;
+	case SLOW_CLIENT_RESYNC:
+		if(resync(bytes))
+			return true;
+		break;
+	default: break;
+	}
+
+	_server->printDebug(QString("Client %1 is lagging behind (%2 bytes queued)").arg(_id).arg(bytes));
+	_throttled = true;
+	return false;
+}
+
+/**
+ * Drop the backlog and restart the client from the latest snapshot point.
+ *
+ * This is done only if the client supports it and the snapshot and the
+ * commands after it are smaller than the backlog.
+ *
+ * @param backlog number of bytes in the client's upload queue
+ * @return true if the client was resynced
+ */
+bool Client::resync(int backlog)
+{
+	if(!(_msgqueue->peerCapabilities() & protocol::CAP_RESYNC))
+		return false;
+
+	// Don't interrupt a snapshot download
+	if(_substreampointer>=0)
+		return false;
+
+	const protocol::MessageStream &stream = _server->mainstream();
+	if(!stream.hasSnapshot())
+		return false;
+
+	const protocol::SnapshotPoint &sp = stream.snapshotPoint().cast<protocol::SnapshotPoint>();
+	if(!sp.isComplete())
+		return false;
+
+	const uint resynclen = sp.substreamLength() + stream.lengthAfter(stream.snapshotPointIndex());
+	if(resynclen >= uint(backlog))
+		return false;
+
+	const int dropped = _msgqueue->dropBacklog();
+	sendMessage(MessagePtr(new protocol::SnapshotMode(protocol::SnapshotMode::RESET)));
+
+	_streampointer = stream.snapshotPointIndex();
+	_substreampointer = 0;
+	_resumelog.reset();
+	++_resyncs;
+
+	_server->printDebug(QString("Dropped %1 bytes of backlog and resynced client %2 from the snapshot point").arg(dropped).arg(_id));
+	return true;
 }
 
 void Client::sendAvailableCommands()
 {
-	if(_state != IN_SESSION)
+	if(_state != IN_SESSION || _writeonly)
+		return;
+
+	if(!checkBacklog())
 		return;
 
+	if(_relay) {
+		sendRelayCommands();
+		return;
+	}
+
 	if(_substreampointer>=0) {
 		// Are we downloading a substream?
 		const protocol::MessagePtr sptr = _server->mainstream().at(_streampointer);
 		Q_ASSERT(sptr->type() == protocol::MSG_SNAPSHOT);
 		const protocol::SnapshotPoint &sp = sptr.cast<const protocol::SnapshotPoint>();
 
-		if(_substreampointer == 0) {
+		if(_substreampointer == 0 && !sp.chunks().isEmpty()) {
 			// User is in the beginning of a stream, send stream position message
-			uint streamlen = 0;
-			for(int i=0;i<sp.substream().length();++i)
-				streamlen += sp.substream().at(i)->length();
-			for(int i=_streampointer+1;i<_server->mainstream().end();++i)
-				streamlen += _server->mainstream().at(i)->length();
-
-			_msgqueue->send(MessagePtr(new protocol::StreamPos(streamlen)));
+			const uint streamlen = sp.substreamLength() + _server->mainstream().lengthAfter(_streampointer);
+			sendMessage(MessagePtr(new protocol::StreamPos(streamlen)));
+		}
+		// Enqueue the pre-serialized substream
+		while(_substreampointer < sp.chunks().length()) {
+			const MessagePtr chunk = sp.chunks().at(_substreampointer++);
+			_resumelog.addSubstream(chunk.cast<protocol::SerializedChunk>().commandCount());
+			sendMessage(chunk);
 		}
-		// Enqueue substream
-		while(_substreampointer < sp.substream().length())
-			_msgqueue->send(sp.substream().at(_substreampointer++));
 
 		if(sp.isComplete()) {
 			_substreampointer = -1;
@@ -120,20 +278,62 @@ void Client::sendAvailableCommands()
 	} else {
 		// No substream in progress, enqueue normal commands
 		// Snapshot points (substreams) are skipped.
+		_resumelog.startStream(_streampointer);
 		while(_streampointer < _server->mainstream().end()) {
 			MessagePtr msg = _server->mainstream().at(_streampointer++);
+			_resumelog.advance(msg);
 			if(msg->type() != protocol::MSG_SNAPSHOT)
-				_msgqueue->send(msg);
+				sendMessage(msg);
+		}
+	}
+
+}
+
+/**
+ * Relays get the main stream as is. Each snapshot point is marked with
+ * SnapshotMode::POINT and its contents are sent in the snapshot stream once
+ * the point is complete. The next snapshot point is not passed until the
+ * previous one has been sent, so the relay never has two incomplete points.
+ */
+void Client::sendRelayCommands()
+{
+	const protocol::MessageStream &stream = _server->mainstream();
+
+	if(_relaysnapshot>=0) {
+		const protocol::SnapshotPoint &sp = stream.at(_relaysnapshot).cast<protocol::SnapshotPoint>();
+		if(sp.isComplete()) {
+			_msgqueue->sendSnapshot(sp.substream());
+			_relaysnapshot = -1;
 		}
 	}
 
+	while(_streampointer < stream.end()) {
+		MessagePtr msg = stream.at(_streampointer);
+		if(msg->type() == protocol::MSG_SNAPSHOT) {
+			if(_relaysnapshot>=0 || _msgqueue->isSendingSnapshot())
+				break;
+
+			sendMessage(MessagePtr(new protocol::SnapshotMode(protocol::SnapshotMode::POINT)));
+			const protocol::SnapshotPoint &sp = msg.cast<protocol::SnapshotPoint>();
+			if(sp.isComplete())
+				_msgqueue->sendSnapshot(sp.substream());
+			else
+				_relaysnapshot = _streampointer;
+		} else {
+			sendMessage(msg);
+		}
+		++_streampointer;
+	}
 }
 
 void Client::receiveMessages()
 {
+	QElapsedTimer timer;
 	while(_msgqueue->isPending()) {
 		MessagePtr msg = _msgqueue->getPending();
+		_server->metrics()->messageReceived(msg->type());
 
+		timer.start();
 		switch(_state) {
 		case LOGIN:
 			handleLoginMessage(msg.cast<protocol::Login>());
@@ -142,7 +342,11 @@ void Client::receiveMessages()
 		case IN_SESSION:
 			handleSessionMessage(msg);
 			break;
+		case DETACHED:
+			// Leftovers from a connection that has been replaced
+			break;
 		}
+		_server->metrics()->messageHandled(timer.nsecsElapsed() / 1e9);
 	}
 }
 
@@ -167,12 +371,13 @@ void Client::receiveSnapshot()
 {
 	if(!_uploading_snapshot) {
 		_server->printError(QString("Received snapshot data from client %1 when not expecting it!").arg(_id));
-		_socket->disconnect();
+		_msgqueue->abort();
 		return;
 	}
 
 	while(_msgqueue->isPendingSnapshot()) {
 		MessagePtr msg = _msgqueue->getPendingSnapshot();
+		_server->metrics()->messageReceived(msg->type());
 
 		// Filter away blatantly unallowed messages
 		switch(msg->type()) {
@@ -201,7 +406,7 @@ void Client::receiveSnapshot()
 
 			if(_msgqueue->isPendingSnapshot()) {
 				_server->printError(QString("Client %1 sent too much snapshot data!").arg(_id));
-				_socket->disconnect();
+				_msgqueue->abort();
 			}
 			break;
 		}
@@ -211,18 +416,26 @@ void Client::receiveSnapshot()
 void Client::gotBadData(int len, int type)
 {
 	_server->printError(QString("Received unknown message type #%1 of length %2 from %3").arg(type).arg(len).arg(peerAddress().toString()));
-	_socket->abort();
+	_msgqueue->abort();
 }
 
-void Client::socketError()
+void Client::socketError(const QString &error)
 {
-	_server->printError(QString("Socket error %1 (from %2)").arg(_socket->errorString()).arg(peerAddress().toString()));
-	_socket->abort();
+	_server->printError(QString("Socket error %1 (from %2)").arg(error).arg(peerAddress().toString()));
+	_msgqueue->abort();
 }
 
 void Client::socketDisconnect()
 {
-	if(_id>0) {
+	if(_upstream) {
+		// The upstream server takes care of the user leaving
+		closeUpstream();
+
+	} else if(isSuspendable()) {
+		// The user may yet return, so the UserLeave is postponed
+		suspendUser();
+
+	} else if(_id>0) {
 		_server->session().userids.release(_id);
 		_server->addToCommandStream(MessagePtr(new protocol::UserLeave(_id)));
 
@@ -232,22 +445,52 @@ void Client::socketDisconnect()
 	emit disconnected(this);
 }
 
+bool Client::isSuspendable() const
+{
+	return _id>0 && _state == IN_SESSION && !_resumetoken.isEmpty() && _resumelog.isValid() && _server->resumeGracePeriod()>0;
+}
+
+void Client::suspendUser()
+{
+	if(!_server->session().drawingctx[_id].penup)
+		_server->addToCommandStream(MessagePtr(new protocol::PenUp(_id)));
+
+	SuspendedUser user;
+	user.id = _id;
+	user.username = _username;
+	user.isOperator = _isOperator;
+	user.userLock = _userLock;
+	user.log = _resumelog;
+	_server->suspendUser(_resumetoken, user);
+}
+
+/**
+ * The user is suspended right away so the new connection can resume
+ * the session. This connection no longer represents the user: its
+ * remaining input is ignored and it leaves no UserLeave behind.
+ */
+bool Client::detachUser()
+{
+	if(!isSuspendable())
+		return false;
+
+	_server->printDebug(QString("User %1 reconnected, dropping the old connection from %2").arg(_id).arg(peerAddress().toString()));
+	suspendUser();
+	_state = DETACHED;
+	_id = 0;
+	_resumetoken = QString();
+	_msgqueue->abort();
+	return true;
+}
+
 void Client::requestSnapshot(bool forcenew)
 {
 	Q_ASSERT(_state != LOGIN);
-	_msgqueue->send(MessagePtr(new protocol::SnapshotMode(forcenew ? protocol::SnapshotMode::REQUEST_NEW : protocol::SnapshotMode::REQUEST)));
+	sendMessage(MessagePtr(new protocol::SnapshotMode(forcenew ? protocol::SnapshotMode::REQUEST_NEW : protocol::SnapshotMode::REQUEST)));
 	_awaiting_snapshot = true;
 
 	_server->addSnapshotPoint();
 
-	// Add user introductions to snapshot point
-	foreach(const Client *c, _server->clients()) {
-		if(c->id()>0) {
-			_server->addToSnapshotStream(protocol::MessagePtr(new protocol::UserJoin(c->id(), c->username())));
-			_server->addToSnapshotStream(protocol::MessagePtr(new protocol::UserAttr(c->id(), c->isUserLocked(), c->isOperator())));
-		}
-	}
-
 	_server->printDebug(QString("Created a new snapshot point and requested data from client %1").arg(_id));
 }
 
@@ -261,10 +504,29 @@ void Client::requestSnapshot(bool forcenew)
  */
 void Client::handleSessionMessage(MessagePtr msg)
 {
+	// Relays only listen
+	if(_relay) {
+		if(msg->type() == protocol::MSG_LOGIN)
+			handleCapabilities(msg.cast<protocol::Login>());
+		return;
+	}
+
+	// On a relay, everything else is validated by the upstream server
+	if(_upstream) {
+		if(msg->type() == protocol::MSG_LOGIN)
+			handleCapabilities(msg.cast<protocol::Login>());
+		else
+			_upstream->send(msg);
+		return;
+	}
+
 	// Filter away blatantly unallowed messages
 	switch(msg->type()) {
 	using namespace protocol;
 	case MSG_LOGIN:
+		// The only login message allowed after login is the capability announcement
+		handleCapabilities(msg.cast<Login>());
+		return;
 	case MSG_USER_JOIN:
 	case MSG_USER_ATTR:
 	case MSG_USER_LEAVE:
@@ -346,10 +608,6 @@ void Client::handleSessionMessage(MessagePtr msg)
 		break;
 	case MSG_PEN_UP:
 		_server->session().drawingContextPenUp(msg.cast<PenUp>());
-		if(_barrierlock == BARRIER_WAIT) {
-			_barrierlock = BARRIER_LOCKED;
-			emit barrierLocked();
-		}
 		break;
 	case MSG_LAYER_CREATE:
 		_server->session().createLayer(msg.cast<LayerCreate>(), true);
@@ -375,10 +633,6 @@ void Client::handleSessionMessage(MessagePtr msg)
 		if(!_server->session().deleteAnnotation(msg.cast<AnnotationDelete>().id()))
 			return;
 		break;
-	case MSG_UNDOPOINT:
-		// keep track of undo points
-		handleUndoPoint();
-		break;
 	case MSG_UNDO:
 		// validate undo command
 		if(!handleUndoCommand(msg.cast<Undo>()))
@@ -401,9 +655,34 @@ void Client::handleSessionMessage(MessagePtr msg)
 	_server->addToCommandStream(msg);
 }
 
+/**
+ * @brief Handle the client's optional feature announcement
+ *
+ * The reply lists the features we will use when talking to this client.
+ * @param msg the capability announcement
+ */
+void Client::handleCapabilities(const protocol::Login &msg)
+{
+	int caps = protocol::parseCapabilityMessage(msg.message());
+	if(caps<0) {
+		_server->printDebug(QString("Warning: user #%1 sent unexpected login message").arg(_id));
+		return;
+	}
+
+	caps &= _server->capabilities();
+
+	sendMessage(MessagePtr(new protocol::Login(protocol::capabilityMessage(caps))));
+	_msgqueue->setPeerCapabilities(caps);
+
+	if((caps & protocol::CAP_RESUME) && _resumetoken.isEmpty()) {
+		_resumetoken = QUuid::createUuid().toString().mid(1, 36);
+		sendMessage(MessagePtr(new protocol::Login(QString("TOKEN %1").arg(_resumetoken))));
+	}
+}
+
 bool Client::isHoldLocked() const
 {
-	return _state == WAIT_FOR_SYNC || _barrierlock == BARRIER_LOCKED;
+	return _state == WAIT_FOR_SYNC;
 }
 
 bool Client::isDropLocked() const
@@ -445,25 +724,11 @@ void Client::unlockUser()
 	sendUpdatedAttrs();
 }
 
-void Client::barrierLock()
-{
-	if(_server->session().drawingctx[_id].penup) {
-		_barrierlock = BARRIER_LOCKED;
-		emit barrierLocked();
-	} else {
-		_barrierlock = BARRIER_WAIT;
-	}
-}
-
-void Client::barrierUnlock()
-{
-	_barrierlock = BARRIER_NOTLOCKED;
-}
-
 void Client::kick(int kickedBy)
 {
 	_server->printDebug(QString("User #%1 (%2) kicked by #%3").arg(_id).arg(_username).arg(kickedBy));
-	_socket->disconnectFromHost();
+	_resumetoken = QString(); // kicked users may not come back
+	_msgqueue->close();
 }
 
 void Client::sendUpdatedAttrs()
@@ -489,7 +754,7 @@ void Client::snapshotNowAvailable()
 	if(_state == WAIT_FOR_SYNC) {
 		_state = IN_SESSION;
 		_streampointer = _server->mainstream().snapshotPointIndex();
-		_substreampointer = 0;
+		_substreampointer = _relay ? -1 : 0;
 		sendAvailableCommands();
 		enqueueHeldCommands();
 	}
@@ -507,6 +772,14 @@ void Client::snapshotNowAvailable()
  * The client responds to OK (or initial hello) with "HOST ***" or "JOIN ***"
  * Server responds with BADNAME, NOSESSION, CLOSED or OK <userid>
  *
+ * Instead of joining, a client whose connection was dropped may respond with
+ * "RESUME <token> <count>", where count is the number of command messages it
+ * has received. Server responds with NORESUME or RESUMED <userid>
+ *
+ * Relays respond with "RELAY" to get a read only copy of the session and
+ * join their users with "RELAYJOIN <username>". Server responds with
+ * OK 0 (relays have no user ID) or as to JOIN.
+ *
  * @param loginmsg login message
  */
 void Client::handleLoginMessage(const protocol::Login &loginmsg)
@@ -515,6 +788,11 @@ void Client::handleLoginMessage(const protocol::Login &loginmsg)
 	QByteArray errormsg = "WHAT?";
 
 	try {
+		if(_upstream) {
+			handleRelayedLogin(msg);
+			return;
+		}
+
 		switch(_substate) {
 		case 0: /* expecting a password */
 			handleLoginPassword(msg);
@@ -526,6 +804,16 @@ void Client::handleLoginMessage(const protocol::Login &loginmsg)
 			} else if(msg.startsWith("JOIN ")) {
 				handleJoinSession(msg);
 				return;
+			} else if(msg.startsWith("RESUME ")) {
+				handleResumeSession(msg);
+				return;
+			} else if(msg.startsWith("RELAYJOIN ")) {
+				_writeonly = true;
+				handleJoinSession(msg);
+				return;
+			} else if(msg == "RELAY") {
+				handleRelayLogin();
+				return;
 			}
 		}
 	} catch(const ProtocolViolation &pv) {
@@ -534,7 +822,7 @@ void Client::handleLoginMessage(const protocol::Login &loginmsg)
 
 	// Unexpected input
 	_server->printError(QString("Error (%1) during login from %2").arg(QString(errormsg)).arg(peerAddress().toString()));
-	_msgqueue->send(MessagePtr(new protocol::Login(errormsg)));
+	sendMessage(MessagePtr(new protocol::Login(errormsg)));
 	_msgqueue->closeWhenReady();
 }
 
@@ -544,7 +832,7 @@ void Client::handleLoginPassword(const QString &pass)
 		throw ProtocolViolation("BADPASS");
 
 	// Password OK, expect HOST/JOIN
-	_msgqueue->send(MessagePtr(new protocol::Login(QByteArray("OK"))));
+	sendMessage(MessagePtr(new protocol::Login(QByteArray("OK"))));
 	_substate = 1;
 }
 
@@ -584,7 +872,7 @@ void Client::handleHostSession(const QString &msg)
 
 	_server->printDebug(QString("User %1 hosts the session").arg(_id));
 
-	_msgqueue->send(MessagePtr(new protocol::Login(QString("OK %1").arg(_id))));
+	sendMessage(MessagePtr(new protocol::Login(QString("OK %1").arg(_id))));
 
 	// Initial state for host is always WAIT_FOR_SYNC, because the server
 	// is not yet in sync with the user!
@@ -592,7 +880,7 @@ void Client::handleHostSession(const QString &msg)
 
 	// Send login message to self only, since the distributable login
 	// notification will be part of the initial snapshot.
-	_msgqueue->send(MessagePtr(new protocol::UserJoin(_id, _username)));
+	sendMessage(MessagePtr(new protocol::UserJoin(_id, _username)));
 
 	// Send request for initial state
 	_server->startSession();
@@ -629,7 +917,7 @@ void Client::handleJoinSession(const QString &msg)
 	}
 
 	emit loggedin(this);
-	_msgqueue->send(MessagePtr(new protocol::Login(QString("OK %1").arg(_id))));
+	sendMessage(MessagePtr(new protocol::Login(QString("OK %1").arg(_id))));
 
 	_state = _server->mainstream().hasSnapshot() ? IN_SESSION : WAIT_FOR_SYNC;
 	if(_state == IN_SESSION) {
@@ -649,6 +937,191 @@ void Client::handleJoinSession(const QString &msg)
 
 }
 
+void Client::handleResumeSession(const QString &msg)
+{
+	// Expected form is "RESUME <token> <count>"
+	QStringList tokens = msg.split(' ', QString::SkipEmptyParts);
+	if(tokens.length() != 3)
+		throw ProtocolViolation("WHAT?");
+
+	bool ok;
+	const qint64 received = tokens[2].toLongLong(&ok);
+	if(!ok || received<0)
+		throw ProtocolViolation("WHAT?");
+
+	// The server may not have noticed the old connection is gone yet
+	Client *old = _server->getClientByResumeToken(tokens[1]);
+	if(old && old != this)
+		old->detachUser();
+
+	SuspendedUser user;
+	if(!_server->resumeUser(tokens[1], &user)) {
+		// The client may still join normally
+		sendMessage(MessagePtr(new protocol::Login(QByteArray("NORESUME"))));
+		return;
+	}
+
+	const protocol::MessageStream &stream = _server->mainstream();
+	const int pos = user.log.find(stream, received);
+	bool resend = false;
+	if(pos<0) {
+		// Couldn't find the position, but the session can still be resent
+		// from the snapshot point without the user leaving and rejoining.
+		resend = stream.hasSnapshot() && stream.snapshotPoint().cast<protocol::SnapshotPoint>().isComplete();
+		if(!resend) {
+			_server->endSuspension(user);
+			sendMessage(MessagePtr(new protocol::Login(QByteArray("NORESUME"))));
+			return;
+		}
+	}
+
+	_id = user.id;
+	_username = user.username;
+	_isOperator = user.isOperator;
+	_userLock = user.userLock;
+
+	emit loggedin(this);
+	sendMessage(MessagePtr(new protocol::Login(QString("RESUMED %1").arg(_id))));
+
+	_state = IN_SESSION;
+	if(resend) {
+		sendMessage(MessagePtr(new protocol::SnapshotMode(protocol::SnapshotMode::RESET)));
+		_streampointer = stream.snapshotPointIndex();
+		_substreampointer = 0;
+		_server->printDebug(QString("User %1 resumed, resending the session from the snapshot point").arg(_id));
+	} else {
+		_streampointer = pos;
+		_substreampointer = -1;
+		_resumelog = user.log;
+		_resumelog.rewind(pos, received);
+		_server->printDebug(QString("User %1 resumed from stream position %2").arg(_id).arg(pos));
+	}
+
+	sendAvailableCommands();
+}
+
+void Client::handleRelayLogin()
+{
+	if(!_server->isSessionStarted())
+		throw ProtocolViolation("NOSESSION");
+
+	_relay = true;
+	emit loggedin(this);
+	sendMessage(MessagePtr(new protocol::Login(QByteArray("OK 0"))));
+
+	_server->printDebug(QString("Relay connected from %1").arg(peerAddress().toString()));
+
+	_state = _server->mainstream().hasSnapshot() ? IN_SESSION : WAIT_FOR_SYNC;
+	if(_state == IN_SESSION) {
+		_streampointer = _server->mainstream().snapshotPointIndex();
+		sendAvailableCommands();
+	}
+}
+
+/**
+ * @brief Pass a login message through to the upstream server
+ *
+ * Only the messages that need the relay's own attention are handled here.
+ * The login state (_substate) follows the upstream server's replies.
+ */
+void Client::handleRelayedLogin(const QString &msg)
+{
+	if(_substate == 1) {
+		if(msg.startsWith("HOST ")) {
+			// Sessions are hosted on the upstream server
+			throw ProtocolViolation("CLOSED");
+
+		} else if(msg.startsWith("JOIN ") || msg.startsWith("RELAYJOIN ")) {
+			// Our users get the session from us, so they join upstream as write only users
+			_writeonly = msg.startsWith("RELAYJOIN ");
+			_username = msg.mid(msg.indexOf(' ') + 1).trimmed();
+			_upstream->send(MessagePtr(new protocol::Login(QString("RELAYJOIN %1").arg(_username))));
+			return;
+
+		} else if(msg.startsWith("RESUME ")) {
+			sendMessage(MessagePtr(new protocol::Login(QByteArray("NORESUME"))));
+			return;
+
+		} else if(msg == "RELAY") {
+			// A relay chained to this one. It is served from our copy of the session.
+			closeUpstream();
+			handleRelayLogin();
+			return;
+		}
+	}
+
+	// Everything else (such as the password) is for the upstream server
+	_upstream->send(MessagePtr(new protocol::Login(msg)));
+}
+
+void Client::completeRelayedLogin(int userid)
+{
+	_id = userid;
+
+	emit loggedin(this);
+	sendMessage(MessagePtr(new protocol::Login(QString("OK %1").arg(_id))));
+
+	if(_writeonly) {
+		// A user of a chained relay: the session is sent by that relay
+		_state = IN_SESSION;
+	} else {
+		_state = _server->mainstream().hasSnapshot() ? IN_SESSION : WAIT_FOR_SYNC;
+		if(_state == IN_SESSION) {
+			_streampointer = _server->mainstream().snapshotPointIndex();
+			_substreampointer = 0;
+			sendAvailableCommands();
+		}
+	}
+
+	_server->printDebug(QString("User %1 joined through this relay").arg(_id));
+}
+
+void Client::receiveUpstreamMessage(MessagePtr msg)
+{
+	if(_state == LOGIN && msg->type() == protocol::MSG_LOGIN) {
+		const QStringList tokens = msg.cast<protocol::Login>().message().split(' ', QString::SkipEmptyParts);
+
+		if(tokens.value(0) == "DRAWPILE") {
+			// Hello: a password may be needed
+			_substate = tokens.contains("PASS") ? 0 : 1;
+
+		} else if(tokens.value(0) == "OK") {
+			if(tokens.length()==1) {
+				// Password accepted
+				_substate = 1;
+			} else {
+				// Logged in
+				completeRelayedLogin(tokens[1].toInt());
+				return;
+			}
+		}
+	}
+
+	// Replies meant for this user only
+	sendMessage(msg);
+}
+
+/**
+ * The connection is closed once everything queued has been sent. Until then,
+ * it is kept alive by the server, since this client may be deleted first.
+ */
+void Client::closeUpstream()
+{
+	UpstreamLink *link = _upstream;
+	_upstream = 0;
+
+	link->disconnect(this);
+	link->setParent(_server);
+	connect(link, SIGNAL(disconnected(QString)), link, SLOT(deleteLater()));
+	link->close();
+}
+
+void Client::upstreamDisconnected(const QString &error)
+{
+	_server->printDebug(QString("Upstream connection of user %1 closed %2").arg(_id).arg(error));
+	_msgqueue->closeWhenReady();
+}
+
 bool Client::validateUsername(const QString &username)
 {
 	if(username.isEmpty())
@@ -791,29 +1264,6 @@ bool Client::handleOperatorCommand(uint8_t ctxid, const QString &cmd)
 	return false;
 }
 
-void Client::handleUndoPoint()
-{
-	// New undo point. This branches the undo history. Since we store the
-	// commands in a linear sequence, this branching is represented by marking
-	// the unreachable UndoPoints as GONE.
-	int pos = _server->mainstream().end() - 1;
-	int limit = protocol::UNDO_HISTORY_LIMIT;
-	while(_server->mainstream().isValidIndex(pos) && limit>0) {
-		protocol::MessagePtr msg = _server->mainstream().at(pos);
-		if(msg->type() == protocol::MSG_UNDOPOINT) {
-			--limit;
-			if(msg->contextId() == _id) {
-				// optimization: we can stop searching after finding the first GONE point
-				if(msg->undoState() == protocol::GONE)
-					break;
-				else if(msg->undoState() == protocol::UNDONE)
-					msg->setUndoState(protocol::GONE);
-			}
-		}
-		--pos;
-	}
-}
-
 bool Client::handleUndoCommand(protocol::Undo &undo)
 {
 	// First check if user context override is used
@@ -827,26 +1277,7 @@ bool Client::handleUndoCommand(protocol::Undo &undo)
 	// experience, we enforce the limit here.
 
 	if(undo.points()>0) {
-		// Undo mode: iterator towards the beginning of the history,
-		// marking not-undone UndoPoints as undone.
-		int limit = protocol::UNDO_HISTORY_LIMIT;
-		int pos = _server->mainstream().end()-1;
-		int points = 0;
-		while(limit>0 && points<undo.points() && _server->mainstream().isValidIndex(pos)) {
-			MessagePtr msg = _server->mainstream().at(pos);
-
-			if(msg->type() == protocol::MSG_SNAPSHOT)
-				break;
-
-			if(msg->type() == protocol::MSG_UNDOPOINT) {
-				--limit;
-				if(msg->contextId() == undo.contextId() && msg->undoState()==protocol::DONE) {
-					msg->setUndoState(protocol::UNDONE);
-					++points;
-				}
-			}
-			--pos;
-		}
+		const int points = _server->undoActions(undo.contextId(), undo.points());
 
 		// Did we undo anything?
 		if(points==0)
@@ -856,46 +1287,7 @@ bool Client::handleUndoCommand(protocol::Undo &undo)
 		undo.setPoints(points);
 		return true;
 	} else if(undo.points()<0) {
-		// Redo mode: find the start of the latest undo sequence, then mark
-		// (points) UndoPoints as redone.
-		int redostart = _server->mainstream().end();
-		int limit = protocol::UNDO_HISTORY_LIMIT;
-		int pos = _server->mainstream().end();
-		while(_server->mainstream().isValidIndex(--pos) && limit>0) {
-			protocol::MessagePtr msg = _server->mainstream().at(pos);
-			if(msg->type() == protocol::MSG_UNDOPOINT) {
-				--limit;
-				if(msg->contextId() == undo.contextId()) {
-					if(msg->undoState() != protocol::DONE)
-						redostart = pos;
-					else
-						break;
-				}
-			}
-		}
-
-		// There may be nothing to redo
-		if(redostart == _server->mainstream().end())
-			return false;
-
-		pos = redostart;
-
-		// Mark undone actions as done again
-		int actions = -undo.points() + 1;
-		int points = 0;
-		while(pos < _server->mainstream().end()) {
-			protocol::MessagePtr msg = _server->mainstream().at(pos);
-			if(msg->contextId() == undo.contextId() && msg->type() == protocol::MSG_UNDOPOINT) {
-				if(msg->undoState() == protocol::UNDONE) {
-					if(--actions==0)
-						break;
-
-					msg->setUndoState(protocol::DONE);
-					++points;
-				}
-			}
-			++pos;
-		}
+		const int points = _server->redoActions(undo.contextId(), -undo.points());
 
 		// Did we redo anything
 		if(points==0)
@@ -924,7 +1316,7 @@ void Client::sendOpWhoList()
 		msgs << QString("#%1: %2 [%3]").arg(c->id()).arg(c->username(), flags);
 	}
 	foreach(const QString &m, msgs)
-		_msgqueue->send(MessagePtr(new protocol::Chat(0, m)));
+		sendMessage(MessagePtr(new protocol::Chat(0, m)));
 }
 
 void Client::sendOpServerStatus()
@@ -935,8 +1327,13 @@ void Client::sendOpServerStatus()
 	msgs << QString("History indices: %1 -- %2").arg(_server->mainstream().offset()).arg(_server->mainstream().end());
 	msgs << QString("Snapshot point exists: %1").arg(_server->mainstream().hasSnapshot() ? "yes" : "no");
 
+	foreach(const protocol::MessagePoolStats &s, protocol::MessagePool::allStats()) {
+		msgs << QString("%1 pool: %2 live, %3 free, %4 of %5 allocations reused")
+			.arg(s.name).arg(s.live).arg(s.pooled).arg(s.reused).arg(s.allocations);
+	}
+
 	foreach(const QString &m, msgs)
-		_msgqueue->send(MessagePtr(new protocol::Chat(0, m)));
+		sendMessage(MessagePtr(new protocol::Chat(0, m)));
 }
 
 }
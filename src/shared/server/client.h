@@ -24,8 +24,11 @@
 #include <QHostAddress>
 
 #include "../net/message.h"
+#include "metrics.h"
+#include "resume.h"
 
 class QTcpSocket;
+class QThread;
 
 namespace protocol {
 	class MessageQueue;
@@ -37,6 +40,7 @@ namespace protocol {
 namespace server {
 
 class Server;
+class UpstreamLink;
 
 class Client : public QObject
 {
@@ -44,11 +48,23 @@ class Client : public QObject
 	enum State {
 		LOGIN,
 		WAIT_FOR_SYNC,
-		IN_SESSION
+		IN_SESSION,
+		DETACHED // the user has resumed on a new connection
 	};
 
 public:
-	Client(Server *server, QTcpSocket *socket);
+	/**
+	 * @brief Construct a client
+	 *
+	 * If an I/O thread is given, the connection is moved there. Reading,
+	 * writing and (de)serialization of messages then happens in that thread, while
+	 * the session logic stays in the server's thread.
+	 *
+	 * @param server the server this client belongs to
+	 * @param socket client connection
+	 * @param iothread thread to handle the connection in (or null to use the server's thread)
+	 */
+	Client(Server *server, QTcpSocket *socket, QThread *iothread=0);
 	~Client();
 
 	//! Get the user's host address
@@ -80,6 +96,22 @@ public:
 	 */
 	bool isUserLocked() const { return _userLock; }
 
+	/**
+	 * @brief Get the index of the next main stream message to send to this client
+	 * @return stream index or -1 if the client is not yet reading the stream
+	 */
+	int streamPointer() const { return _state == IN_SESSION && !_writeonly ? _streampointer : -1; }
+
+	/**
+	 * @brief Is this a relay mirroring the session?
+	 *
+	 * Relays are read only and have no user ID.
+	 */
+	bool isRelay() const { return _relay; }
+
+	//! Get the current statistics of this client connection
+	ClientMetrics metrics() const;
+
 	/**
 	 * @brief Request the client to generate a snapshot
 	 *
@@ -97,6 +129,14 @@ public:
 	 */
 	bool isHoldLocked() const;
 
+	/**
+	 * @brief Is this client lagging behind?
+	 *
+	 * No new commands are sent to a throttled client until its
+	 * upload queue has drained.
+	 */
+	bool isThrottled() const { return _throttled; }
+
 	/**
 	 * @brief Is this client's input queue being ignored?
 	 *
@@ -132,23 +172,21 @@ public:
 	 */
 	void kick(int kickedBy);
 
-	/**
-	 * @brief Barrier lock this user
-	 *
-	 * If this user is currently drawing, the lock won't take place immediately
-	 *
-	 */
-	void barrierLock();
+	//! Get the token the user can resume the session with
+	const QString &resumeToken() const { return _resumetoken; }
 
 	/**
-	 * @brief Lift barrier lock
+	 * @brief Suspend the user and drop this connection
+	 *
+	 * This is used when the user resumes the session on a new connection
+	 * before the server has noticed the old one is dead.
+	 * @return false if the user cannot be suspended
 	 */
-	void barrierUnlock();
+	bool detachUser();
 
 signals:
 	void disconnected(Client *client);
 	void loggedin(Client *client);
-	void barrierLocked();
 
 public slots:
 	/**
@@ -165,19 +203,29 @@ private slots:
 	void gotBadData(int len, int type);
 	void receiveMessages();
 	void receiveSnapshot();
-	void socketError();
+	void socketError(const QString &error);
 	void socketDisconnect();
+	void countReceivedBytes(int bytes) { _bytesReceived += bytes; }
+	void countSentBytes(int bytes);
+	void receiveUpstreamMessage(protocol::MessagePtr msg);
+	void upstreamDisconnected(const QString &error);
 
 private:
+	void sendMessage(protocol::MessagePtr msg);
 	void handleSessionMessage(protocol::MessagePtr msg);
 	void handleLoginMessage(const protocol::Login &msg);
 	void handleLoginPassword(const QString &pass);
 	void handleHostSession(const QString &msg);
 	void handleJoinSession(const QString &msg);
+	void handleResumeSession(const QString &msg);
+	void handleRelayLogin();
+	void handleRelayedLogin(const QString &msg);
+	void completeRelayedLogin(int userid);
+	void closeUpstream();
 	void handleSnapshotStart(const protocol::SnapshotMode &msg);
+	void handleCapabilities(const protocol::Login &msg);
 
 	bool handleOperatorCommand(uint8_t ctxid, const QString &cmd);
-	void handleUndoPoint();
 	bool handleUndoCommand(protocol::Undo &undo);
 
 	void sendOpWhoList();
@@ -191,8 +239,16 @@ private:
 
 	bool isLayerLocked(int layerid);
 
+	bool isSuspendable() const;
+	void suspendUser();
+
+	bool checkBacklog();
+	bool resync(int backlog);
+	void sendRelayCommands();
+
 	Server *_server;
 	QTcpSocket *_socket;
+	QHostAddress _peerAddress;
 	protocol::MessageQueue *_msgqueue;
 	QList<protocol::MessagePtr> _holdqueue;
 
@@ -202,7 +258,7 @@ private:
 	bool _uploading_snapshot;
 
 	int _streampointer;
-	int _substreampointer;
+	int _substreampointer; // next snapshot chunk to send, or -1 if not downloading a snapshot
 
 	int _id;
 	QString _username;
@@ -213,11 +269,34 @@ private:
 	//! Is this user locked? (by an operator)
 	bool _userLock;
 
-	//! User's barrier (snapshot sync) lock status
-	enum {BARRIER_NOTLOCKED, BARRIER_WAIT, BARRIER_LOCKED } _barrierlock;
 
 	//! The user's current layer (needed for layer locking)
 	int _currentLayer;
+
+	qint64 _bytesReceived;
+	qint64 _bytesSent;
+
+	//! Are new commands being held back because the client is lagging?
+	bool _throttled;
+	int _resyncs;
+
+	//! Token the client can use to resume the session after a dropped connection
+	QString _resumetoken;
+
+	//! What part of the stream has been sent (for resuming)
+	ResumeLog _resumelog;
+
+	//! Is this a relay's mirror connection?
+	bool _relay;
+
+	//! Is this a user who gets the session through a relay? (nothing is sent but direct replies)
+	bool _writeonly;
+
+	//! Snapshot point whose contents are yet to be sent to a relay (or -1)
+	int _relaysnapshot;
+
+	//! Connection to the upstream server (when this server is a relay)
+	UpstreamLink *_upstream;
 };
 
 }
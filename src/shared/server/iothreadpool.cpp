@@ -0,0 +1,59 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2013 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <QThread>
+#include <QMutexLocker>
+
+#include "iothreadpool.h"
+
+namespace server {
+
+IoThreadPool::IoThreadPool(int count)
+	: _next(0)
+{
+	Q_ASSERT(count>0);
+	for(int i=0;i<count;++i) {
+		QThread *thread = new QThread;
+		thread->start();
+		_threads.append(thread);
+	}
+}
+
+IoThreadPool::~IoThreadPool()
+{
+	foreach(QThread *thread, _threads) {
+		thread->quit();
+		thread->wait();
+		delete thread;
+	}
+}
+
+/**
+ * Connections are assigned to the threads in round robin order.
+ */
+QThread *IoThreadPool::nextThread()
+{
+	QMutexLocker lock(&_mutex);
+	QThread *thread = _threads.at(_next);
+	_next = (_next + 1) % _threads.count();
+	return thread;
+}
+
+}
@@ -0,0 +1,70 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2013 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+#ifndef DP_SERVER_IOTHREADPOOL_H
+#define DP_SERVER_IOTHREADPOOL_H
+
+#include <QList>
+#include <QMutex>
+
+class QThread;
+
+namespace server {
+
+/**
+ * @brief A set of threads for handling client connections
+ *
+ * Client connections are spread over the I/O threads, where their messages
+ * are read, deserialized, serialized and written. Session logic and the
+ * command stream remain in the session's thread.
+ *
+ * The same pool can be shared by many sessions.
+ */
+class IoThreadPool {
+public:
+	/**
+	 * @brief Start the I/O threads
+	 * @param count number of threads
+	 */
+	explicit IoThreadPool(int count);
+	~IoThreadPool();
+
+	IoThreadPool(const IoThreadPool&) = delete;
+	IoThreadPool &operator=(const IoThreadPool&) = delete;
+
+	/**
+	 * @brief Get the thread that should handle the next connection
+	 *
+	 * This method is thread safe.
+	 * @return I/O thread
+	 */
+	QThread *nextThread();
+
+	//! Get the number of threads in this pool
+	int count() const { return _threads.count(); }
+
+private:
+	QList<QThread*> _threads;
+	QMutex _mutex;
+	int _next;
+};
+
+}
+
+#endif
@@ -0,0 +1,147 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2013 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <QMutexLocker>
+
+#include "metrics.h"
+#include "../net/message.h"
+
+namespace server {
+
+namespace {
+	// Message handling takes microseconds to milliseconds
+	const double LATENCY_BOUNDS[] = {
+		0.00001, 0.00005, 0.0001, 0.0005, 0.001, 0.005, 0.01, 0.05, 0.1
+	};
+
+	// Snapshot syncs take from milliseconds to minutes
+	const double SYNC_BOUNDS[] = {
+		0.01, 0.05, 0.1, 0.5, 1, 5, 10, 30, 60, 300
+	};
+
+	template<int N> QVector<double> toVector(const double (&values)[N])
+	{
+		QVector<double> v(N);
+		for(int i=0;i<N;++i)
+			v[i] = values[i];
+		return v;
+	}
+}
+
+Histogram::Histogram(const QVector<double> &bounds)
+	: _bounds(bounds), _counts(bounds.size()+1, 0), _sum(0), _count(0)
+{
+}
+
+void Histogram::observe(double value)
+{
+	int i=0;
+	while(i<_bounds.size() && value > _bounds.at(i))
+		++i;
+	++_counts[i];
+	_sum += value;
+	++_count;
+}
+
+ServerMetrics::ServerMetrics()
+{
+	_data.messagesReceived.fill(0, 256);
+	_data.messagesSent.fill(0, 256);
+	_data.historyBytes = 0;
+	_data.historyMessages = 0;
+	_data.messageHandling = Histogram(toVector(LATENCY_BOUNDS));
+	_data.snapshotSync = Histogram(toVector(SYNC_BOUNDS));
+}
+
+void ServerMetrics::messageReceived(int type)
+{
+	QMutexLocker lock(&_mutex);
+	++_data.messagesReceived[type & 0xff];
+}
+
+void ServerMetrics::messagesSent(const uchar *types, int count)
+{
+	QMutexLocker lock(&_mutex);
+	for(int i=0;i<count;++i)
+		++_data.messagesSent[types[i]];
+}
+
+void ServerMetrics::messageHandled(double seconds)
+{
+	QMutexLocker lock(&_mutex);
+	_data.messageHandling.observe(seconds);
+}
+
+void ServerMetrics::snapshotSynced(double seconds)
+{
+	QMutexLocker lock(&_mutex);
+	_data.snapshotSync.observe(seconds);
+}
+
+void ServerMetrics::setSample(uint historyBytes, int historyMessages, const QList<ClientMetrics> &clients)
+{
+	QMutexLocker lock(&_mutex);
+	_data.historyBytes = historyBytes;
+	_data.historyMessages = historyMessages;
+	_data.clients = clients;
+}
+
+MetricsSnapshot ServerMetrics::snapshot() const
+{
+	QMutexLocker lock(&_mutex);
+	return _data;
+}
+
+QString ServerMetrics::messageTypeName(int type)
+{
+	using namespace protocol;
+	switch(type) {
+	case MSG_LOGIN: return "login";
+	case MSG_USER_JOIN: return "user_join";
+	case MSG_USER_ATTR: return "user_attr";
+	case MSG_USER_LEAVE: return "user_leave";
+	case MSG_CHAT: return "chat";
+	case MSG_LAYER_ACL: return "layer_acl";
+	case MSG_SNAPSHOT: return "snapshot";
+	case MSG_SESSION_TITLE: return "session_title";
+	case MSG_SESSION_CONFIG: return "session_config";
+	case MSG_STREAMPOS: return "streampos";
+	case MSG_CANVAS_RESIZE: return "canvas_resize";
+	case MSG_LAYER_CREATE: return "layer_create";
+	case MSG_LAYER_ATTR: return "layer_attr";
+	case MSG_LAYER_RETITLE: return "layer_retitle";
+	case MSG_LAYER_ORDER: return "layer_order";
+	case MSG_LAYER_DELETE: return "layer_delete";
+	case MSG_PUTIMAGE: return "putimage";
+	case MSG_TOOLCHANGE: return "toolchange";
+	case MSG_PEN_MOVE: return "pen_move";
+	case MSG_PEN_UP: return "pen_up";
+	case MSG_ANNOTATION_CREATE: return "annotation_create";
+	case MSG_ANNOTATION_RESHAPE: return "annotation_reshape";
+	case MSG_ANNOTATION_EDIT: return "annotation_edit";
+	case MSG_ANNOTATION_DELETE: return "annotation_delete";
+	case MSG_UNDOPOINT: return "undopoint";
+	case MSG_UNDO: return "undo";
+	case MSG_SERIALIZED_CHUNK: return "snapshot_chunk";
+	default: return QString::number(type);
+	}
+}
+
+}
@@ -0,0 +1,146 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2013 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+#ifndef DP_SERVER_METRICS_H
+#define DP_SERVER_METRICS_H
+
+#include <QVector>
+#include <QList>
+#include <QString>
+#include <QMutex>
+
+#include "../net/messagequeue.h"
+
+namespace server {
+
+/**
+ * @brief A histogram with fixed bucket boundaries
+ */
+class Histogram {
+public:
+	/**
+	 * @brief Construct a histogram
+	 * @param bounds upper bounds of the buckets in ascending order
+	 */
+	explicit Histogram(const QVector<double> &bounds=QVector<double>());
+
+	//! Record an observation
+	void observe(double value);
+
+	//! Get the upper bounds of the buckets
+	const QVector<double> &bounds() const { return _bounds; }
+
+	/**
+	 * @brief Get the number of observations in each bucket
+	 *
+	 * The counts are not cumulative. The last count (one past the bounds)
+	 * is for values larger than the largest bound.
+	 */
+	const QVector<quint64> &counts() const { return _counts; }
+
+	//! Get the sum of all observed values
+	double sum() const { return _sum; }
+
+	//! Get the number of observations
+	quint64 count() const { return _count; }
+
+private:
+	QVector<double> _bounds;
+	QVector<quint64> _counts;
+	double _sum;
+	quint64 _count;
+};
+
+/**
+ * @brief Statistics of a single client connection
+ *
+ * Client statistics are reported per session only, so no personal
+ * information (user name, address) is included.
+ */
+struct ClientMetrics {
+	int id;
+	qint64 bytesReceived;
+	qint64 bytesSent;
+	int uploadQueueBytes;
+	double uploadQueueAge;
+	bool throttled;
+	int resyncs;
+};
+
+/**
+ * @brief A copy of a session's metrics at one point in time
+ */
+struct MetricsSnapshot {
+	QVector<quint64> messagesReceived;
+	QVector<quint64> messagesSent;
+
+	uint historyBytes;
+	int historyMessages;
+
+	QList<ClientMetrics> clients;
+
+	Histogram messageHandling;
+	Histogram snapshotSync;
+};
+
+/**
+ * @brief Runtime metrics of a session
+ *
+ * The session updates these from its own thread. They can be read
+ * from any thread (e.g. by the admin interface), so all access is
+ * serialized.
+ *
+ * Time values are recorded in seconds.
+ */
+class ServerMetrics : public protocol::SentMessageCounter {
+public:
+	ServerMetrics();
+
+	ServerMetrics(const ServerMetrics&) = delete;
+	ServerMetrics &operator=(const ServerMetrics&) = delete;
+
+	//! A message of the given type was received
+	void messageReceived(int type);
+
+	//! Messages of the given types were written to a client's connection
+	void messagesSent(const uchar *types, int count);
+
+	//! A message took this long to process
+	void messageHandled(double seconds);
+
+	//! A snapshot took this long to complete
+	void snapshotSynced(double seconds);
+
+	//! Update the periodically sampled values
+	void setSample(uint historyBytes, int historyMessages, const QList<ClientMetrics> &clients);
+
+	//! Get a copy of the current values
+	MetricsSnapshot snapshot() const;
+
+	//! Get the name of a message type (for labeling)
+	static QString messageTypeName(int type);
+
+private:
+	mutable QMutex _mutex;
+	MetricsSnapshot _data;
+};
+
+}
+
+#endif
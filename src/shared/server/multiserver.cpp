@@ -0,0 +1,273 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2013 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QThread>
+#include <QTimer>
+#include <QMutex>
+#include <QRegularExpression>
+#include <QScopedPointer>
+#include <QTextStream>
+
+#include "multiserver.h"
+#include "server.h"
+
+#include "../net/login.h"
+
+namespace server {
+
+MultiServer::MultiServer(QObject *parent)
+	: QObject(parent),
+	  _server(0),
+	  _errors(0),
+	  _debug(0),
+	  _compression(true),
+	  _historylimit(0),
+	  _iopool(0),
+	  _canvas(false),
+	  _resumegrace(Server::DEFAULT_RESUME_GRACE)
+{
+	// Sockets are handed over to the session threads with queued calls
+	qRegisterMetaType<QTcpSocket*>("QTcpSocket*");
+}
+
+MultiServer::~MultiServer()
+{
+	// Sessions are deleted by their threads as they finish.
+	// This includes stopping sessions that were already replaced.
+	const QList<QThread*> threads = findChildren<QThread*>();
+
+	foreach(QThread *thread, threads) {
+		thread->quit();
+		thread->wait();
+	}
+}
+
+bool MultiServer::start(quint16 port, const QHostAddress& address)
+{
+	Q_ASSERT(_server==0);
+	_server = new QTcpServer(this);
+
+	connect(_server, SIGNAL(newConnection()), this, SLOT(newClient()));
+
+	if(!_server->listen(address, port)) {
+		printError(_server->errorString());
+		delete _server;
+		_server = 0;
+		return false;
+	}
+
+	printDebug(QString("Started listening on port %1 at address %2 (multisession mode)").arg(port).arg(address.toString()));
+	return true;
+}
+
+void MultiServer::stop()
+{
+	if(_server)
+		_server->close();
+
+	foreach(Server *s, _sessions)
+		QMetaObject::invokeMethod(s, "stop", Qt::QueuedConnection);
+}
+
+/**
+ * New connections are held here until the client tells which session
+ * it wants to join, or until the selection timeout expires.
+ */
+void MultiServer::newClient()
+{
+	QTcpSocket *socket = _server->nextPendingConnection();
+
+	printDebug(QString("Accepted new client from address %1").arg(socket->peerAddress().toString()));
+
+	QTimer *timer = new QTimer(socket);
+	timer->setSingleShot(true);
+	connect(timer, SIGNAL(timeout()), this, SLOT(sessionSelectTimeout()));
+	timer->start(SESSION_SELECT_TIMEOUT);
+
+	connect(socket, SIGNAL(readyRead()), this, SLOT(readSessionName()));
+	connect(socket, SIGNAL(disconnected()), socket, SLOT(deleteLater()));
+}
+
+/**
+ * Read the session selection message.
+ * The session selection is the only message the client may send before
+ * the session greets it, so nothing past it is read here.
+ *
+ * A client that sends something else first doesn't know about sessions.
+ * It is routed to the default session right away, and the message is
+ * left for the session to read.
+ */
+void MultiServer::readSessionName()
+{
+	QTcpSocket *socket = qobject_cast<QTcpSocket*>(sender());
+	Q_ASSERT(socket);
+
+	char header[3];
+	if(socket->peek(header, 3) < 3)
+		return;
+
+	const int len = protocol::Message::sniffLength(header);
+	if(socket->bytesAvailable() < len)
+		return;
+
+	QByteArray buffer = socket->peek(len);
+	QScopedPointer<protocol::Message> msg(protocol::Message::deserialize((const uchar*)buffer.constData()));
+
+	QString cmd;
+	if(msg && msg->type() == protocol::MSG_LOGIN)
+		cmd = static_cast<protocol::Login*>(msg.data())->message();
+
+	if(!cmd.startsWith("SESSION ")) {
+		routeClient(socket, QString());
+		return;
+	}
+
+	socket->read(len);
+	const QString name = cmd.mid(8);
+
+	static const QRegularExpression validName(QString("^[a-zA-Z0-9_-]{1,%1}$").arg(MAX_SESSION_NAME));
+	if(!validName.match(name).hasMatch()) {
+		printError(QString("Invalid session selection from %1").arg(socket->peerAddress().toString()));
+
+		protocol::Login reply(QByteArray("BADSESSION"));
+		QByteArray data(reply.length(), 0);
+		reply.serialize(data.data());
+		socket->write(data);
+		socket->disconnectFromHost();
+		return;
+	}
+
+	routeClient(socket, name);
+}
+
+void MultiServer::sessionSelectTimeout()
+{
+	QTcpSocket *socket = qobject_cast<QTcpSocket*>(sender()->parent());
+	Q_ASSERT(socket);
+
+	routeClient(socket, QString());
+}
+
+/**
+ * Hand the connection over to the session's thread.
+ * The session is created if it doesn't exist yet.
+ * An empty name refers to the default session.
+ */
+void MultiServer::routeClient(QTcpSocket *socket, const QString &name)
+{
+	// Detach the socket from the acceptor
+	delete socket->findChild<QTimer*>();
+	socket->disconnect(this);
+	disconnect(socket, SIGNAL(disconnected()), socket, SLOT(deleteLater()));
+
+	// A session that is shutting down will not accept the client.
+	// Its replacement is created right away.
+	Server *session = _sessions.value(name);
+	if(session && session->isStopping()) {
+		_sessions.remove(name);
+		_metrics.remove(name);
+		session = 0;
+	}
+	if(!session)
+		session = createSession(name);
+
+	printDebug(QString("Routing client from %1 to session \"%2\"").arg(socket->peerAddress().toString()).arg(name));
+
+	socket->setProperty("session", name);
+	socket->setParent(0);
+	socket->moveToThread(session->thread());
+	QMetaObject::invokeMethod(session, "addClient", Qt::QueuedConnection, Q_ARG(QTcpSocket*, socket));
+}
+
+Server *MultiServer::createSession(const QString &name)
+{
+	Server *session = new Server;
+	session->setErrorStream(_errors);
+	session->setDebugStream(_debug);
+	session->setCompressionEnabled(_compression);
+	session->setHistoryLimit(_historylimit);
+	session->setIoThreadPool(_iopool);
+	session->setSlowClientLimits(_slowclients);
+	session->setCanvasEnabled(_canvas);
+	session->setResumeGracePeriod(_resumegrace);
+	session->setTransient(true);
+	session->setRouterThread(thread());
+
+	QThread *thread = new QThread(this);
+	session->moveToThread(thread);
+
+	connect(session, SIGNAL(serverStopped()), this, SLOT(sessionStopped()));
+	connect(session, SIGNAL(clientRejected(QTcpSocket*)), this, SLOT(rerouteClient(QTcpSocket*)));
+	connect(session, SIGNAL(serverStopped()), thread, SLOT(quit()));
+	connect(thread, SIGNAL(finished()), session, SLOT(deleteLater()));
+	connect(thread, SIGNAL(finished()), thread, SLOT(deleteLater()));
+
+	_sessions[name] = session;
+	_metrics[name] = session->sharedMetrics();
+	thread->start();
+
+	printDebug(QString("Created session \"%1\". Number of sessions is now %2").arg(name).arg(_sessions.count()));
+	return session;
+}
+
+/**
+ * A session stopped after the client was already routed to it,
+ * but before it could accept the client. Try again with a new session.
+ */
+void MultiServer::rerouteClient(QTcpSocket *socket)
+{
+	const QString name = socket->property("session").toString();
+	printDebug(QString("Session \"%1\" was stopping, rerouting client").arg(name));
+	routeClient(socket, name);
+}
+
+void MultiServer::sessionStopped()
+{
+	Server *session = static_cast<Server*>(sender());
+	const QString name = _sessions.key(session);
+	if(_sessions.value(name) != session)
+		return;
+
+	_sessions.remove(name);
+	_metrics.remove(name);
+	printDebug(QString("Session \"%1\" stopped. Number of sessions is now %2").arg(name).arg(_sessions.count()));
+}
+
+void MultiServer::printError(const QString &message)
+{
+	if(_errors) {
+		QMutexLocker lock(&outputMutex());
+		*_errors << message << '\n';
+		_errors->flush();
+	}
+}
+
+void MultiServer::printDebug(const QString &message)
+{
+	if(_debug) {
+		QMutexLocker lock(&outputMutex());
+		*_debug << message << '\n';
+		_debug->flush();
+	}
+}
+
+}
@@ -0,0 +1,140 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2013 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+#ifndef DP_MULTISERVER_H
+#define DP_MULTISERVER_H
+
+#include <QObject>
+#include <QHostAddress>
+#include <QHash>
+#include <QSharedPointer>
+
+#include "slowclient.h"
+
+class QTcpServer;
+class QTcpSocket;
+class QTextStream;
+
+namespace server {
+
+class Server;
+class IoThreadPool;
+class ServerMetrics;
+
+/**
+ * @brief A server that hosts multiple named sessions
+ *
+ * Each session is a Server of its own, running in its own thread.
+ * The multiserver accepts new connections and routes them to the
+ * right session.
+ *
+ * A client selects the session by sending a "SESSION <name>" login message
+ * right after connecting. Clients that send some other message first are
+ * routed to the default session immediately. Clients that send nothing
+ * (older clients wait for the server to greet them) are routed to the
+ * default session after a short delay.
+ *
+ * Sessions are created when the first client asks for them and removed
+ * when they stop. A session that is not in use costs only an idle thread.
+ */
+class MultiServer : public QObject {
+Q_OBJECT
+public:
+	//! How long to wait for a session selection before routing a client to the default session (ms)
+	static const int SESSION_SELECT_TIMEOUT = 1000;
+
+	//! Maximum length of a session name
+	static const int MAX_SESSION_NAME = 32;
+
+	explicit MultiServer(QObject *parent=0);
+	~MultiServer();
+
+	//! Set the stream where error messages are written
+	void setErrorStream(QTextStream *stream) { _errors = stream; }
+
+	//! Set the stream where debug messages are written
+	void setDebugStream(QTextStream *stream) { _debug = stream; }
+
+	//! Enable or disable compression of client connections in new sessions
+	void setCompressionEnabled(bool enable) { _compression = enable; }
+
+	//! Set the history size limit of new sessions (0 means unlimited)
+	void setHistoryLimit(uint bytes) { _historylimit = bytes; }
+
+	//! Set the I/O thread pool shared by all sessions (not owned)
+	void setIoThreadPool(IoThreadPool *pool) { _iopool = pool; }
+
+	//! Set how clients that fall behind are handled in new sessions
+	void setSlowClientLimits(const SlowClientLimits &limits) { _slowclients = limits; }
+
+	//! Maintain a server side canvas in new sessions (see Server::setCanvasEnabled)
+	void setCanvasEnabled(bool enable) { _canvas = enable; }
+
+	//! Set how long dropped connections can be resumed in new sessions (see Server::setResumeGracePeriod)
+	void setResumeGracePeriod(int seconds) { _resumegrace = seconds; }
+
+	//! Start listening for connections
+	bool start(quint16 port, const QHostAddress& address = QHostAddress::Any);
+
+	//! Get the number of sessions currently hosted
+	int sessionCount() const { return _sessions.count(); }
+
+	/**
+	 * @brief Get the metrics of all current sessions
+	 *
+	 * The default session is listed under an empty name.
+	 * @return session name -> metrics
+	 */
+	QHash<QString, QSharedPointer<ServerMetrics> > sessionMetrics() const { return _metrics; }
+
+public slots:
+	//! Stop all sessions and stop listening for new connections
+	void stop();
+
+private slots:
+	void newClient();
+	void readSessionName();
+	void sessionSelectTimeout();
+	void rerouteClient(QTcpSocket *socket);
+	void sessionStopped();
+
+private:
+	void routeClient(QTcpSocket *socket, const QString &session);
+	Server *createSession(const QString &name);
+	void printError(const QString &message);
+	void printDebug(const QString &message);
+
+	QTcpServer *_server;
+	QHash<QString, Server*> _sessions;
+	QHash<QString, QSharedPointer<ServerMetrics> > _metrics;
+
+	QTextStream *_errors;
+	QTextStream *_debug;
+
+	bool _compression;
+	uint _historylimit;
+	IoThreadPool *_iopool;
+	SlowClientLimits _slowclients;
+	bool _canvas;
+	int _resumegrace;
+};
+
+}
+
+#endif
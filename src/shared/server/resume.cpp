@@ -0,0 +1,58 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2013 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include "resume.h"
+#include "../net/messagestream.h"
+
+namespace server {
+
+/**
+ * Since the log knows how many commands have been sent in total and the
+ * index of the next message to send, the position is found by walking
+ * backwards over the messages the client did not receive. These are the
+ * messages that were in transit when the connection dropped, so there
+ * are usually only few of them.
+ *
+ * The client doesn't count meta messages, so the ones following the last
+ * received command are resent too. Some of them may be duplicates.
+ */
+int ResumeLog::find(const protocol::MessageStream &stream, qint64 received) const
+{
+	if(!_valid || _index<0 || received < _streamstart || received > _count)
+		return -1;
+
+	int i = _index;
+	qint64 count = _count;
+	while(i > _startindex) {
+		// The messages may have been cleaned up already
+		if(!stream.isValidIndex(i-1))
+			return -1;
+
+		if(stream.at(i-1)->isCommand()) {
+			if(count == received)
+				break;
+			--count;
+		}
+		--i;
+	}
+	return count == received ? i : -1;
+}
+
+}
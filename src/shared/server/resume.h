@@ -0,0 +1,117 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2013 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+#ifndef DP_SERVER_RESUME_H
+#define DP_SERVER_RESUME_H
+
+#include <QString>
+
+#include "../net/message.h"
+
+namespace protocol {
+	class MessageStream;
+}
+
+namespace server {
+
+/**
+ * @brief Keeps track of what part of the main stream a client has been sent
+ *
+ * The client counts the command stream messages it receives. When resuming
+ * a dropped connection, the count is mapped back to the index of the first
+ * stream message the client did not receive. Only messages sent after the
+ * client finished its last snapshot download can be resumed from.
+ */
+class ResumeLog {
+public:
+	ResumeLog() : _count(0), _index(-1), _startindex(-1), _streamstart(0), _valid(true) { }
+
+	/**
+	 * @brief Snapshot commands were sent
+	 * @param commands number of commands sent
+	 */
+	void addSubstream(int commands) { _count += commands; _index = -1; }
+
+	/**
+	 * @brief Main stream messages will be sent starting from this index
+	 *
+	 * This does nothing if the log is already following the main stream.
+	 * @param index stream index
+	 */
+	void startStream(int index) { if(_index<0) { _index = _startindex = index; _streamstart = _count; } }
+
+	/**
+	 * @brief The next main stream message was sent (or skipped)
+	 * @param msg the message
+	 */
+	void advance(const protocol::MessagePtr &msg) { if(msg->isCommand()) ++_count; ++_index; }
+
+	/**
+	 * @brief Move the log back to a position returned by find()
+	 * @param index stream index
+	 * @param received number of command messages the client received
+	 */
+	void rewind(int index, qint64 received) { _index = index; _count = received; }
+
+	//! The client was told to reset its session
+	void reset() { _count = 0; _index = -1; _startindex = -1; _streamstart = 0; }
+
+	//! Sent messages were altered, so the client's count can no longer be trusted
+	void invalidate() { _valid = false; }
+
+	//! Can this log still be used to resume?
+	bool isValid() const { return _valid; }
+
+	//! Get the index of the next main stream message to send (-1 if not following the stream)
+	int nextIndex() const { return _index; }
+
+	/**
+	 * @brief Find the position the client should resume from
+	 *
+	 * @param stream the main stream
+	 * @param received number of command messages the client received
+	 * @return index of the first stream message to resend or -1 if not possible
+	 */
+	int find(const protocol::MessageStream &stream, qint64 received) const;
+
+private:
+	qint64 _count;
+	int _index;
+	int _startindex;
+	qint64 _streamstart;
+	bool _valid;
+};
+
+/**
+ * @brief A user whose connection was dropped, but who may still resume
+ */
+struct SuspendedUser {
+	int id;
+	QString username;
+	bool isOperator;
+	bool userLock;
+	ResumeLog log;
+
+	//! Time (on the server's clock) after which the session can no longer be resumed
+	qint64 deadline;
+};
+
+}
+
+#endif
@@ -20,28 +20,64 @@
 
 #include <QTcpServer>
 #include <QTcpSocket>
+#include <QMutex>
+#include <QTimer>
 
 #include "server.h"
 #include "client.h"
+#include "iothreadpool.h"
+#include "metrics.h"
+#include "upstream.h"
+
+#ifdef DP_SERVER_CANVAS
+#include "servercanvas.h"
+#endif
 
 #include "../net/snapshot.h"
+#include "../net/login.h"
+#include "../net/meta.h"
+#include "../net/pen.h"
+#include "../net/undo.h"
 
 namespace server {
 
+QMutex &outputMutex()
+{
+	static QMutex mutex;
+	return mutex;
+}
+
 Server::Server(QObject *parent)
 	: QObject(parent),
 	  _server(0),
 	  _errors(0),
 	  _debug(0),
 	  _hasSession(false),
-	  _stopping(false)
-
+	  _stopping(false),
+	  _transient(false),
+	  _routerthread(0),
+	  _capabilities(protocol::SUPPORTED_CAPABILITIES),
+	  _historylimit(0),
+	  _iopool(0),
+	  _resumegrace(DEFAULT_RESUME_GRACE),
+	  _metrics(new ServerMetrics),
+	  _snapshotRetry(false),
+	  _canvas(0),
+	  _mirror(0)
 {
+	_metricsTimer = new QTimer(this);
+	_metricsTimer->setInterval(METRICS_INTERVAL);
+	connect(_metricsTimer, SIGNAL(timeout()), this, SLOT(sampleMetrics()));
+
+	_clock.start();
 }
 
 Server::~Server()
 {
 	delete _server;
+#ifdef DP_SERVER_CANVAS
+	delete _canvas;
+#endif
 }
 
 /**
@@ -52,7 +88,7 @@ Server::~Server()
  */
 bool Server::start(quint16 port, bool anyport, const QHostAddress& address) {
 	Q_ASSERT(_server==0);
-	_stopping = false;
+	_stopping.store(false);
 	_server = new QTcpServer(this);
 
 	connect(_server, SIGNAL(newConnection()), this, SLOT(newClient()));
@@ -70,9 +106,113 @@ bool Server::start(quint16 port, bool anyport, const QHostAddress& address) {
 	}
 
 	printDebug(QString("Started listening on port %1 at address %2").arg(port).arg(address.toString()));
+
+	if(isRelay()) {
+		_mirror = new UpstreamLink(UpstreamLink::MIRROR, _upstreamurl, this);
+		connect(_mirror, SIGNAL(loggedIn()), this, SLOT(mirrorLoggedIn()));
+		connect(_mirror, SIGNAL(messageReceived(protocol::MessagePtr)), this, SLOT(mirrorMessage(protocol::MessagePtr)));
+		connect(_mirror, SIGNAL(snapshotReceived(protocol::MessagePtr)), this, SLOT(mirrorSnapshot(protocol::MessagePtr)));
+		connect(_mirror, SIGNAL(disconnected(QString)), this, SLOT(mirrorDisconnected(QString)));
+	}
+
 	return true;
 }
 
+void Server::setCompressionEnabled(bool enable)
+{
+	if(enable)
+		_capabilities |= protocol::CAP_DEFLATE;
+	else
+		_capabilities &= ~protocol::CAP_DEFLATE;
+}
+
+void Server::setResumeGracePeriod(int seconds)
+{
+	_resumegrace = seconds;
+	if(seconds>0)
+		_capabilities |= protocol::CAP_RESUME;
+	else
+		_capabilities &= ~protocol::CAP_RESUME;
+}
+
+void Server::setUpstream(const QUrl &url)
+{
+	Q_ASSERT(_server==0);
+	_upstreamurl = url;
+
+	// Users of a relay log in upstream and can't resume there
+	setResumeGracePeriod(0);
+}
+
+void Server::mirrorLoggedIn()
+{
+	printDebug(QString("Relaying session from %1").arg(_upstreamurl.toString(QUrl::RemovePassword)));
+	startSession();
+}
+
+void Server::mirrorMessage(protocol::MessagePtr msg)
+{
+	if(msg->type() == protocol::MSG_SNAPSHOT) {
+		if(msg.cast<protocol::SnapshotMode>().mode() != protocol::SnapshotMode::POINT) {
+			printError(QString("Got unexpected snapshot mode %1 from upstream").arg(msg.cast<protocol::SnapshotMode>().mode()));
+			return;
+		}
+
+		// The contents of the snapshot point come in the snapshot stream
+		_snapshotTimer.start();
+		_mainstream.addSnapshotPoint();
+		emit snapshotCreated();
+
+		// Users who logged in before the first snapshot point can now start downloading it
+		foreach(Client *c, _clients)
+			c->snapshotNowAvailable();
+
+		emit newCommandsAvailable();
+		return;
+	}
+
+	addToCommandStream(msg);
+}
+
+void Server::mirrorSnapshot(protocol::MessagePtr msg)
+{
+	if(addToSnapshotStream(msg)) {
+		printDebug("Got a snapshot point from upstream");
+		cleanupCommandStream();
+	}
+}
+
+void Server::mirrorDisconnected(const QString &error)
+{
+	printError(QString("Lost connection to upstream server: %1").arg(error));
+	if(!_stopping.load())
+		stop();
+}
+
+void Server::setCanvasEnabled(bool enable)
+{
+#ifdef DP_SERVER_CANVAS
+	if(enable && !_canvas) {
+		_canvas = new ServerCanvas;
+		updateCanvas();
+	} else if(!enable) {
+		delete _canvas;
+		_canvas = 0;
+	}
+#else
+	if(enable)
+		printError("Server side canvas is not supported in this build.");
+#endif
+}
+
+void Server::updateCanvas()
+{
+#ifdef DP_SERVER_CANVAS
+	if(_canvas)
+		_canvas->update(_mainstream);
+#endif
+}
+
 int Server::port() const
 {
 	Q_ASSERT(_server);
@@ -84,17 +224,34 @@ int Server::port() const
  */
 void Server::newClient()
 {
-	QTcpSocket *socket = _server->nextPendingConnection();
+	addClient(_server->nextPendingConnection());
+}
+
+void Server::addClient(QTcpSocket *socket)
+{
+	if(_stopping.load()) {
+		if(_routerthread) {
+			// Let the router find another home for the client
+			socket->moveToThread(_routerthread);
+			emit clientRejected(socket);
+		} else {
+			socket->abort();
+			socket->deleteLater();
+		}
+		return;
+	}
 
 	printDebug(QString("Accepted new client from adderss %1").arg(socket->peerAddress().toString()));
 	printDebug(QString("Number of connected clients is now %1").arg(_clients.size() + 1));
 
-	Client *client = new Client(this, socket);
+	Client *client = new Client(this, socket, _iopool ? _iopool->nextThread() : 0);
 	_clients.append(client);
 
 	connect(client, SIGNAL(disconnected(Client*)), this, SLOT(removeClient(Client*)));
 	connect(client, SIGNAL(loggedin(Client*)), this, SLOT(clientLoggedIn(Client*)));
-	connect(client, SIGNAL(barrierLocked()), this, SLOT(userBarrierLocked()));
+
+	if(!_metricsTimer->isActive())
+		_metricsTimer->start();
 }
 
 void Server::removeClient(Client *client)
@@ -106,6 +263,15 @@ void Server::removeClient(Client *client)
 	bool removed = _clients.removeOne(client);
 	Q_ASSERT(removed);
 
+	// Take a final sample and stop sampling if the server is now idle
+	sampleMetrics();
+	if(_clients.isEmpty())
+		_metricsTimer->stop();
+
+	// On a relay, the upstream server keeps track of the users
+	if(isRelay())
+		return;
+
 	// Make sure there is at least one operator in the server
 	bool hasOp=false, hasUsers=false;
 	foreach(const Client *c, _clients) {
@@ -125,19 +291,71 @@ void Server::removeClient(Client *client)
 			}
 		}
 	}
-	if(!hasUsers) {
-		// The last user left the session.
-		_session.closed = false;
-		addToCommandStream(_session.sessionConf());
+	// Users who may still resume are still part of the session
+	if(!hasUsers && _suspended.isEmpty())
+		lastUserLeft();
+}
 
-		emit lastClientLeft();
+void Server::lastUserLeft()
+{
+	_session.closed = false;
+	addToCommandStream(_session.sessionConf());
 
-		if(!_mainstream.hasSnapshot() && _hasSession) {
-			// No snapshot and no one to provide one? The server is gone...
-			stop();
-		}
+	emit lastClientLeft();
+
+	if(!_mainstream.hasSnapshot() && _hasSession) {
+		// No snapshot and no one to provide one? The server is gone.
+		// (The server side canvas can't help either, since it starts
+		// from a snapshot.)
+		stop();
+
+	} else if(_transient && !_hasSession && _clients.isEmpty()) {
+		// Nobody managed to start a session here
+		stop();
+	}
+}
+
+void Server::suspendUser(const QString &token, const SuspendedUser &user)
+{
+	printDebug(QString("User %1 disconnected, but may resume within %2 seconds").arg(user.id).arg(_resumegrace));
+
+	SuspendedUser u = user;
+	u.deadline = _clock.elapsed() + _resumegrace * 1000;
+	_suspended[token] = u;
+
+	QTimer::singleShot(_resumegrace * 1000 + 100, this, SLOT(expireSuspendedUsers()));
+}
+
+bool Server::resumeUser(const QString &token, SuspendedUser *user)
+{
+	if(!_suspended.contains(token) || _suspended[token].deadline < _clock.elapsed())
+		return false;
+
+	*user = _suspended.take(token);
+	return true;
+}
+
+void Server::endSuspension(const SuspendedUser &user)
+{
+	_session.userids.release(user.id);
+	addToCommandStream(protocol::MessagePtr(new protocol::UserLeave(user.id)));
+}
 
+void Server::expireSuspendedUsers()
+{
+	const qint64 now = _clock.elapsed();
+	QMutableHashIterator<QString, SuspendedUser> i(_suspended);
+	while(i.hasNext()) {
+		i.next();
+		if(i.value().deadline <= now) {
+			printDebug(QString("User %1 did not resume in time").arg(i.value().id));
+			endSuspension(i.value());
+			i.remove();
+		}
 	}
+
+	if(_suspended.isEmpty() && userCount()==0 && !_stopping.load())
+		lastUserLeft();
 }
 
 void Server::clientLoggedIn(Client *client)
@@ -164,12 +382,29 @@ Client *Server::getClientById(int id)
 	return 0;
 }
 
+Client *Server::getClientByResumeToken(const QString &token)
+{
+	if(token.isEmpty())
+		return 0;
+
+	foreach(Client *c, _clients) {
+		if(c->resumeToken() == token) {
+			return c;
+		}
+	}
+	return 0;
+}
+
 /**
  * Disconnect all clients and stop listening.
  */
 void Server::stop() {
-	_stopping = true;
-	_server->close();
+	_stopping.store(true);
+	if(_server)
+		_server->close();
+
+	if(_mirror)
+		_mirror->close();
 
 	foreach(Client *c, _clients)
 		c->kick(0);
@@ -179,15 +414,68 @@ void Server::stop() {
 
 void Server::addToCommandStream(protocol::MessagePtr msg)
 {
-	// TODO history size limit. Can clear up to lowest stream pointer index.
 	_mainstream.append(msg);
+	updateCanvas();
 	emit newCommandsAvailable();
+
+	if(_historylimit>0 && _mainstream.totalLengthInBytes() > _historylimit)
+		historyLimitReached();
+}
+
+int Server::undoActions(int ctxid, int points)
+{
+	const int minpos = _mainstream.hasSnapshot() ? _mainstream.snapshotPointIndex() + 1 : 0;
+	return _mainstream.markUndone(ctxid, points, protocol::UNDO_HISTORY_LIMIT, minpos).count();
+}
+
+int Server::redoActions(int ctxid, int points)
+{
+	return _mainstream.markRedone(ctxid, points, protocol::UNDO_HISTORY_LIMIT).count();
+}
+
+/**
+ * First, anything no longer needed is discarded. If the history is still
+ * too big, a new snapshot is requested. Old history can be discarded once
+ * the new snapshot is complete.
+ *
+ * A new snapshot is not requested if the commands after the current snapshot
+ * point make up less than half of the limit, since the new snapshot
+ * would not be much smaller than the current one.
+ */
+void Server::historyLimitReached()
+{
+	cleanupCommandStream();
+
+	// Relays get new snapshot points from upstream
+	if(isRelay())
+		return;
+
+	if(_mainstream.totalLengthInBytes() <= _historylimit || _mainstream.lengthInBytes() < _historylimit / 2)
+		return;
+
+	if(_session.syncstate != SessionState::NOT_SYNCING)
+		return;
+
+	if(_mainstream.hasSnapshot() && !_mainstream.snapshotPoint().cast<protocol::SnapshotPoint>().isComplete())
+		return;
+
+	printDebug(QString("History size %1 exceeds limit of %2 bytes.").arg(_mainstream.totalLengthInBytes()).arg(_historylimit));
+	startSnapshotSync();
 }
 
 void Server::addSnapshotPoint()
 {
+	_snapshotTimer.start();
 	_mainstream.addSnapshotPoint();
 	emit snapshotCreated();
+
+	// Add user introductions to snapshot point
+	foreach(const Client *c, _clients) {
+		if(c->id()>0) {
+			addToSnapshotStream(protocol::MessagePtr(new protocol::UserJoin(c->id(), c->username())));
+			addToSnapshotStream(protocol::MessagePtr(new protocol::UserAttr(c->id(), c->isUserLocked(), c->isOperator())));
+		}
+	}
 }
 
 bool Server::addToSnapshotStream(protocol::MessagePtr msg)
@@ -196,65 +484,187 @@ bool Server::addToSnapshotStream(protocol::MessagePtr msg)
 		printError("Tried to add a snapshot command, but there is no snapshot point!");
 		return true;
 	}
-	protocol::SnapshotPoint &sp = _mainstream.snapshotPoint().cast<protocol::SnapshotPoint>();
+	const protocol::SnapshotPoint &sp = _mainstream.snapshotPoint().cast<protocol::SnapshotPoint>();
 	if(sp.isComplete()) {
 		printError("Tried to add a snapshot command, but the snapshot point is already complete!");
 		return true;
 	}
 
-	sp.append(msg);
+	bool complete = _mainstream.appendToSnapshot(msg);
+	if(complete) {
+		if(_snapshotTimer.isValid()) {
+			_metrics->snapshotSynced(_snapshotTimer.nsecsElapsed() / 1e9);
+			_snapshotTimer.invalidate();
+		}
+
+		// The first complete snapshot initializes the canvas
+		updateCanvas();
+	}
 
 	emit newCommandsAvailable();
 
-	return sp.isComplete();
+	return complete;
 }
 
 void Server::cleanupCommandStream()
 {
-	int removed = _mainstream.cleanup();
-	printDebug(QString("Cleaned up %1 messages from the command stream.").arg(removed));
+	// Find the slowest reader. Messages it hasn't received yet must be kept.
+	int readpos = -1;
+	foreach(const Client *c, _clients) {
+		int p = c->streamPointer();
+		if(p>=0 && (readpos<0 || p<readpos))
+			readpos = p;
+	}
+
+	// Users who may still resume will need the messages they missed
+	foreach(const SuspendedUser &u, _suspended) {
+		int p = u.log.nextIndex();
+		if(p>=0 && (readpos<0 || p<readpos))
+			readpos = p;
+	}
+
+	int removed = _mainstream.cleanup(readpos);
+#ifdef DP_SERVER_CANVAS
+	if(_canvas)
+		_canvas->discardSavepoints(_mainstream.offset());
+#endif
+	printDebug(QString("Cleaned up %1 messages from the command stream. History size is now %2 bytes.").arg(removed).arg(_mainstream.totalLengthInBytes()));
 }
 
+/**
+ * The snapshot point is placed at the current end of the stream. The snapshot
+ * request is queued after the commands that precede the point, so the chosen
+ * client generates the snapshot of exactly that state. Everyone keeps drawing
+ * in the meantime: commands received after this are added to the stream
+ * after the snapshot point.
+ *
+ * Strokes in progress are ended (with a PenUp) just before the snapshot
+ * point. The snapshot then doesn't need to capture any unfinished strokes,
+ * and the users' next pen moves simply start new strokes.
+ *
+ * Only an operator who has received the whole stream can be asked for the
+ * snapshot: a lagging client would first have to download its backlog,
+ * holding up the sync (and the history cleanup) for everyone.
+ */
 void Server::startSnapshotSync()
 {
-	printDebug("Starting snapshot sync!");
+	if(isRelay()) {
+		printDebug("Relays get their snapshots from upstream.");
+		return;
+	}
 
-	// Barrier lock all clients
-	foreach(Client *c, _clients)
-		c->barrierLock();
+	if(_session.syncstate != SessionState::NOT_SYNCING) {
+		printDebug("Snapshot sync already in progress.");
+		return;
+	}
+
+	if(_mainstream.hasSnapshot() && !_mainstream.snapshotPoint().cast<protocol::SnapshotPoint>().isComplete()) {
+		printDebug("Previous snapshot is not yet complete.");
+		return;
+	}
+
+	Client *source = 0;
+	bool lagging = false;
+	foreach(Client *c, _clients) {
+		if(c->isOperator() && c->streamPointer()>=0) {
+			if(c->isThrottled() || c->streamPointer() < _mainstream.end()) {
+				lagging = true;
+			} else {
+				source = c;
+				break;
+			}
+		}
+	}
+
+#ifdef DP_SERVER_CANVAS
+	const bool useCanvas = _canvas && _canvas->isReady();
+#else
+	const bool useCanvas = false;
+#endif
+
+	if(!source && !useCanvas) {
+		if(lagging) {
+			printDebug("Operators are lagging behind. Postponing snapshot.");
+			if(!_snapshotRetry) {
+				_snapshotRetry = true;
+				QTimer::singleShot(SNAPSHOT_RETRY_INTERVAL, this, SLOT(retrySnapshotSync()));
+			}
+		} else {
+			printDebug("No operator to generate snapshot!");
+		}
+		return;
+	}
+
+	printDebug(QString("Starting snapshot sync at stream position %1").arg(_mainstream.end()));
+
+	// End strokes in progress
+	QHashIterator<int, DrawingContext> ctx(_session.drawingctx);
+	while(ctx.hasNext()) {
+		ctx.next();
+		if(!ctx.value().penup && getClientById(ctx.key())) {
+			protocol::MessagePtr penup(new protocol::PenUp(ctx.key()));
+			_session.drawingContextPenUp(penup.cast<protocol::PenUp>());
+			addToCommandStream(penup);
+		}
+	}
+
+	if(useCanvas) {
+		makeCanvasSnapshot();
+	} else {
+		_session.syncstate = SessionState::SYNC_WAIT_FOR_ACK;
+		source->requestSnapshot(true);
+	}
+}
+
+void Server::retrySnapshotSync()
+{
+	_snapshotRetry = false;
+	if(!isStopping())
+		startSnapshotSync();
+}
+
+/**
+ * Create a complete snapshot point from the server side canvas.
+ * The canvas is always up to date with the main stream, so the
+ * snapshot is of the current end of the stream.
+ */
+void Server::makeCanvasSnapshot()
+{
+#ifdef DP_SERVER_CANVAS
+	Q_ASSERT(_canvas && _canvas->isReady());
+	printDebug("Generating snapshot from the server side canvas");
+
+	const QList<protocol::MessagePtr> snapshot = _canvas->generateSnapshot();
+
+	addSnapshotPoint();
+	foreach(const protocol::MessagePtr &msg, snapshot)
+		addToSnapshotStream(msg);
+	addToSnapshotStream(protocol::MessagePtr(new protocol::SnapshotMode(protocol::SnapshotMode::END)));
+
+	cleanupCommandStream();
+#endif
 }
 
 void Server::snapshotSyncStarted()
 {
 	printDebug("Snapshot sync started!");
-	// Lift barrier lock
-	foreach(Client *c, _clients)
-		c->barrierUnlock();
+	_session.syncstate = SessionState::NOT_SYNCING;
 }
 
-void Server::userBarrierLocked()
+
+void Server::sampleMetrics()
 {
-	// Count locked users
-	int locked=0;
+	QList<ClientMetrics> clients;
 	foreach(const Client *c, _clients)
-		if(c->isHoldLocked() || c->isDropLocked())
-			++locked;
+		clients.append(c->metrics());
 
-	if(locked == _clients.count()) {
-		// All locked, we can now send the snapshot sync request
-		foreach(Client *c, _clients) {
-			if(c->isOperator()) {
-				c->requestSnapshot(true);
-				break;
-			}
-		}
-	}
+	_metrics->setSample(_mainstream.totalLengthInBytes(), _mainstream.end() - _mainstream.offset(), clients);
 }
 
-
 void Server::printError(const QString &message)
 {
 	if(_errors) {
+		QMutexLocker lock(&outputMutex());
 		*_errors << message << '\n';
 		_errors->flush();
 	}
@@ -263,6 +673,7 @@ void Server::printError(const QString &message)
 void Server::printDebug(const QString &message)
 {
 	if(_debug) {
+		QMutexLocker lock(&outputMutex());
 		*_debug << message << '\n';
 		_debug->flush();
 	}
@@ -24,17 +24,38 @@
 #include <QObject>
 #include <QHostAddress>
 #include <QHash>
+#include <QSharedPointer>
+#include <QElapsedTimer>
+#include <QAtomicInt>
+#include <QUrl>
 
 #include "../util/idlist.h"
 #include "../net/messagestream.h"
 
 #include "session.h"
+#include "slowclient.h"
+#include "resume.h"
 
 class QTcpServer;
+class QTcpSocket;
+class QMutex;
+class QTimer;
+class QThread;
 
 namespace server {
 
 class Client;
+class IoThreadPool;
+class ServerMetrics;
+class ServerCanvas;
+class UpstreamLink;
+
+/**
+ * @brief Get the lock for the error and debug output streams
+ *
+ * Output streams may be shared by servers running in different threads.
+ */
+QMutex &outputMutex();
 
 /**
  * The drawpile server.
@@ -53,6 +74,153 @@ public:
 	//! Set the stream where debug messages are written
 	void setDebugStream(QTextStream *stream) { _debug = stream; }
 
+	/**
+	 * @brief Enable or disable compression of client connections
+	 *
+	 * Compression is used only with clients that support it.
+	 * It is enabled by default.
+	 */
+	void setCompressionEnabled(bool enable);
+
+	/**
+	 * @brief Get the optional protocol features this server will use
+	 * @return capability flags (see protocol::Capability)
+	 */
+	int capabilities() const { return _capabilities; }
+
+	/**
+	 * @brief Set the session history size limit
+	 *
+	 * When the history grows past the limit, messages no longer needed
+	 * are removed and, if that is not enough, a new snapshot is
+	 * automatically requested so older history can be discarded.
+	 *
+	 * @param bytes maximum history size in bytes (0 means unlimited)
+	 */
+	void setHistoryLimit(uint bytes) { _historylimit = bytes; }
+
+	//! Get the session history size limit (0 means unlimited)
+	uint historyLimit() const { return _historylimit; }
+
+	/**
+	 * @brief Handle client connections in a pool of I/O threads
+	 *
+	 * By default, all connections are handled in the server's own thread.
+	 * The pool is not owned by the server and must outlive it.
+	 *
+	 * @param pool I/O thread pool (or null to use the server's thread)
+	 */
+	void setIoThreadPool(IoThreadPool *pool) { _iopool = pool; }
+
+	/**
+	 * @brief Set how clients that fall behind are handled
+	 *
+	 * By default, upload queues are not limited.
+	 * @param limits
+	 */
+	void setSlowClientLimits(const SlowClientLimits &limits) { _slowclients = limits; }
+
+	//! Get the slow client policy and limits
+	const SlowClientLimits &slowClientLimits() const { return _slowclients; }
+
+	/**
+	 * @brief Set how long a dropped connection can be resumed
+	 *
+	 * Clients that support it are given a resume token at login. If such
+	 * a client reconnects within the grace period, it is sent only the
+	 * messages it missed. The user is not reported as having left until
+	 * the grace period has passed.
+	 *
+	 * @param seconds grace period (0 disables resuming)
+	 */
+	void setResumeGracePeriod(int seconds);
+
+	//! Get the resume grace period in seconds
+	int resumeGracePeriod() const { return _resumegrace; }
+
+	/**
+	 * @brief Maintain a headless canvas on the server
+	 *
+	 * With a canvas, the server can create new snapshot points by itself
+	 * instead of requesting a snapshot from a client.
+	 *
+	 * This does nothing unless built with the SERVER_CANVAS option.
+	 * It should be set before the session starts.
+	 *
+	 * @param enable
+	 */
+	void setCanvasEnabled(bool enable);
+
+	/**
+	 * @brief Relay a session hosted on another server
+	 *
+	 * A relay doesn't host a session of its own. It mirrors the main stream
+	 * of the upstream server, snapshot points included, and serves its users
+	 * from that copy. Commands from the users are forwarded upstream, where
+	 * they are validated and added to the stream, which brings them back to
+	 * the relay. A relay can be the upstream server of another relay.
+	 *
+	 * This must be set before start().
+	 *
+	 * @param url upstream server address (drawpile://[:password@]host[:port][/session])
+	 */
+	void setUpstream(const QUrl &url);
+
+	//! Is this server a relay?
+	bool isRelay() const { return !_upstreamurl.isEmpty(); }
+
+	//! Get the address of the upstream server (empty if this is not a relay)
+	const QUrl &upstreamUrl() const { return _upstreamurl; }
+
+	/**
+	 * @brief Get the runtime metrics of this server
+	 *
+	 * Per client figures and history size are sampled once per
+	 * METRICS_INTERVAL milliseconds while there are clients connected.
+	 */
+	ServerMetrics *metrics() const { return _metrics.data(); }
+
+	/**
+	 * @brief Get a shared reference to the metrics
+	 *
+	 * The metrics can be safely read from other threads and remain
+	 * valid even after the server has been deleted.
+	 */
+	QSharedPointer<ServerMetrics> sharedMetrics() const { return _metrics; }
+
+	//! Sampling interval of the metrics (ms)
+	static const int METRICS_INTERVAL = 1000;
+
+	//! Default resume grace period (seconds)
+	static const int DEFAULT_RESUME_GRACE = 30;
+
+	//! Interval at which a postponed snapshot request is retried (ms)
+	static const int SNAPSHOT_RETRY_INTERVAL = 1000;
+
+	/**
+	 * @brief Stop the server automatically when it is no longer needed
+	 *
+	 * A transient server stops when the last client leaves, unless there is
+	 * a session that can still be joined.
+	 * This is used for sessions hosted by a MultiServer.
+	 */
+	void setTransient(bool transient) { _transient = transient; }
+
+	/**
+	 * @brief Set the thread of the router that hands clients to this server
+	 *
+	 * A client handed over while the server is stopping is moved back
+	 * to this thread and returned with clientRejected().
+	 */
+	void setRouterThread(QThread *thread) { _routerthread = thread; }
+
+	/**
+	 * @brief Is the server stopping or stopped?
+	 *
+	 * This can be called from any thread.
+	 */
+	bool isStopping() const { return _stopping.load(); }
+
 	//! Start the server.
 	bool start(quint16 port, bool anyport=false, const QHostAddress& address = QHostAddress::Any);
 
@@ -81,6 +249,27 @@ public:
 	 */
 	void addToCommandStream(protocol::MessagePtr msg);
 
+	/**
+	 * @brief Mark a user's latest actions in the main stream as undone
+	 *
+	 * Undo history is limited to the last UNDO_HISTORY_LIMIT undo points
+	 * or the latest snapshot point, whichever comes first.
+	 *
+	 * @param ctxid user ID
+	 * @param points maximum number of undo points to undo
+	 * @return number of undo points actually undone
+	 */
+	int undoActions(int ctxid, int points);
+
+	/**
+	 * @brief Mark a user's undone actions in the main stream as done again
+	 *
+	 * @param ctxid user ID
+	 * @param points maximum number of undo points to redo
+	 * @return number of undo points actually redone
+	 */
+	int redoActions(int ctxid, int points);
+
 	/**
 	 * @brief Add a new snapshot point.
 	 * @pre there are no unfinished snapshot points
@@ -97,11 +286,16 @@ public:
 
 	/**
 	 * @brief Remove all pre-snapshot messages from the command stream
+	 *
+	 * Messages that have not yet been sent to all clients are kept.
 	 */
 	void cleanupCommandStream();
 
 	/**
-	 * @brief Synchronize clients so that a new snapshot point can be generated
+	 * @brief Request a new snapshot point at the current stream position
+	 *
+	 * If all operators are lagging behind, the request is retried
+	 * once one of them has caught up.
 	 */
 	void startSnapshotSync();
 
@@ -135,6 +329,39 @@ public:
 	 */
 	Client *getClientById(int id);
 
+	/**
+	 * @brief Get the connected client with the specified resume token
+	 * @param token resume token
+	 * @return client or 0 if not found
+	 */
+	Client *getClientByResumeToken(const QString &token);
+
+	/**
+	 * @brief Keep a disconnected user in the session for the grace period
+	 * @param token the user's resume token
+	 * @param user
+	 */
+	void suspendUser(const QString &token, const SuspendedUser &user);
+
+	/**
+	 * @brief Take a suspended user out of the suspension list
+	 * @param token the user's resume token
+	 * @param user where to put the user's info
+	 * @return false if there is no such user or the grace period has passed
+	 */
+	bool resumeUser(const QString &token, SuspendedUser *user);
+
+	/**
+	 * @brief The user can no longer resume
+	 *
+	 * The user leaves the session and the ID is released.
+	 * @param user
+	 */
+	void endSuspension(const SuspendedUser &user);
+
+	//! Get the users who may still resume
+	const QHash<QString, SuspendedUser> &suspendedUsers() const { return _suspended; }
+
 	void printError(const QString &message);
 	void printDebug(const QString &message);
 
@@ -142,11 +369,34 @@ public slots:
 	 //! Stop the server. All clients are disconnected.
 	void stop();
 
+	/**
+	 * @brief Add a new client connection
+	 *
+	 * This is called for connections accepted by this server's own listening
+	 * socket as well as for connections routed here by a MultiServer. The
+	 * socket must belong to this server's thread.
+	 * @param socket the client connection
+	 */
+	void addClient(QTcpSocket *socket);
+
+private:
+	void updateCanvas();
+	void makeCanvasSnapshot();
+	void lastUserLeft();
+
 private slots:
 	void newClient();
 	void removeClient(Client *client);
 	void clientLoggedIn(Client *client);
-	void userBarrierLocked();
+	void historyLimitReached();
+	void retrySnapshotSync();
+	void sampleMetrics();
+	void expireSuspendedUsers();
+
+	void mirrorLoggedIn();
+	void mirrorMessage(protocol::MessagePtr msg);
+	void mirrorSnapshot(protocol::MessagePtr msg);
+	void mirrorDisconnected(const QString &error);
 
 signals:
 	//! This signal is emitted when the server becomes empty
@@ -160,6 +410,9 @@ signals:
 
 	void serverStopped();
 
+	//! A client was handed over after the server started stopping
+	void clientRejected(QTcpSocket *socket);
+
 private:
 	QTcpServer *_server;
 	QList<Client*> _clients;
@@ -171,7 +424,27 @@ private:
 
 	bool _hasSession;
 	SessionState _session;
-	bool _stopping;
+	QAtomicInt _stopping;
+	bool _transient;
+	QThread *_routerthread;
+	int _capabilities;
+	uint _historylimit;
+	IoThreadPool *_iopool;
+	SlowClientLimits _slowclients;
+
+	int _resumegrace;
+	QHash<QString, SuspendedUser> _suspended;
+	QElapsedTimer _clock;
+
+	QSharedPointer<ServerMetrics> _metrics;
+	QTimer *_metricsTimer;
+	QElapsedTimer _snapshotTimer;
+	bool _snapshotRetry;
+
+	ServerCanvas *_canvas;
+
+	QUrl _upstreamurl;
+	UpstreamLink *_mirror;
 };
 
 }
@@ -0,0 +1,400 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2013 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <QDebug>
+#include <QDateTime>
+#include <QImage>
+
+#include "servercanvas.h"
+
+#include "../net/messagestream.h"
+#include "../net/snapshot.h"
+#include "../net/layer.h"
+#include "../net/pen.h"
+#include "../net/image.h"
+#include "../net/annotation.h"
+#include "../net/undo.h"
+#include "../net/meta.h"
+
+#include "../../client/core/layerstack.h"
+#include "../../client/core/layer.h"
+#include "../../client/net/utils.h"
+
+namespace server {
+
+namespace {
+	// Keep at most this many savepoints. When there are more, the oldest
+	// ones are dropped, except for the very first, which is still needed
+	// to undo anything after it.
+	const int MAX_SAVEPOINTS = 64;
+}
+
+struct CanvasSavepoint {
+	CanvasSavepoint() : timestamp(0), streampointer(-1), canvas(0) {}
+	CanvasSavepoint(const CanvasSavepoint &) = delete;
+	CanvasSavepoint &operator=(const CanvasSavepoint&) = delete;
+	~CanvasSavepoint() { delete canvas; }
+
+	qint64 timestamp;
+	int streampointer;
+	paintcore::Savepoint *canvas;
+	QHash<int, CanvasContext> contexts;
+	QHash<int, CanvasAnnotation> annotations;
+};
+
+ServerCanvas::ServerCanvas()
+	: _image(new paintcore::LayerStack), _ready(false), _streampointer(-1), _replaying(false)
+{
+}
+
+ServerCanvas::~ServerCanvas()
+{
+	while(!_savepoints.isEmpty())
+		delete _savepoints.takeLast();
+	delete _image;
+}
+
+void ServerCanvas::update(const protocol::MessageStream &stream)
+{
+	if(!_ready) {
+		// Start from the first complete snapshot
+		if(!stream.hasSnapshot())
+			return;
+
+		const protocol::SnapshotPoint &sp = stream.snapshotPoint().cast<protocol::SnapshotPoint>();
+		if(!sp.isComplete())
+			return;
+
+		_streampointer = stream.snapshotPointIndex();
+		foreach(const protocol::MessagePtr &msg, sp.substream())
+			handleCommand(stream, msg, _streampointer);
+
+		makeSavepoint(_streampointer, true);
+		++_streampointer;
+		_ready = true;
+	}
+
+	Q_ASSERT(_streampointer >= stream.offset());
+	while(_streampointer < stream.end()) {
+		const protocol::MessagePtr msg = stream.at(_streampointer);
+		if(msg->type() == protocol::MSG_SNAPSHOT)
+			makeSavepoint(_streampointer, true);
+		else
+			handleCommand(stream, msg, _streampointer);
+		++_streampointer;
+	}
+}
+
+void ServerCanvas::handleCommand(const protocol::MessageStream &stream, const protocol::MessagePtr &msg, int pos)
+{
+	switch(msg->type()) {
+		using namespace protocol;
+		case MSG_CANVAS_RESIZE: handleCanvasResize(msg.cast<CanvasResize>(), pos); break;
+		case MSG_LAYER_CREATE: handleLayerCreate(msg.cast<LayerCreate>()); break;
+		case MSG_LAYER_ATTR: handleLayerAttributes(msg.cast<LayerAttributes>()); break;
+		case MSG_LAYER_RETITLE: handleLayerTitle(msg.cast<LayerRetitle>()); break;
+		case MSG_LAYER_ORDER: handleLayerOrder(msg.cast<LayerOrder>()); break;
+		case MSG_LAYER_DELETE: handleLayerDelete(msg.cast<LayerDelete>()); break;
+		case MSG_TOOLCHANGE: handleToolChange(msg.cast<ToolChange>()); break;
+		case MSG_PEN_MOVE: handlePenMove(msg.cast<PenMove>()); break;
+		case MSG_PEN_UP: handlePenUp(msg.cast<PenUp>()); break;
+		case MSG_PUTIMAGE: handlePutImage(msg.cast<PutImage>()); break;
+		case MSG_UNDOPOINT:
+			if(!_replaying)
+				_undo.addUndoPoint(msg->contextId(), pos);
+			makeSavepoint(pos, false);
+			break;
+		case MSG_UNDO:
+			if(!_replaying)
+				handleUndo(stream, msg.cast<Undo>(), pos);
+			break;
+		case MSG_ANNOTATION_CREATE: {
+			const AnnotationCreate &cmd = msg.cast<AnnotationCreate>();
+			CanvasAnnotation &a = _annotations[cmd.id()];
+			a.id = cmd.id();
+			a.rect = QRect(cmd.x(), cmd.y(), cmd.w(), cmd.h());
+			break; }
+		case MSG_ANNOTATION_RESHAPE: {
+			const AnnotationReshape &cmd = msg.cast<AnnotationReshape>();
+			if(_annotations.contains(cmd.id()))
+				_annotations[cmd.id()].rect = QRect(cmd.x(), cmd.y(), cmd.w(), cmd.h());
+			break; }
+		case MSG_ANNOTATION_EDIT: {
+			const AnnotationEdit &cmd = msg.cast<AnnotationEdit>();
+			if(_annotations.contains(cmd.id())) {
+				_annotations[cmd.id()].bg = cmd.bg();
+				_annotations[cmd.id()].text = cmd.text();
+			}
+			break; }
+		case MSG_ANNOTATION_DELETE:
+			_annotations.remove(msg.cast<AnnotationDelete>().id());
+			break;
+		case MSG_SESSION_TITLE:
+			_title = msg.cast<SessionTitle>().title();
+			break;
+		case MSG_USER_JOIN: _users.insert(msg->contextId()); break;
+		case MSG_USER_LEAVE: _users.remove(msg->contextId()); break;
+		default: /* other meta messages don't affect the canvas */ break;
+	}
+}
+
+void ServerCanvas::handleCanvasResize(const protocol::CanvasResize &cmd, int pos)
+{
+	_image->resize(cmd.top(), cmd.right(), cmd.bottom(), cmd.left());
+	makeSavepoint(pos, false);
+}
+
+void ServerCanvas::handleLayerCreate(const protocol::LayerCreate &cmd)
+{
+	_image->addLayer(cmd.id(), cmd.title(), QColor::fromRgba(cmd.fill()));
+}
+
+void ServerCanvas::handleLayerAttributes(const protocol::LayerAttributes &cmd)
+{
+	paintcore::Layer *layer = _image->getLayer(cmd.id());
+	if(layer) {
+		layer->setOpacity(cmd.opacity());
+		layer->setBlend(cmd.blend());
+	}
+}
+
+void ServerCanvas::handleLayerTitle(const protocol::LayerRetitle &cmd)
+{
+	paintcore::Layer *layer = _image->getLayer(cmd.id());
+	if(layer)
+		layer->setTitle(cmd.title());
+}
+
+void ServerCanvas::handleLayerOrder(const protocol::LayerOrder &cmd)
+{
+	_image->reorderLayers(cmd.order());
+}
+
+void ServerCanvas::handleLayerDelete(const protocol::LayerDelete &cmd)
+{
+	if(cmd.merge())
+		_image->mergeLayerDown(cmd.id());
+	_image->deleteLayer(cmd.id());
+}
+
+void ServerCanvas::handleToolChange(const protocol::ToolChange &cmd)
+{
+	CanvasContext &ctx = _contexts[cmd.contextId()];
+	paintcore::Brush &b = ctx.brush;
+	ctx.layer = cmd.layer();
+	b.setBlendingMode(cmd.blend());
+	b.setSubpixel(cmd.mode() & protocol::TOOL_MODE_SUBPIXEL);
+	b.setIncremental(cmd.mode() & protocol::TOOL_MODE_INCREMENTAL);
+	b.setSpacing(cmd.spacing());
+	b.setRadius(cmd.size_h());
+	b.setRadius2(cmd.size_l());
+	b.setHardness(cmd.hard_h() / 255.0);
+	b.setHardness2(cmd.hard_l() / 255.0);
+	b.setOpacity(cmd.opacity_h() / 255.0);
+	b.setOpacity2(cmd.opacity_l() / 255.0);
+	b.setColor(cmd.color_h());
+	b.setColor2(cmd.color_l());
+}
+
+void ServerCanvas::handlePenMove(const protocol::PenMove &cmd)
+{
+	CanvasContext &ctx = _contexts[cmd.contextId()];
+	paintcore::Layer *layer = _image->getLayer(ctx.layer);
+	if(!layer)
+		return;
+
+	const protocol::PenPointVector &points = cmd.points();
+	for(int i=0;i<points.size();++i) {
+		const protocol::PenPoint &pp = points.at(i);
+		const paintcore::Point p(pp.x / 4.0, pp.y / 4.0, pp.p/255.0);
+
+		if(ctx.pendown) {
+			layer->drawLine(cmd.contextId(), ctx.brush, ctx.lastpoint, p, ctx.distance);
+		} else {
+			ctx.pendown = true;
+			ctx.distance = 0;
+			layer->dab(cmd.contextId(), ctx.brush, p);
+		}
+		ctx.lastpoint = p;
+	}
+}
+
+void ServerCanvas::handlePenUp(const protocol::PenUp &cmd)
+{
+	CanvasContext &ctx = _contexts[cmd.contextId()];
+	paintcore::Layer *layer = _image->getLayer(ctx.layer);
+	if(layer)
+		layer->mergeSublayer(cmd.contextId());
+	ctx.pendown = false;
+}
+
+void ServerCanvas::handlePutImage(const protocol::PutImage &cmd)
+{
+	paintcore::Layer *layer = _image->getLayer(cmd.layer());
+	if(!layer)
+		return;
+
+	QByteArray data = qUncompress(cmd.image());
+	QImage img(reinterpret_cast<const uchar*>(data.constData()), cmd.width(), cmd.height(), QImage::Format_ARGB32);
+	layer->putImage(cmd.x(), cmd.y(), img, (cmd.flags() & protocol::PutImage::MODE_BLEND));
+}
+
+/**
+ * The server has already enforced the undo history limit and set the
+ * number of points actually undone or redone, so the command can be
+ * applied to the canvas's own undo index as is.
+ */
+void ServerCanvas::handleUndo(const protocol::MessageStream &stream, const protocol::Undo &cmd, int pos)
+{
+	if(cmd.points()==0)
+		return;
+
+	const int ctxid = cmd.contextId();
+
+	QList<int> marked;
+	if(cmd.points()>0)
+		marked = _undo.markUndone(ctxid, cmd.points());
+	else
+		marked = _undo.markRedone(ctxid, -cmd.points());
+
+	if(marked.isEmpty()) {
+		qWarning() << "Server canvas: nothing to undo for user" << ctxid;
+		return;
+	}
+
+	const int target = marked.first();
+
+	// Find nearest savepoint
+	const CanvasSavepoint *savepoint = 0;
+	for(int i=_savepoints.count()-1;i>=0;--i) {
+		if(_savepoints.at(i)->streampointer <= target) {
+			savepoint = _savepoints.at(i);
+			break;
+		}
+	}
+
+	if(!savepoint) {
+		qWarning() << "Server canvas: cannot undo action by user" << ctxid << ": no savepoint found!";
+		return;
+	}
+
+	revertSavepoint(savepoint);
+
+	// Replay commands, excluding undone ones
+	protocol::ReplayUndoState undostate(_undo, savepoint->streampointer);
+
+	_replaying = true;
+	for(int i=savepoint->streampointer+1;i<pos;++i) {
+		const protocol::MessagePtr msg = stream.at(i);
+		if(msg->type() == protocol::MSG_SNAPSHOT)
+			makeSavepoint(i, true);
+		else if(undostate.next(msg, i) == protocol::DONE)
+			handleCommand(stream, msg, i);
+	}
+	_replaying = false;
+}
+
+/**
+ * Savepoints are made at snapshot points and, like on the client,
+ * at undo points when enough time or commands have passed since the
+ * previous one and no stroke is in progress.
+ */
+void ServerCanvas::makeSavepoint(int pos, bool force)
+{
+	if(!force) {
+		if(!_savepoints.isEmpty()) {
+			const CanvasSavepoint *sp = _savepoints.last();
+			const qint64 now = QDateTime::currentMSecsSinceEpoch();
+			if(now - sp->timestamp < 1000 && pos - sp->streampointer < 100)
+				return;
+		}
+
+		foreach(const CanvasContext &ctx, _contexts)
+			if(ctx.pendown)
+				return;
+	}
+
+	CanvasSavepoint *savepoint = new CanvasSavepoint;
+	savepoint->timestamp = QDateTime::currentMSecsSinceEpoch();
+	savepoint->streampointer = pos;
+	savepoint->canvas = _image->makeSavepoint();
+	savepoint->contexts = _contexts;
+	savepoint->annotations = _annotations;
+	_savepoints.append(savepoint);
+
+	while(_savepoints.count() > MAX_SAVEPOINTS)
+		delete _savepoints.takeAt(1);
+}
+
+void ServerCanvas::revertSavepoint(const CanvasSavepoint *savepoint)
+{
+	_image->restoreSavepoint(savepoint->canvas);
+	_contexts = savepoint->contexts;
+	_annotations = savepoint->annotations;
+
+	// Reverting a savepoint destroys all newer savepoints
+	while(_savepoints.last() != savepoint)
+		delete _savepoints.takeLast();
+}
+
+void ServerCanvas::discardSavepoints(int index)
+{
+	while(_savepoints.count() > 1 && _savepoints.at(1)->streampointer <= index)
+		delete _savepoints.takeFirst();
+
+	// Nothing before the oldest savepoint can be undone anymore
+	if(!_savepoints.isEmpty())
+		_undo.discardBefore(_savepoints.first()->streampointer);
+}
+
+QList<protocol::MessagePtr> ServerCanvas::generateSnapshot() const
+{
+	Q_ASSERT(_ready);
+	QList<protocol::MessagePtr> msgs;
+
+	msgs.append(protocol::MessagePtr(new protocol::CanvasResize(0, 0, _image->width(), _image->height(), 0)));
+
+	if(!_title.isEmpty())
+		msgs.append(protocol::MessagePtr(new protocol::SessionTitle(0, _title)));
+
+	for(int i=0;i<_image->layers();++i) {
+		const paintcore::Layer *layer = _image->getLayerByIndex(i);
+		msgs.append(protocol::MessagePtr(new protocol::LayerCreate(0, layer->id(), 0, layer->title())));
+		msgs.append(protocol::MessagePtr(new protocol::LayerAttributes(0, layer->id(), layer->opacity(), layer->blendmode())));
+		msgs.append(net::putQImage(0, layer->id(), 0, 0, layer->toImage(), false));
+	}
+
+	foreach(const CanvasAnnotation &a, _annotations) {
+		msgs.append(protocol::MessagePtr(new protocol::AnnotationCreate(0, a.id, a.rect.x(), a.rect.y(), a.rect.width(), a.rect.height())));
+		msgs.append(protocol::MessagePtr(new protocol::AnnotationEdit(0, a.id, a.bg, a.text)));
+	}
+
+	// Only the tool states of users still in the session are needed
+	QHashIterator<int, CanvasContext> ctx(_contexts);
+	while(ctx.hasNext()) {
+		ctx.next();
+		if(_users.contains(ctx.key()))
+			msgs.append(net::brushToToolChange(ctx.key(), ctx.value().layer, ctx.value().brush));
+	}
+
+	return msgs;
+}
+
+}
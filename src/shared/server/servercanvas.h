@@ -0,0 +1,177 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2013 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+#ifndef DP_SERVER_SERVERCANVAS_H
+#define DP_SERVER_SERVERCANVAS_H
+
+#include <QHash>
+#include <QList>
+#include <QSet>
+#include <QRect>
+#include <QString>
+
+#include "../net/message.h"
+#include "../net/undoindex.h"
+#include "../../client/core/brush.h"
+#include "../../client/core/point.h"
+
+namespace protocol {
+	class MessageStream;
+	class CanvasResize;
+	class LayerCreate;
+	class LayerAttributes;
+	class LayerRetitle;
+	class LayerOrder;
+	class LayerDelete;
+	class ToolChange;
+	class PenMove;
+	class PenUp;
+	class PutImage;
+	class Undo;
+}
+
+namespace paintcore {
+	class LayerStack;
+}
+
+namespace server {
+
+/**
+ * @brief Drawing state of a single user on the server side canvas
+ */
+struct CanvasContext {
+	CanvasContext() : layer(0), pendown(false), distance(0) {}
+
+	int layer;
+	paintcore::Brush brush;
+	paintcore::Point lastpoint;
+	bool pendown;
+	qreal distance;
+};
+
+struct CanvasAnnotation {
+	CanvasAnnotation() : id(0), bg(0) {}
+
+	int id;
+	QRect rect;
+	quint32 bg;
+	QString text;
+};
+
+struct CanvasSavepoint;
+
+/**
+ * @brief A headless canvas the server can generate snapshots from
+ *
+ * The server side canvas replays the session's command stream using the
+ * same paint engine the clients use. This lets the server create new
+ * snapshot points by itself, without requesting one from a client.
+ *
+ * The canvas reads the commands straight from the server's main stream.
+ * It keeps track of its own read position, so update() can be called
+ * whenever new commands have been added.
+ *
+ * Undo is implemented the same way as in the client: the canvas is reverted
+ * to a savepoint and the commands after it are replayed. The canvas keeps
+ * its own index of the undo points it has executed, rather than relying on
+ * the undo states of the main stream, since the server marks those as soon
+ * as an Undo command is received, possibly before the canvas has caught up.
+ * The state of other commands is derived from the nearest preceding
+ * UndoPoint of the same user.
+ *
+ * This class is available only when the server is built with SERVER_CANVAS.
+ */
+class ServerCanvas {
+public:
+	ServerCanvas();
+	~ServerCanvas();
+
+	ServerCanvas(const ServerCanvas&) = delete;
+	ServerCanvas &operator=(const ServerCanvas&) = delete;
+
+	/**
+	 * @brief Has the canvas been initialized?
+	 *
+	 * The canvas is initialized from the first complete snapshot
+	 * in the stream.
+	 */
+	bool isReady() const { return _ready; }
+
+	/**
+	 * @brief Execute all new commands in the stream
+	 * @param stream the server's main stream
+	 */
+	void update(const protocol::MessageStream &stream);
+
+	/**
+	 * @brief Generate the commands to recreate the current canvas
+	 *
+	 * Strokes in progress and the tool states of users who have
+	 * left the session are not included.
+	 *
+	 * @pre isReady() == true
+	 * @return list of snapshot commands
+	 */
+	QList<protocol::MessagePtr> generateSnapshot() const;
+
+	/**
+	 * @brief Discard savepoints made before the given stream index
+	 *
+	 * The latest savepoint before the index is kept, since it is still
+	 * needed to undo commands after the index.
+	 *
+	 * @param index stream index
+	 */
+	void discardSavepoints(int index);
+
+private:
+	void handleCommand(const protocol::MessageStream &stream, const protocol::MessagePtr &msg, int pos);
+
+	void handleCanvasResize(const protocol::CanvasResize &cmd, int pos);
+	void handleLayerCreate(const protocol::LayerCreate &cmd);
+	void handleLayerAttributes(const protocol::LayerAttributes &cmd);
+	void handleLayerTitle(const protocol::LayerRetitle &cmd);
+	void handleLayerOrder(const protocol::LayerOrder &cmd);
+	void handleLayerDelete(const protocol::LayerDelete &cmd);
+	void handleToolChange(const protocol::ToolChange &cmd);
+	void handlePenMove(const protocol::PenMove &cmd);
+	void handlePenUp(const protocol::PenUp &cmd);
+	void handlePutImage(const protocol::PutImage &cmd);
+	void handleUndo(const protocol::MessageStream &stream, const protocol::Undo &cmd, int pos);
+
+	void makeSavepoint(int pos, bool force);
+	void revertSavepoint(const CanvasSavepoint *savepoint);
+
+	paintcore::LayerStack *_image;
+	QHash<int, CanvasContext> _contexts;
+	QHash<int, CanvasAnnotation> _annotations;
+	QSet<int> _users;
+	QString _title;
+
+	QList<CanvasSavepoint*> _savepoints;
+	protocol::UndoIndex _undo;
+
+	bool _ready;
+	int _streampointer;
+	bool _replaying;
+};
+
+}
+
+#endif
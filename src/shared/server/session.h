@@ -103,7 +103,7 @@ struct SessionState {
 	QString password;
 
 	//! State of snapshot sync
-	enum {NOT_SYNCING, SYNC_WAIT_FOR_LOCK, SYNC_WAIT_FOR_ACK } syncstate;
+	enum {NOT_SYNCING, SYNC_WAIT_FOR_ACK } syncstate;
 
 	/**
 	 * @brief Get the layer with the given ID
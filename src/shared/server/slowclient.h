@@ -0,0 +1,69 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2013 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+#ifndef DP_SERVER_SLOWCLIENT_H
+#define DP_SERVER_SLOWCLIENT_H
+
+namespace server {
+
+/**
+ * @brief What to do with a client that cannot keep up with the session
+ */
+enum SlowClientPolicy {
+	//! Let the client's upload queue grow without limit
+	SLOW_CLIENT_IGNORE,
+
+	//! Stop reading the client's input and sending it new commands until its queue drains
+	SLOW_CLIENT_PAUSE,
+
+	//! Merge queued pen moves. Stop sending new commands if that is not enough.
+	SLOW_CLIENT_COALESCE,
+
+	//! Drop the backlog and resend the latest snapshot point and the commands after it
+	SLOW_CLIENT_RESYNC
+};
+
+/**
+ * @brief Upload queue limits for slow clients
+ *
+ * A client is lagging when its upload queue is longer than the byte limit
+ * or its oldest queued message has waited longer than the time limit.
+ * Once the policy has been applied, new commands are held back until the
+ * queue has drained to half the byte limit (or empty, if there is no
+ * byte limit.)
+ *
+ * Resyncing requires a complete snapshot point and a client that supports
+ * it. It is done only when the snapshot and the commands after it are
+ * smaller than the backlog. Otherwise new commands are just held back.
+ */
+struct SlowClientLimits {
+	SlowClientLimits() : policy(SLOW_CLIENT_IGNORE), bytes(0), seconds(0) { }
+
+	SlowClientPolicy policy;
+
+	//! Maximum upload queue length in bytes (0 means no limit)
+	int bytes;
+
+	//! Maximum time a message may wait in the queue (0 means no limit)
+	int seconds;
+};
+
+}
+
+#endif
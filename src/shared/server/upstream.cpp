@@ -0,0 +1,204 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2013 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <QTcpSocket>
+#include <QStringList>
+
+#include "config.h"
+
+#include "upstream.h"
+
+#include "../net/messagequeue.h"
+#include "../net/login.h"
+
+namespace server {
+
+namespace {
+	// The relay's own stream is append only, so upstream must not reset
+	// it and upstream connections are never resumed.
+	const int LINK_CAPABILITIES = protocol::CAP_COMPACT_PENMOVE | protocol::CAP_DEFLATE | protocol::CAP_FRAGMENT;
+
+	enum MirrorLoginState {
+		EXPECT_HELLO,
+		EXPECT_PASSWORD_OK,
+		EXPECT_RELAY_OK
+	};
+}
+
+UpstreamLink::UpstreamLink(Mode mode, const QUrl &url, QObject *parent)
+	: QObject(parent), _mode(mode), _url(url), _loginstate(EXPECT_HELLO), _loggedin(false), _closed(false)
+{
+	_socket = new QTcpSocket(this);
+	_msgqueue = new protocol::MessageQueue(_socket, this);
+
+	connect(_socket, SIGNAL(connected()), this, SLOT(socketConnected()));
+	connect(_socket, SIGNAL(disconnected()), this, SLOT(socketDisconnected()));
+	connect(_msgqueue, SIGNAL(socketError(QString)), this, SLOT(socketError(QString)));
+	connect(_msgqueue, SIGNAL(messageAvailable()), this, SLOT(receiveMessages()));
+	connect(_msgqueue, SIGNAL(snapshotAvailable()), this, SLOT(receiveSnapshot()));
+
+	_socket->connectToHost(url.host(), url.port(DRAWPILE_PROTO_DEFAULT_PORT));
+}
+
+void UpstreamLink::send(protocol::MessagePtr msg)
+{
+	_msgqueue->send(msg);
+}
+
+void UpstreamLink::close()
+{
+	_msgqueue->closeWhenReady();
+}
+
+void UpstreamLink::socketConnected()
+{
+	// Select the session on a multisession server
+	QString session = _url.path();
+	if(session.startsWith('/'))
+		session = session.mid(1);
+
+	if(!session.isEmpty())
+		send(protocol::MessagePtr(new protocol::Login(QString("SESSION %1").arg(session))));
+}
+
+void UpstreamLink::socketDisconnected()
+{
+	if(!_closed) {
+		_closed = true;
+		emit disconnected(_error);
+	}
+}
+
+void UpstreamLink::socketError(const QString &error)
+{
+	if(_error.isEmpty())
+		_error = error;
+
+	if(_socket->state() != QTcpSocket::UnconnectedState)
+		_socket->abort();
+	else
+		socketDisconnected();
+}
+
+void UpstreamLink::loginFailed(const QString &error)
+{
+	_error = error;
+	_msgqueue->close();
+}
+
+void UpstreamLink::announceCapabilities()
+{
+	_loggedin = true;
+	send(protocol::MessagePtr(new protocol::Login(protocol::capabilityMessage(LINK_CAPABILITIES))));
+}
+
+void UpstreamLink::receiveMessages()
+{
+	while(_msgqueue->isPending()) {
+		protocol::MessagePtr msg = _msgqueue->getPending();
+
+		if(msg->type() == protocol::MSG_LOGIN) {
+			const QString text = msg.cast<protocol::Login>().message();
+
+			if(_loggedin) {
+				// The only login message expected after login is the capability reply
+				const int caps = protocol::parseCapabilityMessage(text);
+				if(caps>=0) {
+					_msgqueue->setPeerCapabilities(caps & LINK_CAPABILITIES);
+					continue;
+				}
+
+			} else if(_mode == MIRROR) {
+				handleMirrorLogin(text);
+				continue;
+
+			} else {
+				// User logins are passed through. Just watch for the final "OK <userid>"
+				const QStringList tokens = text.split(' ', QString::SkipEmptyParts);
+				if(tokens.length()==2 && tokens[0] == "OK") {
+					emit messageReceived(msg);
+					announceCapabilities();
+					continue;
+				}
+			}
+		}
+
+		emit messageReceived(msg);
+	}
+}
+
+void UpstreamLink::receiveSnapshot()
+{
+	while(_msgqueue->isPendingSnapshot())
+		emit snapshotReceived(_msgqueue->getPendingSnapshot());
+}
+
+/**
+ * The mirror connection logs in like this:
+ *
+ * Server sends "DRAWPILE <version> [PASS]"
+ * If password is required, relay sends it and expects OK
+ * Relay sends RELAY
+ * Server sends OK 0 (relays don't get a user ID)
+ */
+void UpstreamLink::handleMirrorLogin(const QString &msg)
+{
+	switch(_loginstate) {
+	case EXPECT_HELLO: {
+		const QStringList tokens = msg.split(' ', QString::SkipEmptyParts);
+		if(tokens.length() < 2 || tokens[0] != "DRAWPILE" || tokens[1].section('.', 0, 0).toInt() != DRAWPILE_PROTO_MAJOR_VERSION) {
+			loginFailed(QString("Incompatible upstream server: %1").arg(msg));
+			return;
+		}
+
+		if(tokens.length()==3 && tokens[2] == "PASS") {
+			if(_url.password().isEmpty()) {
+				loginFailed("Upstream session is password protected");
+				return;
+			}
+			send(protocol::MessagePtr(new protocol::Login(_url.password())));
+			_loginstate = EXPECT_PASSWORD_OK;
+		} else {
+			send(protocol::MessagePtr(new protocol::Login(QByteArray("RELAY"))));
+			_loginstate = EXPECT_RELAY_OK;
+		}
+		break;
+	}
+	case EXPECT_PASSWORD_OK:
+		if(msg != "OK") {
+			loginFailed(QString("Upstream login failed: %1").arg(msg));
+			return;
+		}
+		send(protocol::MessagePtr(new protocol::Login(QByteArray("RELAY"))));
+		_loginstate = EXPECT_RELAY_OK;
+		break;
+
+	case EXPECT_RELAY_OK:
+		if(msg != "OK 0") {
+			loginFailed(QString("Upstream login failed: %1").arg(msg));
+			return;
+		}
+		announceCapabilities();
+		emit loggedIn();
+		break;
+	}
+}
+
+}
@@ -0,0 +1,117 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2013 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+#ifndef DP_SERVER_UPSTREAM_H
+#define DP_SERVER_UPSTREAM_H
+
+#include <QObject>
+#include <QUrl>
+
+#include "../net/message.h"
+
+class QTcpSocket;
+
+namespace protocol {
+	class MessageQueue;
+}
+
+namespace server {
+
+/**
+ * @brief A connection from a relay to its upstream server
+ *
+ * A relay uses two kinds of upstream connections:
+ *
+ * - MIRROR: a single read only connection, logged in with "RELAY". The
+ *   upstream server sends its main stream over it as is, snapshot points
+ *   included. The relay serves its own users from this copy.
+ * - USER: one connection per user of the relay. The user's login is passed
+ *   through, except that it joins with "RELAYJOIN", so the upstream server
+ *   doesn't send the main stream over it. It is used to forward the user's
+ *   commands in order and to pass back messages meant for that user only.
+ *
+ * The upstream server may itself be a relay.
+ */
+class UpstreamLink : public QObject
+{
+	Q_OBJECT
+public:
+	enum Mode {MIRROR, USER};
+
+	/**
+	 * @brief Connect to the upstream server
+	 *
+	 * A session name can be given in the URL path. The password (needed
+	 * in mirror mode only) is taken from the URL as well.
+	 *
+	 * @param mode connection mode
+	 * @param url upstream server address
+	 * @param parent
+	 */
+	UpstreamLink(Mode mode, const QUrl &url, QObject *parent=0);
+
+	//! Send a message upstream
+	void send(protocol::MessagePtr msg);
+
+	//! Close the connection once all queued messages have been sent
+	void close();
+
+signals:
+	//! Mirror mode login is complete. The main stream follows.
+	void loggedIn();
+
+	/**
+	 * @brief A message was received
+	 *
+	 * In user mode, login messages are passed through as well.
+	 */
+	void messageReceived(protocol::MessagePtr msg);
+
+	//! Mirror mode: a message for the latest snapshot point was received
+	void snapshotReceived(protocol::MessagePtr msg);
+
+	//! The connection was closed
+	void disconnected(const QString &error);
+
+private slots:
+	void socketConnected();
+	void socketDisconnected();
+	void socketError(const QString &error);
+	void receiveMessages();
+	void receiveSnapshot();
+
+private:
+	void handleMirrorLogin(const QString &msg);
+	void loginFailed(const QString &error);
+	void announceCapabilities();
+
+	Mode _mode;
+	QUrl _url;
+	QTcpSocket *_socket;
+	protocol::MessageQueue *_msgqueue;
+
+	int _loginstate;
+	bool _loggedin;
+	bool _closed;
+	QString _error;
+};
+
+}
+
+#endif
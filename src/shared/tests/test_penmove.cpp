@@ -0,0 +1,99 @@
+/*
+   DrawPile - a collaborative drawing program.
+
+   Copyright (C) 2013 Calle Laakkonen
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+#include <QtTest>
+#include <QScopedPointer>
+
+#include "../net/pen.h"
+
+using protocol::PenMove;
+using protocol::PenPoint;
+using protocol::PenPointVector;
+using protocol::MAX_PENMOVE_POINTS;
+
+class TestPenMove : public QObject
+{
+	Q_OBJECT
+private slots:
+	void compactPointLimit();
+	void compactRoundTrip();
+};
+
+namespace {
+
+//! Compact pen move payload with the given number of zero-delta points
+QByteArray zeroDeltaPayload(int points)
+{
+	QByteArray payload(1 + 3 * points, 0);
+	payload[0] = 1; // context ID
+	return payload;
+}
+
+PenMove *deserializeCompact(const QByteArray &payload)
+{
+	return PenMove::deserializeCompact((const uchar*)payload.constData(), payload.length());
+}
+
+}
+
+void TestPenMove::compactPointLimit()
+{
+	// The largest pen move that can still be re-encoded normally
+	const QByteArray maxPayload = zeroDeltaPayload(MAX_PENMOVE_POINTS);
+	QScopedPointer<PenMove> pm(deserializeCompact(maxPayload));
+	QVERIFY(!pm.isNull());
+	QCOMPARE(pm->contextId(), uint8_t(1));
+	QCOMPARE(pm->points().size(), MAX_PENMOVE_POINTS);
+	QVERIFY(pm->length() <= 0xffff + 3);
+
+	// One point more must be rejected
+	const QByteArray overPayload = zeroDeltaPayload(MAX_PENMOVE_POINTS + 1);
+	QScopedPointer<PenMove> over(deserializeCompact(overPayload));
+	QVERIFY(over.isNull());
+}
+
+void TestPenMove::compactRoundTrip()
+{
+	PenPointVector points;
+	points.append(PenPoint(100, 200, 0));
+	points.append(PenPoint(101, 199, 10));
+	points.append(PenPoint(-5000, 70000, 255));
+	points.append(PenPoint(-5000, 70000, 3));
+	points.append(PenPoint(2147483647, -2147483647-1, 128));
+
+	PenMove pm(7, points);
+	QByteArray buffer(pm.compactLength(), 0);
+	const int len = pm.serializeCompact(buffer.data());
+	QCOMPARE(len, buffer.length());
+
+	QScopedPointer<PenMove> decoded(PenMove::deserializeCompact((const uchar*)buffer.constData() + 3, len - 3));
+	QVERIFY(!decoded.isNull());
+	QCOMPARE(decoded->contextId(), uint8_t(7));
+	QCOMPARE(decoded->points().size(), points.size());
+	for(int i=0;i<points.size();++i) {
+		QCOMPARE(decoded->points().at(i).x, points.at(i).x);
+		QCOMPARE(decoded->points().at(i).y, points.at(i).y);
+		QCOMPARE(decoded->points().at(i).p, points.at(i).p);
+	}
+}
+
+QTEST_APPLESS_MAIN(TestPenMove)
+#include "test_penmove.moc"